@@ -16,6 +16,41 @@
  * @param fd integer file descriptor on which an event was triggered.
  */
 typedef void (epoll_cb_t)(void *context, int fd);
+
+/**
+ * Function type for the epoll_app timeout callback.
+ * It is called before each wait for events.
+ * @param context the context set in the call to create_epoll_app
+ * @return the longest time to wait for events in milliseconds, or -1 to
+ * wait until one arrives.
+ */
+typedef int (epoll_timeout_cb_t)(void *context);
+
+/**
+ * Length of the periods the busy polling budget applies to.
+ */
+#define EPOLL_APP_BUSY_POLL_PERIOD_NS 100000000ull
+
+/**
+ * Busy polling state, see epoll_app_set_busy_poll.
+ */
+typedef struct {
+    // 0 if busy polling is disabled.
+    uint64_t max_ns;
+    // time which may be spent polling without finding input, per period.
+    uint64_t budget_ns;
+    // smoothed time between two arrivals of input.
+    uint64_t gap_ns;
+    uint64_t last_ns;
+    // the loop polls without blocking until then.
+    uint64_t until_ns;
+    uint64_t period_start_ns;
+    uint64_t spent_ns;
+    // polls made while spinning which found input, and blocking waits.
+    uint64_t hits;
+    uint64_t sleeps;
+} epoll_busy_poll_t;
+
 /**
  * Application state.
  * The callbacks are called when the event corresponding to their name is
@@ -35,6 +70,8 @@ typedef struct {
     epoll_cb_t *epollpri_cb;
     epoll_cb_t *epollerr_cb;
     epoll_cb_t *epollhup_cb;
+    epoll_timeout_cb_t *timeout_cb;
+    epoll_busy_poll_t busy_poll;
 } epoll_app_t;
 
 /**
@@ -77,6 +114,30 @@ int epoll_app_del_fd(epoll_app_t *app, int fd);
  */
 int epoll_app_mod_fd(epoll_app_t *app, int fd, int flags);
 
+/**
+ * Get the flags associated with a previously added file descriptor.
+ * @param app the epoll_app to use
+ * @param fd the file descriptor to look up
+ * @return the epoll flags of fd, or -1 if it is not in the interest list.
+ */
+int epoll_app_get_flags(epoll_app_t *app, int fd);
+
+/**
+ * Poll for events without blocking for a while after input arrives, instead
+ * of sleeping in epoll_wait and paying for the wakeup on the next message.
+ * The window follows the time between arrivals: it is twice the smoothed
+ * gap, and there is no window at all if the gap is longer than max_us, as
+ * the next message would most likely not arrive within it. Polls which find
+ * nothing count against a budget of budget_pct of every
+ * EPOLL_APP_BUSY_POLL_PERIOD_NS, once it is used up the loop blocks as
+ * usual until the next period.
+ * @param app the epoll_app to use
+ * @param max_us longest window in microseconds, 0 to always block
+ * @param budget_pct share of the time which may be spent spinning, 1 to 100
+ * @return 0 on success, -1 if budget_pct is out of range.
+ */
+int epoll_app_set_busy_poll(epoll_app_t *app, uint32_t max_us, int budget_pct);
+
 /**
  * Close all file descriptors associated with this application context.
  * @param app previously initialized epoll_app_t
@@ -93,6 +154,8 @@ void destroy_epoll_app(epoll_app_t *app);
  * Run the main loop.  This function will block until run_mainloop in the
  * pre-initialized application context is set to false, which can be done
  * by a signal handler, or by one of the handler functions when it is called.
+ * If timeout_cb is set, it bounds each wait for events. While the loop is
+ * busy polling, see epoll_app_set_busy_poll, waits do not block at all.
  * @param app the application context to run.
  */
 
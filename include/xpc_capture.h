@@ -0,0 +1,116 @@
+#pragma once
+/**
+ * Traffic capture.
+ * Every message the router forwards can be appended to a capture file, with
+ * the time its first byte arrived and the route it took. The file is
+ * allocated and memory mapped up front, so capturing a message is a copy
+ * into the mapping and costs no system calls. Once the file is full further
+ * messages are only counted as lost.
+ *
+ * Layout: an xpc_capture_hdr_t, then records back to back. Each record is an
+ * xpc_capture_rec_t followed by the message as it was forwarded (header
+ * included, rewritten for the output), padded to XPC_CAPTURE_ALIGN bytes.
+ * Only records before hdr->end are complete, the file is truncated there
+ * when capturing stops.
+ *
+ * xpc_replay feeds a capture back through a router.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+#define XPC_CAPTURE_MAGIC 0x50414358
+#define XPC_CAPTURE_VERSION 1
+#define XPC_CAPTURE_ALIGN 8
+
+// the message header is big endian, otherwise little endian.
+#define XPC_CAPTURE_BIG_ENDIAN (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // offset just past the last complete record.
+    uint64_t end;
+    // size of the file while capturing.
+    uint64_t capacity;
+    // messages which did not fit.
+    uint64_t lost;
+} xpc_capture_hdr_t;
+
+typedef struct {
+    // length of the record, including this header and padding.
+    uint32_t rec_len;
+    uint32_t flags;
+    // CLOCK_MONOTONIC time the first byte of the message arrived.
+    uint64_t ingress_ns;
+    int32_t in_fd;
+    int32_t in_chn;
+    int32_t out_fd;
+    int32_t out_chn;
+    // length of the message following this header.
+    uint32_t msg_len;
+    uint32_t reserved;
+} xpc_capture_rec_t;
+
+typedef struct xpc_capture xpc_capture_t;
+
+/**
+ * Capture every message forwarded by a router to a file, which is created
+ * or replaced and allocated to its full size.
+ * @param ctx the router context to use
+ * @param path the file to capture to
+ * @param max_bytes size of the file
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int xpc_capture_enable(xpc_router_t *ctx, const char *path, size_t max_bytes);
+
+/**
+ * Append a finalized message to the router's capture.
+ * @param ctx a router with capture enabled
+ * @param msg_buf the message, with its ingress time and source route set
+ * @param out_fd the output it was queued to
+ * @param out_chn the channel it was sent to
+ * @param big_endian the byte order of its header
+ */
+void xpc_capture_msg(
+    xpc_router_t *ctx, const msg_buf_t *msg_buf, int out_fd, int out_chn,
+    bool big_endian
+);
+
+/**
+ * Stop capturing, truncating the file to the records in it.
+ * @param self the capture to free, may be NULL
+ */
+void xpc_capture_free(xpc_capture_t *self);
+
+/**
+ * Map a capture file read-only.
+ * @param path the capture file
+ * @param len set to the length of the mapping
+ * @return the header, or NULL if the file is missing or not a capture.
+ */
+const xpc_capture_hdr_t *xpc_capture_map(const char *path, size_t *len);
+
+/**
+ * Unmap a capture mapped with xpc_capture_map.
+ */
+void xpc_capture_unmap(const xpc_capture_hdr_t *hdr, size_t len);
+
+/**
+ * Iterate over the records of a mapped capture.
+ * @param hdr the mapped capture
+ * @param rec the previous record, or NULL for the first one
+ * @return the next record, or NULL after the last one.
+ */
+const xpc_capture_rec_t *xpc_capture_next(
+    const xpc_capture_hdr_t *hdr, const xpc_capture_rec_t *rec
+);
+
+/**
+ * The message of a record.
+ */
+static inline const uint8_t *xpc_capture_msg_bytes(const xpc_capture_rec_t *rec) {
+    return (const uint8_t *)(rec + 1);
+}
@@ -0,0 +1,106 @@
+#pragma once
+/**
+ * Local clients over Unix-domain SOCK_SEQPACKET sockets.
+ * A listener is an endpoint of the router like any other fd: routes into it
+ * deliver messages to the clients subscribed to the route's output channel,
+ * and routes out of it apply to messages sent by any of its clients.
+ * Each datagram holds exactly one message, header and payload, so nothing
+ * is reframed on the way. Headers are in host byte order.
+ *
+ * Clients subscribe by sending a message to channel 0 (from 0) of type
+ * XPC_CLIENT_SUBSCRIBE, whose payload is an array of uint32_t channels.
+ * XPC_CLIENT_UNSUBSCRIBE undoes it. XPC_CLIENT_SHM_ATTACH moves the client's
+ * traffic into shared memory, see xpc_shm.h.
+ */
+
+#include <stdint.h>
+#include <xpc_utils.h>
+
+// control message types, only meaningful between a client and the router.
+#define XPC_CLIENT_SUBSCRIBE 0x40
+#define XPC_CLIENT_UNSUBSCRIBE 0x41
+#define XPC_CLIENT_SHM_ATTACH 0x42
+
+/**
+ * Messages queued for a client before newer ones are dropped, so that a
+ * client which stops reading cannot exhaust memory.
+ */
+#define XPC_CLIENT_MAX_QUEUED 64
+
+/**
+ * Datagrams read from a client per read event, so one busy client does not
+ * starve the others.
+ */
+#define XPC_CLIENT_RECV_BATCH 16
+
+/**
+ * Create a listening SOCK_SEQPACKET socket at path, replacing a stale one.
+ * @param path file system path of the socket
+ * @return the non-blocking listening fd, or -1 on failure (errno is set).
+ */
+int xpc_listen_seqpacket(const char *path);
+
+/**
+ * Register a listening socket with the router. Its clients are accepted
+ * and watched through io_watch_fd_cb when it is readable.
+ * The fd should be watched for reading by the caller, like other inputs.
+ * @param ctx the router context to use
+ * @param lfd a listening SOCK_SEQPACKET socket
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int xpc_add_listener(xpc_router_t *ctx, int lfd);
+
+/**
+ * Subscribe a client to messages routed to a channel of its listener.
+ * @param ctx the router context to use
+ * @param cfd the client fd
+ * @param chn the channel
+ * @return 0 on success, -1 if cfd is not a client or memory is exhausted.
+ */
+int xpc_client_subscribe(xpc_router_t *ctx, int cfd, int chn);
+
+/**
+ * Undo xpc_client_subscribe.
+ * @return 0 on success, -1 if cfd was not subscribed to chn.
+ */
+int xpc_client_unsubscribe(xpc_router_t *ctx, int cfd, int chn);
+
+/**
+ * Accept every pending connection on a listener.
+ * @return the number of clients accepted.
+ */
+int xpc_client_accept(xpc_router_t *ctx, int lfd);
+
+/**
+ * Read and route up to XPC_CLIENT_RECV_BATCH datagrams from a client.
+ * A client which hung up is closed.
+ * @return the number of bytes read.
+ */
+int xpc_client_recv(xpc_router_t *ctx, int cfd);
+
+/**
+ * Route one message from a client which is already in memory, as if it had
+ * arrived on the client's socket.
+ * @param ctx the router context to use
+ * @param cfd the client fd
+ * @param wire the message, header included, in host byte order
+ * @param len length of the message
+ */
+void xpc_client_deliver(
+    xpc_router_t *ctx, int cfd, const uint8_t *wire, int len
+);
+
+/**
+ * Copy the finalized messages queued on a listener to its subscribers.
+ * @param ctx the router context to use
+ * @param lfd the listener
+ * @param bus the output context of the listener
+ */
+void xpc_client_fanout(xpc_router_t *ctx, int lfd, xpc_out_ctx_t *bus);
+
+/**
+ * Forget a client and close its fd. Its queued messages are lost.
+ * @param ctx the router context to use
+ * @param cfd the client fd
+ */
+void xpc_client_close(xpc_router_t *ctx, int cfd);
@@ -0,0 +1,141 @@
+#pragma once
+/**
+ * Negotiated compression of the payloads on a link, with xpc_lz.h.
+ * Meant for serial links, whose bandwidth is usually what limits the
+ * router, and whose telemetry usually compresses well.
+ *
+ * Compression is offered per endpoint (compress=yes in the topology) and
+ * used once the peer asks for it, with a negotiation message (to 0, from 0)
+ * of type XPC_NEG_TYPE_COMPRESS whose first payload byte is one of:
+ *
+ *   XPC_COMPRESS_ON     reset the history of the direction toward the
+ *                       receiver, and use compression from now on
+ *   XPC_COMPRESS_RESET  the history of the direction toward the sender
+ *                       was lost, send XPC_COMPRESS_ON again
+ *   XPC_COMPRESS_OFF    stop compressing, or compression was refused
+ *
+ * The router answers XPC_COMPRESS_ON with XPC_COMPRESS_ON, or with
+ * XPC_COMPRESS_OFF if it was not offered; the peer does not answer
+ * XPC_COMPRESS_ON. Every message after XPC_COMPRESS_ON, in either
+ * direction, is part of the history of its direction, except for
+ * negotiation messages. A compressed message has XPC_COMPRESS_TYPE_FLAG set
+ * in its type, and its size is that of the compressed payload. Messages
+ * which did not get shorter are sent as they are, so types with that bit
+ * set cannot be used on a compressed link.
+ *
+ * The router decompresses messages as they arrive, before they are routed,
+ * and compresses them as they are written, so the history is in the order
+ * the link carries them. A message the router drops is still added to the
+ * history. After resynchronization, or a payload which fails to
+ * decompress, the router asks for XPC_COMPRESS_ON again with
+ * XPC_COMPRESS_RESET, and drops compressed messages until it arrives.
+ *
+ * Only byte stream inputs negotiate compression, and pipeline threads do
+ * not, see xpc_pipeline.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+/**
+ * Negotiation message type of compression. Chosen away from the types
+ * defined by tinyxpc.
+ */
+#define XPC_NEG_TYPE_COMPRESS 0x21
+
+// payloads of XPC_NEG_TYPE_COMPRESS.
+#define XPC_COMPRESS_OFF 0
+#define XPC_COMPRESS_ON 1
+#define XPC_COMPRESS_RESET 2
+
+/**
+ * Set in the type of a message whose payload is compressed.
+ */
+#define XPC_COMPRESS_TYPE_FLAG 0x8000
+
+/**
+ * Offer compression to the peer of an input, or withdraw the offer.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param allow true to use compression if the peer asks for it
+ * @return 0 on success, -1 if fd is not a byte stream input.
+ */
+int xpc_compress_allow(xpc_router_t *ctx, int fd, bool allow);
+
+/**
+ * Act on a XPC_NEG_TYPE_COMPRESS message. Called by xpc_accumulate_msg.
+ * @param ctx the router context to use
+ * @param fd the input it arrived on
+ * @param in_ctx its context
+ * @param payload its payload
+ * @param len its length
+ */
+void xpc_compress_neg(
+    xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx,
+    const uint8_t *payload, int len
+);
+
+/**
+ * Decompress a message which arrived whole on a compressed input, in place.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param in_ctx its context
+ * @param out_ctx the output the message is queued to
+ * @param msg_buf the message, its header already in the byte order of the
+ * output
+ * @return 0 if the message should be routed, -1 if it should be dropped as
+ * malformed: it cannot be decompressed, or it is larger than
+ * ctx->max_msg_size once it is.
+ */
+int xpc_compress_ingress(
+    xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx,
+    xpc_out_ctx_t *out_ctx, msg_buf_t *msg_buf
+);
+
+/**
+ * A message is dropped from a compressed input before it was read. Its
+ * payload is kept as history while it is skipped, see
+ * xpc_compress_discarded.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param in_ctx its context
+ */
+void xpc_compress_discard(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx);
+
+/**
+ * Where the next bytes of a payload dropped from a compressed input go.
+ * @param in_ctx the input context, in_ctx->lz_discard is set
+ * @return the buffer of the payload, at in_ctx->buf_offset.
+ */
+uint8_t *xpc_compress_discard_buf(xpc_in_ctx_t *in_ctx);
+
+/**
+ * Add a payload dropped from a compressed input to the history, once it was
+ * read whole.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param in_ctx its context
+ */
+void xpc_compress_discarded(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx);
+
+/**
+ * The history of a compressed input is lost, because bytes of it were
+ * skipped. Ask the peer to start over.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param in_ctx its context
+ */
+void xpc_compress_lost(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx);
+
+/**
+ * Compress a message in place as it is taken from the queue of an output
+ * to be written, if the output is compressed.
+ * @param ctx the router context to use
+ * @param out_ctx the output, out_ctx->lz_tx is set
+ * @param msg_buf the message, nothing of it written yet
+ */
+void xpc_compress_egress(
+    xpc_router_t *ctx, xpc_out_ctx_t *out_ctx, msg_buf_t *msg_buf
+);
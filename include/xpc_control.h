@@ -0,0 +1,101 @@
+#pragma once
+/**
+ * Route changes at runtime, over a control socket.
+ * The control socket is a Unix-domain SOCK_SEQPACKET listener. Each datagram
+ * sent to it holds one or more commands, one per line, and is answered with
+ * one datagram: "ok" followed by the output of the commands, or
+ * "error: <reason>". All of them are checked first, if any of them is
+ * invalid none of them is applied. Changes already applied are not rolled
+ * back though: if memory runs out while applying one, the commands before
+ * it stay applied, the reply is "error: out of memory after N commands",
+ * and the one which failed may be half applied, see xpc_control_exec.
+ * Endpoints are named as in the topology:
+ *
+ *   route    k64:1 -> out:1 [flags]   add a route, or redirect one
+ *   unroute  k64:1                    remove a route
+ *   list                              every route and its traffic
+ *
+ * Route flags are those of the topology, see xpc_topology.h, except for
+ * hooks: they are loaded when the router is built, a redirected route keeps
+ * its hook. A route given the limit it had keeps its bucket and counters.
+ * The router runs on one thread, and the commands of a datagram are all
+ * applied between two io events, so forwarding never sees half of a change.
+ * A message which is being received when its route changes is completed on
+ * the old route, and outputs no route leads to anymore are freed once they
+ * are drained, see xpc_remove_route.
+ *
+ * Pipeline threads copy the routes when they start, see xpc_pipeline.h, so
+ * the control socket is only available with the event loop.
+ */
+
+#include <stdbool.h>
+#include <xpc_utils.h>
+#include <xpc_topology.h>
+
+/**
+ * Longest datagram of commands accepted.
+ */
+#define XPC_CONTROL_CMD_MAX 4096
+
+/**
+ * Most commands in one datagram.
+ */
+#define XPC_CONTROL_MAX_CMDS 64
+
+/**
+ * Longest reply, a list which does not fit is cut short with "...".
+ */
+#define XPC_CONTROL_REPLY_MAX 65536
+
+typedef struct xpc_control xpc_control_t;
+
+/**
+ * Listen for controllers. The listening socket, and every controller it
+ * accepts, is watched through the router's io_watch_fd_cb.
+ * @param router the router whose routes are changed, with its io callbacks
+ * set
+ * @param topo the opened topology the router was built from, endpoints are
+ * named after it
+ * @param path file system path of the control socket
+ * @return the control socket, or NULL on failure (errno is set).
+ */
+xpc_control_t *create_xpc_control(
+    xpc_router_t *router, xpc_topology_t *topo, const char *path
+);
+
+/**
+ * Check whether an fd is the control socket or one of its controllers.
+ */
+bool xpc_control_owns(xpc_control_t *self, int fd);
+
+/**
+ * Handle a read event on an fd owned by the control socket: accept
+ * controllers, or answer a datagram of commands.
+ * @param self the control socket
+ * @param fd the fd which is readable
+ * @return the number of bytes read.
+ */
+int xpc_control_recv(xpc_control_t *self, int fd);
+
+/**
+ * Apply a datagram of commands. They are all checked before the first is
+ * applied, but applying one can still fail for lack of memory. The
+ * commands before it then stay applied, and the one which failed may be
+ * half applied: a new output may have been added without its settings, or
+ * a redirected route may already point at it. Listing the routes shows
+ * where the router was left.
+ * @param self the control socket
+ * @param cmds the commands, one per line, modified in place
+ * @param reply where the reply is written, NUL terminated
+ * @param max room at reply
+ * @return 0 if the commands were applied, -1 if one was invalid and none
+ * of them was applied, or if memory ran out and only those before the one
+ * the reply names were.
+ */
+int xpc_control_exec(xpc_control_t *self, char *cmds, char *reply, int max);
+
+/**
+ * Disconnect every controller, close the control socket and free it.
+ * @param self the control socket, may be NULL
+ */
+void xpc_control_free(xpc_control_t *self);
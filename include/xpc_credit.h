@@ -0,0 +1,102 @@
+#pragma once
+/**
+ * Credit-based flow control toward senders.
+ * Without it a slow output can only push back through the kernel, and a
+ * microcontroller on a serial link does not notice that: it keeps sending,
+ * and the router buffers or drops. With credits, the router tells each
+ * sender how many bytes it may send on each channel, and the sender waits
+ * for more instead of overrunning the router.
+ *
+ * A sender asks for credits with a negotiation message (to 0, from 0) of
+ * type XPC_NEG_TYPE_CREDIT, with no payload or a nonzero first byte. A zero
+ * first byte turns credits off again. From then on the router sends it
+ * messages of the same type whose payload is a list of grants, each
+ * XPC_CREDIT_GRANT_SIZE bytes: the channel as a uint16_t, then the bytes
+ * granted as a uint32_t, both in the sender's byte order. A grant adds to
+ * what is left of the previous ones. Every message sent uses up its
+ * length, header included, and a message which exceeds the credit left on
+ * its channel is dropped as XPC_DROP_QUEUE_FULL.
+ *
+ * Each output has a window of bytes, which is shared between the routes of
+ * credit senders toward it. The credit granted is what is left of the
+ * window after the messages queued at the output and the credit which is
+ * still outstanding. Grants are made by xpc_router_poll, once a route has
+ * used up half of its share, and all grants for one sender go out in one
+ * message, so refreshes are batched rather than sent per message.
+ *
+ * Pipeline threads do not grant credits, see xpc_pipeline.h. A sender which
+ * gets no grant should go on sending without them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc_utils.h>
+
+/**
+ * Negotiation message type of credit requests and grants. Chosen away from
+ * the types defined by tinyxpc.
+ */
+#define XPC_NEG_TYPE_CREDIT 0x20
+
+/**
+ * Bytes of one grant in the payload of a XPC_NEG_TYPE_CREDIT message.
+ */
+#define XPC_CREDIT_GRANT_SIZE 6
+
+/**
+ * Default window of each output.
+ */
+#define XPC_CREDIT_WINDOW (16 << 10)
+
+/**
+ * Turn credits on or off for an input. While they are on, the input is
+ * also an output, grants are queued to it.
+ * @param ctx the router context to use
+ * @param fd the input
+ * @param enable true to turn credits on
+ * @return 0 on success, -1 if fd is not an input or memory is exhausted.
+ */
+int xpc_credit_enable(xpc_router_t *ctx, int fd, bool enable);
+
+/**
+ * Set the window an output shares between the senders routed to it.
+ * @param ctx the router context to use
+ * @param ofd an fd which is already the output of a route
+ * @param bytes the window, at least one message of the largest size
+ * expected, or the senders stall
+ * @return 0 on success, -1 if ofd is not an output.
+ */
+int xpc_set_credit_window(xpc_router_t *ctx, int ofd, int bytes);
+
+/**
+ * Take the credit for a message from its route, when its header arrives.
+ * @param ctx the router context to use
+ * @param route the route of the message, on an input using credits
+ * @param len the length of the message, header included
+ * @return true if there was enough credit, false if the message should be
+ * dropped.
+ */
+bool xpc_credit_take(xpc_router_t *ctx, xpc_route_t *route, int len);
+
+/**
+ * Grant the credits which are due, see above. Called by xpc_router_poll.
+ * @param ctx the router context to use
+ * @return the number of grant messages queued.
+ */
+int xpc_credit_poll(xpc_router_t *ctx);
+
+/**
+ * Decode the grants in the payload of a XPC_NEG_TYPE_CREDIT message, for
+ * senders.
+ * @param payload the payload
+ * @param len its length
+ * @param big_endian the byte order of the sender
+ * @param chns set to the channel of each grant
+ * @param bytes set to the bytes of each grant
+ * @param max room in chns and bytes
+ * @return the number of grants decoded.
+ */
+int xpc_credit_decode(
+    const uint8_t *payload, int len, bool big_endian,
+    uint16_t *chns, uint32_t *bytes, int max
+);
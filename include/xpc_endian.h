@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * Byte order handling for txpc headers.
+ * Each input fd is assigned a codec when its byte order is negotiated, so
+ * the hot path calls through a function pointer chosen once, instead of
+ * testing the byte order of every header it sees.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <tinyxpc/tinyxpc.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define XPC_HOST_BIG_ENDIAN true
+#else
+#define XPC_HOST_BIG_ENDIAN false
+#endif
+
+/**
+ * Convert a header from its on-wire representation to host byte order.
+ * @param dst the decoded header
+ * @param wire sizeof(txpc_hdr_t) bytes as received
+ */
+typedef void (xpc_hdr_decode_fn_t)(txpc_hdr_t *dst, const void *wire);
+
+/**
+ * Convert a header from host byte order to its on-wire representation.
+ * @param wire destination for sizeof(txpc_hdr_t) bytes
+ * @param src the header in host byte order
+ */
+typedef void (xpc_hdr_encode_fn_t)(void *wire, const txpc_hdr_t *src);
+
+/**
+ * A decode/encode pair for one byte order.
+ */
+typedef struct {
+    bool big_endian;
+    xpc_hdr_decode_fn_t *decode;
+    xpc_hdr_encode_fn_t *encode;
+} xpc_hdr_codec_t;
+
+extern const xpc_hdr_codec_t xpc_hdr_codec_le;
+extern const xpc_hdr_codec_t xpc_hdr_codec_be;
+
+/**
+ * Get the codec for a byte order.
+ * @param big_endian true for a big endian peer, false for little endian
+ * @return a statically allocated codec, never NULL.
+ */
+const xpc_hdr_codec_t *xpc_hdr_codec_select(bool big_endian);
+
+/**
+ * Determine the byte order of an endianness negotiation header.
+ * Negotiation headers have to=0 and from=0 in any byte order, so the type
+ * and size fields are used to tell which byte order the sender used.
+ * @param wire sizeof(txpc_hdr_t) bytes as received
+ * @param current the codec currently in use for this input
+ * @return the codec which decodes wire as a TXPC_NEG_TYPE_ENDIANNESS header,
+ * or NULL if wire is not such a header in either byte order.
+ */
+const xpc_hdr_codec_t *xpc_hdr_codec_detect(
+    const void *wire, const xpc_hdr_codec_t *current
+);
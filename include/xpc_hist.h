@@ -0,0 +1,86 @@
+#pragma once
+/**
+ * Log-linear latency histograms, in the style of HdrHistogram.
+ * Each power of two is split into 2^XPC_HIST_SUB_BITS equal buckets, so a
+ * recorded value is known to within 1/2^XPC_HIST_SUB_BITS of itself
+ * (about 6%) over the whole range, with a fixed number of buckets and a
+ * constant time record.
+ */
+
+#include <stdint.h>
+
+#define XPC_HIST_SUB_BITS 4
+// values of 2^XPC_HIST_MAX_BITS (about 18 minutes in nanoseconds) and more
+// share the last bucket.
+#define XPC_HIST_MAX_BITS 40
+#define XPC_HIST_BUCKETS \
+    (((XPC_HIST_MAX_BITS - XPC_HIST_SUB_BITS + 1) << XPC_HIST_SUB_BITS) + 1)
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[XPC_HIST_BUCKETS];
+} xpc_hist_t;
+
+/**
+ * Bucket of a value.
+ */
+static inline int xpc_hist_bucket(uint64_t v) {
+    if(v < (1u << XPC_HIST_SUB_BITS)) {
+        return v;
+    }
+    if(v >= (1ull << XPC_HIST_MAX_BITS)) {
+        return XPC_HIST_BUCKETS - 1;
+    }
+    int shift = (63 - __builtin_clzll(v)) - XPC_HIST_SUB_BITS;
+    return ((shift + 1) << XPC_HIST_SUB_BITS)
+        + (int)(v >> shift) - (1 << XPC_HIST_SUB_BITS);
+}
+
+/**
+ * Record a value.
+ */
+static inline void xpc_hist_record(xpc_hist_t *self, uint64_t v) {
+    self->buckets[xpc_hist_bucket(v)]++;
+    if(self->count == 0 || v < self->min) {
+        self->min = v;
+    }
+    if(v > self->max) {
+        self->max = v;
+    }
+    self->count++;
+}
+
+/**
+ * Create an empty histogram.
+ * @return the histogram, or NULL if memory is exhausted.
+ */
+xpc_hist_t *create_xpc_hist();
+
+/**
+ * Empty a histogram.
+ */
+void xpc_hist_reset(xpc_hist_t *self);
+
+/**
+ * Add the values recorded in one histogram to another.
+ * @param self the histogram to add to
+ * @param other the histogram to add
+ */
+void xpc_hist_merge(xpc_hist_t *self, const xpc_hist_t *other);
+
+/**
+ * Largest value which falls in the same bucket as v.
+ */
+uint64_t xpc_hist_highest_equivalent(uint64_t v);
+
+/**
+ * Value at a percentile: the highest value equivalent to the one which
+ * percentile percent of the recorded values are at or below. It is never
+ * more than the largest value recorded.
+ * @param self the histogram
+ * @param percentile from 0 to 100
+ * @return the value, or 0 if nothing was recorded.
+ */
+uint64_t xpc_hist_percentile(const xpc_hist_t *self, double percentile);
@@ -0,0 +1,166 @@
+#pragma once
+/**
+ * Routing functions.
+ * A route may have a hook, a function run on every message it carries once
+ * the message arrived whole, before it is queued. The hook sees the header
+ * and the payload in the buffer of the output, without a copy, and decides
+ * what happens to the message:
+ *
+ *   XPC_HOOK_PASS      forward it on the route, the payload may have been
+ *                      changed in place
+ *   XPC_HOOK_REWRITE   forward it with the header the hook changed, its
+ *                      size may only shrink
+ *   XPC_HOOK_DROP      drop it, counted as XPC_DROP_FILTERED
+ *   XPC_HOOK_REDIRECT  forward it to the destinations the hook listed
+ *                      instead of the route
+ *   XPC_HOOK_FANOUT    forward it on the route and to the destinations the
+ *                      hook listed
+ *
+ * A destination on the output of the route takes the buffer itself, any
+ * other output gets a copy, as buffers belong to the queue of one output.
+ * Destinations must already be outputs, a copy which has no output or no
+ * buffer is only counted in the statistics of the hook.
+ *
+ * Hooks are loaded from shared objects with xpc_hook_load, which look up an
+ * xpc_hook_def_t by name, or made from one linked into the program with
+ * xpc_hook_create. Each hook has its own state, made by the init function of
+ * its definition from a string argument. Hooks run on the router thread
+ * and hold up forwarding for as long as they take; bench_router measures
+ * their cost with -H.
+ *
+ * Messages on a cut-through route are written before they arrived whole,
+ * a route with a hook is never cut through. Pipeline threads do not run
+ * hooks, see xpc_pipeline.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+/**
+ * Version of xpc_hook_def_t, a definition of another version is not loaded.
+ */
+#define XPC_HOOK_ABI 1
+
+/**
+ * Most destinations a hook may list for one message.
+ */
+#define XPC_HOOK_MAX_DST 8
+
+typedef enum {
+    XPC_HOOK_PASS,
+    XPC_HOOK_REWRITE,
+    XPC_HOOK_DROP,
+    XPC_HOOK_REDIRECT,
+    XPC_HOOK_FANOUT,
+    XPC_HOOK_NVERDICTS
+} xpc_hook_verdict_t;
+
+/**
+ * A message as a hook sees it.
+ */
+typedef struct {
+    // the header as it is forwarded on the route, in host byte order: to is
+    // the output channel. Read back unless the verdict is XPC_HOOK_PASS or
+    // XPC_HOOK_DROP, a larger size than it had is ignored.
+    txpc_hdr_t hdr;
+    // hdr.size bytes, in the buffer of the message.
+    uint8_t *payload;
+    // where the message came from.
+    int in_fd;
+    int in_chn;
+    // the destination of the route.
+    xpc_switch_tbl_entry_t route;
+    // destinations for XPC_HOOK_REDIRECT and XPC_HOOK_FANOUT, filled in by
+    // the hook. Each gets the header, rewritten for its channel.
+    xpc_switch_tbl_entry_t dst[XPC_HOOK_MAX_DST];
+    int ndst;
+} xpc_hook_msg_t;
+
+typedef xpc_hook_verdict_t xpc_hook_fn_t(void *state, xpc_hook_msg_t *msg);
+
+/**
+ * What a shared object exports, by any name, to provide a hook.
+ */
+typedef struct {
+    // XPC_HOOK_ABI.
+    uint32_t abi;
+    // make the state of a hook from its argument, may be NULL.
+    // @return 0 on success, the hook is not made otherwise.
+    int (*init)(const char *arg, void **state);
+    xpc_hook_fn_t *fn;
+    // free the state of a hook, may be NULL.
+    void (*fini)(void *state);
+} xpc_hook_def_t;
+
+typedef struct {
+    // messages the hook ran on, by verdict.
+    uint64_t verdicts[XPC_HOOK_NVERDICTS];
+    // copies made for destinations off the output of the route, and those
+    // which were dropped.
+    uint64_t copies;
+    uint64_t copies_dropped;
+} xpc_hook_stats_t;
+
+typedef struct xpc_hook xpc_hook_t;
+
+/**
+ * Make a hook from a definition linked into the program.
+ * @param def the definition, it must outlive the hook
+ * @param arg passed to the init function of the definition, may be NULL
+ * @return the hook, or NULL on failure with errno set.
+ */
+xpc_hook_t *xpc_hook_create(const xpc_hook_def_t *def, const char *arg);
+
+/**
+ * Load a hook from a shared object.
+ * @param path the shared object, NULL for the program itself
+ * @param symbol the name of its xpc_hook_def_t
+ * @param arg passed to the init function of the definition, may be NULL
+ * @return the hook, or NULL on failure, the reason is printed to stderr.
+ */
+xpc_hook_t *xpc_hook_load(const char *path, const char *symbol, const char *arg);
+
+/**
+ * Free a hook, and close the shared object it was loaded from.
+ * @param self the hook, may be NULL
+ */
+void xpc_hook_free(xpc_hook_t *self);
+
+/**
+ * Run a hook on the messages of a route, replacing the one it had.
+ * @param ctx the router context to use
+ * @param ifd input fd of the route
+ * @param ito input channel of the route
+ * @param hook the hook, which the route then owns, or NULL to remove it
+ * @return 0 on success, -1 if the route does not exist.
+ */
+int xpc_set_route_hook(xpc_router_t *ctx, int ifd, int ito, xpc_hook_t *hook);
+
+/**
+ * Read the counters of the hook of a route.
+ * @return 0 on success, -1 if there is no such route or it has no hook.
+ */
+int xpc_hook_get_stats(
+    xpc_router_t *ctx, int ifd, int ito, xpc_hook_stats_t *stats
+);
+
+/**
+ * Run the hook of a route on a message which arrived whole in its buffer,
+ * and queue the copies it asks for. This is called before the message is
+ * finalized, and not for messages which are cut through.
+ * @param ctx the router context to use
+ * @param route the route, which has a hook
+ * @param out_ctx the output of the route, msg_buf belongs to its queue
+ * @param msg_buf the message, with its header encoded for the output and
+ * its source and ingress time set
+ * @param out_chn set to the channel msg_buf is forwarded on
+ * @return true if msg_buf is still to be finalized on the output of the
+ * route, false if it was cleared.
+ */
+bool xpc_hook_run(
+    xpc_router_t *ctx, xpc_route_t *route, xpc_out_ctx_t *out_ctx,
+    msg_buf_t *msg_buf, int *out_chn
+);
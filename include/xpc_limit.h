@@ -0,0 +1,98 @@
+#pragma once
+/**
+ * Per-route rate limiting and sampling.
+ * Some channels carry streams, such as debug output, at a far higher rate
+ * than their consumers need. A route may keep only one message in every N
+ * of them, and may hold the rest to a token bucket of messages or bytes a
+ * second. Both are decided when the header of a message arrives, before a
+ * buffer is taken for it, so a message which is not forwarded only costs
+ * reading its payload into the discard buffer.
+ *
+ * Sampling comes first and is deterministic: the first message of each N
+ * is kept. The bucket then only sees the messages sampling kept, it starts
+ * full and is refilled from the arrival time of each message, so a burst
+ * of up to its depth goes through at once. In bytes, a message costs its
+ * length with its header, and one longer than the depth never fits.
+ *
+ * Messages sampled out are dropped as XPC_DROP_SAMPLED and those over the
+ * rate as XPC_DROP_RATE_LIMITED, each decision is also counted in the
+ * statistics of the limit. Messages of credit senders still use up their
+ * credit, as the sender did send them, see xpc_credit.h.
+ *
+ * Pipeline threads do not apply limits, see xpc_pipeline.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc_utils.h>
+
+typedef struct {
+    // tokens a second, 0 for no rate limit.
+    uint32_t rate;
+    // whether a token is a byte rather than a message.
+    bool bytes;
+    // depth of the bucket, 0 for one second of rate.
+    uint32_t burst;
+    // forward one message in every sample, 0 or 1 to forward them all.
+    uint32_t sample;
+} xpc_limit_conf_t;
+
+typedef struct {
+    // messages forwarded, sampled out and over the rate.
+    uint64_t passed;
+    uint64_t sampled;
+    uint64_t limited;
+} xpc_limit_stats_t;
+
+typedef struct xpc_limit xpc_limit_t;
+
+/**
+ * Limit the messages of a route, replacing the limit it had. The bucket
+ * and the counters are kept if the limit did not change.
+ * @param ctx the router context to use
+ * @param ifd input fd of the route
+ * @param ito input channel of the route
+ * @param conf the limit, or NULL or one which limits nothing to remove it
+ * @return 0 on success, -1 if the route does not exist, the limit has a
+ * burst but no rate, or memory is exhausted.
+ */
+int xpc_set_route_limit(
+    xpc_router_t *ctx, int ifd, int ito, const xpc_limit_conf_t *conf
+);
+
+/**
+ * Read the counters of the limit of a route.
+ * @return 0 on success, -1 if there is no such route or it has no limit.
+ */
+int xpc_limit_get_stats(
+    xpc_router_t *ctx, int ifd, int ito, xpc_limit_stats_t *stats
+);
+
+/**
+ * Parse a route flag of a limit: rate_msgs=N, rate_bytes=N, burst=N or
+ * sample=N, as the topology and the control socket take them.
+ * @param conf the limit the flag is added to
+ * @param flag the flag
+ * @return 0 if it was parsed, 1 if it is not a flag of a limit, or -1 if
+ * its value is bad.
+ */
+int xpc_limit_parse_flag(xpc_limit_conf_t *conf, const char *flag);
+
+/**
+ * Decide whether a message on a route with a limit is forwarded, once its
+ * header arrived.
+ * @param self the limit of the route
+ * @param len the length of the message, header included
+ * @param now_ns when the message arrived, see xpc_monotonic_ns
+ * @param reason set to why the message is dropped
+ * @return true if it is forwarded, false if it is to be dropped.
+ */
+bool xpc_limit_admit(
+    xpc_limit_t *self, int len, uint64_t now_ns, xpc_drop_reason_t *reason
+);
+
+/**
+ * Free a limit.
+ * @param self the limit, may be NULL
+ */
+void xpc_limit_free(xpc_limit_t *self);
@@ -0,0 +1,122 @@
+#pragma once
+/**
+ * A small LZ77 codec for message payloads, in the style of LZ4, with a
+ * dictionary which streams across messages: a payload may copy from the
+ * payloads before it on the same link, so short, repetitive messages like
+ * telemetry compress well even though each of them is too short to
+ * compress on its own.
+ *
+ * Both ends keep the same history, which is every payload they passed
+ * through the codec, in order, compressed or not. The history is a buffer
+ * of the most recent payloads: once the next payload does not fit, all but
+ * its last XPC_LZ_WINDOW bytes are discarded. This only depends on the
+ * lengths of the payloads, so both ends always discard the same bytes.
+ * Payloads longer than XPC_LZ_MAX_PAYLOAD are not part of the history.
+ *
+ * A compressed payload is the length of the original payload as a LEB128
+ * varint, followed by sequences. A sequence is a token byte, whose high
+ * nibble is the number of literals and whose low nibble is the length of
+ * the match minus XPC_LZ_MIN_MATCH. A nibble of 15 is continued by bytes
+ * which are added to it, up to and including the first byte which is not
+ * 255. The literals follow, then the distance of the match back from the
+ * current position, as a little endian uint16_t, then the continuation of
+ * the match length. The last sequence has literals only, it ends once the
+ * original length is reached.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Bytes of history kept when old payloads are discarded. Matches may reach
+ * further back than this while the older bytes are still buffered.
+ */
+#define XPC_LZ_WINDOW (16 << 10)
+
+/**
+ * Longest payload which goes through the codec.
+ */
+#define XPC_LZ_MAX_PAYLOAD (64 << 10)
+
+/**
+ * Shortest match encoded.
+ */
+#define XPC_LZ_MIN_MATCH 4
+
+/**
+ * Payloads shorter than this are kept in the history, but compressing them
+ * is not attempted.
+ */
+#define XPC_LZ_MIN_PAYLOAD 8
+
+// entries of the match finder, indexed by a hash of 4 bytes.
+#define XPC_LZ_HASH_BITS 12
+
+/**
+ * One direction of a link.
+ */
+typedef struct {
+    // the history, hist_len bytes of it are valid.
+    uint8_t *hist;
+    int hist_len;
+    // compressed payloads are written here.
+    uint8_t *out;
+    // last position in hist each hash was seen at, or -1.
+    int32_t table[1 << XPC_LZ_HASH_BITS];
+    // consecutive payloads compression did not pay off for, and payloads to
+    // go before it is attempted again.
+    int misses;
+    int skip;
+    // payload bytes through the codec, and the bytes sent for them.
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+} xpc_lz_t;
+
+/**
+ * Create a codec with an empty history.
+ * @return the codec, or NULL if memory is exhausted.
+ */
+xpc_lz_t *create_xpc_lz();
+
+/**
+ * Empty the history, both ends of a link do so at the same point.
+ */
+void xpc_lz_reset(xpc_lz_t *self);
+
+/**
+ * Compress a payload against the history, and add it to the history.
+ * @param self the sending end
+ * @param src the payload
+ * @param len its length
+ * @param out set to the compressed payload, valid until the next call
+ * @return the length of the compressed payload, or -1 if the payload should
+ * be sent as it is, because compressing it did not pay off or it is too
+ * long. It is part of the history in either case, unless it is longer than
+ * XPC_LZ_MAX_PAYLOAD.
+ */
+int xpc_lz_compress(xpc_lz_t *self, const uint8_t *src, int len, const uint8_t **out);
+
+/**
+ * Add a payload which was received as it is to the history.
+ * @param self the receiving end
+ * @param src the payload
+ * @param len its length
+ */
+void xpc_lz_append(xpc_lz_t *self, const uint8_t *src, int len);
+
+/**
+ * Decompress a payload, and add it to the history.
+ * @param self the receiving end
+ * @param src the compressed payload
+ * @param len its length
+ * @param out set to the original payload, valid until the next call
+ * @return the length of the original payload, or -1 if the compressed
+ * payload is corrupt. The history is lost then, until both ends reset it.
+ */
+int xpc_lz_decompress(xpc_lz_t *self, const uint8_t *src, int len, const uint8_t **out);
+
+/**
+ * Free a codec.
+ * @param self the codec, may be NULL
+ */
+void xpc_lz_free(xpc_lz_t *self);
@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include <alibc/containers/dynabuf.h>
 #include <alibc/containers/array.h>
 #include <alibc/containers/hashmap.h>
@@ -18,20 +20,47 @@ typedef struct {
     int buf_id;
     // this is the offset for writing
     int wr_offset;
+    // owner-defined flags, reset when the buffer is cleared.
+    int flags;
+    // size when the buffer was finalized, counted in the queued bytes until
+    // it is cleared.
+    int final_size;
+    // whether it was dequeued since it was last finalized.
+    bool dequeued;
+    // owner-defined origin of the message: CLOCK_MONOTONIC time its first
+    // byte arrived, and the route it came in on.
+    uint64_t ingress_ns;
+    int src_fd;
+    int src_chn;
     dynabuf_t *buf;
 } msg_buf_t;
 
 /**
  * Message queue data type
  * The message queue is a collection of buffers of dynamic length.
- * Buffers marked as final are dequeue'd in unspecified order, and can be
- * cleared to allow them to be re-used without requiring a system call.
+ * Buffers marked as final are dequeue'd in the order they were finalized,
+ * and can be cleared to allow them to be re-used without requiring a system
+ * call.
  */
 typedef struct {
     array_t *cleared_buffers;
     hashmap_t *inflight_buffers;
     bitmap_t *final_buffer_marks;
     int current_min_id;
+    // ids of the finalized buffers, oldest first. A ring with room for every
+    // buffer of the queue, so finalizing never allocates.
+    int *final_fifo;
+    int fifo_cap;
+    int fifo_head;
+    int fifo_len;
+
+    // statistics, only ever written by the queue's owner.
+    // bytes of finalized messages not yet cleared, and the most there were.
+    int64_t queued_bytes;
+    int64_t peak_queued_bytes;
+    // new buffers taken from the cleared list, or allocated.
+    uint64_t pool_hits;
+    uint64_t pool_misses;
 } msg_queue_t;
 
 /**
@@ -53,6 +82,16 @@ void msg_buf_free(msg_buf_t *self);
 msg_queue_t *create_msg_queue();
 
 
+/**
+ * Preallocate buffers so that messages do not allocate memory until more
+ * than nbufs of them are in the queue at once.
+ * @param self the message queue to use
+ * @param nbufs number of buffers which should be available
+ * @param buf_size capacity of each buffer, in bytes
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int xpc_msg_queue_reserve(msg_queue_t *self, int nbufs, int buf_size);
+
 /**
  * Retrieve (and possibly allocate space for) a buffer to hold a new message
  * in the specified queue.
@@ -72,6 +111,8 @@ msg_buf_t *xpc_msg_getbuf(msg_queue_t *self, int id);
  * Mark a message's buffer as final, indicating that it can be dequeued safely.
  * After calling this function, the buffer pointed to by which is considered
  * to be empty.  Its corresponding id specified by which is no longer valid.
+ * A buffer finalized again after it was dequeued is put back in front of
+ * the others, to be dequeued next.
  * @param self the message queue to use
  * @param which the id of a buffer to be finalized.
  * @return 0 on success, -1 if the id (which) is not valid.
@@ -87,6 +128,26 @@ int xpc_msg_finalize(msg_queue_t *self, int which);
  */
 msg_buf_t *xpc_msg_dequeue_final(msg_queue_t *self);
 
+/**
+ * Function type for choosing a finalized buffer to dequeue.
+ * @param ctx the context passed to xpc_msg_dequeue_select
+ * @param buf a finalized buffer
+ * @return true to dequeue buf.
+ */
+typedef bool (msg_pick_cb_t)(void *ctx, const msg_buf_t *buf);
+
+/**
+ * Retrieve a finalized buffer chosen by the caller.
+ * Finalized buffers are offered to pick oldest first, until it accepts one.
+ * @param self the message queue to use
+ * @param pick called with each finalized buffer, NULL accepts the first
+ * @param ctx passed to pick
+ * @return the accepted buffer, or NULL if pick accepted none.
+ */
+msg_buf_t *xpc_msg_dequeue_select(
+    msg_queue_t *self, msg_pick_cb_t *pick, void *ctx
+);
+
 /**
  * Clear the contents of a message's buffer. This does not necessarily cause it
  * to be cleared in a particular way, but rather marks the buffer as being
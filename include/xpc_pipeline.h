@@ -0,0 +1,93 @@
+#pragma once
+/**
+ * Pipelined forwarding, one thread per direction of each device.
+ * In the event loop, a slow write to one output delays reading every input.
+ * In pipeline mode each input gets an ingress thread, which parses headers
+ * and routes messages, and each output gets an egress thread, which writes
+ * them. They are connected by bounded rings in private memory, see
+ * xpc_ring.h, one for each pair of threads with a route between them.
+ *
+ * The routes, byte orders and limits are taken from a router which has been
+ * set up as usual, and must not change while the pipeline runs. Listeners,
+ * their clients, capturing, spilling to disk, file sinks, the hooks of
+ * xpc_hook.h and the sampling and rate limits of xpc_limit.h need the event
+ * loop and are not supported; coalescing settings are ignored, an egress
+ * thread writes whatever messages are waiting at once. Messages are passed
+ * on whole, so XPC_ROUTE_CUT_THROUGH has no effect either, and each thread
+ * serves a single fd, so the weights of xpc_sched.h are ignored. The
+ * threads block in poll(2), busy polling only applies to the event loop.
+ *
+ * A message which does not fit in the ring toward its output is dropped as
+ * XPC_DROP_QUEUE_FULL, so a slow output never holds up its inputs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc_utils.h>
+
+/**
+ * Default data bytes of each ring between two threads.
+ */
+#define XPC_PIPELINE_QUEUE_BYTES (256 << 10)
+
+/**
+ * Bytes an ingress thread reads at once.
+ */
+#define XPC_PIPELINE_READ_BYTES 4096
+
+/**
+ * Bytes an egress thread gathers into one write, unless a single message is
+ * larger.
+ */
+#define XPC_PIPELINE_WRITE_BYTES 4096
+
+typedef struct xpc_pipeline xpc_pipeline_t;
+
+/**
+ * Create a pipeline for the routes of a router. No thread is started yet.
+ * @param router a router with its routes set, it must outlive the pipeline
+ * @param queue_bytes data bytes of each ring, a power of two, or 0 for
+ * XPC_PIPELINE_QUEUE_BYTES
+ * @return the pipeline, or NULL on failure, with errno ENOTSUP if the router
+ * uses something only the event loop can do.
+ */
+xpc_pipeline_t *create_xpc_pipeline(xpc_router_t *router, uint32_t queue_bytes);
+
+/**
+ * Pin the ingress or egress thread of an fd to a CPU.
+ * @param self the pipeline, not started yet
+ * @param fd an input or output of the router
+ * @param egress true for the thread writing fd, false for the one reading it
+ * @param cpu the CPU, or -1 to let the thread run anywhere
+ * @return 0 on success, -1 if fd has no such thread.
+ */
+int xpc_pipeline_set_cpu(xpc_pipeline_t *self, int fd, bool egress, int cpu);
+
+/**
+ * Start every thread.
+ * @return 0 on success, -1 on failure (errno is set), no thread is left
+ * running.
+ */
+int xpc_pipeline_start(xpc_pipeline_t *self);
+
+/**
+ * Copy the traffic counters of the threads into the router's input, output
+ * and route contexts, so xpc_router_poll publishes them. Only the thread
+ * which owns the router may call this.
+ * @param self the pipeline
+ */
+void xpc_pipeline_sync(xpc_pipeline_t *self);
+
+/**
+ * Stop and join every thread. Messages still in the rings are discarded.
+ * The counters are synchronized a last time, and forwarding latencies are
+ * added to the routes.
+ * @param self the pipeline
+ */
+void xpc_pipeline_stop(xpc_pipeline_t *self);
+
+/**
+ * Stop the pipeline if it runs, and free it. The router is not freed.
+ * @param self the pipeline, may be NULL
+ */
+void xpc_pipeline_free(xpc_pipeline_t *self);
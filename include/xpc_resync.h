@@ -0,0 +1,56 @@
+#pragma once
+/**
+ * Candidate search for stream resynchronization.
+ * After a header fails validation, the input is scanned for the next offset
+ * at which a header plausibly starts. Most offsets are rejected by looking
+ * at a single byte of the header: the low byte of the to-channel, which
+ * must be a routed channel, or 0 for negotiation. Only the survivors are
+ * decoded and validated in full by the router.
+ */
+
+#include <stdint.h>
+#include <xpc_endian.h>
+
+/**
+ * Number of distinct filter byte values checked with vector compares; more
+ * than this falls back to a table lookup per byte.
+ */
+#define XPC_RESYNC_MAX_VALUES 8
+
+typedef struct {
+    // offset within a header of the byte candidates are filtered on.
+    int filter_off;
+    // values which the filter byte may have.
+    uint8_t values[XPC_RESYNC_MAX_VALUES];
+    int n_values;
+    // the same values as a 256 bit set, always complete.
+    uint64_t value_set[4];
+} xpc_resync_filter_t;
+
+/**
+ * Prepare a filter for headers encoded by codec.
+ * The to-channel 0 (negotiation) is always accepted.
+ * @param self the filter to initialize
+ * @param codec byte order of the input being scanned
+ */
+void xpc_resync_filter_init(xpc_resync_filter_t *self, const xpc_hdr_codec_t *codec);
+
+/**
+ * Accept headers sent to another to-channel.
+ * @param self a filter initialized with xpc_resync_filter_init
+ * @param to_chn the channel to accept
+ */
+void xpc_resync_filter_add(xpc_resync_filter_t *self, int to_chn);
+
+/**
+ * Find the first offset which may be the start of a header.
+ * @param self the filter to use
+ * @param buf the buffer to scan
+ * @param start first offset to consider
+ * @param limit offsets up to but not including limit are considered. The
+ * filter byte of each must lie in buf, so limit + filter_off <= buffer size.
+ * @return the offset of a candidate, or -1 if there are none.
+ */
+int xpc_resync_find(
+    const xpc_resync_filter_t *self, const uint8_t *buf, int start, int limit
+);
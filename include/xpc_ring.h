@@ -0,0 +1,167 @@
+#pragma once
+/**
+ * Single producer, single consumer rings in shared memory.
+ * Local clients may exchange messages with the router through a pair of
+ * rings in a memfd, see xpc_shm.h, instead of through their socket. Each
+ * side only ever writes its own index, so no locks are needed.
+ *
+ * A ring holds records of a uint32_t length followed by that many bytes,
+ * padded to XPC_RING_ALIGN. A record never wraps around the end of the
+ * ring, a length of XPC_RING_WRAP sends the reader back to the start.
+ *
+ * Doorbells are only rung for a side which is asleep. A consumer about to
+ * block sets its waiting flag and looks at the ring once more, a producer
+ * checks the flag after publishing; with a full barrier on both sides one
+ * of them always sees the other. Producers waiting for room work the same
+ * way with the roles swapped.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define XPC_RING_MAGIC 0x474e4952
+#define XPC_RING_VERSION 1
+#define XPC_RING_ALIGN 8
+#define XPC_RING_WRAP UINT32_MAX
+// indices and flags of the two sides are kept on separate cache lines.
+#define XPC_RING_CACHE_LINE 64
+
+/**
+ * Shared state of one ring.
+ */
+typedef struct {
+    // written by the producer: bytes published so far, and whether it is
+    // asleep until there is room.
+    _Alignas(XPC_RING_CACHE_LINE) uint64_t head;
+    uint32_t producer_waiting;
+    // written by the consumer: bytes consumed so far, and whether it is
+    // asleep until there is data.
+    _Alignas(XPC_RING_CACHE_LINE) uint64_t tail;
+    uint32_t consumer_waiting;
+} xpc_ring_ctl_t;
+
+/**
+ * Header of a shared area, followed by the control block and data of the
+ * ring toward the router, then those of the ring toward the client.
+ */
+typedef struct {
+    _Alignas(XPC_RING_CACHE_LINE) uint32_t magic;
+    uint32_t version;
+    // data bytes of each ring, a power of two.
+    uint32_t ring_bytes;
+    uint32_t reserved;
+} xpc_ring_area_t;
+
+/**
+ * One side's view of a ring. The fields other than ctl and data are
+ * private to that side.
+ */
+typedef struct {
+    xpc_ring_ctl_t *ctl;
+    uint8_t *data;
+    uint32_t size;
+    // the producer's head, or the consumer's tail.
+    uint64_t pos;
+    // last value seen of the other side's index, it is only reloaded when
+    // it looks like the ring is full or empty.
+    uint64_t peer_pos;
+    // the record being written or read.
+    uint32_t rec_len;
+    // the other side wrote something impossible, the ring is unusable.
+    bool broken;
+} xpc_ring_t;
+
+/**
+ * Size of a shared area holding two rings.
+ * @param ring_bytes data bytes of each ring, a power of two
+ */
+size_t xpc_ring_area_size(uint32_t ring_bytes);
+
+/**
+ * Initialize a shared area, both rings are empty.
+ * The consumer of the ring toward the router starts asleep, so the first
+ * message rings its doorbell.
+ * @param area zeroed memory of xpc_ring_area_size(ring_bytes) bytes
+ * @param ring_bytes data bytes of each ring, a power of two
+ */
+void xpc_ring_area_init(xpc_ring_area_t *area, uint32_t ring_bytes);
+
+/**
+ * Get the views of the rings of a shared area, after checking its header.
+ * @param area the mapped area
+ * @param len length of the mapping
+ * @param to_router set to the ring toward the router
+ * @param to_client set to the ring toward the client
+ * @return 0 on success, -1 if the area is not valid.
+ */
+int xpc_ring_area_open(
+    xpc_ring_area_t *area, size_t len, xpc_ring_t *to_router,
+    xpc_ring_t *to_client
+);
+
+/**
+ * Set up one side's view of a ring in private memory, for rings between
+ * threads of one process. Each thread gets its own view of the ring.
+ * @param self the view
+ * @param ctl zeroed control block
+ * @param data data bytes of the ring
+ * @param size number of data bytes, a power of two
+ */
+void xpc_ring_init(xpc_ring_t *self, xpc_ring_ctl_t *ctl, void *data, uint32_t size);
+
+/**
+ * Largest record a ring accepts.
+ */
+uint32_t xpc_ring_max_record(const xpc_ring_t *self);
+
+/**
+ * Make room for a record.
+ * @param self the producer's view
+ * @param len length of the record
+ * @return where to write it, or NULL if there is no room now.
+ */
+void *xpc_ring_reserve(xpc_ring_t *self, uint32_t len);
+
+/**
+ * Publish the record made room for by xpc_ring_reserve.
+ * @return true if the consumer is asleep and its doorbell must be rung.
+ */
+bool xpc_ring_commit(xpc_ring_t *self);
+
+/**
+ * Look at the next record.
+ * @param self the consumer's view
+ * @param len set to the length of the record
+ * @return the record, or NULL if the ring is empty or broken.
+ */
+const void *xpc_ring_peek(xpc_ring_t *self, uint32_t *len);
+
+/**
+ * Consume the record returned by xpc_ring_peek.
+ * @return true if the producer is asleep and its doorbell must be rung.
+ */
+bool xpc_ring_release(xpc_ring_t *self);
+
+/**
+ * Announce that the consumer is going to sleep until its doorbell rings.
+ * @return true if it may sleep, false if a record arrived meanwhile.
+ */
+bool xpc_ring_consumer_sleep(xpc_ring_t *self);
+
+/**
+ * Announce that the consumer is awake again.
+ */
+void xpc_ring_consumer_wake(xpc_ring_t *self);
+
+/**
+ * Announce that the producer is going to sleep until there is room.
+ * @param len length of the record it is waiting to write
+ * @return true if it may sleep, false if there is room now.
+ */
+bool xpc_ring_producer_sleep(xpc_ring_t *self, uint32_t len);
+
+/**
+ * Announce that the producer is awake again.
+ */
+void xpc_ring_producer_wake(xpc_ring_t *self);
@@ -0,0 +1,118 @@
+#pragma once
+/**
+ * Real-time profile.
+ * Allocating and faulting in memory can cost milliseconds on a loaded
+ * system: a pooled buffer which grows for a large message, the first time
+ * a stage fills, a table of routes which grows, stack pages touched by a
+ * deeper call.
+ *
+ * xpc_rt_enable grows every pooled buffer to the largest message the router
+ * accepts and every coalescing stage to its threshold plus one message,
+ * writes to all of them, grows the tables of contexts and routes by
+ * XPC_RT_SPARE_FDS and XPC_RT_SPARE_ROUTES, and touches XPC_RT_STACK_BYTES
+ * of stack. It locks the memory of the process (mlockall, current and
+ * future), pins the calling thread to a CPU and moves it to SCHED_FIFO if
+ * asked, and once all of this succeeded keeps malloc from returning memory
+ * to the system. Threads the caller starts later inherit the scheduling
+ * policy.
+ *
+ * Nothing guarantees the forwarding path does not allocate, it is checked:
+ * after a warm-up time the page faults of the process, the growth of the
+ * malloc heap, the message buffers allocated instead of taken from a pool and
+ * the allocations counted by the caller, if it counts them, are checked by
+ * xpc_router_poll. Any of them going up after warm-up is
+ * reported on stderr, once per check which saw it, and can be read with
+ * xpc_rt_violations. Clients accepted and compression negotiated after
+ * warm-up allocate memory, and are reported like anything else.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc_utils.h>
+
+/**
+ * Stack prefaulted by xpc_rt_enable.
+ */
+#define XPC_RT_STACK_BYTES (256 * 1024)
+
+/**
+ * Time between two checks after warm-up.
+ */
+#define XPC_RT_CHECK_MS 1000
+
+#define XPC_RT_WARMUP_MS 1000
+
+/**
+ * Inputs or outputs, and routes, which can be added after xpc_rt_enable
+ * before their tables grow.
+ */
+#define XPC_RT_SPARE_FDS 16
+#define XPC_RT_SPARE_ROUTES 64
+
+typedef struct {
+    // mlockall the process.
+    bool lock_memory;
+    // CPU the calling thread is pinned to, -1 for any.
+    int cpu;
+    // SCHED_FIFO priority of the calling thread, 0 to leave it as is.
+    int priority;
+    // time after xpc_rt_enable before the checks start.
+    uint32_t warmup_ms;
+    // calls to the allocator counted by the caller, e.g. with
+    // -Wl,--wrap=malloc, NULL if it does not count them.
+    const uint64_t *alloc_count;
+} xpc_rt_opts_t;
+
+#define XPC_RT_OPTS_DEFAULT { \
+    .lock_memory = true, .cpu = -1, .priority = 0, \
+    .warmup_ms = XPC_RT_WARMUP_MS, .alloc_count = NULL \
+}
+
+/**
+ * What happened since warm-up.
+ */
+typedef struct {
+    // minor and major faults of the whole process.
+    uint64_t page_faults;
+    // bytes the malloc arenas and mmapped chunks grew by.
+    uint64_t heap_bytes;
+    // allocations counted through xpc_rt_opts_t.alloc_count.
+    uint64_t allocations;
+    // message buffers allocated because the pool of an output was empty.
+    uint64_t pool_misses;
+} xpc_rt_usage_t;
+
+typedef struct xpc_rt xpc_rt_t;
+
+/**
+ * Prepare the process for real-time forwarding, see above. Call it once the
+ * routes are set and the outputs reserved, from the thread which runs the
+ * router.
+ * @param ctx the router context to use
+ * @param opts what to do
+ * @return 0 on success, -1 on failure with errno set: the memory could not
+ * be locked (EPERM or ENOMEM, see mlockall), the CPU does not exist, or
+ * SCHED_FIFO is not allowed.
+ */
+int xpc_rt_enable(xpc_router_t *ctx, const xpc_rt_opts_t *opts);
+
+/**
+ * Run the checks, this is called by xpc_router_poll.
+ * @param ctx the router context to use
+ * @return milliseconds until the next check, or -1 if there are none.
+ */
+int xpc_rt_poll(xpc_router_t *ctx);
+
+/**
+ * Check now, and read what happened since warm-up.
+ * @param ctx the router context to use
+ * @param usage filled in
+ * @return 0 on success, -1 if the profile is not enabled or its first
+ * check, at the end of warm-up, has not run yet.
+ */
+int xpc_rt_violations(xpc_router_t *ctx, xpc_rt_usage_t *usage);
+
+/**
+ * Free the state of the profile, the process stays locked and pinned.
+ */
+void xpc_rt_free(xpc_rt_t *self);
@@ -0,0 +1,87 @@
+#pragma once
+/**
+ * Deficit round robin between the fds and routes of a router.
+ * Without it, each io event moves one message, so an input which sends
+ * large messages, or many, gets as much of the event loop as it wants, and
+ * its messages crowd the queues of the outputs it shares with others.
+ *
+ * With a quantum set, each wait for events is one round. In a round each
+ * ready fd may move quantum times its weight in bytes, messages are read or
+ * written until that is used up or the fd has nothing more, and at least
+ * once. The last message may overshoot the share, the excess is taken from
+ * the next round, up to a whole share, and an fd which runs out of work
+ * keeps nothing for later. The same applies to the routes sharing an
+ * output: a message is only taken from the queue of the output if its route
+ * has some of its share left, and a new round starts once every route with
+ * messages waiting has used up its share. Shares are in bytes, headers
+ * included, so a route gets the same bandwidth whatever the size of its
+ * messages.
+ *
+ * A weight of 0 counts as 1. Negotiation messages, and messages whose route
+ * was removed, are not counted against any route. Pipeline threads are not
+ * scheduled, see xpc_pipeline.h.
+ */
+
+#include <stdint.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+/**
+ * Suggested quantum, a few messages of the usual size.
+ */
+#define XPC_SCHED_QUANTUM 4096
+
+/**
+ * Start or stop scheduling.
+ * @param ctx the router context to use
+ * @param quantum bytes per round of weight 1, 0 to serve each event once
+ * @return 0 on success, -1 if quantum is negative.
+ */
+int xpc_sched_enable(xpc_router_t *ctx, int quantum);
+
+/**
+ * Set the weight of an fd, as an input and as an output.
+ * @param ctx the router context to use
+ * @param fd an input or output
+ * @param weight its share relative to the others
+ * @return 0 on success, -1 if fd is neither or weight is negative.
+ */
+int xpc_sched_set_fd_weight(xpc_router_t *ctx, int fd, int weight);
+
+/**
+ * Set the weight of a route, relative to the others toward its output.
+ * @param ctx the router context to use
+ * @param ifd input fd of the route
+ * @param ito input channel of the route
+ * @param weight its share relative to the others
+ * @return 0 on success, -1 if the route does not exist or weight is
+ * negative.
+ */
+int xpc_sched_set_route_weight(xpc_router_t *ctx, int ifd, int ito, int weight);
+
+/**
+ * Read from an input for as long as its share allows. This replaces
+ * xpc_accumulate_msg as the read callback of the event loop.
+ * @param ctx the router context to use
+ * @param fd an fd which is ready for reading
+ * @return the number of bytes read.
+ */
+int xpc_sched_read(xpc_router_t *ctx, int fd);
+
+/**
+ * Write to an output for as long as its share allows. This replaces
+ * xpc_write_msg as the write callback of the event loop.
+ * @param ctx the router context to use
+ * @param fd an fd which is ready for writing
+ * @return the number of bytes written.
+ */
+int xpc_sched_write(xpc_router_t *ctx, int fd);
+
+/**
+ * Take the next message to write from the queue of an output, from a route
+ * with some of its share left. Without a quantum, any finalized message.
+ * @param ctx the router context to use
+ * @param out_ctx the output
+ * @return the message, or NULL if none is finalized.
+ */
+msg_buf_t *xpc_sched_dequeue(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx);
@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * Serial port setup.
+ * Ports are put in raw mode at an arbitrary baud rate, set with termios2 and
+ * BOTHER rather than the fixed Bxxx rates of termios.
+ *
+ * VMIN and VTIME decide when the tty layer considers input readable. The
+ * router's fds are non-blocking, so read(2) never waits on them; what they
+ * change is when epoll reports the port readable. With VTIME 0, readiness
+ * waits for VMIN bytes, which batches wakeups but holds back a trailing
+ * message shorter than VMIN until more data arrives. VMIN 1 wakes on every
+ * byte, for the lowest latency.
+ */
+
+#include <stdbool.h>
+
+typedef struct {
+    // line rate in bits per second, any rate the driver can generate.
+    int baud;
+    // termios VMIN, bytes which make the port readable.
+    int vmin;
+    // termios VTIME, in tenths of a second.
+    int vtime_ds;
+    // ask the driver to push received bytes to the tty layer immediately
+    // (ASYNC_LOW_LATENCY), instead of batching them.
+    bool low_latency;
+} xpc_serial_opts_t;
+
+#define XPC_SERIAL_OPTS_DEFAULT \
+    {.baud = 921600, .vmin = 1, .vtime_ds = 0, .low_latency = true}
+
+/**
+ * What the driver actually applied, which may differ from the request.
+ */
+typedef struct {
+    // the output baud rate read back from the port.
+    int baud;
+    // whether ASYNC_LOW_LATENCY is set, not all drivers support it.
+    bool low_latency;
+} xpc_serial_status_t;
+
+/**
+ * Open a serial port exclusively, non-blocking, and configure it.
+ * @param path the device node
+ * @param opts the settings to apply
+ * @param status if not NULL, set to the settings the driver applied
+ * @return the fd, or -1 on failure (errno is set).
+ */
+int xpc_serial_open(
+    const char *path, const xpc_serial_opts_t *opts, xpc_serial_status_t *status
+);
+
+/**
+ * Configure an open serial port: raw mode, 8N1, no flow control.
+ * @param fd the port
+ * @param opts the settings to apply
+ * @param status if not NULL, set to the settings the driver applied
+ * @return 0 on success, -1 if the port rejected the settings.
+ * Failing to set low latency is not an error, status reports it.
+ */
+int xpc_serial_configure(
+    int fd, const xpc_serial_opts_t *opts, xpc_serial_status_t *status
+);
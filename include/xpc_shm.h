@@ -0,0 +1,93 @@
+#pragma once
+/**
+ * Shared memory transport for local clients.
+ * A client connected to a listener (see xpc_clients.h) may move its traffic
+ * into a pair of rings in a memfd, see xpc_ring.h. It sends a control
+ * message of type XPC_CLIENT_SHM_ATTACH over its socket, carrying the memfd
+ * and two eventfds as SCM_RIGHTS: the router's doorbell, then its own.
+ * The memfd must be sealed against shrinking and growing, the router maps
+ * it whole and would fault if it were truncated under the mapping.
+ *
+ * From then on the router reads the client's messages from one ring when
+ * its doorbell fd is readable, and copies messages for the client straight
+ * into the other ring from the listener. Doorbells are only rung for a side
+ * which is asleep, so a busy client and router exchange messages without
+ * system calls. The socket stays open for control messages and to notice
+ * the client hanging up.
+ *
+ * xpc_shm_client.h is the client side.
+ */
+
+#include <stdint.h>
+#include <xpc_utils.h>
+#include <xpc_ring.h>
+
+/**
+ * Messages read from a client's ring per doorbell, so one busy client does
+ * not starve the others.
+ */
+#define XPC_SHM_RECV_BATCH 64
+
+typedef struct xpc_shm_link {
+    // the client's socket, and the listener it connected to.
+    int cfd;
+    int lfd;
+    // eventfds rung to wake the router, and to wake the client.
+    int router_bell;
+    int client_bell;
+    xpc_ring_area_t *area;
+    size_t area_len;
+    xpc_ring_t rx;
+    xpc_ring_t tx;
+} xpc_shm_link_t;
+
+/**
+ * Move a client's traffic into shared memory. The router owns the fds
+ * passed from here on, and closes them even if this fails. The doorbells
+ * are made non-blocking.
+ * The router's doorbell is watched through io_watch_fd_cb.
+ * @param ctx the router context to use
+ * @param cfd a client of a listener
+ * @param memfd the shared area, see xpc_ring_area_init, sealed with
+ * F_SEAL_SHRINK and F_SEAL_GROW
+ * @param router_bell the eventfd the client rings to wake the router
+ * @param client_bell the eventfd the router rings to wake the client
+ * @return 0 on success, -1 on failure: the area is not sealed or too
+ * small, or a doorbell is not an eventfd.
+ */
+int xpc_shm_attach(
+    xpc_router_t *ctx, int cfd, int memfd, int router_bell, int client_bell
+);
+
+/**
+ * Route up to XPC_SHM_RECV_BATCH messages from a client's ring.
+ * A client whose ring is corrupt is closed.
+ * @param ctx the router context to use
+ * @param router_bell the doorbell which was readable
+ * @return the number of bytes read.
+ */
+int xpc_shm_recv(xpc_router_t *ctx, int router_bell);
+
+/**
+ * Copy a finalized message into a client's ring.
+ * @param ctx the router context to use
+ * @param link the client
+ * @param msg_buf the message
+ * @return 0 on success, -1 if the ring is full.
+ */
+int xpc_shm_send(
+    xpc_router_t *ctx, xpc_shm_link_t *link, const msg_buf_t *msg_buf
+);
+
+/**
+ * Stop using shared memory for a client, before its socket is closed.
+ * @param ctx the router context to use
+ * @param link the client, freed by this call
+ */
+void xpc_shm_detach(xpc_router_t *ctx, xpc_shm_link_t *link);
+
+/**
+ * Unmap and close everything of a link, without telling the router.
+ * @param link the link to free, may be NULL
+ */
+void xpc_shm_link_free(xpc_shm_link_t *link);
@@ -0,0 +1,95 @@
+#pragma once
+/**
+ * Client side of the shared memory transport, see xpc_shm.h.
+ * A client connects to a listener, hands the router a pair of rings and
+ * then sends and receives whole messages through them. Nothing here
+ * blocks except xpc_shm_client_wait.
+ *
+ * Clients with their own event loop watch xpc_shm_client_fd for reading,
+ * and call xpc_shm_client_arm before each wait. Receiving or sending
+ * tells the router the client is awake again.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <tinyxpc/tinyxpc.h>
+
+/**
+ * Default data bytes of each ring.
+ */
+#define XPC_SHM_CLIENT_RING_BYTES (1 << 20)
+
+typedef struct xpc_shm_client xpc_shm_client_t;
+
+/**
+ * Connect to a listener and attach a pair of rings.
+ * @param path file system path of the listener
+ * @param ring_bytes data bytes of each ring, a power of two, or 0 for
+ * XPC_SHM_CLIENT_RING_BYTES
+ * @return the client, or NULL on failure (errno is set).
+ */
+xpc_shm_client_t *xpc_shm_client_connect(const char *path, uint32_t ring_bytes);
+
+/**
+ * Subscribe to, or unsubscribe from, channels of the listener.
+ * @param self the client
+ * @param chns the channels
+ * @param n number of channels
+ * @param subscribe false to unsubscribe
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int xpc_shm_client_subscribe(
+    xpc_shm_client_t *self, const uint32_t *chns, int n, bool subscribe
+);
+
+/**
+ * Send a message. hdr->size is the length of the payload.
+ * @return 0 on success, -1 with errno EAGAIN if the ring is full, or
+ * EMSGSIZE if the message could never fit.
+ */
+int xpc_shm_client_send(
+    xpc_shm_client_t *self, const txpc_hdr_t *hdr, const void *payload
+);
+
+/**
+ * Receive a message.
+ * @param self the client
+ * @param hdr set to the header of the message
+ * @param payload where its payload is copied
+ * @param max room at payload
+ * @return the length of the payload, or -1 with errno EAGAIN if there is
+ * no message, or EMSGSIZE if it is larger than max (it is kept).
+ */
+int xpc_shm_client_recv(
+    xpc_shm_client_t *self, txpc_hdr_t *hdr, void *payload, int max
+);
+
+/**
+ * The fd which is readable when the router rang the client's doorbell.
+ */
+int xpc_shm_client_fd(xpc_shm_client_t *self);
+
+/**
+ * Ask the router to ring the doorbell once a message arrives, or once
+ * send_len bytes of payload can be sent.
+ * @param self the client
+ * @param send_len payload waiting to be sent, 0 if none
+ * @return true if the client may wait, false if it can go on right away.
+ */
+bool xpc_shm_client_arm(xpc_shm_client_t *self, int send_len);
+
+/**
+ * Wait until a message arrives, or send_len bytes of payload can be sent.
+ * @param self the client
+ * @param send_len payload waiting to be sent, 0 if none
+ * @param timeout_ms longest wait, -1 for no limit
+ * @return 0 once the client can go on or the time is up, -1 on failure,
+ * with errno EPIPE if the router hung up.
+ */
+int xpc_shm_client_wait(xpc_shm_client_t *self, int send_len, int timeout_ms);
+
+/**
+ * Disconnect and free a client.
+ * @param self the client, may be NULL
+ */
+void xpc_shm_client_close(xpc_shm_client_t *self);
@@ -0,0 +1,214 @@
+#pragma once
+/**
+ * File sinks.
+ * A sink is an output which archives what is routed to it in segment files,
+ * instead of writing it to an fd. Each segment is allocated and memory
+ * mapped when it is started, so archiving a message is a copy into the
+ * mapping: no system call, and no process reading a fifo.
+ *
+ * Segments are named after the path of the sink and the CLOCK_REALTIME
+ * millisecond they were started at, as path.<ms>, so they sort by time. A
+ * new one is started once the next message does not fit, or once the
+ * current one is rotate_ms old and not empty. A finished segment is
+ * truncated to its records.
+ *
+ * Layout of a segment: an xpc_sink_hdr_t, an index of index_max
+ * xpc_sink_index_t, then records back to back from data_off. Each record is
+ * an xpc_sink_rec_t followed by the message as it was forwarded, header
+ * included, padded to XPC_SINK_ALIGN bytes. Only records before hdr->end
+ * are complete. The index has an entry for the first record at or past
+ * every (capacity - data_off) / index_max bytes, with its time, so
+ * xpc_sink_seek finds a time without reading the whole segment. Times never
+ * go back within a segment: if the clock steps back, records are given the
+ * time of the one before them until it catches up.
+ *
+ * Pages are written back by the kernel as it sees fit. The sync policy asks
+ * for more every sync_bytes written or sync_ms passed, whichever is first,
+ * and when a segment is finished: XPC_SINK_SYNC_ASYNC starts writing back
+ * what was added since, without waiting for it (sync_file_range), and
+ * XPC_SINK_SYNC_DATA waits until it is on disk (fdatasync), which stalls
+ * the router meanwhile.
+ *
+ * The fd of a sink is the directory of its segments, opened with O_PATH by
+ * xpc_sink_open. It stands for the sink in routes and is never written to
+ * or watched for events. Pipeline threads do not write sinks, see
+ * xpc_pipeline.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+#define XPC_SINK_MAGIC 0x4b4e4953
+#define XPC_SINK_VERSION 1
+#define XPC_SINK_ALIGN 8
+
+// the message headers are big endian, otherwise little endian.
+#define XPC_SINK_BIG_ENDIAN (1 << 0)
+// the segment is finished, nothing is added to it anymore.
+#define XPC_SINK_CLOSED (1 << 1)
+
+typedef enum {
+    XPC_SINK_SYNC_NONE,
+    XPC_SINK_SYNC_ASYNC,
+    XPC_SINK_SYNC_DATA,
+} xpc_sink_sync_t;
+
+typedef struct {
+    // size of a segment while it is written.
+    size_t segment_bytes;
+    // age at which a segment is finished, 0 to only finish full ones.
+    uint32_t rotate_ms;
+    // entries in the index of each segment.
+    uint32_t index_max;
+    xpc_sink_sync_t sync;
+    uint32_t sync_ms;
+    size_t sync_bytes;
+} xpc_sink_opts_t;
+
+#define XPC_SINK_OPTS_DEFAULT { \
+    .segment_bytes = 64 << 20, .rotate_ms = 0, .index_max = 1024, \
+    .sync = XPC_SINK_SYNC_ASYNC, .sync_ms = 1000, .sync_bytes = 1 << 20 \
+}
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    // entries the index has room for, and entries in it.
+    uint32_t index_max;
+    uint32_t index_count;
+    uint32_t reserved;
+    // offset of the first record.
+    uint64_t data_off;
+    // offset just past the last complete record.
+    uint64_t end;
+    // size of the file while it is written.
+    uint64_t capacity;
+    // CLOCK_REALTIME time the first and the last record were written.
+    uint64_t first_ns;
+    uint64_t last_ns;
+} xpc_sink_hdr_t;
+
+typedef struct {
+    // CLOCK_REALTIME time the record was written.
+    uint64_t time_ns;
+    // offset of the record.
+    uint64_t offset;
+} xpc_sink_index_t;
+
+typedef struct {
+    // length of the record, including this header and padding.
+    uint32_t rec_len;
+    // length of the message following this header.
+    uint32_t msg_len;
+    // CLOCK_REALTIME time the record was written.
+    uint64_t time_ns;
+    // CLOCK_MONOTONIC time the first byte of the message arrived.
+    uint64_t ingress_ns;
+    int32_t in_fd;
+    int32_t in_chn;
+} xpc_sink_rec_t;
+
+typedef struct {
+    // segments started, messages and message bytes archived.
+    uint64_t segments;
+    uint64_t msgs;
+    uint64_t bytes;
+    // messages which did not fit in a segment, or had none to go to.
+    uint64_t lost;
+    // times the sync policy was applied.
+    uint64_t syncs;
+} xpc_sink_stats_t;
+
+typedef struct xpc_sink xpc_sink_t;
+
+/**
+ * Open the fd a sink is known by: the directory its segments go to.
+ * @param path path of the sink, its segments are path.<ms>
+ * @return the fd, or -1 on failure with errno set.
+ */
+int xpc_sink_open(const char *path);
+
+/**
+ * Archive what is routed to an fd from xpc_sink_open. Nothing is created
+ * until the first message arrives.
+ * @param ctx the router context to use
+ * @param fd the fd of the sink
+ * @param path the path it was opened with
+ * @param opts segment size, rotation and sync policy
+ * @return 0 on success, -1 on failure with errno set: the options are
+ * invalid, or fd is already an output of some other kind.
+ */
+int xpc_sink_enable(
+    xpc_router_t *ctx, int fd, const char *path, const xpc_sink_opts_t *opts
+);
+
+/**
+ * Archive the finalized messages of a sink, this is called by
+ * xpc_output_ready.
+ * @param ctx the router context to use
+ * @param out_ctx the output context of a sink
+ */
+void xpc_sink_drain(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx);
+
+/**
+ * Rotate and sync the sinks which are due, this is called by
+ * xpc_router_poll.
+ * @param ctx the router context to use
+ * @return milliseconds until the next rotation or sync, or -1 if there are
+ * none.
+ */
+int xpc_sink_poll(xpc_router_t *ctx);
+
+/**
+ * Read the counters of a sink.
+ * @return 0 on success, -1 if fd is not a sink.
+ */
+int xpc_sink_get_stats(xpc_router_t *ctx, int fd, xpc_sink_stats_t *stats);
+
+/**
+ * Finish the current segment and free the sink.
+ * @param self the sink to free, may be NULL
+ */
+void xpc_sink_free(xpc_sink_t *self);
+
+/**
+ * Map a segment read-only, it may still be written.
+ * @param path the segment
+ * @param len set to the length of the mapping
+ * @return the header, or NULL if the file is missing or not a segment.
+ */
+const xpc_sink_hdr_t *xpc_sink_map(const char *path, size_t *len);
+
+/**
+ * Unmap a segment mapped with xpc_sink_map.
+ */
+void xpc_sink_unmap(const xpc_sink_hdr_t *hdr, size_t len);
+
+/**
+ * Iterate over the records of a mapped segment.
+ * @param hdr the mapped segment
+ * @param rec the previous record, or NULL for the first one
+ * @return the next record, or NULL after the last one.
+ */
+const xpc_sink_rec_t *xpc_sink_next(
+    const xpc_sink_hdr_t *hdr, const xpc_sink_rec_t *rec
+);
+
+/**
+ * Find the first record of a mapped segment written at or after a time.
+ * @param hdr the mapped segment
+ * @param time_ns CLOCK_REALTIME time
+ * @return the record, or NULL if all of them are older.
+ */
+const xpc_sink_rec_t *xpc_sink_seek(const xpc_sink_hdr_t *hdr, uint64_t time_ns);
+
+/**
+ * The message of a record.
+ */
+static inline const uint8_t *xpc_sink_msg_bytes(const xpc_sink_rec_t *rec) {
+    return (const uint8_t *)(rec + 1);
+}
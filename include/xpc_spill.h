@@ -0,0 +1,149 @@
+#pragma once
+/**
+ * Disk spill of output queues.
+ * The queue of an output grows for as long as its consumer does not read,
+ * a fifo whose reader restarts holds the messages of the whole restart in
+ * memory. With a spill, once the messages queued for an output exceed a
+ * memory budget they are moved to segment files on disk instead, and fed
+ * back to the output in the order they were spilled once it can be written
+ * again.
+ *
+ * Segments are created next to the path given, as path.0, path.1 and so on,
+ * each allocated up front and memory mapped, so spilling a message is a copy
+ * into the mapping. Only the segment being written and the one being read
+ * are mapped. A segment is removed once it is read, at most max_segments
+ * exist at a time; a message which does not fit in them is dropped as
+ * XPC_DROP_QUEUE_FULL. Reading a segment advises the kernel to read ahead
+ * of it.
+ *
+ * While anything is spilled every message finalized for the output is
+ * spilled behind it, so nothing overtakes what is on disk, and messages are
+ * fed back one at a time through a buffer of the queue. Spilled messages
+ * are written in the order they were spilled rather than scheduled, see
+ * xpc_sched.h, and are not counted against credit windows, see
+ * xpc_credit.h. The segments are removed when the output is freed, they do
+ * not outlive the router. Pipeline threads do not spill, see
+ * xpc_pipeline.h.
+ *
+ * A spilled message which cannot be fed back, because its segment cannot
+ * be mapped or no buffer is available, is counted as a stall. The output
+ * stops asking to be written meanwhile, and xpc_router_poll hands it back
+ * to the io event manager every XPC_SPILL_RETRY_MS until it can be.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+
+#define XPC_SPILL_ALIGN 8
+
+/**
+ * Defaults for the size and number of segments.
+ */
+#define XPC_SPILL_SEGMENT_BYTES (4 << 20)
+#define XPC_SPILL_SEGMENTS 16
+
+/**
+ * Bytes read ahead of the message being fed back.
+ */
+#define XPC_SPILL_READAHEAD (256 * 1024)
+
+/**
+ * Milliseconds between attempts to feed back a stalled spill.
+ */
+#define XPC_SPILL_RETRY_MS 10
+
+typedef struct {
+    // length of the record, including this header and padding.
+    uint32_t rec_len;
+    // length of the message following this header.
+    uint32_t msg_len;
+    // CLOCK_MONOTONIC time the first byte of the message arrived.
+    uint64_t ingress_ns;
+    int32_t src_fd;
+    int32_t src_chn;
+    uint32_t flags;
+    uint32_t reserved;
+} xpc_spill_rec_t;
+
+typedef struct {
+    // messages and bytes on disk right now.
+    uint64_t msgs;
+    uint64_t bytes;
+    // segment files which exist right now.
+    int segments;
+    // messages spilled and fed back so far.
+    uint64_t spilled;
+    uint64_t drained;
+    // messages dropped because every segment was full.
+    uint64_t dropped;
+    // times the oldest message could not be fed back, and errno of the
+    // last of them.
+    uint64_t stalls;
+    int last_errno;
+} xpc_spill_stats_t;
+
+typedef struct xpc_spill xpc_spill_t;
+
+/**
+ * Spill the queue of an output to disk past a memory budget.
+ * @param ctx the router context to use
+ * @param ofd the output fd
+ * @param path prefix of the segment files
+ * @param mem_bytes bytes which may be queued in memory before spilling
+ * @param segment_bytes size of each segment file, 0 for
+ * XPC_SPILL_SEGMENT_BYTES
+ * @param max_segments most segment files at a time, 0 for
+ * XPC_SPILL_SEGMENTS
+ * @return 0 on success, -1 on failure with errno set: ofd is not an output
+ * or already spills, or the first segment could not be created.
+ */
+int xpc_spill_enable(
+    xpc_router_t *ctx, int ofd, const char *path, int64_t mem_bytes,
+    uint32_t segment_bytes, int max_segments
+);
+
+/**
+ * Move the finalized messages of an output to its spill once it is over
+ * budget, or already spilling. This is called by xpc_output_ready.
+ * @param ctx the router context to use
+ * @param out_ctx an output context with a spill
+ */
+void xpc_spill_offload(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx);
+
+/**
+ * Take the oldest spilled message back into a buffer of the queue of its
+ * output. The buffer is dequeued already: it is cleared once written, like
+ * one returned by xpc_msg_dequeue_final.
+ * @param ctx the router context to use
+ * @param out_ctx an output context with a spill
+ * @return the buffer, or NULL if nothing is spilled or the message could
+ * not be fed back, which stalls the spill until xpc_spill_poll retries it.
+ */
+msg_buf_t *xpc_spill_dequeue(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx);
+
+/**
+ * Hand the outputs whose spill stalled back to the io event manager once
+ * they are due to be retried, this is called by xpc_router_poll.
+ * @param ctx the router context to use
+ * @return milliseconds until the next retry, or -1 if there are none.
+ */
+int xpc_spill_poll(xpc_router_t *ctx);
+
+/**
+ * Check whether an output has messages on disk.
+ */
+bool xpc_spill_pending(const xpc_spill_t *self);
+
+/**
+ * Read the counters of the spill of an output.
+ * @return 0 on success, -1 if ofd does not spill.
+ */
+int xpc_spill_get_stats(xpc_router_t *ctx, int ofd, xpc_spill_stats_t *stats);
+
+/**
+ * Unmap and remove every segment, spilled messages are lost.
+ */
+void xpc_spill_free(xpc_spill_t *self);
@@ -0,0 +1,155 @@
+#pragma once
+/**
+ * Router statistics in shared memory.
+ * The router's counters are plain fields updated on the forwarding path.
+ * Every interval they are copied into a memory mapped file, which other
+ * processes map read-only and read without ever pausing forwarding.
+ *
+ * The page is written under a sequence counter: it is odd while a snapshot
+ * is being written, and readers retry until they copy the page without it
+ * changing (see xpc_stats_snapshot).
+ *
+ * Layout: an xpc_stats_page_t, then max_fds xpc_stats_fd_t, then
+ * max_routes xpc_stats_route_t. Only the first n_fds and n_routes are valid.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <xpc_utils.h>
+
+#define XPC_STATS_MAGIC 0x53435058
+#define XPC_STATS_VERSION 4
+
+typedef struct {
+    int32_t fd;
+    // an xpc_in_kind_t, or -1 for an fd which is only an output.
+    int32_t kind;
+    xpc_counters_t rx;
+    xpc_counters_t tx;
+    // bytes queued toward the fd now, and the most there have been.
+    int64_t queue_bytes;
+    int64_t queue_peak_bytes;
+    // message buffers reused from the output's pool, or newly allocated.
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+} xpc_stats_fd_t;
+
+/**
+ * Summary of a latency histogram, in nanoseconds.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} xpc_stats_latency_t;
+
+typedef struct {
+    int32_t in_fd;
+    int32_t in_chn;
+    int32_t out_fd;
+    int32_t out_chn;
+    xpc_counters_t stats;
+    // time from the first byte of a message arriving to its last byte being
+    // written, since the route was set.
+    xpc_stats_latency_t latency;
+} xpc_stats_route_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // odd while a snapshot is being written.
+    uint64_t seq;
+    // CLOCK_MONOTONIC time of the snapshot.
+    uint64_t published_ns;
+    uint32_t max_fds;
+    uint32_t max_routes;
+    uint32_t n_fds;
+    uint32_t n_routes;
+    // more fds or routes existed than fit, the rest are left out.
+    uint32_t truncated;
+    uint32_t reserved;
+} xpc_stats_page_t;
+
+typedef struct xpc_stats_export xpc_stats_export_t;
+
+/**
+ * Names of the drop reasons, indexed by xpc_drop_reason_t.
+ */
+extern const char *const xpc_drop_reason_names[XPC_DROP_NREASONS];
+
+/**
+ * Publish a router's statistics to a file, which is created or replaced.
+ * Use a path under /dev/shm to keep it in memory. The file is written
+ * next to path and renamed over it, so the directory must be writable. An
+ * export which was enabled before is replaced, its file is removed unless
+ * it had the same path.
+ * @param ctx the router context to use
+ * @param path the file to publish to
+ * @param max_fds number of fds the file has room for
+ * @param max_routes number of routes the file has room for
+ * @param interval_ms time between snapshots
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int xpc_stats_enable(
+    xpc_router_t *ctx, const char *path, int max_fds, int max_routes,
+    uint32_t interval_ms
+);
+
+/**
+ * Write a snapshot of the router's statistics now.
+ * @param ctx a router with statistics enabled
+ */
+void xpc_stats_publish(xpc_router_t *ctx);
+
+/**
+ * Publish a snapshot if the interval has passed, see xpc_router_poll.
+ * @param ctx the router context to use
+ * @return milliseconds until the next snapshot, -1 if statistics are not
+ * enabled.
+ */
+int xpc_stats_poll(xpc_router_t *ctx);
+
+/**
+ * Unmap the statistics file and remove it.
+ * @param self the export to free, may be NULL
+ */
+void xpc_stats_export_free(xpc_stats_export_t *self);
+
+/**
+ * Map a statistics file read-only.
+ * @param path the file the router publishes to
+ * @param len set to the length of the mapping
+ * @return the page, or NULL if the file is missing or not a statistics file.
+ */
+const xpc_stats_page_t *xpc_stats_map(const char *path, size_t *len);
+
+/**
+ * Unmap a page mapped with xpc_stats_map.
+ */
+void xpc_stats_unmap(const xpc_stats_page_t *page, size_t len);
+
+/**
+ * Copy a consistent snapshot out of a mapped page.
+ * @param page the mapped page
+ * @param dst a buffer of len bytes
+ * @param len the length of the mapping
+ * @return 0 on success, -1 if the router kept writing while copying.
+ */
+int xpc_stats_snapshot(const xpc_stats_page_t *page, void *dst, size_t len);
+
+/**
+ * The fd records following a page.
+ */
+static inline const xpc_stats_fd_t *xpc_stats_fds(const xpc_stats_page_t *page) {
+    return (const xpc_stats_fd_t *)(page + 1);
+}
+
+/**
+ * The route records following the fd records of a page.
+ */
+static inline const xpc_stats_route_t *xpc_stats_routes(
+        const xpc_stats_page_t *page) {
+    return (const xpc_stats_route_t *)(xpc_stats_fds(page) + page->max_fds);
+}
@@ -0,0 +1,313 @@
+#pragma once
+/**
+ * Router topology files.
+ * A topology file declares the endpoints the router talks to and the routes
+ * between them, one declaration per line. '#' starts a comment.
+ *
+ *   router   max_msg_size=4096 strict_channels=yes stats=/dev/shm/xpc.stats
+ *   device   k64    path=/dev/ttyACM0 baud=921600 mode=rdwr endian=little
+ *   fifo     k64in  path=./k64_stdin mode=rd
+ *   fifo     k64out path=./k64_stdout mode=wr spill=/var/tmp/k64out
+ *   socket   logger path=/run/logger.sock mode=wr
+ *   listen   local  path=/run/xpc.sock
+ *   file     archive path=/var/log/xpc/k64 segment_mb=256 rotate_s=3600
+ *   stdio    out    mode=wr
+ *   route    k64:1 -> out:1
+ *   route    k64in:2 -> k64:2 no_coalesce
+ *   route    k64:3 -> local:3
+ *   route    k64:4 -> k64out:4
+ *   route    k64:5 -> out:5 hook=/usr/lib/xpc/filters.so:drop_debug
+ *   route    k64:6 -> out:6 sample=10 rate_msgs=100
+ *
+ * A listen endpoint accepts SOCK_SEQPACKET clients, see xpc_clients.h.
+ * Routes into it reach the clients subscribed to the output channel.
+ * A file endpoint archives what is routed to it in memory-mapped segment
+ * files, see xpc_sink.h, it can only be written.
+ * A stdio endpoint is stdin if it is read, and stdout if it is written, it
+ * cannot be both.
+ * A socket endpoint whose server is not up yet does not keep the router
+ * from starting, it is connected once the server is, see
+ * xpc_topology_connect_poll.
+ *
+ * Router options:
+ *   max_msg_size       largest payload accepted
+ *   strict_channels    yes or no, see xpc_router_t
+ *   stats              file the statistics are published to, see xpc_stats.h
+ *   stats_interval_ms  time between statistics snapshots (default 1000)
+ *   capture            file forwarded messages are captured to, see
+ *                      xpc_capture.h
+ *   capture_mb         size of the capture file in MiB (default 64)
+ *   pipeline           yes or no, forward with a thread per direction of
+ *                      each endpoint instead of the event loop, see
+ *                      xpc_pipeline.h
+ *   pipeline_queue_kb  KiB of each ring between two pipeline threads, a
+ *                      power of two (default 256)
+ *   control            path of a socket routes can be changed through at
+ *                      runtime, see xpc_control.h
+ *   busy_poll_us       longest time to poll without blocking after input
+ *                      arrives, 0 to always block (default 0), see
+ *                      epoll_app_set_busy_poll
+ *   busy_poll_budget   percentage of the time which may be spent polling
+ *                      without finding input (default 50)
+ *   realtime           yes or no, prefault the message pools, lock memory
+ *                      and check for page faults once warm, see xpc_rt.h
+ *   rt_cpu             CPU the event loop is pinned to with realtime, in
+ *                      pipeline mode rx_cpu and tx_cpu pin the threads
+ *   rt_priority        SCHED_FIFO priority with realtime, inherited by the
+ *                      pipeline threads, 0 to keep the default policy
+ *   rt_warmup_ms       time before the checks start (default 1000)
+ *   sched_quantum      bytes each fd and route may move per round, 0 to
+ *                      move a message per io event (default 0), see
+ *                      xpc_sched.h
+ *
+ * Endpoint options:
+ *   path            device node, fifo (created if missing) or unix socket
+ *   mode            rd, wr or rdwr
+ *   baud            line rate of a device, any rate the driver supports
+ *   vmin, vtime     termios VMIN and VTIME of a device, see xpc_serial.h
+ *   low_latency     yes or no, ASYNC_LOW_LATENCY for a device (default yes)
+ *   endian          little or big, the byte order assumed for the peer
+ *   queue_msgs      message buffers preallocated for the endpoint as output
+ *   queue_msg_size  capacity of each of those buffers, including the header
+ *   coalesce_bytes  see xpc_set_coalescing, 0 disables coalescing
+ *   coalesce_us     see xpc_set_coalescing
+ *   credit_window   bytes shared by the senders using credits toward the
+ *                   endpoint, see xpc_credit.h
+ *   compress        yes or no, offer compression to the peer (default no),
+ *                   see xpc_compress.h
+ *   weight          share of the endpoint when scheduling, relative to the
+ *                   others (default 1)
+ *   spill           prefix of the files the queue of the endpoint spills to
+ *                   once over its memory budget, see xpc_spill.h
+ *   spill_mem_kb    KiB queued in memory before spilling (default 1024)
+ *   spill_segment_kb  KiB of each spill file (default 4096)
+ *   spill_segments  most spill files at a time (default 16)
+ *   segment_mb      MiB of each segment of a file endpoint (default 64)
+ *   rotate_s        age at which a segment of a file endpoint is finished,
+ *                   0 to only finish full ones (default 0)
+ *   sync            none, async or data, see xpc_sink_sync_t (default
+ *                   async)
+ *   sync_ms, sync_kb  time and KiB between syncs of a file endpoint
+ *                   (default 1000 and 1024)
+ *   rx_cpu, tx_cpu  CPU the pipeline thread reading, or writing, the
+ *                   endpoint is pinned to
+ *
+ * A channel of an endpoint is the source of at most one route.
+ *
+ * Route flags:
+ *   no_coalesce     see XPC_ROUTE_NO_COALESCE
+ *   cut_through     start writing a message before it arrived whole, for
+ *                   large messages, see XPC_ROUTE_CUT_THROUGH
+ *   weight=N        share of the route in its output when scheduling,
+ *                   relative to the other routes to it (default 1)
+ *   hook=SO:SYMBOL  run the xpc_hook_def_t named SYMBOL of the shared
+ *                   object SO on each message, see xpc_hook.h
+ *   hook_arg=ARG    argument the hook is started with
+ *   rate_msgs=N, rate_bytes=N  forward at most N messages, or bytes, a
+ *                   second, see xpc_limit.h
+ *   burst=N         messages, or bytes, forwarded at once after a pause
+ *                   (default one second of the rate)
+ *   sample=N        forward only the first message of every N
+ *
+ * The router built from a topology has its tables and queues sized from it,
+ * so the first message of each route does not allocate memory. With
+ * realtime, it also enables xpc_rt.h on the calling thread, which should be
+ * the one that runs the router.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <alibc/containers/array.h>
+#include <xpc_utils.h>
+#include <xpc_serial.h>
+#include <xpc_pipeline.h>
+#include <xpc_sink.h>
+#include <xpc_limit.h>
+
+#define XPC_TOPO_NAME_MAX 32
+#define XPC_TOPO_PATH_MAX 256
+
+/**
+ * Time between attempts to connect the sockets which are not connected.
+ */
+#define XPC_TOPO_CONNECT_RETRY_MS 1000
+
+// endpoint io modes, as a bit mask.
+#define XPC_TOPO_MODE_RD (1 << 0)
+#define XPC_TOPO_MODE_WR (1 << 1)
+#define XPC_TOPO_MODE_RDWR (XPC_TOPO_MODE_RD | XPC_TOPO_MODE_WR)
+
+typedef enum {
+    XPC_TOPO_DEVICE,
+    XPC_TOPO_FIFO,
+    XPC_TOPO_SOCKET,
+    XPC_TOPO_STDIO,
+    XPC_TOPO_LISTEN,
+    XPC_TOPO_FILE,
+} xpc_topo_kind_t;
+
+/**
+ * One endpoint declaration.
+ */
+typedef struct {
+    xpc_topo_kind_t kind;
+    char name[XPC_TOPO_NAME_MAX];
+    char path[XPC_TOPO_PATH_MAX];
+    int mode;
+    // device settings, and what the driver made of them once opened.
+    xpc_serial_opts_t serial;
+    xpc_serial_status_t serial_status;
+    bool big_endian;
+    int queue_msgs;
+    int queue_msg_size;
+    int coalesce_bytes;
+    uint32_t coalesce_us;
+    int credit_window;
+    bool compress;
+    // 0 for the default weight.
+    int sched_weight;
+    // segment files the queue spills to, empty for none. 0 for the default
+    // size and number of segments.
+    char spill_path[XPC_TOPO_PATH_MAX];
+    int spill_mem_kb;
+    int spill_segment_kb;
+    int spill_segments;
+    // segments, rotation and syncing of a file sink.
+    xpc_sink_opts_t sink;
+    // CPUs of the pipeline threads of the endpoint, -1 for any.
+    int rx_cpu;
+    int tx_cpu;
+    // file descriptor, -1 until xpc_topology_open is called.
+    int fd;
+    // a socket which is not connected yet.
+    bool connecting;
+} xpc_topo_endpoint_t;
+
+/**
+ * One route declaration, endpoints are indexes into the endpoint list.
+ */
+typedef struct {
+    int in_ep;
+    int in_chn;
+    int out_ep;
+    int out_chn;
+    uint32_t flags;
+    // 0 for the default weight.
+    int weight;
+    // shared object and symbol of its hook, and the argument of the hook,
+    // the path is empty if it has none.
+    char hook_path[XPC_TOPO_PATH_MAX];
+    char hook_symbol[XPC_TOPO_NAME_MAX];
+    char hook_arg[XPC_TOPO_PATH_MAX];
+    // sampling and rate limit, all 0 for none.
+    xpc_limit_conf_t limit;
+    // line of the topology it was declared on.
+    int line;
+} xpc_topo_route_t;
+
+typedef struct {
+    // array of xpc_topo_endpoint_t
+    array_t *endpoints;
+    // array of xpc_topo_route_t
+    array_t *routes;
+    int max_msg_size;
+    bool strict_channels;
+    // statistics are not published if this is empty.
+    char stats_path[XPC_TOPO_PATH_MAX];
+    int stats_interval_ms;
+    // messages are not captured if this is empty.
+    char capture_path[XPC_TOPO_PATH_MAX];
+    int capture_mb;
+    bool pipeline;
+    int pipeline_queue_kb;
+    // routes cannot be changed at runtime if this is empty.
+    char control_path[XPC_TOPO_PATH_MAX];
+    int sched_quantum;
+    int busy_poll_us;
+    int busy_poll_budget;
+    bool realtime;
+    int rt_cpu;
+    int rt_priority;
+    int rt_warmup_ms;
+    // sockets which are not connected yet, and CLOCK_MONOTONIC time they
+    // are tried again.
+    int connecting;
+    uint64_t connect_ns;
+} xpc_topology_t;
+
+/**
+ * Parse a topology file.
+ * Errors are reported on stderr with the offending line number.
+ * @param path the file to read
+ * @return the topology, or NULL if the file could not be read or is invalid.
+ */
+xpc_topology_t *xpc_topology_load(const char *path);
+
+/**
+ * Open every endpoint in the topology, creating fifos where necessary.
+ * All fds are non-blocking.
+ * @param self a loaded topology
+ * A socket which cannot be connected yet is opened anyway, the error is
+ * reported on stderr and the endpoint is marked as connecting.
+ * @return 0 on success, -1 if an endpoint could not be opened (errno is set
+ * and the message on stderr names the endpoint).
+ */
+int xpc_topology_open(xpc_topology_t *self);
+
+/**
+ * Try again to connect the sockets which are not connected, every
+ * XPC_TOPO_CONNECT_RETRY_MS. Once one is, the router is asked to watch it
+ * through io_watch_fd_cb if it is an input, and through io_add_fd_cb if it
+ * is an output, so what was queued for it meanwhile is written. Until
+ * then it should not be watched, see xpc_topology_connecting.
+ * @param self an opened topology
+ * @param router the router built from it
+ * @return the number of milliseconds until the next attempt, or -1 if every
+ * socket is connected.
+ */
+int xpc_topology_connect_poll(xpc_topology_t *self, xpc_router_t *router);
+
+/**
+ * Check whether an fd is a socket which is not connected yet. Reading it
+ * fails, and it is always reported as hung up.
+ */
+bool xpc_topology_connecting(xpc_topology_t *self, int fd);
+
+/**
+ * Create a router with every route in an opened topology.
+ * @param self an opened topology
+ * @return the router, or NULL on failure.
+ */
+xpc_router_t *xpc_topology_build_router(xpc_topology_t *self);
+
+/**
+ * Create the pipeline for a router built from a topology, with its threads
+ * pinned as the endpoints ask. The threads are not started.
+ * @param self an opened topology
+ * @param router the router built from it
+ * @return the pipeline, or NULL on failure (the reason is on stderr).
+ */
+xpc_pipeline_t *xpc_topology_build_pipeline(
+    xpc_topology_t *self, xpc_router_t *router
+);
+
+/**
+ * Find an endpoint by name.
+ * @return the endpoint, or NULL if there is none by that name.
+ */
+xpc_topo_endpoint_t *xpc_topology_find(xpc_topology_t *self, const char *name);
+
+/**
+ * Close the fd of an endpoint before the topology is freed, e.g. an input
+ * which hung up. Like xpc_topology_free, stdin, stdout and stderr are left
+ * open.
+ * @param self the topology
+ * @param fd the fd, which is closed even if no endpoint has it
+ */
+void xpc_topology_close_fd(xpc_topology_t *self, int fd);
+
+/**
+ * Close every opened endpoint and free the topology.
+ * @param self the topology to destroy
+ */
+void xpc_topology_free(xpc_topology_t *self);
@@ -1,7 +1,13 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <tinyxpc/tinyxpc.h>
 #include <xpc_msg_queue.h>
+#include <xpc_endian.h>
+#include <xpc_resync.h>
+#include <xpc_hist.h>
+#include <xpc_lz.h>
 #include <alibc/containers/dynabuf.h>
 #include <alibc/containers/array.h>
 #include <alibc/containers/hashmap.h>
@@ -12,27 +18,222 @@
 typedef struct {
     int fd;
     int to_chn;
-    // not supporting routing functions right now, but that could be useful
-    // for doing things like ioctls on serial ports if necessary, and
-    // interpreting custom xpc message types
+    // routing functions hang off the values of the table, see xpc_route_t
+    // and xpc_hook.h.
 } xpc_switch_tbl_entry_t;
 
+/**
+ * Route flags, set with xpc_set_route_flags.
+ */
+// messages on this route flush the output's coalescing stage immediately.
+#define XPC_ROUTE_NO_COALESCE (1 << 0)
+// messages on this route start being written before they arrived whole,
+// see xpc_write_msg.
+#define XPC_ROUTE_CUT_THROUGH (1 << 1)
+
+/**
+ * Time a message written while it arrives may go without receiving more of
+ * it before it is dropped, so its output writes other messages again.
+ */
+#define XPC_CUT_THROUGH_STALL_MS 1000
+
+/**
+ * Reasons a message is dropped instead of routed.
+ */
+typedef enum {
+    // no route for its channel, or no output for the route.
+    XPC_DROP_NO_ROUTE,
+    // no buffer could be allocated for it.
+    XPC_DROP_NO_BUFFER,
+    // its framing was corrupt.
+    XPC_DROP_MALFORMED,
+    // the output already had as many messages queued as it may.
+    XPC_DROP_QUEUE_FULL,
+    // the hook of its route dropped it, see xpc_hook.h.
+    XPC_DROP_FILTERED,
+    // sampling, or the rate limit, of its route left it out, see
+    // xpc_limit.h.
+    XPC_DROP_SAMPLED,
+    XPC_DROP_RATE_LIMITED,
+    XPC_DROP_NREASONS
+} xpc_drop_reason_t;
+
+/**
+ * Traffic counters. The router is single threaded, they are plain
+ * increments on the forwarding path and are published with xpc_stats.h.
+ */
+typedef struct {
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t drops[XPC_DROP_NREASONS];
+} xpc_counters_t;
+
+struct xpc_hook;
+struct xpc_limit;
+
+/**
+ * Values of the switching table.
+ * The destination of a route and the options that apply to it.
+ */
+typedef struct {
+    xpc_switch_tbl_entry_t dst;
+    uint32_t flags;
+    // messages forwarded on this route.
+    xpc_counters_t stats;
+    // time from the first byte of a message arriving to its last byte
+    // being written, in nanoseconds.
+    xpc_hist_t *latency;
+    // bytes the sender was granted and has not sent yet, if its input uses
+    // credits, see xpc_credit.h.
+    int64_t credit;
+    // share of its output, and what is left of it in the output's current
+    // round, see xpc_sched.h.
+    int sched_weight;
+    int64_t sched_deficit;
+    uint32_t sched_round;
+    // routing function run on each message, see xpc_hook.h.
+    struct xpc_hook *hook;
+    // sampling and rate limit of its messages, see xpc_limit.h.
+    struct xpc_limit *limit;
+} xpc_route_t;
+
+/**
+ * Largest negotiation payload which is kept, longer payloads are truncated.
+ */
+#define XPC_NEG_PAYLOAD_MAX 16
+
+/**
+ * Size of the scratch buffer which dropped payloads are read into.
+ */
+#define XPC_DISCARD_BUF_SIZE 4096
+
+/**
+ * Default largest payload accepted before a header is considered corrupt.
+ */
+#define XPC_DEFAULT_MAX_MSG_SIZE 65536
+
+/**
+ * Size of the lookahead buffer used to resynchronize an input.
+ */
+#define XPC_RESYNC_BUF_SIZE 4096
+
+/**
+ * Channels of an input whose drops are counted apart, see
+ * xpc_get_drop_count.
+ */
+#define XPC_DROP_CHANNELS 16
+
+typedef struct {
+    int chn;
+    uint64_t count;
+} xpc_drop_slot_t;
+
+
+/**
+ * Kinds of input, see xpc_clients.h for listeners and their clients.
+ */
+typedef enum {
+    // a byte stream, messages are framed by their headers.
+    XPC_IN_STREAM = 0,
+    // a listening socket, readable when a client is waiting to connect.
+    XPC_IN_LISTENER,
+    // a connected SOCK_SEQPACKET client, one message per datagram.
+    XPC_IN_SEQPACKET,
+    // the doorbell of a client attached over shared memory, see xpc_shm.h.
+    XPC_IN_SHM,
+} xpc_in_kind_t;
+
+struct xpc_shm_link;
 
 /**
  * Information required to describe the state of reading from a single source.
  */
 typedef struct {
+    xpc_in_kind_t kind;
+    // for clients, the listener they connected to. Its routes apply to them.
+    int listen_fd;
+    // for clients attached over shared memory and their doorbells, the
+    // rings they use.
+    struct xpc_shm_link *shm;
     // otherwise pass buf_id to xpc_msg_getbuf
     bool msg_inflight;
+    // the inflight message is being dropped, buf_offset counts payload
+    // bytes skipped so far.
+    bool discarding;
     // temporary buffer for receiving a message when only the incoming fd
     // is known.
     txpc_hdr_t msg_hdr;
+    // the header as it arrived, before conversion to host byte order.
+    uint8_t hdr_wire[sizeof(txpc_hdr_t)];
+    // number of header bytes received so far
+    int hdr_offset;
+    // byte order of this input, selected when endianness is negotiated.
+    const xpc_hdr_codec_t *codec;
+    // payload of a negotiation message, these are handled by the router.
+    uint8_t neg_payload[XPC_NEG_PAYLOAD_MAX];
+
+    /**
+     * Resynchronization. After a header fails validation the input is
+     * scanned for the next plausible header. Bytes read while scanning and
+     * not yet consumed are kept in rx_buf[rx_start, rx_end), and are read
+     * before anything else from the fd. rx_buf is allocated along with the
+     * context, by the first route from the input.
+     */
+    bool resyncing;
+    xpc_resync_filter_t resync_filter;
+    uint8_t *rx_buf;
+    int rx_start;
+    int rx_end;
+    // number of times resynchronization began, and bytes it skipped.
+    uint64_t resync_count;
+    uint64_t resync_skipped;
     // this is passed to xpc_msg_getbuf
     int buf_id;
     // this is the offset for reading (from an fd, into a buffer)
     int buf_offset;
+    // output and channel the buffer of the inflight message belongs to. The
+    // message completes there even if its route changes meanwhile.
+    int out_fd;
+    int out_chn;
+    // messages received whole, and dropped, from this fd.
+    xpc_counters_t rx;
+    // messages dropped by channel, for the first XPC_DROP_CHANNELS channels
+    // which dropped any, and for all the others together.
+    xpc_drop_slot_t drop_chns[XPC_DROP_CHANNELS];
+    int n_drop_chns;
+    uint64_t drops_other;
+    // the sender asked for credits, see xpc_credit.h.
+    bool credit_flow;
+    // compression is offered to the sender, and the history of what it
+    // sends once it accepted, see xpc_compress.h. The history is lost until
+    // the sender starts over, and a dropped payload is read into it.
+    bool compress_allowed;
+    xpc_lz_t *lz_rx;
+    bool lz_rx_lost;
+    bool lz_discard;
+    // CLOCK_MONOTONIC time the first byte of the current header arrived.
+    uint64_t msg_start_ns;
+    // share of the event loop when reading, and what is left of it, see
+    // xpc_sched.h.
+    int sched_weight;
+    int64_t sched_deficit;
+    // the input reached end of file, or reading it failed.
+    bool hangup;
 } xpc_in_ctx_t;
 
+/**
+ * Where a staged message came from, its latency is recorded once the stage
+ * is written.
+ */
+typedef struct {
+    uint64_t ingress_ns;
+    int src_fd;
+    int src_chn;
+} xpc_msg_origin_t;
+
+struct xpc_spill;
+struct xpc_sink;
+
 /**
  * Information  describing the state of output to a file descriptor.
  */
@@ -40,15 +241,127 @@ typedef struct {
     msg_queue_t *msg_queue;
     // the id that is currently being written.
     int current_buf_id;
+    // the id of a message which is still arriving on a cut-through route,
+    // and may be written up to the bytes received so far. Nothing else is
+    // written to this fd between its first and last byte. The output waits
+    // for more of it once everything received is written. It is dropped
+    // if its input hangs up, or stalls for XPC_CUT_THROUGH_STALL_MS.
+    int cut_through_id;
+    bool cut_through_waiting;
+    // CLOCK_MONOTONIC time more of it last arrived.
+    uint64_t cut_through_ns;
+    // byte order of this output, headers are encoded with it on ingress.
+    const xpc_hdr_codec_t *codec;
+
+    /**
+     * Coalescing stage. Finalized messages are copied here and written
+     * together once coalesce_bytes are staged, or once the first staged
+     * message is coalesce_delay_us old. Disabled if coalesce_bytes is 0.
+     */
+    int coalesce_bytes;
+    uint32_t coalesce_delay_us;
+    dynabuf_t *stage;
+    // bytes in the stage, and bytes of those already written.
+    int stage_len;
+    int stage_wr;
+    // the stage is being written, nothing is added until it is empty.
+    bool stage_flushing;
+    // number of messages in the stage, and where each of them came from.
+    int stage_msgs;
+    dynabuf_t *stage_origins;
+    // CLOCK_MONOTONIC time at which the stage must be written.
+    uint64_t stage_deadline_ns;
+
+    // each message is sent as one datagram, this rules out coalescing.
+    bool seqpacket;
+    // a listener: messages are copied to the subscribed clients instead of
+    // being written to this fd.
+    bool fanout;
+    // no route leads here anymore, the context is freed once its queue is
+    // drained, see xpc_remove_route.
+    bool retired;
+    // most bytes queued here or granted as credit toward here, see
+    // xpc_credit.h. The routes of credit senders sharing it and their
+    // outstanding credit are recounted whenever credits are granted.
+    int credit_window;
+    int credit_routes;
+    int64_t credit_outstanding;
+    // the history of what is compressed toward this fd, and whether the
+    // peer was told to start using it, see xpc_compress.h.
+    xpc_lz_t *lz_tx;
+    bool lz_tx_active;
+    // share of the event loop when writing, and what is left of it, and the
+    // round of the routes sharing this output, see xpc_sched.h.
+    int sched_weight;
+    int64_t sched_deficit;
+    uint32_t sched_round;
+    // segment files the queue overflows to past its memory budget, see
+    // xpc_spill.h.
+    struct xpc_spill *spill;
+    // segment files messages are archived to instead of being written to
+    // this fd, see xpc_sink.h.
+    struct xpc_sink *sink;
+    // messages written whole to this fd.
+    xpc_counters_t tx;
 } xpc_out_ctx_t;
 
 
+/**
+ * Monotonic time in nanoseconds, used for deadlines and timestamps.
+ */
+static inline uint64_t xpc_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct xpc_stats_export;
+struct xpc_capture;
+struct xpc_rt;
+
 typedef struct {
     uint32_t crc_polyn;
+    // byte order assumed for an fd until its peer negotiates one.
     bool big_endian;
     hashmap_t *in_contexts;
     hashmap_t *out_contexts;
     hashmap_t *switch_tbl;
+    // the keys of the tables above, ints and xpc_switch_tbl_entry_t, so the
+    // polls walk them without allocating an iterator.
+    array_t *in_fds;
+    array_t *out_fds;
+    array_t *route_keys;
+    // dropped payloads are read here, shared by all inputs.
+    uint8_t discard_buf[XPC_DISCARD_BUF_SIZE];
+    // number of outputs with messages waiting in their coalescing stage.
+    int coalesce_pending;
+    // number of outputs with a message written while it arrives.
+    int cut_throughs;
+    // headers with a larger size are corrupt.
+    int max_msg_size;
+    // headers to channels without a route are corrupt, rather than dropped.
+    bool strict_channels;
+    // (listen fd, channel) -> array_t of int, the clients subscribed to it.
+    hashmap_t *subscriptions;
+    // shared memory page statistics are published to, see xpc_stats.h.
+    struct xpc_stats_export *stats_export;
+    // file forwarded messages are captured to, see xpc_capture.h.
+    struct xpc_capture *capture;
+    // page fault and allocation checks, see xpc_rt.h.
+    struct xpc_rt *rt;
+    // number of retired outputs still draining.
+    int retired_outputs;
+    // number of outputs which are file sinks.
+    int sinks;
+    // number of outputs whose spill stalled, see xpc_spill.h.
+    int spill_stalled;
+    // number of inputs which use credits.
+    int credit_inputs;
+    // scratch space for granting credits, see xpc_credit.h.
+    dynabuf_t *credit_grants;
+    // bytes each fd and route may move per round of weight 1, 0 if fds are
+    // served as events arrive, see xpc_sched.h.
+    int sched_quantum;
 
     /**
      * These items are needed for controlling event-based IO.
@@ -59,6 +372,13 @@ typedef struct {
     void *io_event_context;
     int (*io_add_fd_cb)(void *ctx, int fd);
     int (*io_del_fd_cb)(void *ctx, int fd);
+    // start watching an fd the router opened (an accepted client) for
+    // reading, and stop watching one before it is closed.
+    int (*io_watch_fd_cb)(void *ctx, int fd);
+    int (*io_forget_fd_cb)(void *ctx, int fd);
+    // close an input which hung up, once it is forgotten. The router closes
+    // it itself if this is not set.
+    int (*io_close_fd_cb)(void *ctx, int fd);
 } xpc_router_t;
 
 
@@ -72,6 +392,31 @@ void xpc_out_ctx_free(xpc_out_ctx_t *self);
  */
 xpc_router_t *initialize_xpc_router();
 
+/**
+ * Create a new xpc router whose tables are sized ahead of time, so they do
+ * not grow while routing.
+ * @param max_fds the number of distinct input and output fds expected
+ * @param max_routes the number of routes expected
+ */
+xpc_router_t *initialize_xpc_router_sized(int max_fds, int max_routes);
+
+/**
+ * Add a key to one of the key lists of a router, see in_fds.
+ * @param keys the list
+ * @param key the key, an int or an xpc_switch_tbl_entry_t
+ * @param len the size of the key
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int xpc_keys_add(array_t *keys, const void *key, size_t len);
+
+/**
+ * Remove a key from one of the key lists of a router, if it is there.
+ * @param keys the list
+ * @param key the key
+ * @param len the size of the key
+ */
+void xpc_keys_remove(array_t *keys, const void *key, size_t len);
+
 /**
  * Free all structures associated with the given xpc router
  * @param ctx the router to destroy
@@ -92,17 +437,278 @@ int xpc_accumulate_msg(xpc_router_t *ctx, int fd);
  * Write as much of a message as possible to the specified fd.
  * Data is only written if it is available for the specified fd, no other
  * fds are tried.
+ * Complete messages are written first. Without one, a message still
+ * arriving on a XPC_ROUTE_CUT_THROUGH route is written as far as it was
+ * received, unless the output coalesces, compresses or sends datagrams.
  * @param ctx the router context to use
  * @param fd a file descriptor which is ready for writing.
  */
 int xpc_write_msg(xpc_router_t *ctx, int fd);
 
 /**
- * Set up the path for messages coming from a particular fd and channel
+ * Set up the path for messages coming from a particular fd and channel.
+ * An existing route is redirected, keeping its statistics. A message which
+ * is already being received completes on the old destination.
+ * @return 0 on success. Otherwise memory is exhausted, and the route is
+ * left as it was.
  */
 int xpc_set_route(xpc_router_t *ctx, int ifd, int ofd, int ito, int oto);
 
+/**
+ * Get the output context of an fd, creating it if there is none yet.
+ * An fd which is also an input shares its byte order.
+ * @param ctx the router context to use
+ * @param ofd the fd
+ * @return the output context, or NULL if memory is exhausted.
+ */
+xpc_out_ctx_t *xpc_add_output(xpc_router_t *ctx, int ofd);
+
 /**
  * Remove the specified route, disabling messages going to that destination.
+ * Further messages to it are dropped as XPC_DROP_NO_ROUTE, one which is
+ * already being received is still delivered. Once no route leads to an
+ * output anymore, its context is freed as soon as its queue is drained, see
+ * xpc_router_poll. The input keeps its context.
+ * @return 0 on success, -1 if there is no such route.
  */
 int xpc_remove_route(xpc_router_t *ctx, int ifd, int ito);
+
+/**
+ * Get the number of messages from a source which were dropped, because they
+ * had no route, or could not be buffered.
+ * @param ctx the router context to use
+ * @param fd the input fd the messages arrived on
+ * @param to_chn the channel they were sent to
+ * @return the number of messages dropped, 0 if fd is not an input. Only the
+ * first XPC_DROP_CHANNELS channels of an input to drop messages are counted
+ * apart, drops on any other channel are only in its drops_other and rx.
+ */
+uint64_t xpc_get_drop_count(xpc_router_t *ctx, int fd, int to_chn);
+
+/**
+ * Get the forwarding latency of a route: the time from the first byte of
+ * each message arriving to its last byte being written.
+ * @param ctx the router context to use
+ * @param ifd the input fd of the route
+ * @param ito the channel of the route
+ * @return the histogram of latencies in nanoseconds, or NULL if there is no
+ * such route.
+ */
+const xpc_hist_t *xpc_get_route_latency(xpc_router_t *ctx, int ifd, int ito);
+
+/**
+ * Record the forwarding latency of a message on the route it came in on.
+ * @param ctx the router context to use
+ * @param src_fd the input fd of the route
+ * @param src_chn the channel of the route
+ * @param latency_ns time from its first byte arriving to its last byte
+ * leaving
+ */
+void xpc_record_latency(
+    xpc_router_t *ctx, int src_fd, int src_chn, uint64_t latency_ns
+);
+
+/**
+ * Count a message which was dropped instead of routed.
+ * @param ctx the router context to use
+ * @param fd the fd the message was dropped at, normally the input it
+ * arrived on
+ * @param to_chn the channel it was sent to
+ * @param reason why it was dropped
+ */
+void xpc_count_drop(
+    xpc_router_t *ctx, int fd, int to_chn, xpc_drop_reason_t reason
+);
+
+/**
+ * Hand a message which was just finalized in the queue of an output on to
+ * it: wake the output, stage it for coalescing, or copy it to the clients of
+ * a listener.
+ * @param ctx the router context to use
+ * @param ofd the output fd
+ * @param out_ctx the output context of ofd
+ */
+void xpc_output_ready(xpc_router_t *ctx, int ofd, xpc_out_ctx_t *out_ctx);
+
+/**
+ * Get a buffer for a negotiation message (to 0, from 0) from the router to
+ * the peer of an output.
+ * @param ctx the router context to use
+ * @param fd the output
+ * @param type the negotiation message type
+ * @param size the size of its payload, which the caller writes after the
+ * header
+ * @return the buffer, or NULL if fd is not an output or no buffer was
+ * available.
+ */
+msg_buf_t *xpc_neg_getbuf(xpc_router_t *ctx, int fd, int type, int size);
+
+/**
+ * Queue a negotiation message once its payload is written. It is not
+ * coalesced, and has no route its latency would be recorded for.
+ * @param ctx the router context to use
+ * @param fd the output
+ * @param msg_buf the buffer from xpc_neg_getbuf
+ */
+void xpc_neg_finalize(xpc_router_t *ctx, int fd, msg_buf_t *msg_buf);
+
+/**
+ * Get resynchronization statistics for an input.
+ * @param ctx the router context to use
+ * @param fd the input fd
+ * @param events set to the number of times the input lost framing
+ * @param skipped_bytes set to the number of bytes skipped to regain it
+ * @return 0 on success, -1 if fd is not an input.
+ */
+int xpc_get_resync_stats(
+    xpc_router_t *ctx, int fd, uint64_t *events, uint64_t *skipped_bytes
+);
+
+/**
+ * Route lookup of xpc_hdr_take, pipeline threads keep their own routes.
+ * @return the route of a channel of the input, or NULL if it has none.
+ */
+typedef void *(*xpc_hdr_lookup_fn)(void *arg, int fd, int to_chn);
+
+/**
+ * An input as xpc_hdr_take sees it.
+ */
+typedef struct {
+    int fd;
+    // byte order of the input, see xpc_hdr_take.
+    const xpc_hdr_codec_t *codec;
+    xpc_hdr_lookup_fn lookup;
+    void *lookup_arg;
+    // stored atomically, the counters of a pipeline thread are read by
+    // another one.
+    xpc_counters_t *rx;
+    uint64_t *resync_count;
+    uint64_t *resync_skipped;
+} xpc_hdr_input_t;
+
+typedef enum {
+    XPC_HDR_BAD = 0,
+    XPC_HDR_MSG,
+    XPC_HDR_NEG,
+} xpc_hdr_kind_t;
+
+/**
+ * Check whether a header could have been sent by a well-behaved peer: a
+ * negotiation message the router knows, or a message whose payload is no
+ * larger than ctx->max_msg_size.
+ * @param ctx the router context to use
+ * @param in the input the header came from
+ * @param hdr the decoded header
+ * @param strict also require that the channel is routed, and that the
+ * payload of a negotiation message fits in XPC_NEG_PAYLOAD_MAX
+ * @param route set to the route of the channel, or NULL, may be NULL
+ * @return true if the header is valid.
+ */
+bool xpc_hdr_valid(
+    xpc_router_t *ctx, xpc_hdr_input_t *in, const txpc_hdr_t *hdr,
+    bool strict, void **route
+);
+
+/**
+ * Decode a complete header of an input and find its route. The event loop
+ * and the pipeline threads both parse headers with this.
+ * A negotiation message may arrive in either byte order, and its size is
+ * needed before the byte order is known, so in->codec is switched to the
+ * order it was sent in.
+ * A header which is not valid, see xpc_hdr_valid, begins resynchronization:
+ * unless the input already was resynchronizing, it counts as a malformed
+ * drop and in resync_count. The first byte of the header is skipped either
+ * way, the caller looks for the next header after it. A resynchronizing
+ * input, or any input with ctx->strict_channels, only accepts headers to
+ * routed channels.
+ * @param ctx the router context to use
+ * @param in the input
+ * @param wire the header as it was received
+ * @param hdr set to the decoded header
+ * @param resyncing whether the input is resynchronizing
+ * @param route set to the route of a message, NULL if its channel has none
+ * @return what the header is, XPC_HDR_BAD if it is not valid.
+ */
+xpc_hdr_kind_t xpc_hdr_take(
+    xpc_router_t *ctx, xpc_hdr_input_t *in, const uint8_t *wire,
+    txpc_hdr_t *hdr, bool resyncing, void **route
+);
+
+/**
+ * Preallocate message buffers for an output, so its first nbufs messages in
+ * flight do not allocate memory.
+ * @param ctx the router context to use
+ * @param ofd an fd which is already the output of a route
+ * @param nbufs number of message buffers
+ * @param buf_size capacity of each buffer, including the header
+ * @return 0 on success, -1 if ofd is not an output or memory is exhausted.
+ */
+int xpc_reserve_output(xpc_router_t *ctx, int ofd, int nbufs, int buf_size);
+
+/**
+ * Set the flags for an existing route.
+ * @param ctx the router context to use
+ * @param ifd input fd of the route
+ * @param ito input channel of the route
+ * @param flags a combination of XPC_ROUTE_* flags
+ * @return 0 on success, -1 if the route does not exist.
+ */
+int xpc_set_route_flags(xpc_router_t *ctx, int ifd, int ito, uint32_t flags);
+
+/**
+ * Batch small messages toward an output into fewer writes.
+ * Messages are staged until max_bytes are waiting or the oldest one has
+ * waited max_delay_us, whichever comes first. Routes with
+ * XPC_ROUTE_NO_COALESCE bypass the wait.
+ * @param ctx the router context to use
+ * @param ofd an fd which is already the output of a route
+ * @param max_bytes flush threshold in bytes, 0 disables coalescing
+ * @param max_delay_us longest time a message may wait in the stage
+ * @return 0 on success, -1 if ofd is not an output or memory is exhausted.
+ */
+int xpc_set_coalescing(
+    xpc_router_t *ctx, int ofd, int max_bytes, uint32_t max_delay_us
+);
+
+/**
+ * Check the coalescing deadlines of all outputs.
+ * Outputs whose deadline has passed are handed back to the io event manager
+ * for writing. This should be called before waiting for io events.
+ * @param ctx the router context to use
+ * @return the number of milliseconds until the next deadline, or -1 if no
+ * output is waiting on one.
+ */
+int xpc_coalesce_poll(xpc_router_t *ctx);
+
+/**
+ * Run the router's timers: coalescing deadlines, dropping stalled
+ * cut-through messages, statistics publishing, the checks of the real-time
+ * profile and freeing retired outputs which have drained.
+ * This should be called before waiting for io events.
+ * @param ctx the router context to use
+ * @return the number of milliseconds until the next timer, or -1 if there
+ * is none.
+ */
+int xpc_router_poll(xpc_router_t *ctx);
+
+/**
+ * Stop reading an input which reached end of file or hung up. Its routes
+ * are removed, a message it was receiving is dropped as XPC_DROP_MALFORMED,
+ * and its context is freed. Unless it is also written to, the fd is
+ * forgotten through io_forget_fd_cb and closed. Clients are closed like in
+ * xpc_client_close. xpc_accumulate_msg calls this when a read returns 0 or
+ * fails.
+ * @param ctx the router context to use
+ * @param fd the input
+ */
+void xpc_input_hangup(xpc_router_t *ctx, int fd);
+
+/**
+ * Select the byte order used for headers read from and written to an fd.
+ * This is normally done by endianness negotiation, but may be set ahead of
+ * time for peers which never negotiate.
+ * @param ctx the router context to use
+ * @param fd the file descriptor whose peer has the given byte order
+ * @param big_endian true if the peer is big endian
+ */
+void xpc_set_endianness(xpc_router_t *ctx, int fd, bool big_endian);
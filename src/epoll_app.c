@@ -1,5 +1,9 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <epoll_app.h>
 #include <alibc/containers/array.h>
@@ -13,9 +17,10 @@ epoll_app_t *create_epoll_app(int close_on_exec, void *callback_ctx) {
     }
 
     // initialize epoll
-    r->epoll_fd = epoll_create1(close_on_exec);
+    r->epoll_fd = epoll_create1(close_on_exec ? EPOLL_CLOEXEC:0);
     if(r->epoll_fd == -1) {
         free(r);
+        r = NULL;
         goto done;
     }
 
@@ -37,11 +42,36 @@ epoll_app_t *create_epoll_app(int close_on_exec, void *callback_ctx) {
     }
     r->cb_ctx = callback_ctx;
     r->run_mainloop = true;
+    r->epollin_cb = NULL;
+    r->epollout_cb = NULL;
+    r->epollrdhup_cb = NULL;
+    r->epollpri_cb = NULL;
+    r->epollerr_cb = NULL;
+    r->epollhup_cb = NULL;
+    r->timeout_cb = NULL;
+    memset(&r->busy_poll, 0, sizeof(r->busy_poll));
 done:
     return r;
 }
 
+/**
+ * Find the index of fd in the event list, or -1 if it is not there.
+ */
+static int epoll_app_find_fd(epoll_app_t *app, int fd) {
+    for(int i = 0; i < array_size(app->event_list); i++) {
+        struct epoll_event *ev = array_fetch(app->event_list, i);
+        if(ev->data.fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int epoll_app_add_fd(epoll_app_t *app, int fd, int flags) {
+    // adding an fd twice would grow the event list without bound.
+    if(epoll_app_find_fd(app, fd) != -1) {
+        return epoll_app_mod_fd(app, fd, flags);
+    }
     int fd_index = array_size(app->event_list);
     struct epoll_event epoll_temp = {0};
     epoll_temp.events = flags;
@@ -129,17 +159,26 @@ done:
 }
 
 int epoll_app_mod_fd(epoll_app_t *app, int fd, int flags) {
-    int fd_index = array_size(app->event_list);
-    struct epoll_event epoll_temp = {0};
-    epoll_temp.events = flags;
-    // NOTE: this can be used to store any pointer and will be available
-    // from epoll_wait when it unblocks
-    epoll_temp.data = (epoll_data_t)fd;
+    int fd_index = epoll_app_find_fd(app, fd);
+    if(fd_index != -1) {
+        // update the existing entry in place.
+        ((struct epoll_event *)array_fetch(app->event_list, fd_index))->events =
+            flags;
+    }
+    else {
+        struct epoll_event epoll_temp = {0};
+        epoll_temp.events = flags;
+        // NOTE: this can be used to store any pointer and will be available
+        // from epoll_wait when it unblocks
+        epoll_temp.data = (epoll_data_t)fd;
 
-    // alc will copy the local structure
-    array_append(app->event_list, &epoll_temp);
-    // ensure there is space for epoll to have all fds active after epoll_wait()
-    array_resize(app->event_buffer, array_size(app->event_list));
+        fd_index = array_size(app->event_list);
+        // alc will copy the local structure
+        array_append(app->event_list, &epoll_temp);
+        // ensure there is space for epoll to have all fds active after
+        // epoll_wait()
+        array_resize(app->event_buffer, array_size(app->event_list));
+    }
 
     // add event_list to epoll
     int r = epoll_ctl(
@@ -171,6 +210,70 @@ done:
     return fd_index == -1 ? -1:0;
 }
 
+int epoll_app_get_flags(epoll_app_t *app, int fd) {
+    int fd_index = epoll_app_find_fd(app, fd);
+    if(fd_index == -1) {
+        return -1;
+    }
+    return ((struct epoll_event *)array_fetch(app->event_list, fd_index))->events;
+}
+
+int epoll_app_set_busy_poll(epoll_app_t *app, uint32_t max_us, int budget_pct) {
+    if(budget_pct < 1 || budget_pct > 100) {
+        return -1;
+    }
+    memset(&app->busy_poll, 0, sizeof(app->busy_poll));
+    app->busy_poll.max_ns = (uint64_t)max_us * 1000;
+    app->busy_poll.budget_ns = EPOLL_APP_BUSY_POLL_PERIOD_NS / 100 * budget_pct;
+    return 0;
+}
+
+static uint64_t epoll_app_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Check whether the next wait should be a poll, starting a new budget
+ * period if the last one is over.
+ */
+static bool epoll_app_spin(epoll_busy_poll_t *bp, uint64_t now) {
+    if(now - bp->period_start_ns >= EPOLL_APP_BUSY_POLL_PERIOD_NS) {
+        bp->period_start_ns = now;
+        bp->spent_ns = 0;
+    }
+    return now < bp->until_ns && bp->spent_ns < bp->budget_ns;
+}
+
+/**
+ * Account for a wait, and move the window if input arrived.
+ */
+static void epoll_app_busy_poll_update(
+        epoll_busy_poll_t *bp, bool spun, uint64_t start, bool arrived) {
+    uint64_t now = epoll_app_now_ns();
+    if(!arrived) {
+        if(spun) {
+            bp->spent_ns += now - start;
+        }
+        return;
+    }
+    if(spun) {
+        bp->hits++;
+    }
+    if(bp->last_ns != 0) {
+        // a long idle time should not keep the window shut once input
+        // arrives quickly again.
+        uint64_t gap = now - bp->last_ns;
+        gap = (gap > 2 * bp->max_ns) ? 2 * bp->max_ns:gap;
+        bp->gap_ns = (bp->gap_ns == 0) ? gap:bp->gap_ns - bp->gap_ns / 8 + gap / 8;
+    }
+    bp->last_ns = now;
+    uint64_t window = 2 * bp->gap_ns;
+    window = (window > bp->max_ns) ? bp->max_ns:window;
+    bp->until_ns = (bp->gap_ns <= bp->max_ns) ? now + window:now;
+}
+
 void epoll_app_close_all(epoll_app_t *app) {
     // normal cleanup
     iter_context *it = create_array_iterator(app->event_list);
@@ -197,13 +300,27 @@ void destroy_epoll_app(epoll_app_t *app) {
 }
 
 void epoll_app_mainloop(epoll_app_t *app) {
+    epoll_busy_poll_t *bp = &app->busy_poll;
     while(app->run_mainloop) {
+        uint64_t start = (bp->max_ns > 0) ? epoll_app_now_ns():0;
+        // block forever if no data is available, unless asked not to.
+        int timeout = -1;
+        if(app->timeout_cb != NULL) {
+            timeout = app->timeout_cb(app->cb_ctx);
+        }
+        bool spin = bp->max_ns > 0 && timeout != 0 && epoll_app_spin(bp, start);
+        if(spin) {
+            timeout = 0;
+        }
+        else if(timeout != 0) {
+            bp->sleeps++;
+        }
         int epoll_r = epoll_wait(
             app->epoll_fd,
             (struct epoll_event *)(app->event_buffer->data->buf),
             // use event list to get number of actual events in interest list
             array_size(app->event_list),
-            -1 // block forever if no data is available
+            timeout
         );
         if(epoll_r == -1) {
             perror("epoll_wait");
@@ -212,46 +329,57 @@ void epoll_app_mainloop(epoll_app_t *app) {
         // XXX this is not pretty, modifies the array size so normal operations
         // only act on what epoll actually put in the buffer.
         app->event_buffer->size = epoll_r;
-        iter_context *it = create_array_iterator(app->event_buffer);
-        for(struct epoll_event *ev = iter_next(it); ev; ev = iter_next(it)) {
-            int curr_fd = (int)ev->data.u32;
-            if(ev->events & EPOLLIN) {
+        if(bp->max_ns > 0) {
+            bool arrived = false;
+            for(int i = 0; i < epoll_r; i++) {
+                struct epoll_event *ev = array_fetch(app->event_buffer, i);
+                arrived |= (ev->events & EPOLLIN) != 0;
+            }
+            epoll_app_busy_poll_update(bp, spin, start, arrived);
+        }
+        // by index, an iterator would be allocated on every wake-up. The
+        // event is copied, a callback adding an fd may move the buffer.
+        for(int i = 0; i < epoll_r; i++) {
+            struct epoll_event ev = *(struct epoll_event *)array_fetch(
+                app->event_buffer, i
+            );
+            int curr_fd = (int)ev.data.u32;
+            if(ev.events & EPOLLIN) {
                 // read event
                 if(app->epollin_cb != NULL) {
                     app->epollin_cb(app->cb_ctx, curr_fd);
                 }
             }
-            if(ev->events & EPOLLOUT) {
+            if(ev.events & EPOLLOUT) {
                 // write event
                 if(app->epollout_cb != NULL) {
                     app->epollout_cb(app->cb_ctx, curr_fd);
                 }
             }
-            if(ev->events & EPOLLRDHUP) {
+            if(ev.events & EPOLLRDHUP) {
                 // read hangup / peer closed connection
                 if(app->epollrdhup_cb != NULL) {
                     app->epollrdhup_cb(app->cb_ctx, curr_fd);
                 }
             }
-            if(ev->events & EPOLLPRI) {
+            if(ev.events & EPOLLPRI) {
                 // exceptional condition
                 if(app->epollpri_cb != NULL) {
                     app->epollpri_cb(app->cb_ctx, curr_fd);
                 }
             }
-            if(ev->events & EPOLLERR) {
+            if(ev.events & EPOLLERR) {
                 // write on read-closed fifo or other error
                 if(app->epollerr_cb != NULL) {
                     app->epollerr_cb(app->cb_ctx, curr_fd);
                 }
             }
-            if(ev->events & EPOLLHUP) {
+            if(ev.events & EPOLLHUP) {
                 // hangup
                 if(app->epollhup_cb != NULL) {
                     app->epollhup_cb(app->cb_ctx, curr_fd);
                 }
             }
         }
-        iter_free(it);
     }
 }
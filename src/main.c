@@ -5,40 +5,113 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <termios.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <tinyxpc/tinyxpc.h>
 #include <alibc/containers/array.h>
+#include <alibc/containers/hashmap.h>
 #include <alibc/containers/array_iterator.h>
 #include <alibc/containers/iterator.h>
 #include <xpc_utils.h>
+#include <xpc_topology.h>
+#include <xpc_pipeline.h>
+#include <xpc_control.h>
+#include <xpc_sched.h>
 #include <epoll_app.h>
 
 epoll_app_t *global_context;
+// routes can be changed through this at runtime, if the topology asks for it.
+static xpc_control_t *control = NULL;
+// endpoints which hang up are closed through this.
+static xpc_topology_t *topology = NULL;
 
 static const int epoll_rd_flags = EPOLLIN | EPOLLHUP | EPOLLRDHUP;
 static const int epoll_wr_flags = EPOLLOUT | EPOLLHUP;
-static const int epoll_rdwr_flags = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLRDHUP;
 
+// the router asks for write events when an output has data, and stops them
+// when it has none. Inputs which are also outputs keep their read events.
+// Sockets are not watched before they are connected.
 static int app_add_fd(void *ctx, int fd) {
-    int fd_status = fcntl(fd, F_GETFD);
-    if(fd_status & O_RDONLY) {
-        epoll_app_add_fd(ctx, fd, epoll_rd_flags);
+    if(xpc_topology_connecting(topology, fd)) {
+        return 0;
     }
-    else if(fd_status & O_WRONLY) {
-        epoll_app_add_fd(ctx, fd, epoll_wr_flags);
+    int flags = epoll_app_get_flags(ctx, fd);
+    if(flags == -1) {
+        return epoll_app_add_fd(ctx, fd, epoll_wr_flags);
     }
-    else {
-        epoll_app_add_fd(ctx, fd, epoll_rdwr_flags);
+    if(flags & EPOLLOUT) {
+        return 0;
     }
+    return epoll_app_mod_fd(ctx, fd, flags | EPOLLOUT);
 }
 
 static int app_del_fd(void *ctx, int fd) {
-    epoll_app_del_fd(ctx, fd);
+    int flags = epoll_app_get_flags(ctx, fd);
+    if(flags == -1 || !(flags & EPOLLOUT)) {
+        return 0;
+    }
+    if(flags & EPOLLIN) {
+        return epoll_app_mod_fd(ctx, fd, flags & ~EPOLLOUT);
+    }
+    return epoll_app_del_fd(ctx, fd);
+}
+
+// clients accepted by the router are watched for reading until they close,
+// as are inputs routed from at runtime, which may be outputs already.
+static int app_watch_fd(void *ctx, int fd) {
+    if(xpc_topology_connecting(topology, fd)) {
+        return 0;
+    }
+    int flags = epoll_app_get_flags(ctx, fd);
+    if(flags == -1) {
+        return epoll_app_add_fd(ctx, fd, epoll_rd_flags);
+    }
+    return epoll_app_mod_fd(ctx, fd, flags | epoll_rd_flags);
+}
+
+static int app_forget_fd(void *ctx, int fd) {
+    return epoll_app_del_fd(ctx, fd);
+}
+
+static int app_close_fd(void *ctx, int fd) {
+    xpc_topology_close_fd(topology, fd);
+    return 0;
+}
+
+// the control socket and its controllers are not known to the router.
+static void app_read(void *ctx, int fd) {
+    if(control != NULL && xpc_control_owns(control, fd)) {
+        xpc_control_recv(control, fd);
+        return;
+    }
+    xpc_sched_read(ctx, fd);
+}
+
+// an input which hung up may still have data, it is closed once it is read.
+// Outputs find out when they are written.
+static void app_hangup(void *ctx, int fd) {
+    xpc_router_t *xpc = ctx;
+    if(hashmap_fetch(xpc->in_contexts, fd) != NULL
+            || (control != NULL && xpc_control_owns(control, fd))) {
+        app_read(ctx, fd);
+    }
+}
+
+// epoll_app passes its context untyped, the router functions take theirs.
+static void app_write(void *ctx, int fd) {
+    xpc_sched_write(ctx, fd);
+}
+
+static int router_poll_cb(void *ctx) {
+    int timeout_ms = xpc_router_poll(ctx);
+    int connect_ms = xpc_topology_connect_poll(topology, ctx);
+    if(timeout_ms == -1 || (connect_ms != -1 && connect_ms < timeout_ms)) {
+        timeout_ms = connect_ms;
+    }
+    return timeout_ms;
 }
 
 static void unix_signal_handler(int signum) {
@@ -53,28 +126,29 @@ static void unix_signal_handler(int signum) {
     }
 }
 
-
-int configure_device(char *dev_path, int baud, int flags) {
-    int fd = -1;
-    fd = open(dev_path, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if(fd == -1) {
-        goto done;
+/**
+ * Forward with the pipeline threads until SIGINT. This thread only runs the
+ * router's timers, to publish statistics.
+ */
+static int run_pipeline(
+        epoll_app_t *app, xpc_topology_t *topo, xpc_router_t *xpc) {
+    xpc_pipeline_t *pipe = xpc_topology_build_pipeline(topo, xpc);
+    if(pipe == NULL) {
+        return -6;
     }
-
-    // set flags
-    fcntl(fd, F_SETFL, flags);
-
-    // set the port as being exclusive
-    ioctl(fd, TIOCEXCL, NULL);
-
-    struct termios options;
-    tcgetattr(fd, &options);
-    cfmakeraw(&options);
-    cfsetspeed(&options, B921600);
-    tcsetattr(fd, TCSANOW, &options);
-
-done:
-    return fd;
+    if(xpc_pipeline_start(pipe) != 0) {
+        perror("pipeline");
+        xpc_pipeline_free(pipe);
+        return -6;
+    }
+    while(app->run_mainloop) {
+        xpc_pipeline_sync(pipe);
+        int timeout_ms = xpc_router_poll(xpc);
+        // SIGINT interrupts the wait.
+        poll(NULL, 0, (timeout_ms == -1 || timeout_ms > 1000) ? 1000:timeout_ms);
+    }
+    xpc_pipeline_free(pipe);
+    return 0;
 }
 
 int main(int argc, char **argv) {
@@ -102,75 +176,94 @@ int main(int argc, char **argv) {
     global_context = app;
 
 
-    // tell epoll AND xpc about INPUTS, tell ONLY xpc about OUTPUTS.
-    // xpc has the smarts to turn off write events when no data is available.
-    int ser_fd = configure_device(argv[1], 921600, 0 /*FNDELAY*/);
-    if(ser_fd == -1) {
-        perror("open");
-        status = -4;
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <topology file>\n", argv[0]);
+        status = -3;
         goto bad_device;
     }
-
-    // TODO how do we handle fds that are in AND out?
-    // we're going to need EVEN MORE STATE LOGIC
-    // this was rdwr_flags
-    epoll_app_add_fd(app, ser_fd, epoll_rd_flags);
-
-    // make a fifo for the demux'd output
-    if(mkfifo("k64_stdout", 0660) < 0 && errno != EEXIST) {
-        perror("mkfifo k64_stdout");
-        status = -5;
+    xpc_topology_t *topo = xpc_topology_load(argv[1]);
+    if(topo == NULL) {
+        status = -3;
         goto bad_device;
     }
+    if(xpc_topology_open(topo) != 0) {
+        status = -4;
+        goto bad_topology;
+    }
+    topology = topo;
 
-    // we are only writing to the fifo
-/*
- *    int k64out_fd = open("./k64_stdout", O_WRONLY | O_NONBLOCK);
- *    if(k64out_fd == -1) {
- *        perror("open k64_stdout");
- *        status = -5;
- *        goto bad_device;
- *    }
- *
- *    epoll_app_add_fd(app, k64out_fd, EPOLLOUT | EPOLLHUP);
- */
-    /*epoll_app_add_fd(app, STDOUT_FILENO, EPOLLOUT);*/
-
-    // make a fifo for mux'd input
-    if(mkfifo("k64_stdin", 0660) < 0 && errno != EEXIST) {
-        perror("mkfifo k64_stdin");
-        status = -5;
-        goto bad_device;
+    // tell epoll AND xpc about INPUTS, tell ONLY xpc about OUTPUTS.
+    // xpc has the smarts to turn off write events when no data is available.
+    for(int i = 0; i < array_size(topo->routes); i++) {
+        xpc_topo_route_t *route = array_fetch(topo->routes, i);
+        xpc_topo_endpoint_t *in = array_fetch(topo->endpoints, route->in_ep);
+        if(!in->connecting && epoll_app_get_flags(app, in->fd) == -1) {
+            epoll_app_add_fd(app, in->fd, epoll_rd_flags);
+        }
     }
-    int k64in_fd = open("./k64_stdin", O_RDONLY | O_NONBLOCK);
-    if(k64in_fd == -1) {
-        perror("open k64_stdin");
-        status = -5;
-        goto bad_device;
+    // listeners accept clients whether or not anything is routed from them.
+    for(int i = 0; i < array_size(topo->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(topo->endpoints, i);
+        if(ep->kind == XPC_TOPO_LISTEN) {
+            epoll_app_add_fd(app, ep->fd, epoll_rd_flags);
+        }
     }
 
-    epoll_app_add_fd(app, k64in_fd, EPOLLIN|EPOLLHUP|EPOLLRDHUP);
-
     // configure the xpc router
-    xpc_router_t *xpc = initialize_xpc_router();
+    xpc_router_t *xpc = xpc_topology_build_router(topo);
     if(xpc == NULL) {
-        goto bad_device;
+        status = -5;
+        goto bad_topology;
     }
     // allow xpc to talk to epoll_app
     xpc->io_event_context = app;
     xpc->io_add_fd_cb = app_add_fd;
     xpc->io_del_fd_cb = app_del_fd;
+    xpc->io_watch_fd_cb = app_watch_fd;
+    xpc->io_forget_fd_cb = app_forget_fd;
+    xpc->io_close_fd_cb = app_close_fd;
 
     // use xpc to handle epoll_app
     app->cb_ctx = xpc;
-    app->epollin_cb = xpc_accumulate_msg;
-    app->epollout_cb = xpc_write_msg;
-    xpc_set_route(xpc, ser_fd, STDOUT_FILENO, 1, 1); 
+    app->epollin_cb = app_read;
+    app->epollout_cb = app_write;
+    app->epollrdhup_cb = app_hangup;
+    app->epollhup_cb = app_hangup;
+    app->timeout_cb = router_poll_cb;
+    epoll_app_set_busy_poll(app, topo->busy_poll_us, topo->busy_poll_budget);
 
-    epoll_app_mainloop(global_context);
+    if(topo->connecting > 0 && topo->pipeline) {
+        fprintf(stderr, "pipeline: every socket has to be connected at startup\n");
+        status = -6;
+        goto bad_router;
+    }
+    if(topo->control_path[0] != '\0' && topo->pipeline) {
+        fprintf(stderr, "control: routes cannot change in pipeline mode\n");
+        status = -6;
+        goto bad_router;
+    }
+    if(topo->control_path[0] != '\0') {
+        control = create_xpc_control(xpc, topo, topo->control_path);
+        if(control == NULL) {
+            perror(topo->control_path);
+            status = -6;
+            goto bad_router;
+        }
+    }
+
+    if(topo->pipeline) {
+        status = run_pipeline(app, topo, xpc);
+    }
+    else {
+        epoll_app_mainloop(global_context);
+    }
 
+    xpc_control_free(control);
+bad_router:
     xpc_router_destroy(xpc);
 // early exit conditions
+bad_topology:
+    xpc_topology_free(topo);
 bad_device:
     destroy_epoll_app(app);
     /*destroy_xpc_router(xpc);*/
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xpc_utils.h>
+#include <xpc_capture.h>
+
+struct xpc_capture {
+    int fd;
+    uint8_t *map;
+    size_t len;
+};
+
+#define XPC_CAPTURE_PAD(n) \
+    (((n) + XPC_CAPTURE_ALIGN - 1) & ~(size_t)(XPC_CAPTURE_ALIGN - 1))
+
+int xpc_capture_enable(xpc_router_t *ctx, const char *path, size_t max_bytes) {
+    int status = -1;
+    int err = 0;
+    xpc_capture_t *r = calloc(1, sizeof(xpc_capture_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->len = (max_bytes > sizeof(xpc_capture_hdr_t)) ?
+        max_bytes:sizeof(xpc_capture_hdr_t);
+    r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(r->fd == -1) {
+        goto bad_capture;
+    }
+    // allocating the blocks now means a full disk fails here, rather than
+    // with SIGBUS on the forwarding path.
+    if((err = posix_fallocate(r->fd, 0, r->len)) != 0) {
+        errno = err;
+        goto bad_capture;
+    }
+    r->map = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if(r->map == MAP_FAILED) {
+        r->map = NULL;
+        goto bad_capture;
+    }
+    xpc_capture_hdr_t *hdr = (xpc_capture_hdr_t *)r->map;
+    hdr->version = XPC_CAPTURE_VERSION;
+    hdr->end = sizeof(xpc_capture_hdr_t);
+    hdr->capacity = r->len;
+    hdr->lost = 0;
+    __atomic_store_n(&hdr->magic, XPC_CAPTURE_MAGIC, __ATOMIC_RELEASE);
+
+    xpc_capture_free(ctx->capture);
+    ctx->capture = r;
+    status = 0;
+    goto done;
+
+bad_capture:
+    err = errno;
+    if(r->fd != -1) {
+        close(r->fd);
+        unlink(path);
+    }
+    free(r);
+    errno = err;
+done:
+    return status;
+}
+
+void xpc_capture_msg(
+        xpc_router_t *ctx, const msg_buf_t *msg_buf, int out_fd, int out_chn,
+        bool big_endian) {
+    xpc_capture_t *self = ctx->capture;
+    xpc_capture_hdr_t *hdr = (xpc_capture_hdr_t *)self->map;
+    size_t rec_len = XPC_CAPTURE_PAD(sizeof(xpc_capture_rec_t) + msg_buf->size);
+    if(hdr->end + rec_len > self->len) {
+        hdr->lost++;
+        return;
+    }
+    xpc_capture_rec_t *rec = (xpc_capture_rec_t *)(self->map + hdr->end);
+    rec->rec_len = rec_len;
+    rec->flags = big_endian ? XPC_CAPTURE_BIG_ENDIAN:0;
+    rec->ingress_ns = msg_buf->ingress_ns;
+    rec->in_fd = msg_buf->src_fd;
+    rec->in_chn = msg_buf->src_chn;
+    rec->out_fd = out_fd;
+    rec->out_chn = out_chn;
+    rec->msg_len = msg_buf->size;
+    rec->reserved = 0;
+    memcpy(rec + 1, msg_buf->buf->buf, msg_buf->size);
+    // a reader of the live file sees whole records only.
+    __atomic_store_n(&hdr->end, hdr->end + rec_len, __ATOMIC_RELEASE);
+}
+
+void xpc_capture_free(xpc_capture_t *self) {
+    if(self != NULL) {
+        if(self->map != NULL) {
+            xpc_capture_hdr_t *hdr = (xpc_capture_hdr_t *)self->map;
+            uint64_t end = hdr->end;
+            munmap(self->map, self->len);
+            if(ftruncate(self->fd, end) != 0) {
+                // the unused tail stays, readers stop at hdr->end anyway.
+            }
+        }
+        close(self->fd);
+        free(self);
+    }
+}
+
+const xpc_capture_hdr_t *xpc_capture_map(const char *path, size_t *len) {
+    const xpc_capture_hdr_t *r = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        goto done;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(xpc_capture_hdr_t)) {
+        errno = EINVAL;
+        goto done;
+    }
+    r = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(r == MAP_FAILED) {
+        r = NULL;
+        goto done;
+    }
+    if(__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != XPC_CAPTURE_MAGIC
+            || r->version != XPC_CAPTURE_VERSION || r->end > st.st_size) {
+        munmap((void *)r, st.st_size);
+        r = NULL;
+        errno = EINVAL;
+        goto done;
+    }
+    *len = st.st_size;
+done:
+    if(fd != -1) {
+        close(fd);
+    }
+    return r;
+}
+
+void xpc_capture_unmap(const xpc_capture_hdr_t *hdr, size_t len) {
+    if(hdr != NULL) {
+        munmap((void *)hdr, len);
+    }
+}
+
+const xpc_capture_rec_t *xpc_capture_next(
+        const xpc_capture_hdr_t *hdr, const xpc_capture_rec_t *rec) {
+    uint64_t end = __atomic_load_n(&hdr->end, __ATOMIC_ACQUIRE);
+    uint64_t off = (rec == NULL) ?
+        sizeof(xpc_capture_hdr_t):((const uint8_t *)rec - (const uint8_t *)hdr)
+        + rec->rec_len;
+    if(off + sizeof(xpc_capture_rec_t) > end) {
+        return NULL;
+    }
+    const xpc_capture_rec_t *r =
+        (const xpc_capture_rec_t *)((const uint8_t *)hdr + off);
+    // a damaged record ends the capture.
+    if(r->rec_len < sizeof(xpc_capture_rec_t) + r->msg_len
+            || off + r->rec_len > end) {
+        return NULL;
+    }
+    return r;
+}
@@ -0,0 +1,583 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_clients.h>
+#include <xpc_capture.h>
+#include <xpc_hook.h>
+#include <xpc_limit.h>
+#include <xpc_shm.h>
+#include <xpc_endian.h>
+#include <xpc_msg_queue.h>
+#include <alibc/containers/array.h>
+#include <alibc/containers/hashmap.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/hashmap_iterator.h>
+
+int xpc_listen_seqpacket(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = -1;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        goto done;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        goto done;
+    }
+    // a socket left behind by a previous run would make bind fail.
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || listen(fd, SOMAXCONN) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+done:
+    return fd;
+}
+
+int xpc_add_listener(xpc_router_t *ctx, int lfd) {
+    int status = -1;
+    xpc_in_ctx_t in_ctx = {0};
+    xpc_out_ctx_t out_ctx = {0};
+    // routes may have been set up first, which creates both contexts.
+    xpc_in_ctx_t *in = hashmap_fetch(ctx->in_contexts, lfd);
+    if(in == NULL) {
+        in_ctx.codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+        hashmap_set(ctx->in_contexts, lfd, &in_ctx);
+        if(hashmap_status(ctx->in_contexts) != ALC_HASHMAP_SUCCESS) {
+            goto done;
+        }
+        if(xpc_keys_add(ctx->in_fds, &lfd, sizeof(lfd)) != 0) {
+            hashmap_remove(ctx->in_contexts, lfd);
+            goto done;
+        }
+        in = hashmap_fetch(ctx->in_contexts, lfd);
+    }
+    in->kind = XPC_IN_LISTENER;
+    in->listen_fd = lfd;
+
+    xpc_out_ctx_t *out = hashmap_fetch(ctx->out_contexts, lfd);
+    if(out == NULL) {
+        if(create_xpc_out_ctx(&out_ctx) == NULL) {
+            goto done;
+        }
+        hashmap_set(ctx->out_contexts, lfd, &out_ctx);
+        if(hashmap_status(ctx->out_contexts) != ALC_HASHMAP_SUCCESS) {
+            xpc_out_ctx_free(&out_ctx);
+            goto done;
+        }
+        if(xpc_keys_add(ctx->out_fds, &lfd, sizeof(lfd)) != 0) {
+            xpc_out_ctx_free(&out_ctx);
+            hashmap_remove(ctx->out_contexts, lfd);
+            goto done;
+        }
+        out = hashmap_fetch(ctx->out_contexts, lfd);
+    }
+    // clients are local, so the byte order is always the host's.
+    out->codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    in->codec = out->codec;
+    out->fanout = true;
+    status = 0;
+done:
+    return status;
+}
+
+/**
+ * Get the subscriber list of a channel, creating it if asked to.
+ */
+static array_t *xpc_subscribers(xpc_router_t *ctx, int lfd, int chn, bool create) {
+    xpc_switch_tbl_entry_t key = {.fd = lfd, .to_chn = chn};
+    array_t **subs = hashmap_fetch(ctx->subscriptions, *(void**)&key);
+    if(subs != NULL) {
+        return *subs;
+    }
+    if(!create) {
+        return NULL;
+    }
+    array_t *r = create_array(4, sizeof(int));
+    if(r == NULL) {
+        return NULL;
+    }
+    // a pointer is copied by value.
+    hashmap_set(ctx->subscriptions, *(void**)&key, r);
+    if(hashmap_status(ctx->subscriptions) != ALC_HASHMAP_SUCCESS) {
+        array_free(r);
+        r = NULL;
+    }
+    return r;
+}
+
+/**
+ * Remove a client from a subscriber list.
+ * @return 0 if it was there, -1 otherwise.
+ */
+static int xpc_subscribers_remove(array_t *subs, int cfd) {
+    for(int i = 0; i < array_size(subs); i++) {
+        if(*(int *)array_fetch(subs, i) == cfd) {
+            array_remove(subs, i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int xpc_client_subscribe(xpc_router_t *ctx, int cfd, int chn) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_SEQPACKET) {
+        return -1;
+    }
+    array_t *subs = xpc_subscribers(ctx, in_ctx->listen_fd, chn, true);
+    if(subs == NULL) {
+        return -1;
+    }
+    for(int i = 0; i < array_size(subs); i++) {
+        if(*(int *)array_fetch(subs, i) == cfd) {
+            return 0;
+        }
+    }
+    return array_append(subs, cfd) == 0 ? 0:-1;
+}
+
+int xpc_client_unsubscribe(xpc_router_t *ctx, int cfd, int chn) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_SEQPACKET) {
+        return -1;
+    }
+    array_t *subs = xpc_subscribers(ctx, in_ctx->listen_fd, chn, false);
+    if(subs == NULL) {
+        return -1;
+    }
+    return xpc_subscribers_remove(subs, cfd);
+}
+
+int xpc_client_accept(xpc_router_t *ctx, int lfd) {
+    int accepted = 0;
+    while(true) {
+        int cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(cfd == -1) {
+            // EAGAIN once the backlog is empty. Other errors concern the
+            // connection which failed, not the listener.
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if(errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            perror("accept4");
+            break;
+        }
+        xpc_in_ctx_t in_ctx = {0};
+        xpc_out_ctx_t out_ctx = {0};
+        in_ctx.kind = XPC_IN_SEQPACKET;
+        in_ctx.listen_fd = lfd;
+        in_ctx.codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+        if(create_xpc_out_ctx(&out_ctx) == NULL) {
+            close(cfd);
+            continue;
+        }
+        out_ctx.seqpacket = true;
+        hashmap_set(ctx->in_contexts, cfd, &in_ctx);
+        if(hashmap_status(ctx->in_contexts) != ALC_HASHMAP_SUCCESS) {
+            xpc_out_ctx_free(&out_ctx);
+            close(cfd);
+            continue;
+        }
+        hashmap_set(ctx->out_contexts, cfd, &out_ctx);
+        if(hashmap_status(ctx->out_contexts) != ALC_HASHMAP_SUCCESS
+                || xpc_keys_add(ctx->in_fds, &cfd, sizeof(cfd)) != 0
+                || xpc_keys_add(ctx->out_fds, &cfd, sizeof(cfd)) != 0
+                || (ctx->io_watch_fd_cb != NULL
+                    && ctx->io_watch_fd_cb(ctx->io_event_context, cfd) != 0)) {
+            // the client is only half set up, let close sort it out.
+            xpc_out_ctx_free(&out_ctx);
+            hashmap_remove(ctx->out_contexts, cfd);
+            hashmap_remove(ctx->in_contexts, cfd);
+            xpc_keys_remove(ctx->in_fds, &cfd, sizeof(cfd));
+            xpc_keys_remove(ctx->out_fds, &cfd, sizeof(cfd));
+            close(cfd);
+            continue;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+/**
+ * Throw away the datagram at the head of a client's socket.
+ */
+static void xpc_client_skip(xpc_router_t *ctx, int cfd) {
+    // whatever does not fit in the buffer of a seqpacket read is discarded.
+    recv(cfd, ctx->discard_buf, 1, MSG_DONTWAIT);
+}
+
+/**
+ * Act on the payload of a subscription control message.
+ */
+static void xpc_client_subscriptions(
+        xpc_router_t *ctx, int cfd, const txpc_hdr_t *hdr,
+        const uint8_t *payload, int len) {
+    int n_chn = len / sizeof(uint32_t);
+    for(int i = 0; i < n_chn; i++) {
+        uint32_t chn;
+        memcpy(&chn, payload + i * sizeof(uint32_t), sizeof(chn));
+        if(hdr->type == XPC_CLIENT_SUBSCRIBE) {
+            xpc_client_subscribe(ctx, cfd, chn);
+        }
+        else if(hdr->type == XPC_CLIENT_UNSUBSCRIBE) {
+            xpc_client_unsubscribe(ctx, cfd, chn);
+        }
+    }
+}
+
+/**
+ * Act on a control message from a client.
+ */
+static void xpc_client_control(
+        xpc_router_t *ctx, int cfd, const txpc_hdr_t *hdr, int len) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    const int max_fds = 3;
+    int fds[3];
+    int n_fds = 0;
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    // keep what fits of the payload.
+    struct iovec iov = {
+        .iov_base = ctx->discard_buf,
+        .iov_len = (len < sizeof(ctx->discard_buf)) ?
+            len:sizeof(ctx->discard_buf)
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf)
+    };
+    int rd = recvmsg(cfd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    // any descriptors are collected first, so none of them leak.
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL;
+            c = CMSG_NXTHDR(&mh, c)) {
+        if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if(n_fds < max_fds) {
+                fds[n_fds++] = fd;
+            }
+            else {
+                close(fd);
+            }
+        }
+    }
+    if(rd >= hdr_len && hdr->type == XPC_CLIENT_SHM_ATTACH
+            && n_fds == max_fds) {
+        if(xpc_shm_attach(ctx, cfd, fds[0], fds[1], fds[2]) != 0) {
+            xpc_count_drop(ctx, cfd, 0, XPC_DROP_MALFORMED);
+        }
+        return;
+    }
+    for(int i = 0; i < n_fds; i++) {
+        close(fds[i]);
+    }
+    if(rd >= hdr_len) {
+        xpc_client_subscriptions(
+            ctx, cfd, hdr, ctx->discard_buf + hdr_len, rd - hdr_len
+        );
+    }
+}
+
+/**
+ * Take a buffer from the output a client's message is routed to, counting
+ * the message as dropped if there is no route, its limit leaves it out, or
+ * there is no buffer.
+ * @return the buffer, with room for len bytes, or NULL.
+ */
+static msg_buf_t *xpc_client_msg_buf(
+        xpc_router_t *ctx, int cfd, xpc_in_ctx_t *in_ctx, const txpc_hdr_t *hdr,
+        int len, xpc_route_t **sw_ent, xpc_out_ctx_t **out_ctx) {
+    xpc_switch_tbl_entry_t key = {.fd = in_ctx->listen_fd, .to_chn = hdr->to};
+    msg_buf_t *msg_buf = NULL;
+    xpc_drop_reason_t reason = XPC_DROP_NO_ROUTE;
+    *sw_ent = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    *out_ctx = NULL;
+    if(*sw_ent != NULL) {
+        *out_ctx = hashmap_fetch(ctx->out_contexts, (*sw_ent)->dst.fd);
+    }
+    if(*out_ctx != NULL && ((*sw_ent)->limit == NULL || xpc_limit_admit(
+            (*sw_ent)->limit, len, xpc_monotonic_ns(), &reason))) {
+        msg_buf = xpc_msg_getbuf((*out_ctx)->msg_queue, -1);
+        reason = XPC_DROP_NO_BUFFER;
+    }
+    if(msg_buf != NULL && msg_buf->buf->capacity < len
+            && dynabuf_resize(msg_buf->buf, len) != 0) {
+        xpc_msg_clear((*out_ctx)->msg_queue, msg_buf->buf_id);
+        msg_buf = NULL;
+    }
+    if(msg_buf == NULL) {
+        xpc_count_drop(ctx, cfd, hdr->to, reason);
+        if(*sw_ent != NULL) {
+            (*sw_ent)->stats.drops[reason]++;
+        }
+    }
+    return msg_buf;
+}
+
+/**
+ * Finish routing a client's message once it is in its buffer.
+ */
+static void xpc_client_msg_done(
+        xpc_router_t *ctx, xpc_in_ctx_t *in_ctx, xpc_route_t *sw_ent,
+        xpc_out_ctx_t *out_ctx, msg_buf_t *msg_buf, txpc_hdr_t hdr, int len) {
+    // a datagram arrives whole, its latency starts once it is read.
+    msg_buf->ingress_ns = xpc_monotonic_ns();
+    msg_buf->src_fd = in_ctx->listen_fd;
+    msg_buf->src_chn = hdr.to;
+    hdr.to = sw_ent->dst.to_chn;
+    out_ctx->codec->encode(msg_buf->buf->buf, &hdr);
+    msg_buf->size = len;
+    msg_buf->flags = sw_ent->flags;
+    in_ctx->rx.msgs++;
+    in_ctx->rx.bytes += len;
+    int out_chn = sw_ent->dst.to_chn;
+    if(sw_ent->hook != NULL
+            && !xpc_hook_run(ctx, sw_ent, out_ctx, msg_buf, &out_chn)) {
+        return;
+    }
+    if(ctx->capture != NULL) {
+        xpc_capture_msg(
+            ctx, msg_buf, sw_ent->dst.fd, out_chn, out_ctx->codec->big_endian
+        );
+    }
+    xpc_msg_finalize(out_ctx->msg_queue, msg_buf->buf_id);
+    sw_ent->stats.msgs++;
+    sw_ent->stats.bytes += len;
+    xpc_output_ready(ctx, sw_ent->dst.fd, out_ctx);
+}
+
+/**
+ * Check the header of a client's message.
+ * @return true if it may be routed.
+ */
+static bool xpc_client_hdr_valid(
+        xpc_router_t *ctx, int cfd, const txpc_hdr_t *hdr, int len) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    if((uint64_t)hdr->size != (uint64_t)(len - hdr_len)
+            || (uint64_t)hdr->size > (uint64_t)ctx->max_msg_size) {
+        // a malformed datagram, unlike on a stream it costs nothing else.
+        xpc_count_drop(ctx, cfd, hdr->to, XPC_DROP_MALFORMED);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Route one datagram from a client.
+ * @return the number of bytes read, 0 if there was nothing to read, or -1
+ * if the client hung up.
+ */
+static int xpc_client_recv_one(
+        xpc_router_t *ctx, int cfd, xpc_in_ctx_t *in_ctx) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    txpc_hdr_t hdr;
+    // the header says where the message goes, so it is looked at first and
+    // the datagram is then read straight into the output's buffer.
+    int len = recv(cfd, wire, hdr_len, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    if(len == 0) {
+        // an empty datagram cannot be told apart from a hangup.
+        return -1;
+    }
+    if(len < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0:-1;
+    }
+    if(len < hdr_len) {
+        xpc_count_drop(ctx, cfd, 0, XPC_DROP_MALFORMED);
+        xpc_client_skip(ctx, cfd);
+        return len;
+    }
+    in_ctx->codec->decode(&hdr, wire);
+    if(!xpc_client_hdr_valid(ctx, cfd, &hdr, len)) {
+        xpc_client_skip(ctx, cfd);
+        return len;
+    }
+    if(hdr.to == 0 && hdr.from == 0) {
+        xpc_client_control(ctx, cfd, &hdr, len);
+        return len;
+    }
+
+    xpc_route_t *sw_ent = NULL;
+    xpc_out_ctx_t *out_ctx = NULL;
+    msg_buf_t *msg_buf = xpc_client_msg_buf(
+        ctx, cfd, in_ctx, &hdr, len, &sw_ent, &out_ctx
+    );
+    if(msg_buf == NULL) {
+        xpc_client_skip(ctx, cfd);
+        return len;
+    }
+    if(recv(cfd, msg_buf->buf->buf, len, MSG_DONTWAIT) != len) {
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        return -1;
+    }
+    xpc_client_msg_done(ctx, in_ctx, sw_ent, out_ctx, msg_buf, hdr, len);
+    return len;
+}
+
+void xpc_client_deliver(
+        xpc_router_t *ctx, int cfd, const uint8_t *wire, int len) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    txpc_hdr_t hdr;
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    if(in_ctx == NULL) {
+        return;
+    }
+    if(len < hdr_len) {
+        xpc_count_drop(ctx, cfd, 0, XPC_DROP_MALFORMED);
+        return;
+    }
+    in_ctx->codec->decode(&hdr, wire);
+    if(!xpc_client_hdr_valid(ctx, cfd, &hdr, len)) {
+        return;
+    }
+    if(hdr.to == 0 && hdr.from == 0) {
+        xpc_client_subscriptions(ctx, cfd, &hdr, wire + hdr_len, len - hdr_len);
+        return;
+    }
+
+    xpc_route_t *sw_ent = NULL;
+    xpc_out_ctx_t *out_ctx = NULL;
+    msg_buf_t *msg_buf = xpc_client_msg_buf(
+        ctx, cfd, in_ctx, &hdr, len, &sw_ent, &out_ctx
+    );
+    if(msg_buf == NULL) {
+        return;
+    }
+    memcpy(msg_buf->buf->buf, wire, len);
+    // the client could still be writing to wire, only the copy is trusted.
+    txpc_hdr_t copied;
+    in_ctx->codec->decode(&copied, msg_buf->buf->buf);
+    if(copied.to != hdr.to || copied.size != hdr.size) {
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        xpc_count_drop(ctx, cfd, hdr.to, XPC_DROP_MALFORMED);
+        return;
+    }
+    xpc_client_msg_done(ctx, in_ctx, sw_ent, out_ctx, msg_buf, hdr, len);
+}
+
+int xpc_client_recv(xpc_router_t *ctx, int cfd) {
+    int bytes_read = 0;
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    if(in_ctx == NULL) {
+        goto done;
+    }
+    for(int i = 0; i < XPC_CLIENT_RECV_BATCH; i++) {
+        int rd_bytes = xpc_client_recv_one(ctx, cfd, in_ctx);
+        if(rd_bytes < 0) {
+            xpc_client_close(ctx, cfd);
+            break;
+        }
+        if(rd_bytes == 0) {
+            break;
+        }
+        bytes_read += rd_bytes;
+    }
+done:
+    return bytes_read;
+}
+
+void xpc_client_fanout(xpc_router_t *ctx, int lfd, xpc_out_ctx_t *bus) {
+    msg_buf_t *msg_buf = NULL;
+    txpc_hdr_t hdr;
+    while((msg_buf = xpc_msg_dequeue_final(bus->msg_queue)) != NULL) {
+        bus->codec->decode(&hdr, msg_buf->buf->buf);
+        array_t *subs = xpc_subscribers(ctx, lfd, hdr.to, false);
+        for(int i = 0; subs != NULL && i < array_size(subs); i++) {
+            int cfd = *(int *)array_fetch(subs, i);
+            xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, cfd);
+            xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+            msg_buf_t *copy = NULL;
+            if(in_ctx != NULL && in_ctx->shm != NULL) {
+                // the message goes straight into the client's ring, without
+                // being queued or written.
+                if(xpc_shm_send(ctx, in_ctx->shm, msg_buf) != 0) {
+                    xpc_count_drop(ctx, cfd, hdr.to, XPC_DROP_QUEUE_FULL);
+                    continue;
+                }
+                out_ctx->tx.msgs++;
+                out_ctx->tx.bytes += msg_buf->size;
+                xpc_record_latency(
+                    ctx, msg_buf->src_fd, msg_buf->src_chn,
+                    xpc_monotonic_ns() - msg_buf->ingress_ns
+                );
+                continue;
+            }
+            // a client which does not keep up loses messages, the others
+            // are not held back by it.
+            if(hashmap_size(out_ctx->msg_queue->inflight_buffers)
+                    < XPC_CLIENT_MAX_QUEUED) {
+                copy = xpc_msg_getbuf(out_ctx->msg_queue, -1);
+            }
+            if(copy != NULL && copy->buf->capacity < msg_buf->size
+                    && dynabuf_resize(copy->buf, msg_buf->size) != 0) {
+                xpc_msg_clear(out_ctx->msg_queue, copy->buf_id);
+                copy = NULL;
+            }
+            if(copy == NULL) {
+                xpc_count_drop(ctx, cfd, hdr.to, XPC_DROP_QUEUE_FULL);
+                continue;
+            }
+            memcpy(copy->buf->buf, msg_buf->buf->buf, msg_buf->size);
+            copy->size = msg_buf->size;
+            copy->flags = msg_buf->flags;
+            copy->ingress_ns = msg_buf->ingress_ns;
+            copy->src_fd = msg_buf->src_fd;
+            copy->src_chn = msg_buf->src_chn;
+            xpc_msg_finalize(out_ctx->msg_queue, copy->buf_id);
+            if(ctx->io_add_fd_cb != NULL) {
+                ctx->io_add_fd_cb(ctx->io_event_context, cfd);
+            }
+        }
+        xpc_msg_clear(bus->msg_queue, msg_buf->buf_id);
+    }
+}
+
+void xpc_client_close(xpc_router_t *ctx, int cfd) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_SEQPACKET) {
+        return;
+    }
+    if(in_ctx->shm != NULL) {
+        xpc_shm_detach(ctx, in_ctx->shm);
+        in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    }
+    iter_context *it = create_hashmap_keys_iterator(ctx->subscriptions);
+    for(xpc_switch_tbl_entry_t *k = iter_next(it); k != NULL; k = iter_next(it)) {
+        if(k->fd == in_ctx->listen_fd) {
+            array_t **subs = hashmap_fetch(ctx->subscriptions, *(void**)k);
+            xpc_subscribers_remove(*subs, cfd);
+        }
+    }
+    iter_free(it);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, cfd);
+    xpc_out_ctx_free(out_ctx);
+    hashmap_remove(ctx->out_contexts, cfd);
+    hashmap_remove(ctx->in_contexts, cfd);
+    xpc_keys_remove(ctx->out_fds, &cfd, sizeof(cfd));
+    xpc_keys_remove(ctx->in_fds, &cfd, sizeof(cfd));
+    if(ctx->io_forget_fd_cb != NULL) {
+        ctx->io_forget_fd_cb(ctx->io_event_context, cfd);
+    }
+    close(cfd);
+}
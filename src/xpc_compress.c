@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <tinyxpc/tinyxpc.h>
+#include <alibc/containers/dynabuf.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_lz.h>
+#include <xpc_compress.h>
+
+/**
+ * Queue a XPC_NEG_TYPE_COMPRESS message to the peer of an input.
+ */
+static void xpc_compress_send(xpc_router_t *ctx, int fd, uint8_t what) {
+    if(xpc_add_output(ctx, fd) == NULL) {
+        return;
+    }
+    msg_buf_t *msg_buf = xpc_neg_getbuf(ctx, fd, XPC_NEG_TYPE_COMPRESS, 1);
+    if(msg_buf == NULL) {
+        return;
+    }
+    ((uint8_t *)msg_buf->buf->buf)[sizeof(txpc_hdr_t)] = what;
+    xpc_neg_finalize(ctx, fd, msg_buf);
+}
+
+int xpc_compress_allow(xpc_router_t *ctx, int fd, bool allow) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_STREAM) {
+        return -1;
+    }
+    in_ctx->compress_allowed = allow;
+    return 0;
+}
+
+void xpc_compress_neg(
+        xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx,
+        const uint8_t *payload, int len) {
+    uint8_t what = (len > 0) ? payload[0]:XPC_COMPRESS_ON;
+    if(in_ctx->kind != XPC_IN_STREAM) {
+        return;
+    }
+    if(what == XPC_COMPRESS_OFF) {
+        xpc_lz_free(in_ctx->lz_rx);
+        in_ctx->lz_rx = NULL;
+        in_ctx->lz_rx_lost = false;
+        // the peer is not expecting anything else, but the output stops
+        // compressing in order.
+        if(hashmap_fetch(ctx->out_contexts, fd) != NULL) {
+            xpc_compress_send(ctx, fd, XPC_COMPRESS_OFF);
+        }
+        return;
+    }
+    if(!in_ctx->compress_allowed) {
+        xpc_compress_send(ctx, fd, XPC_COMPRESS_OFF);
+        return;
+    }
+    xpc_out_ctx_t *out_ctx = xpc_add_output(ctx, fd);
+    if(out_ctx == NULL) {
+        return;
+    }
+    if(out_ctx->lz_tx == NULL) {
+        out_ctx->lz_tx = create_xpc_lz();
+    }
+    if(what == XPC_COMPRESS_ON && in_ctx->lz_rx == NULL) {
+        in_ctx->lz_rx = create_xpc_lz();
+    }
+    if(out_ctx->lz_tx == NULL || in_ctx->lz_rx == NULL) {
+        xpc_lz_free(in_ctx->lz_rx);
+        in_ctx->lz_rx = NULL;
+        xpc_compress_send(ctx, fd, XPC_COMPRESS_OFF);
+        return;
+    }
+    if(what == XPC_COMPRESS_ON) {
+        // the peer started its side over before sending this.
+        xpc_lz_reset(in_ctx->lz_rx);
+        in_ctx->lz_rx_lost = false;
+    }
+    // the output starts its side over once this is written, see
+    // xpc_compress_egress. XPC_COMPRESS_RESET is answered the same way.
+    xpc_compress_send(ctx, fd, XPC_COMPRESS_ON);
+}
+
+void xpc_compress_lost(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    if(in_ctx->lz_rx == NULL || in_ctx->lz_rx_lost) {
+        return;
+    }
+    in_ctx->lz_rx_lost = true;
+    xpc_compress_send(ctx, fd, XPC_COMPRESS_RESET);
+}
+
+int xpc_compress_ingress(
+        xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx,
+        xpc_out_ctx_t *out_ctx, msg_buf_t *msg_buf) {
+    const uint8_t *raw = NULL;
+    bool compressed = in_ctx->msg_hdr.type & XPC_COMPRESS_TYPE_FLAG;
+    uint8_t *payload = (uint8_t *)msg_buf->buf->buf + sizeof(txpc_hdr_t);
+    if(in_ctx->lz_rx_lost) {
+        // nothing can be decompressed until the peer starts over.
+        return compressed ? -1:0;
+    }
+    if(!compressed) {
+        xpc_lz_append(in_ctx->lz_rx, payload, in_ctx->msg_hdr.size);
+        return 0;
+    }
+    int len = xpc_lz_decompress(in_ctx->lz_rx, payload, in_ctx->msg_hdr.size, &raw);
+    if(len < 0) {
+        xpc_compress_lost(ctx, fd, in_ctx);
+        return -1;
+    }
+    if((uint64_t)len > (uint64_t)ctx->max_msg_size) {
+        // the header only bounded what was sent, it stays history.
+        return -1;
+    }
+    int msg_len = sizeof(txpc_hdr_t) + len;
+    if(msg_buf->buf->capacity < msg_len
+            && dynabuf_resize(msg_buf->buf, msg_len) != 0) {
+        // it is part of the history even so.
+        return -1;
+    }
+    txpc_hdr_t out_hdr = in_ctx->msg_hdr;
+    out_hdr.to = in_ctx->out_chn;
+    out_hdr.type &= ~XPC_COMPRESS_TYPE_FLAG;
+    out_hdr.size = len;
+    out_ctx->codec->encode(msg_buf->buf->buf, &out_hdr);
+    memcpy((uint8_t *)msg_buf->buf->buf + sizeof(txpc_hdr_t), raw, len);
+    msg_buf->size = msg_len;
+    return 0;
+}
+
+void xpc_compress_discard(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    if(in_ctx->lz_rx == NULL || in_ctx->lz_rx_lost
+            || in_ctx->msg_hdr.size > XPC_LZ_MAX_PAYLOAD) {
+        // longer payloads are not history.
+        return;
+    }
+    if(in_ctx->buf_offset > 0) {
+        // part of it was read into a queue buffer, and is gone.
+        xpc_compress_lost(ctx, fd, in_ctx);
+        return;
+    }
+    in_ctx->lz_discard = true;
+}
+
+uint8_t *xpc_compress_discard_buf(xpc_in_ctx_t *in_ctx) {
+    // the receiving end does not compress, its output buffer is free.
+    return in_ctx->lz_rx->out + in_ctx->buf_offset;
+}
+
+void xpc_compress_discarded(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    const uint8_t *raw = NULL;
+    in_ctx->lz_discard = false;
+    if(!(in_ctx->msg_hdr.type & XPC_COMPRESS_TYPE_FLAG)) {
+        xpc_lz_append(in_ctx->lz_rx, in_ctx->lz_rx->out, in_ctx->msg_hdr.size);
+    }
+    else if(xpc_lz_decompress(
+            in_ctx->lz_rx, in_ctx->lz_rx->out, in_ctx->msg_hdr.size, &raw) < 0) {
+        xpc_compress_lost(ctx, fd, in_ctx);
+    }
+}
+
+void xpc_compress_egress(
+        xpc_router_t *ctx, xpc_out_ctx_t *out_ctx, msg_buf_t *msg_buf) {
+    const uint8_t *packed = NULL;
+    uint8_t *wire = msg_buf->buf->buf;
+    uint8_t *payload = wire + sizeof(txpc_hdr_t);
+    txpc_hdr_t hdr;
+    out_ctx->codec->decode(&hdr, wire);
+    if(hdr.to == 0 && hdr.from == 0) {
+        // the history of this side starts over where the peer is told to.
+        if(hdr.type == XPC_NEG_TYPE_COMPRESS && hdr.size > 0) {
+            out_ctx->lz_tx_active = payload[0] == XPC_COMPRESS_ON;
+            xpc_lz_reset(out_ctx->lz_tx);
+        }
+        return;
+    }
+    if(!out_ctx->lz_tx_active) {
+        return;
+    }
+    int len = xpc_lz_compress(out_ctx->lz_tx, payload, hdr.size, &packed);
+    if(len < 0) {
+        return;
+    }
+    memcpy(payload, packed, len);
+    hdr.type |= XPC_COMPRESS_TYPE_FLAG;
+    hdr.size = len;
+    out_ctx->codec->encode(wire, &hdr);
+    // the queue counted it at its original size.
+    int saved = msg_buf->size - (int)sizeof(txpc_hdr_t) - len;
+    msg_buf->size -= saved;
+    msg_buf->final_size -= saved;
+    out_ctx->msg_queue->queued_bytes -= saved;
+}
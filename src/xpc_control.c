@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <alibc/containers/array.h>
+#include <alibc/containers/hashmap.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/hashmap_iterator.h>
+#include <xpc_utils.h>
+#include <xpc_clients.h>
+#include <xpc_credit.h>
+#include <xpc_compress.h>
+#include <xpc_sched.h>
+#include <xpc_spill.h>
+#include <xpc_sink.h>
+#include <xpc_limit.h>
+#include <xpc_topology.h>
+#include <xpc_control.h>
+
+struct xpc_control {
+    xpc_router_t *router;
+    xpc_topology_t *topo;
+    char path[XPC_TOPO_PATH_MAX];
+    int lfd;
+    // array of int, the connected controllers.
+    array_t *conns;
+    char cmds[XPC_CONTROL_CMD_MAX + 1];
+    char reply[XPC_CONTROL_REPLY_MAX];
+};
+
+typedef enum {
+    XPC_CONTROL_ROUTE,
+    XPC_CONTROL_UNROUTE,
+    XPC_CONTROL_LIST,
+} xpc_control_op_t;
+
+/**
+ * One command, validated and resolved to fds.
+ */
+typedef struct {
+    xpc_control_op_t op;
+    xpc_topo_endpoint_t *in;
+    int in_chn;
+    xpc_topo_endpoint_t *out;
+    int out_chn;
+    uint32_t flags;
+    // 0 for the default weight.
+    int weight;
+    xpc_limit_conf_t limit;
+} xpc_control_cmd_t;
+
+/**
+ * A reply being written, which is cut short once it is full.
+ */
+typedef struct {
+    char *buf;
+    int len;
+    int max;
+    bool full;
+} xpc_control_reply_t;
+
+static void reply_printf(xpc_control_reply_t *r, const char *fmt, ...) {
+    // room is kept for the "...\n" marking a cut.
+    int room = r->max - r->len - 4;
+    if(r->full || room <= 0) {
+        r->full = true;
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->buf + r->len, room, fmt, ap);
+    va_end(ap);
+    if(n >= room) {
+        // drop the partial line.
+        r->buf[r->len] = '\0';
+        r->full = true;
+        strcpy(r->buf + r->len, "...\n");
+        r->len += 4;
+        return;
+    }
+    r->len += n;
+}
+
+/**
+ * Resolve "name:channel" to an opened endpoint which can be used in the
+ * given direction.
+ * @return NULL on success, or the reason it is not valid.
+ */
+static const char *parse_end(
+        xpc_control_t *self, char *tok, int mode,
+        xpc_topo_endpoint_t **ep, int *chn) {
+    char *colon = strrchr(tok, ':');
+    if(colon == NULL) {
+        return "expected name:channel";
+    }
+    *colon = '\0';
+    *ep = xpc_topology_find(self->topo, tok);
+    if(*ep == NULL || (*ep)->fd == -1) {
+        return "unknown endpoint";
+    }
+    if(!((*ep)->mode & mode)) {
+        return "endpoint cannot be used in this direction";
+    }
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(colon + 1, &end, 0);
+    // channel 0 is reserved for negotiation.
+    if(errno != 0 || end == colon + 1 || *end != '\0' || v <= 0 || v > UINT16_MAX) {
+        return "bad channel";
+    }
+    *chn = (int)v;
+    return NULL;
+}
+
+/**
+ * Parse one line of commands.
+ * @return NULL on success, or the reason it is not valid.
+ */
+static const char *parse_cmd(
+        xpc_control_t *self, char *line, xpc_control_cmd_t *cmd) {
+    char *tok[12] = {NULL};
+    int ntok = 0;
+    int status = 0;
+    char *save = NULL;
+    for(char *t = strtok_r(line, " \t\r", &save); t != NULL;
+            t = strtok_r(NULL, " \t\r", &save)) {
+        if(ntok == sizeof(tok) / sizeof(tok[0])) {
+            return "too many arguments";
+        }
+        tok[ntok++] = t;
+    }
+    memset(cmd, 0, sizeof(*cmd));
+    if(!strcmp(tok[0], "list") && ntok == 1) {
+        cmd->op = XPC_CONTROL_LIST;
+        return NULL;
+    }
+    if(!strcmp(tok[0], "unroute") && ntok == 2) {
+        cmd->op = XPC_CONTROL_UNROUTE;
+        return parse_end(self, tok[1], XPC_TOPO_MODE_RD, &cmd->in, &cmd->in_chn);
+    }
+    if(strcmp(tok[0], "route") != 0 || ntok < 3) {
+        return "unknown command";
+    }
+    cmd->op = XPC_CONTROL_ROUTE;
+    int i = 1;
+    const char *err = parse_end(
+        self, tok[i++], XPC_TOPO_MODE_RD, &cmd->in, &cmd->in_chn
+    );
+    if(err != NULL) {
+        return err;
+    }
+    if(!strcmp(tok[i], "->")) {
+        i++;
+    }
+    if(i >= ntok) {
+        return "route needs a destination";
+    }
+    err = parse_end(self, tok[i++], XPC_TOPO_MODE_WR, &cmd->out, &cmd->out_chn);
+    if(err != NULL) {
+        return err;
+    }
+    for(; i < ntok; i++) {
+        if(!strcmp(tok[i], "no_coalesce")) {
+            cmd->flags |= XPC_ROUTE_NO_COALESCE;
+        }
+        else if(!strcmp(tok[i], "cut_through")) {
+            cmd->flags |= XPC_ROUTE_CUT_THROUGH;
+        }
+        else if(!strncmp(tok[i], "weight=", 7)) {
+            char *end = NULL;
+            errno = 0;
+            long v = strtol(tok[i] + 7, &end, 0);
+            if(errno != 0 || end == tok[i] + 7 || *end != '\0'
+                    || v <= 0 || v > INT16_MAX) {
+                return "bad route weight";
+            }
+            cmd->weight = (int)v;
+        }
+        else if((status = xpc_limit_parse_flag(&cmd->limit, tok[i])) != 1) {
+            if(status != 0) {
+                return "bad route limit";
+            }
+        }
+        else {
+            return "unknown route flag";
+        }
+    }
+    if(cmd->limit.burst > 0 && cmd->limit.rate == 0) {
+        return "burst needs a rate";
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a route exists once the commands before cmds[n] are applied.
+ */
+static bool route_exists(
+        xpc_control_t *self, xpc_control_cmd_t *cmds, int n, int fd, int chn) {
+    xpc_switch_tbl_entry_t key = {.fd = fd, .to_chn = chn};
+    bool exists = hashmap_fetch(self->router->switch_tbl, *(void**)&key) != NULL;
+    for(int i = 0; i < n; i++) {
+        if(cmds[i].op != XPC_CONTROL_LIST
+                && cmds[i].in->fd == fd && cmds[i].in_chn == chn) {
+            exists = cmds[i].op == XPC_CONTROL_ROUTE;
+        }
+    }
+    return exists;
+}
+
+static const char *endpoint_name(xpc_control_t *self, int fd, char *tmp) {
+    for(int i = 0; i < array_size(self->topo->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->topo->endpoints, i);
+        if(ep->fd == fd) {
+            return ep->name;
+        }
+    }
+    sprintf(tmp, "fd%d", fd);
+    return tmp;
+}
+
+static void list_routes(xpc_control_t *self, xpc_control_reply_t *reply) {
+    char in_tmp[16], out_tmp[16];
+    iter_context *it = create_hashmap_keys_iterator(self->router->switch_tbl);
+    for(xpc_switch_tbl_entry_t *k = iter_next(it); k != NULL; k = iter_next(it)) {
+        xpc_route_t *route = hashmap_fetch(self->router->switch_tbl, *(void**)k);
+        uint64_t drops = 0;
+        for(int i = 0; i < XPC_DROP_NREASONS; i++) {
+            drops += route->stats.drops[i];
+        }
+        char weight[24] = "";
+        if(route->sched_weight > 0) {
+            sprintf(weight, " weight=%d", route->sched_weight);
+        }
+        reply_printf(
+            reply, "%s:%d -> %s:%d%s%s%s msgs=%llu bytes=%llu drops=%llu\n",
+            endpoint_name(self, k->fd, in_tmp), k->to_chn,
+            endpoint_name(self, route->dst.fd, out_tmp), route->dst.to_chn,
+            (route->flags & XPC_ROUTE_NO_COALESCE) ? " no_coalesce":"",
+            (route->flags & XPC_ROUTE_CUT_THROUGH) ? " cut_through":"",
+            weight,
+            (unsigned long long)route->stats.msgs,
+            (unsigned long long)route->stats.bytes,
+            (unsigned long long)drops
+        );
+    }
+    iter_free(it);
+}
+
+/**
+ * Add or redirect a route. Contexts the route creates are set up like the
+ * ones built from the topology, and a new input is watched.
+ */
+static int apply_route(xpc_control_t *self, xpc_control_cmd_t *cmd) {
+    xpc_router_t *r = self->router;
+    int ifd = cmd->in->fd;
+    int ofd = cmd->out->fd;
+    bool new_in = hashmap_fetch(r->in_contexts, ifd) == NULL;
+    bool new_out = hashmap_fetch(r->out_contexts, ofd) == NULL;
+    bool in_known = !new_in || hashmap_fetch(r->out_contexts, ifd) != NULL;
+    bool out_known = !new_out || hashmap_fetch(r->in_contexts, ofd) != NULL;
+    if(xpc_set_route(r, ifd, ofd, cmd->in_chn, cmd->out_chn) != 0
+            || xpc_set_route_flags(r, ifd, cmd->in_chn, cmd->flags) != 0
+            || xpc_sched_set_route_weight(r, ifd, cmd->in_chn, cmd->weight) != 0
+            || xpc_set_route_limit(r, ifd, cmd->in_chn, &cmd->limit) != 0) {
+        return -1;
+    }
+    // a peer which already negotiated its byte order keeps it.
+    if(!in_known) {
+        xpc_set_endianness(r, ifd, cmd->in->big_endian);
+    }
+    if(!out_known && ofd != ifd) {
+        xpc_set_endianness(r, ofd, cmd->out->big_endian);
+    }
+    if(new_out && (xpc_reserve_output(
+                r, ofd, cmd->out->queue_msgs, cmd->out->queue_msg_size) != 0
+            || xpc_set_coalescing(
+                r, ofd, cmd->out->coalesce_bytes, cmd->out->coalesce_us) != 0
+            || xpc_set_credit_window(r, ofd, cmd->out->credit_window) != 0)) {
+        return -1;
+    }
+    if(new_out && cmd->out->spill_path[0] != '\0' && xpc_spill_enable(
+            r, ofd, cmd->out->spill_path, (int64_t)cmd->out->spill_mem_kb << 10,
+            (uint32_t)cmd->out->spill_segment_kb << 10,
+            cmd->out->spill_segments) != 0) {
+        return -1;
+    }
+    if(new_out && cmd->out->kind == XPC_TOPO_FILE
+            && xpc_sink_enable(r, ofd, cmd->out->path, &cmd->out->sink) != 0) {
+        return -1;
+    }
+    if(new_in && cmd->in->sched_weight > 0
+            && xpc_sched_set_fd_weight(r, ifd, cmd->in->sched_weight) != 0) {
+        return -1;
+    }
+    if(new_out && cmd->out->sched_weight > 0
+            && xpc_sched_set_fd_weight(r, ofd, cmd->out->sched_weight) != 0) {
+        return -1;
+    }
+    if(new_in && cmd->in->compress && xpc_compress_allow(r, ifd, true) != 0) {
+        return -1;
+    }
+    if(new_in && r->io_watch_fd_cb != NULL) {
+        return r->io_watch_fd_cb(r->io_event_context, ifd);
+    }
+    return 0;
+}
+
+int xpc_control_exec(xpc_control_t *self, char *cmds, char *reply, int max) {
+    xpc_control_cmd_t parsed[XPC_CONTROL_MAX_CMDS];
+    xpc_control_reply_t out = {.buf = reply, .len = 0, .max = max, .full = false};
+    const char *err = NULL;
+    int n = 0;
+    int line = 0;
+    char *save = NULL;
+    reply[0] = '\0';
+
+    // everything is checked before anything is applied.
+    for(char *l = strtok_r(cmds, "\n", &save); l != NULL && err == NULL;
+            l = strtok_r(NULL, "\n", &save)) {
+        line++;
+        if(strspn(l, " \t\r") == strlen(l) || l[strspn(l, " \t\r")] == '#') {
+            continue;
+        }
+        if(n == XPC_CONTROL_MAX_CMDS) {
+            err = "too many commands";
+            break;
+        }
+        err = parse_cmd(self, l, &parsed[n]);
+        if(err == NULL && parsed[n].op == XPC_CONTROL_UNROUTE
+                && !route_exists(
+                    self, parsed, n, parsed[n].in->fd, parsed[n].in_chn)) {
+            err = "no such route";
+        }
+        n++;
+    }
+    if(err != NULL) {
+        reply_printf(&out, "error: line %d: %s\n", line, err);
+        return -1;
+    }
+
+    reply_printf(&out, "ok\n");
+    for(int i = 0; i < n; i++) {
+        xpc_control_cmd_t *cmd = &parsed[i];
+        int status = 0;
+        if(cmd->op == XPC_CONTROL_ROUTE) {
+            status = apply_route(self, cmd);
+        }
+        else if(cmd->op == XPC_CONTROL_UNROUTE) {
+            status = xpc_remove_route(self->router, cmd->in->fd, cmd->in_chn);
+        }
+        else {
+            list_routes(self, &out);
+        }
+        if(status != 0) {
+            // only memory running out gets here, after validation. What
+            // was applied stays, see xpc_control_exec.
+            out.len = 0;
+            out.full = false;
+            reply_printf(
+                &out, "error: out of memory after %d commands\n", i
+            );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+xpc_control_t *create_xpc_control(
+        xpc_router_t *router, xpc_topology_t *topo, const char *path) {
+    xpc_control_t *r = NULL;
+    if(strlen(path) >= XPC_TOPO_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        goto done;
+    }
+    r = malloc(sizeof(xpc_control_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->router = router;
+    r->topo = topo;
+    strcpy(r->path, path);
+    r->conns = create_array(4, sizeof(int));
+    if(r->conns == NULL) {
+        goto bad_conns;
+    }
+    r->lfd = xpc_listen_seqpacket(path);
+    if(r->lfd == -1) {
+        goto bad_listen;
+    }
+    if(router->io_watch_fd_cb != NULL
+            && router->io_watch_fd_cb(router->io_event_context, r->lfd) != 0) {
+        goto bad_watch;
+    }
+    goto done;
+
+bad_watch:
+    close(r->lfd);
+    unlink(path);
+bad_listen:
+    array_free(r->conns);
+bad_conns:
+    free(r);
+    r = NULL;
+done:
+    return r;
+}
+
+bool xpc_control_owns(xpc_control_t *self, int fd) {
+    if(fd == self->lfd) {
+        return true;
+    }
+    for(int i = 0; i < array_size(self->conns); i++) {
+        if(*(int *)array_fetch(self->conns, i) == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void control_close(xpc_control_t *self, int fd) {
+    for(int i = 0; i < array_size(self->conns); i++) {
+        if(*(int *)array_fetch(self->conns, i) == fd) {
+            array_remove(self->conns, i);
+            break;
+        }
+    }
+    if(self->router->io_forget_fd_cb != NULL) {
+        self->router->io_forget_fd_cb(self->router->io_event_context, fd);
+    }
+    close(fd);
+}
+
+static void control_accept(xpc_control_t *self) {
+    xpc_router_t *router = self->router;
+    while(true) {
+        int cfd = accept4(self->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(cfd == -1) {
+            if(errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // elements no larger than a pointer are passed by value.
+        if(array_append(self->conns, cfd) != 0) {
+            close(cfd);
+            continue;
+        }
+        if(router->io_watch_fd_cb != NULL
+                && router->io_watch_fd_cb(router->io_event_context, cfd) != 0) {
+            array_remove(self->conns, array_size(self->conns) - 1);
+            close(cfd);
+        }
+    }
+}
+
+int xpc_control_recv(xpc_control_t *self, int fd) {
+    if(fd == self->lfd) {
+        control_accept(self);
+        return 0;
+    }
+    int n = recv(fd, self->cmds, XPC_CONTROL_CMD_MAX + 1, MSG_DONTWAIT);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if(n <= 0) {
+        // the controller hung up.
+        control_close(self, fd);
+        return 0;
+    }
+    if(n > XPC_CONTROL_CMD_MAX) {
+        strcpy(self->reply, "error: commands too long\n");
+    }
+    else {
+        self->cmds[n] = '\0';
+        xpc_control_exec(self, self->cmds, self->reply, XPC_CONTROL_REPLY_MAX);
+    }
+    // a controller which does not read its replies is dropped.
+    if(send(fd, self->reply, strlen(self->reply), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        control_close(self, fd);
+    }
+    return n;
+}
+
+void xpc_control_free(xpc_control_t *self) {
+    if(self != NULL) {
+        while(array_size(self->conns) > 0) {
+            control_close(self, *(int *)array_fetch(self->conns, 0));
+        }
+        array_free(self->conns);
+        if(self->router->io_forget_fd_cb != NULL) {
+            self->router->io_forget_fd_cb(self->router->io_event_context, self->lfd);
+        }
+        close(self->lfd);
+        unlink(self->path);
+        free(self);
+    }
+}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <tinyxpc/tinyxpc.h>
+#include <alibc/containers/dynabuf.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_credit.h>
+
+/**
+ * A grant waiting to be sent.
+ */
+typedef struct {
+    int fd;
+    int chn;
+    uint32_t bytes;
+} xpc_credit_grant_t;
+
+static void put_field(uint8_t *dst, int len, uint32_t v, bool big_endian) {
+    for(int i = 0; i < len; i++) {
+        int shift = 8 * (big_endian ? (len - 1 - i):i);
+        dst[i] = (v >> shift) & 0xff;
+    }
+}
+
+static uint32_t get_field(const uint8_t *src, int len, bool big_endian) {
+    uint32_t v = 0;
+    for(int i = 0; i < len; i++) {
+        int shift = 8 * (big_endian ? (len - 1 - i):i);
+        v |= (uint32_t)src[i] << shift;
+    }
+    return v;
+}
+
+int xpc_credit_enable(xpc_router_t *ctx, int fd, bool enable) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    // clients are pushed back on by their sockets.
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_STREAM) {
+        return -1;
+    }
+    if(in_ctx->credit_flow == enable) {
+        return 0;
+    }
+    if(enable && xpc_add_output(ctx, fd) == NULL) {
+        return -1;
+    }
+    in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    in_ctx->credit_flow = enable;
+    ctx->credit_inputs += enable ? 1:-1;
+    // the sender starts over without any credit.
+    for(int i = 0; i < array_size(ctx->route_keys); i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        if(k->fd == fd) {
+            xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)k);
+            route->credit = 0;
+        }
+    }
+    return 0;
+}
+
+int xpc_set_credit_window(xpc_router_t *ctx, int ofd, int bytes) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL || bytes <= 0) {
+        return -1;
+    }
+    out_ctx->credit_window = bytes;
+    return 0;
+}
+
+bool xpc_credit_take(xpc_router_t *ctx, xpc_route_t *route, int len) {
+    if(route->credit < len) {
+        return false;
+    }
+    route->credit -= len;
+    return true;
+}
+
+/**
+ * Queue one message with the grants for a sender.
+ * @return 0 on success, -1 if no buffer was available, the credit is
+ * granted again later.
+ */
+static int xpc_credit_send(
+        xpc_router_t *ctx, xpc_credit_grant_t *grants, int n) {
+    int fd = grants[0].fd;
+    msg_buf_t *msg_buf = xpc_neg_getbuf(
+        ctx, fd, XPC_NEG_TYPE_CREDIT, n * XPC_CREDIT_GRANT_SIZE
+    );
+    if(msg_buf == NULL) {
+        return -1;
+    }
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    bool be = out_ctx->codec->big_endian;
+    uint8_t *wire = (uint8_t *)msg_buf->buf->buf + sizeof(txpc_hdr_t);
+    for(int i = 0; i < n; i++) {
+        put_field(wire, 2, grants[i].chn, be);
+        put_field(wire + 2, 4, grants[i].bytes, be);
+        wire += XPC_CREDIT_GRANT_SIZE;
+    }
+    xpc_neg_finalize(ctx, fd, msg_buf);
+    return 0;
+}
+
+static int xpc_credit_grant_cmp(const void *a, const void *b) {
+    const xpc_credit_grant_t *ga = a;
+    const xpc_credit_grant_t *gb = b;
+    return (ga->fd > gb->fd) - (ga->fd < gb->fd);
+}
+
+/**
+ * Get the route of a switch table key, and its output, if its sender uses
+ * credits.
+ * @return the route, or NULL if it is not subject to credits.
+ */
+static xpc_route_t *xpc_credit_route(
+        xpc_router_t *ctx, xpc_switch_tbl_entry_t *k, xpc_out_ctx_t **out_ctx) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, k->fd);
+    if(in_ctx == NULL || !in_ctx->credit_flow) {
+        return NULL;
+    }
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)k);
+    *out_ctx = hashmap_fetch(ctx->out_contexts, route->dst.fd);
+    return (*out_ctx == NULL) ? NULL:route;
+}
+
+/**
+ * Count the credit routes sharing each window, and the credit outstanding
+ * toward it.
+ */
+static void xpc_credit_count(xpc_router_t *ctx) {
+    xpc_out_ctx_t *out_ctx = NULL;
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        out_ctx = hashmap_fetch(
+            ctx->out_contexts, *(int *)array_fetch(ctx->out_fds, i)
+        );
+        out_ctx->credit_routes = 0;
+        out_ctx->credit_outstanding = 0;
+    }
+    for(int i = 0; i < array_size(ctx->route_keys); i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        xpc_route_t *route = xpc_credit_route(ctx, k, &out_ctx);
+        if(route != NULL) {
+            out_ctx->credit_routes++;
+            out_ctx->credit_outstanding += route->credit;
+        }
+    }
+}
+
+/**
+ * Top up the routes which used half of their share, as far as the windows
+ * allow.
+ * @return the number of grants, in ctx->credit_grants.
+ */
+static int xpc_credit_collect(xpc_router_t *ctx) {
+    int n = 0;
+    xpc_out_ctx_t *out_ctx = NULL;
+    for(int i = 0; i < array_size(ctx->route_keys); i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        xpc_route_t *route = xpc_credit_route(ctx, k, &out_ctx);
+        if(route == NULL) {
+            continue;
+        }
+        int64_t share = out_ctx->credit_window / out_ctx->credit_routes;
+        int64_t room = out_ctx->credit_window - out_ctx->msg_queue->queued_bytes
+            - out_ctx->stage_len - out_ctx->credit_outstanding;
+        if(route->credit >= share / 2 || room <= 0) {
+            continue;
+        }
+        if(ctx->credit_grants->capacity <= n && dynabuf_resize(
+                ctx->credit_grants, 2 * ctx->credit_grants->capacity) != 0) {
+            break;
+        }
+        int64_t grant = share - route->credit;
+        grant = (grant < room) ? grant:room;
+        xpc_credit_grant_t *g = (xpc_credit_grant_t *)ctx->credit_grants->buf + n;
+        g->fd = k->fd;
+        g->chn = k->to_chn;
+        g->bytes = grant;
+        n++;
+        route->credit += grant;
+        out_ctx->credit_outstanding += grant;
+    }
+    return n;
+}
+
+int xpc_credit_poll(xpc_router_t *ctx) {
+    int sent = 0;
+    if(ctx->credit_inputs == 0) {
+        goto done;
+    }
+    if(ctx->credit_grants == NULL) {
+        ctx->credit_grants = create_dynabuf(16, sizeof(xpc_credit_grant_t));
+        if(ctx->credit_grants == NULL) {
+            goto done;
+        }
+    }
+    xpc_credit_count(ctx);
+    int n = xpc_credit_collect(ctx);
+
+    // one message per sender.
+    xpc_credit_grant_t *grants = ctx->credit_grants->buf;
+    qsort(grants, n, sizeof(xpc_credit_grant_t), xpc_credit_grant_cmp);
+    for(int i = 0; i < n;) {
+        int j = i + 1;
+        while(j < n && grants[j].fd == grants[i].fd) {
+            j++;
+        }
+        if(xpc_credit_send(ctx, grants + i, j - i) == 0) {
+            sent++;
+        }
+        else {
+            // take the grants back, they are made again on the next poll.
+            for(int g = i; g < j; g++) {
+                xpc_switch_tbl_entry_t key = {
+                    .fd = grants[g].fd, .to_chn = grants[g].chn
+                };
+                xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+                route->credit -= grants[g].bytes;
+            }
+        }
+        i = j;
+    }
+done:
+    return sent;
+}
+
+int xpc_credit_decode(
+        const uint8_t *payload, int len, bool big_endian,
+        uint16_t *chns, uint32_t *bytes, int max) {
+    int n = 0;
+    for(; n < max && (n + 1) * XPC_CREDIT_GRANT_SIZE <= len; n++) {
+        const uint8_t *g = payload + n * XPC_CREDIT_GRANT_SIZE;
+        chns[n] = get_field(g, 2, big_endian);
+        bytes[n] = get_field(g + 2, 4, big_endian);
+    }
+    return n;
+}
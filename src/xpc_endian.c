@@ -0,0 +1,79 @@
+#include <string.h>
+#include <xpc_endian.h>
+#include <tinyxpc/tinyxpc.h>
+
+// The width of each header field is a compile time constant, so only one arm
+// of this survives optimization.
+#define XPC_BSWAP_FIELD(f) do {                         \
+    if(sizeof(f) == 2) (f) = __builtin_bswap16(f);      \
+    else if(sizeof(f) == 4) (f) = __builtin_bswap32(f); \
+    else if(sizeof(f) == 8) (f) = __builtin_bswap64(f); \
+} while(0)
+
+static void xpc_hdr_decode_native(txpc_hdr_t *dst, const void *wire) {
+    memcpy(dst, wire, sizeof(txpc_hdr_t));
+}
+
+static void xpc_hdr_encode_native(void *wire, const txpc_hdr_t *src) {
+    memcpy(wire, src, sizeof(txpc_hdr_t));
+}
+
+static void xpc_hdr_decode_swapped(txpc_hdr_t *dst, const void *wire) {
+    memcpy(dst, wire, sizeof(txpc_hdr_t));
+    XPC_BSWAP_FIELD(dst->to);
+    XPC_BSWAP_FIELD(dst->from);
+    XPC_BSWAP_FIELD(dst->type);
+    XPC_BSWAP_FIELD(dst->size);
+}
+
+static void xpc_hdr_encode_swapped(void *wire, const txpc_hdr_t *src) {
+    txpc_hdr_t tmp = *src;
+    XPC_BSWAP_FIELD(tmp.to);
+    XPC_BSWAP_FIELD(tmp.from);
+    XPC_BSWAP_FIELD(tmp.type);
+    XPC_BSWAP_FIELD(tmp.size);
+    memcpy(wire, &tmp, sizeof(txpc_hdr_t));
+}
+
+#if XPC_HOST_BIG_ENDIAN
+const xpc_hdr_codec_t xpc_hdr_codec_le = {
+    false, xpc_hdr_decode_swapped, xpc_hdr_encode_swapped
+};
+const xpc_hdr_codec_t xpc_hdr_codec_be = {
+    true, xpc_hdr_decode_native, xpc_hdr_encode_native
+};
+#else
+const xpc_hdr_codec_t xpc_hdr_codec_le = {
+    false, xpc_hdr_decode_native, xpc_hdr_encode_native
+};
+const xpc_hdr_codec_t xpc_hdr_codec_be = {
+    true, xpc_hdr_decode_swapped, xpc_hdr_encode_swapped
+};
+#endif
+
+const xpc_hdr_codec_t *xpc_hdr_codec_select(bool big_endian) {
+    return big_endian ? &xpc_hdr_codec_be:&xpc_hdr_codec_le;
+}
+
+static bool is_endianness_neg(const txpc_hdr_t *hdr) {
+    return hdr->to == 0 && hdr->from == 0
+        && hdr->type == TXPC_NEG_TYPE_ENDIANNESS;
+}
+
+const xpc_hdr_codec_t *xpc_hdr_codec_detect(
+    const void *wire, const xpc_hdr_codec_t *current) {
+    const xpc_hdr_codec_t *r = current;
+    txpc_hdr_t hdr;
+    current->decode(&hdr, wire);
+    if(is_endianness_neg(&hdr)) {
+        goto done;
+    }
+    // try the opposite byte order before giving up.
+    r = xpc_hdr_codec_select(!current->big_endian);
+    r->decode(&hdr, wire);
+    if(!is_endianness_neg(&hdr)) {
+        r = NULL;
+    }
+done:
+    return r;
+}
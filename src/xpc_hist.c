@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include <xpc_hist.h>
+
+xpc_hist_t *create_xpc_hist() {
+    return calloc(1, sizeof(xpc_hist_t));
+}
+
+void xpc_hist_reset(xpc_hist_t *self) {
+    memset(self, 0, sizeof(xpc_hist_t));
+}
+
+void xpc_hist_merge(xpc_hist_t *self, const xpc_hist_t *other) {
+    if(other->count == 0) {
+        return;
+    }
+    for(int i = 0; i < XPC_HIST_BUCKETS; i++) {
+        self->buckets[i] += other->buckets[i];
+    }
+    if(self->count == 0 || other->min < self->min) {
+        self->min = other->min;
+    }
+    if(other->max > self->max) {
+        self->max = other->max;
+    }
+    self->count += other->count;
+}
+
+/**
+ * Smallest value in a bucket.
+ */
+static uint64_t xpc_hist_lowest(int bucket) {
+    if(bucket < (1 << XPC_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> XPC_HIST_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << XPC_HIST_SUB_BITS) - 1);
+    return ((1ull << XPC_HIST_SUB_BITS) + sub) << shift;
+}
+
+uint64_t xpc_hist_highest_equivalent(uint64_t v) {
+    int bucket = xpc_hist_bucket(v);
+    if(bucket == XPC_HIST_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+    return xpc_hist_lowest(bucket + 1) - 1;
+}
+
+uint64_t xpc_hist_percentile(const xpc_hist_t *self, double percentile) {
+    if(self->count == 0) {
+        return 0;
+    }
+    // the rank of the value wanted, at least the first one.
+    uint64_t rank = (uint64_t)((percentile / 100.0) * self->count + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < XPC_HIST_BUCKETS; i++) {
+        seen += self->buckets[i];
+        if(seen >= rank) {
+            uint64_t v = xpc_hist_highest_equivalent(xpc_hist_lowest(i));
+            return (v < self->max) ? v:self->max;
+        }
+    }
+    return self->max;
+}
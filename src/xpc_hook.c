@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <alibc/containers/dynabuf.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_capture.h>
+#include <xpc_hook.h>
+
+struct xpc_hook {
+    const xpc_hook_def_t *def;
+    void *state;
+    // the shared object it was loaded from, NULL if it is linked in.
+    void *dl;
+    xpc_hook_stats_t stats;
+};
+
+xpc_hook_t *xpc_hook_create(const xpc_hook_def_t *def, const char *arg) {
+    xpc_hook_t *r = NULL;
+    if(def == NULL || def->abi != XPC_HOOK_ABI || def->fn == NULL) {
+        errno = EINVAL;
+        goto done;
+    }
+    r = calloc(1, sizeof(xpc_hook_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->def = def;
+    if(def->init != NULL && def->init(arg, &r->state) != 0) {
+        free(r);
+        r = NULL;
+        errno = EINVAL;
+    }
+done:
+    return r;
+}
+
+xpc_hook_t *xpc_hook_load(const char *path, const char *symbol, const char *arg) {
+    xpc_hook_t *r = NULL;
+    const char *name = (path != NULL) ? path:"program";
+    void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(dl == NULL) {
+        fprintf(stderr, "hook: %s\n", dlerror());
+        goto done;
+    }
+    const xpc_hook_def_t *def = dlsym(dl, symbol);
+    if(def == NULL) {
+        fprintf(stderr, "hook: %s has no %s\n", name, symbol);
+        goto bad_dl;
+    }
+    if(def->abi != XPC_HOOK_ABI) {
+        fprintf(stderr, "hook: %s of %s is version %u, not %d\n",
+            symbol, name, def->abi, XPC_HOOK_ABI);
+        goto bad_dl;
+    }
+    r = xpc_hook_create(def, arg);
+    if(r == NULL) {
+        fprintf(stderr, "hook: %s of %s failed to start\n", symbol, name);
+        goto bad_dl;
+    }
+    r->dl = dl;
+    goto done;
+
+bad_dl:
+    dlclose(dl);
+done:
+    return r;
+}
+
+void xpc_hook_free(xpc_hook_t *self) {
+    if(self != NULL) {
+        if(self->def->fini != NULL) {
+            self->def->fini(self->state);
+        }
+        if(self->dl != NULL) {
+            dlclose(self->dl);
+        }
+        free(self);
+    }
+}
+
+int xpc_set_route_hook(xpc_router_t *ctx, int ifd, int ito, xpc_hook_t *hook) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL) {
+        return -1;
+    }
+    if(route->hook != hook) {
+        xpc_hook_free(route->hook);
+    }
+    route->hook = hook;
+    return 0;
+}
+
+int xpc_hook_get_stats(
+        xpc_router_t *ctx, int ifd, int ito, xpc_hook_stats_t *stats) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL || route->hook == NULL) {
+        return -1;
+    }
+    *stats = route->hook->stats;
+    return 0;
+}
+
+/**
+ * Queue a copy of a message to a destination off the output of its route.
+ */
+static void xpc_hook_copy(
+        xpc_router_t *ctx, xpc_hook_t *self, const msg_buf_t *msg_buf,
+        txpc_hdr_t hdr, xpc_switch_tbl_entry_t dst) {
+    int len = sizeof(txpc_hdr_t) + hdr.size;
+    msg_buf_t *copy = NULL;
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, dst.fd);
+    if(out_ctx != NULL && !out_ctx->retired) {
+        copy = xpc_msg_getbuf(out_ctx->msg_queue, -1);
+    }
+    if(copy != NULL && copy->buf->capacity < len
+            && dynabuf_resize(copy->buf, len) != 0) {
+        xpc_msg_clear(out_ctx->msg_queue, copy->buf_id);
+        copy = NULL;
+    }
+    if(copy == NULL) {
+        self->stats.copies_dropped++;
+        return;
+    }
+    hdr.to = dst.to_chn;
+    out_ctx->codec->encode(copy->buf->buf, &hdr);
+    memcpy(
+        (uint8_t *)copy->buf->buf + sizeof(txpc_hdr_t),
+        (const uint8_t *)msg_buf->buf->buf + sizeof(txpc_hdr_t), hdr.size
+    );
+    copy->size = len;
+    copy->flags = msg_buf->flags;
+    copy->ingress_ns = msg_buf->ingress_ns;
+    copy->src_fd = msg_buf->src_fd;
+    copy->src_chn = msg_buf->src_chn;
+    if(ctx->capture != NULL) {
+        xpc_capture_msg(
+            ctx, copy, dst.fd, dst.to_chn, out_ctx->codec->big_endian
+        );
+    }
+    xpc_msg_finalize(out_ctx->msg_queue, copy->buf_id);
+    self->stats.copies++;
+    xpc_output_ready(ctx, dst.fd, out_ctx);
+}
+
+bool xpc_hook_run(
+        xpc_router_t *ctx, xpc_route_t *route, xpc_out_ctx_t *out_ctx,
+        msg_buf_t *msg_buf, int *out_chn) {
+    xpc_hook_t *self = route->hook;
+    xpc_hook_msg_t msg;
+    out_ctx->codec->decode(&msg.hdr, msg_buf->buf->buf);
+    uint32_t size = msg.hdr.size;
+    msg.payload = (uint8_t *)msg_buf->buf->buf + sizeof(txpc_hdr_t);
+    msg.in_fd = msg_buf->src_fd;
+    msg.in_chn = msg_buf->src_chn;
+    msg.route = route->dst;
+    msg.ndst = 0;
+    *out_chn = route->dst.to_chn;
+
+    xpc_hook_verdict_t verdict = self->def->fn(self->state, &msg);
+    if(verdict < 0 || verdict >= XPC_HOOK_NVERDICTS) {
+        // an unknown verdict changes nothing.
+        verdict = XPC_HOOK_PASS;
+    }
+    self->stats.verdicts[verdict]++;
+    if(verdict == XPC_HOOK_PASS) {
+        return true;
+    }
+    if(verdict == XPC_HOOK_DROP) {
+        xpc_count_drop(ctx, msg_buf->src_fd, msg_buf->src_chn, XPC_DROP_FILTERED);
+        route->stats.drops[XPC_DROP_FILTERED]++;
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        return false;
+    }
+    if(msg.hdr.size > size) {
+        msg.hdr.size = size;
+    }
+    msg_buf->size = sizeof(txpc_hdr_t) + msg.hdr.size;
+
+    // the buffer stays on the route, unless it is redirected off its output.
+    bool keep = verdict != XPC_HOOK_REDIRECT;
+    int ndst = (msg.ndst < XPC_HOOK_MAX_DST) ? msg.ndst:XPC_HOOK_MAX_DST;
+    ndst = (verdict == XPC_HOOK_REWRITE || ndst < 0) ? 0:ndst;
+    if(keep) {
+        *out_chn = msg.hdr.to;
+    }
+    for(int i = 0; i < ndst; i++) {
+        if(!keep && msg.dst[i].fd == route->dst.fd) {
+            keep = true;
+            *out_chn = msg.dst[i].to_chn;
+        }
+        else {
+            xpc_hook_copy(ctx, self, msg_buf, msg.hdr, msg.dst[i]);
+        }
+    }
+    if(!keep) {
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        return false;
+    }
+    msg.hdr.to = *out_chn;
+    out_ctx->codec->encode(msg_buf->buf->buf, &msg.hdr);
+    return true;
+}
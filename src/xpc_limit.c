@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_limit.h>
+
+// tokens are kept in billionths, so refilling takes no division.
+#define XPC_LIMIT_SCALE 1000000000ull
+
+struct xpc_limit {
+    xpc_limit_conf_t conf;
+    uint64_t tokens;
+    uint64_t depth;
+    // time an empty bucket takes to fill.
+    uint64_t fill_ns;
+    uint64_t last_ns;
+    // messages since the last one sampling kept.
+    uint32_t skipped;
+    xpc_limit_stats_t stats;
+};
+
+static bool xpc_limit_none(const xpc_limit_conf_t *conf) {
+    return conf == NULL || (conf->rate == 0 && conf->sample <= 1);
+}
+
+int xpc_set_route_limit(
+        xpc_router_t *ctx, int ifd, int ito, const xpc_limit_conf_t *conf) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    xpc_limit_t *r = NULL;
+    if(route == NULL || (conf != NULL && conf->burst > 0 && conf->rate == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(xpc_limit_none(conf)) {
+        xpc_limit_free(route->limit);
+        route->limit = NULL;
+        return 0;
+    }
+    const xpc_limit_conf_t *old = (route->limit != NULL) ? &route->limit->conf:NULL;
+    if(old != NULL && old->rate == conf->rate && old->bytes == conf->bytes
+            && old->burst == conf->burst && old->sample == conf->sample) {
+        return 0;
+    }
+    r = calloc(1, sizeof(xpc_limit_t));
+    if(r == NULL) {
+        return -1;
+    }
+    r->conf = *conf;
+    if(conf->rate > 0) {
+        r->depth = (uint64_t)((conf->burst > 0) ? conf->burst:conf->rate)
+            * XPC_LIMIT_SCALE;
+        r->tokens = r->depth;
+        r->fill_ns = r->depth / conf->rate + 1;
+        r->last_ns = xpc_monotonic_ns();
+    }
+    xpc_limit_free(route->limit);
+    route->limit = r;
+    return 0;
+}
+
+int xpc_limit_get_stats(
+        xpc_router_t *ctx, int ifd, int ito, xpc_limit_stats_t *stats) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL || route->limit == NULL) {
+        return -1;
+    }
+    *stats = route->limit->stats;
+    return 0;
+}
+
+static int parse_u32(const char *v, uint32_t *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(v, &end, 0);
+    if(errno != 0 || end == v || *end != '\0' || *v == '-' || n > UINT32_MAX) {
+        return -1;
+    }
+    *out = (uint32_t)n;
+    return 0;
+}
+
+int xpc_limit_parse_flag(xpc_limit_conf_t *conf, const char *flag) {
+    if(!strncmp(flag, "rate_msgs=", 10)) {
+        conf->bytes = false;
+        return parse_u32(flag + 10, &conf->rate);
+    }
+    if(!strncmp(flag, "rate_bytes=", 11)) {
+        conf->bytes = true;
+        return parse_u32(flag + 11, &conf->rate);
+    }
+    if(!strncmp(flag, "burst=", 6)) {
+        return parse_u32(flag + 6, &conf->burst);
+    }
+    if(!strncmp(flag, "sample=", 7)) {
+        return parse_u32(flag + 7, &conf->sample);
+    }
+    return 1;
+}
+
+bool xpc_limit_admit(
+        xpc_limit_t *self, int len, uint64_t now_ns, xpc_drop_reason_t *reason) {
+    if(self->conf.sample > 1) {
+        bool keep = self->skipped == 0;
+        self->skipped = (self->skipped + 1 < self->conf.sample) ?
+            self->skipped + 1:0;
+        if(!keep) {
+            self->stats.sampled++;
+            *reason = XPC_DROP_SAMPLED;
+            return false;
+        }
+    }
+    if(self->conf.rate > 0) {
+        uint64_t elapsed = (now_ns > self->last_ns) ? now_ns - self->last_ns:0;
+        self->last_ns = (now_ns > self->last_ns) ? now_ns:self->last_ns;
+        if(elapsed >= self->fill_ns) {
+            self->tokens = self->depth;
+        }
+        else {
+            self->tokens += elapsed * self->conf.rate;
+            self->tokens = (self->tokens < self->depth) ? self->tokens:self->depth;
+        }
+        uint64_t cost = (self->conf.bytes ? (uint64_t)len:1) * XPC_LIMIT_SCALE;
+        if(self->tokens < cost) {
+            self->stats.limited++;
+            *reason = XPC_DROP_RATE_LIMITED;
+            return false;
+        }
+        self->tokens -= cost;
+    }
+    self->stats.passed++;
+    return true;
+}
+
+void xpc_limit_free(xpc_limit_t *self) {
+    free(self);
+}
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include <xpc_lz.h>
+
+// room for the window and the longest payload after it.
+#define XPC_LZ_HIST_SIZE (XPC_LZ_WINDOW + XPC_LZ_MAX_PAYLOAD)
+
+/**
+ * Consecutive payloads which did not compress before the codec backs off,
+ * and attempts one payload out of this many until one compresses again.
+ */
+#define XPC_LZ_MISS_LIMIT 8
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t xpc_lz_hash(const uint8_t *p) {
+    return (read32(p) * 2654435761u) >> (32 - XPC_LZ_HASH_BITS);
+}
+
+xpc_lz_t *create_xpc_lz() {
+    xpc_lz_t *r = malloc(sizeof(xpc_lz_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->hist = malloc(XPC_LZ_HIST_SIZE);
+    r->out = malloc(XPC_LZ_MAX_PAYLOAD);
+    if(r->hist == NULL || r->out == NULL) {
+        xpc_lz_free(r);
+        r = NULL;
+        goto done;
+    }
+    xpc_lz_reset(r);
+    r->raw_bytes = 0;
+    r->wire_bytes = 0;
+done:
+    return r;
+}
+
+void xpc_lz_reset(xpc_lz_t *self) {
+    self->hist_len = 0;
+    memset(self->table, 0xff, sizeof(self->table));
+    self->misses = 0;
+    self->skip = 0;
+}
+
+void xpc_lz_free(xpc_lz_t *self) {
+    if(self != NULL) {
+        free(self->hist);
+        free(self->out);
+        free(self);
+    }
+}
+
+/**
+ * Make room for a payload at the end of the history, discarding all but the
+ * last XPC_LZ_WINDOW bytes if it does not fit.
+ */
+static void xpc_lz_make_room(xpc_lz_t *self, int len) {
+    if(self->hist_len + len <= XPC_LZ_HIST_SIZE) {
+        return;
+    }
+    int shift = self->hist_len - XPC_LZ_WINDOW;
+    memmove(self->hist, self->hist + shift, XPC_LZ_WINDOW);
+    self->hist_len = XPC_LZ_WINDOW;
+    for(int i = 0; i < (1 << XPC_LZ_HASH_BITS); i++) {
+        self->table[i] = (self->table[i] >= shift) ? self->table[i] - shift:-1;
+    }
+}
+
+/**
+ * Make the positions [from, to) of the history candidates for matches.
+ */
+static void xpc_lz_index(xpc_lz_t *self, int from, int to) {
+    for(int i = from; i + XPC_LZ_MIN_MATCH <= to; i++) {
+        self->table[xpc_lz_hash(self->hist + i)] = i;
+    }
+}
+
+/**
+ * Write a length which does not fit in its nibble.
+ */
+static uint8_t *put_len(uint8_t *op, int n) {
+    for(; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *ie, int *n) {
+    uint8_t b = 0;
+    do {
+        if(*ip == ie || *n > XPC_LZ_MAX_PAYLOAD) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while(b == 255);
+    return 0;
+}
+
+/**
+ * Write a sequence.
+ * @param ml the length of the match less XPC_LZ_MIN_MATCH, or -1 for the last
+ * sequence
+ * @return the end of the sequence, or NULL if it does not fit before oe.
+ */
+static uint8_t *put_seq(
+        uint8_t *op, uint8_t *oe, const uint8_t *lit, int nlit, int dist, int ml) {
+    int need = 1 + (nlit / 255 + 1) + nlit + ((ml < 0) ? 0:2 + ml / 255 + 1);
+    if(oe - op < need) {
+        return NULL;
+    }
+    uint8_t mnib = (ml < 0) ? 0:((ml < 15) ? ml:15);
+    *op++ = ((nlit < 15) ? nlit:15) << 4 | mnib;
+    if(nlit >= 15) {
+        op = put_len(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if(ml >= 0) {
+        *op++ = dist & 0xff;
+        *op++ = dist >> 8;
+        if(ml >= 15) {
+            op = put_len(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+/**
+ * Compress the end of the history, from start, into self->out.
+ * @return the compressed length, or -1 if it is not shorter than the payload.
+ */
+static int xpc_lz_encode(xpc_lz_t *self, int start) {
+    uint8_t *base = self->hist;
+    int end = self->hist_len;
+    int len = end - start;
+    uint8_t *op = self->out;
+    // it only pays off if it is shorter.
+    uint8_t *oe = self->out + len - 1;
+    int anchor = start;
+    int i = start;
+
+    for(uint32_t v = len; ; v >>= 7) {
+        *op++ = (v & 0x7f) | ((v >= 0x80) ? 0x80:0);
+        if(v < 0x80) {
+            break;
+        }
+    }
+    while(i + XPC_LZ_MIN_MATCH <= end) {
+        uint32_t h = xpc_lz_hash(base + i);
+        int cand = self->table[h];
+        self->table[h] = i;
+        if(cand < 0 || i - cand > 0xffff || read32(base + cand) != read32(base + i)) {
+            i++;
+            continue;
+        }
+        int mlen = XPC_LZ_MIN_MATCH;
+        while(i + mlen < end && base[cand + mlen] == base[i + mlen]) {
+            mlen++;
+        }
+        op = put_seq(
+            op, oe, base + anchor, i - anchor, i - cand, mlen - XPC_LZ_MIN_MATCH
+        );
+        if(op == NULL) {
+            goto bad_fit;
+        }
+        xpc_lz_index(self, i + 1, i + mlen);
+        i += mlen;
+        anchor = i;
+    }
+    op = put_seq(op, oe, base + anchor, end - anchor, 0, -1);
+    if(op == NULL) {
+        goto bad_fit;
+    }
+    return op - self->out;
+
+bad_fit:
+    // the rest of the payload is still history for the next one.
+    xpc_lz_index(self, i, end);
+    return -1;
+}
+
+int xpc_lz_compress(xpc_lz_t *self, const uint8_t *src, int len, const uint8_t **out) {
+    int r = -1;
+    self->raw_bytes += len;
+    if(len > XPC_LZ_MAX_PAYLOAD) {
+        goto done;
+    }
+    xpc_lz_make_room(self, len);
+    int start = self->hist_len;
+    memcpy(self->hist + start, src, len);
+    self->hist_len += len;
+    if(len < XPC_LZ_MIN_PAYLOAD || self->skip > 0) {
+        self->skip -= (self->skip > 0) ? 1:0;
+        xpc_lz_index(self, start, self->hist_len);
+        goto done;
+    }
+    r = xpc_lz_encode(self, start);
+    if(r < 0 && ++self->misses >= XPC_LZ_MISS_LIMIT) {
+        // stays at the limit, so the next miss backs off again.
+        self->misses = XPC_LZ_MISS_LIMIT;
+        self->skip = XPC_LZ_MISS_LIMIT - 1;
+    }
+    else if(r >= 0) {
+        self->misses = 0;
+        *out = self->out;
+    }
+done:
+    self->wire_bytes += (r < 0) ? len:r;
+    return r;
+}
+
+void xpc_lz_append(xpc_lz_t *self, const uint8_t *src, int len) {
+    self->raw_bytes += len;
+    self->wire_bytes += len;
+    if(len > XPC_LZ_MAX_PAYLOAD) {
+        return;
+    }
+    xpc_lz_make_room(self, len);
+    memcpy(self->hist + self->hist_len, src, len);
+    self->hist_len += len;
+}
+
+int xpc_lz_decompress(xpc_lz_t *self, const uint8_t *src, int len, const uint8_t **out) {
+    const uint8_t *ip = src;
+    const uint8_t *ie = src + len;
+    uint32_t raw = 0;
+    uint8_t b = 0;
+    int shift = 0;
+    do {
+        if(ip == ie || shift > 28) {
+            goto bad_payload;
+        }
+        b = *ip++;
+        raw |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while(b & 0x80);
+    if(raw > XPC_LZ_MAX_PAYLOAD) {
+        goto bad_payload;
+    }
+    xpc_lz_make_room(self, raw);
+    uint8_t *op = self->hist + self->hist_len;
+    uint8_t *oe = op + raw;
+
+    while(true) {
+        if(ip == ie) {
+            goto bad_payload;
+        }
+        uint8_t token = *ip++;
+        int nlit = token >> 4;
+        if(nlit == 15 && get_len(&ip, ie, &nlit) != 0) {
+            goto bad_payload;
+        }
+        if(nlit > ie - ip || nlit > oe - op) {
+            goto bad_payload;
+        }
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if(op == oe) {
+            break;
+        }
+        if(ie - ip < 2) {
+            goto bad_payload;
+        }
+        int dist = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 0xf;
+        if(mlen == 15 && get_len(&ip, ie, &mlen) != 0) {
+            goto bad_payload;
+        }
+        mlen += XPC_LZ_MIN_MATCH;
+        if(dist == 0 || dist > op - self->hist || mlen > oe - op) {
+            goto bad_payload;
+        }
+        // the match may overlap what it produces.
+        for(const uint8_t *m = op - dist; mlen > 0; mlen--) {
+            *op++ = *m++;
+        }
+    }
+    if(ip != ie) {
+        goto bad_payload;
+    }
+    *out = self->hist + self->hist_len;
+    self->hist_len += raw;
+    self->raw_bytes += raw;
+    self->wire_bytes += len;
+    return raw;
+
+bad_payload:
+    return -1;
+}
@@ -21,8 +21,15 @@ msg_buf_t *create_msg_buf() {
         r = NULL;
         goto done;
     }
+    r->size = 0;
     r->buf_id = 0;
     r->wr_offset = 0;
+    r->flags = 0;
+    r->final_size = 0;
+    r->dequeued = false;
+    r->ingress_ns = 0;
+    r->src_fd = -1;
+    r->src_chn = 0;
 done:
     return r;
 }
@@ -66,20 +73,115 @@ msg_queue_t *create_msg_queue() {
         goto done;
     }
     r->current_min_id = 0;
+    r->final_fifo = NULL;
+    r->fifo_cap = 0;
+    r->fifo_head = 0;
+    r->fifo_len = 0;
+    r->queued_bytes = 0;
+    r->peak_queued_bytes = 0;
+    r->pool_hits = 0;
+    r->pool_misses = 0;
 done:
     return r;
 }
 
+static int *xpc_msg_fifo_at(msg_queue_t *self, int i) {
+    return &self->final_fifo[(self->fifo_head + i) % self->fifo_cap];
+}
+
+/**
+ * Make room in the ring of finalized ids for n buffers.
+ */
+static int xpc_msg_fifo_reserve(msg_queue_t *self, int n) {
+    if(n <= self->fifo_cap) {
+        return 0;
+    }
+    int cap = (self->fifo_cap > 0) ? self->fifo_cap:8;
+    while(cap < n) {
+        cap *= 2;
+    }
+    int *fifo = malloc(cap * sizeof(int));
+    if(fifo == NULL) {
+        return -1;
+    }
+    for(int i = 0; i < self->fifo_len; i++) {
+        fifo[i] = *xpc_msg_fifo_at(self, i);
+    }
+    free(self->final_fifo);
+    self->final_fifo = fifo;
+    self->fifo_cap = cap;
+    self->fifo_head = 0;
+    return 0;
+}
+
+static void xpc_msg_fifo_remove(msg_queue_t *self, int i) {
+    for(; i < self->fifo_len - 1; i++) {
+        *xpc_msg_fifo_at(self, i) = *xpc_msg_fifo_at(self, i + 1);
+    }
+    self->fifo_len--;
+}
+
+int xpc_msg_queue_reserve(msg_queue_t *self, int nbufs, int buf_size) {
+    int r = 0;
+    // the inflight map can only be sized when it is created, so it is
+    // replaced while it is still empty.
+    if(hashmap_size(self->inflight_buffers) == 0) {
+        hashmap_t *inflight = create_hashmap(
+            2 * nbufs, sizeof(int), sizeof(msg_buf_t*),
+            alc_default_hash_i32, alc_default_cmp_i32, NULL
+        );
+        if(inflight == NULL) {
+            r = -1;
+            goto done;
+        }
+        hashmap_free(self->inflight_buffers);
+        self->inflight_buffers = inflight;
+    }
+    bitmap_resize(self->final_buffer_marks, nbufs);
+    array_resize(self->cleared_buffers, nbufs);
+    if(xpc_msg_fifo_reserve(self, nbufs) != 0) {
+        r = -1;
+        goto done;
+    }
+
+    // size the buffers which are already free, then add more.
+    for(int i = 0; i < array_size(self->cleared_buffers); i++) {
+        msg_buf_t *buf = *(msg_buf_t **)array_fetch(self->cleared_buffers, i);
+        if(buf->buf->capacity < buf_size
+                && dynabuf_resize(buf->buf, buf_size) != 0) {
+            r = -1;
+            goto done;
+        }
+    }
+    while(array_size(self->cleared_buffers)
+            + hashmap_size(self->inflight_buffers) < nbufs) {
+        msg_buf_t *buf = create_msg_buf();
+        if(buf == NULL || dynabuf_resize(buf->buf, buf_size) != 0) {
+            msg_buf_free(buf);
+            r = -1;
+            goto done;
+        }
+        array_append(self->cleared_buffers, buf);
+    }
+done:
+    return r;
+}
 
 msg_buf_t *xpc_msg_getbuf(msg_queue_t *self, int id) {
     msg_buf_t *r = NULL;
     msg_buf_t **tmp = NULL;
     // caller is requesting a new buffer be created.
     if(id < 0) {
+        // every buffer which is inflight may be finalized at once.
+        if(xpc_msg_fifo_reserve(
+                self, hashmap_size(self->inflight_buffers) + 1) != 0) {
+            goto done;
+        }
         // use an already-malloc'd buffer if possible.
         if(array_size(self->cleared_buffers) > 0) {
             tmp = array_remove(self->cleared_buffers, 0);
             r = (tmp == NULL) ? NULL:*tmp;
+            self->pool_hits++;
         }
         // otherwise, make a new one and hold onto it.
         else {
@@ -87,6 +189,7 @@ msg_buf_t *xpc_msg_getbuf(msg_queue_t *self, int id) {
             if(r == NULL) {
                 goto done;
             }
+            self->pool_misses++;
         }
 
         hashmap_set(self->inflight_buffers, self->current_min_id, r);
@@ -109,44 +212,99 @@ done:
 
 int xpc_msg_finalize(msg_queue_t *self, int which) {
     int r = 0;
-    if(hashmap_fetch(self->inflight_buffers, which) == NULL) {
+    msg_buf_t **pbuf = hashmap_fetch(self->inflight_buffers, which);
+    if(pbuf == NULL) {
         r = -1;
         goto done;
     }
+    if(bitmap_contains(self->final_buffer_marks, which)) {
+        goto done;
+    }
     bitmap_add(self->final_buffer_marks, which);
+    if((*pbuf)->dequeued) {
+        // put back after being dequeued, it is still the oldest.
+        (*pbuf)->dequeued = false;
+        self->fifo_head = (self->fifo_head + self->fifo_cap - 1) % self->fifo_cap;
+        self->fifo_len++;
+        *xpc_msg_fifo_at(self, 0) = which;
+    }
+    else {
+        *xpc_msg_fifo_at(self, self->fifo_len++) = which;
+    }
+    // a message put back after being dequeued is already counted.
+    if((*pbuf)->final_size == 0) {
+        (*pbuf)->final_size = (*pbuf)->size;
+        self->queued_bytes += (*pbuf)->size;
+        if(self->queued_bytes > self->peak_queued_bytes) {
+            self->peak_queued_bytes = self->queued_bytes;
+        }
+    }
 done:
     return r;
 }
 
 msg_buf_t *xpc_msg_dequeue_final(msg_queue_t *self) {
+    return xpc_msg_dequeue_select(self, NULL, NULL);
+}
+
+msg_buf_t *xpc_msg_dequeue_select(
+        msg_queue_t *self, msg_pick_cb_t *pick, void *ctx) {
     msg_buf_t *r = NULL;
-    iter_context *it = create_hashmap_keys_iterator(self->inflight_buffers);
-    while(iter_status(it) != ALC_ITER_STOP) {
-        int *pnext = iter_next(it);
-        if(pnext == NULL) break;
-        int next = *pnext;
-        if(bitmap_contains(self->final_buffer_marks, next)) {
-            r = *hashmap_remove(self->inflight_buffers, next);
-            // marked as inflight nonfinal, even though it is, to prevent
-            // re-dequeueing this message. call clear() to allow this buffer
-            // to be re-used.
-            bitmap_remove(self->final_buffer_marks, next);
-            break;
+    for(int i = 0; i < self->fifo_len; i++) {
+        int next = *xpc_msg_fifo_at(self, i);
+        // the buffer stays in the inflight map until it is cleared,
+        // otherwise clear() cannot find it to recycle it.
+        msg_buf_t *buf = *(msg_buf_t **)hashmap_fetch(
+            self->inflight_buffers, next
+        );
+        if(pick != NULL && !pick(ctx, buf)) {
+            continue;
+        }
+        r = buf;
+        buf->dequeued = true;
+        // marked as inflight nonfinal, even though it is, to prevent
+        // re-dequeueing this message. call clear() to allow this buffer
+        // to be re-used.
+        bitmap_remove(self->final_buffer_marks, next);
+        if(i == 0) {
+            self->fifo_head = (self->fifo_head + 1) % self->fifo_cap;
+            self->fifo_len--;
         }
+        else {
+            xpc_msg_fifo_remove(self, i);
+        }
+        break;
     }
-    iter_free(it);
-
     return r;
 }
 
 int xpc_msg_clear(msg_queue_t *self, int which) {
     int r = -1;
-    msg_buf_t *buf = hashmap_remove(self->inflight_buffers, which);
+    msg_buf_t **pbuf = (msg_buf_t **)hashmap_remove(
+        self->inflight_buffers, which
+    );
+    msg_buf_t *buf = (pbuf == NULL) ? NULL:*pbuf;
     if(buf != NULL) {
         array_append(self->cleared_buffers, buf);
         buf->size = 0;
         buf->buf_id = 0;
         buf->wr_offset = 0;
+        buf->flags = 0;
+        self->queued_bytes -= buf->final_size;
+        buf->final_size = 0;
+        buf->dequeued = false;
+        buf->ingress_ns = 0;
+        buf->src_fd = -1;
+        buf->src_chn = 0;
+        if(bitmap_contains(self->final_buffer_marks, which)) {
+            // cleared without being dequeued.
+            for(int i = 0; i < self->fifo_len; i++) {
+                if(*xpc_msg_fifo_at(self, i) == which) {
+                    xpc_msg_fifo_remove(self, i);
+                    break;
+                }
+            }
+        }
         bitmap_remove(self->final_buffer_marks, which);
         // bring down the min_id to this index if it is lower than the
         // current minimum - otherwise the linear search in getbuf()
@@ -179,6 +337,7 @@ void xpc_msg_queue_destroy(msg_queue_t *self) {
         array_free(self->cleared_buffers);
         hashmap_free(self->inflight_buffers);
         bitmap_free(self->final_buffer_marks);
+        free(self->final_fifo);
         free(self);
     }
 }
@@ -0,0 +1,829 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_hist.h>
+#include <xpc_ring.h>
+#include <xpc_pipeline.h>
+#include <xpc_credit.h>
+#include <xpc_compress.h>
+#include <alibc/containers/hashmap.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/hashmap_iterator.h>
+
+typedef struct xpc_pipe_egress xpc_pipe_egress_t;
+
+/**
+ * A ring from an ingress thread to an egress thread. Each side has its own
+ * view of it.
+ */
+typedef struct {
+    xpc_ring_ctl_t *ctl;
+    uint8_t *data;
+    xpc_ring_t tx;
+    xpc_ring_t rx;
+    xpc_pipe_egress_t *egress;
+} xpc_pipe_link_t;
+
+/**
+ * Each record in a ring is this, followed by the message as it is written.
+ */
+typedef struct {
+    uint64_t ingress_ns;
+    uint32_t route_id;
+    uint32_t reserved;
+} xpc_pipe_rec_t;
+
+/**
+ * A route as its ingress thread sees it.
+ */
+typedef struct {
+    int to_chn;
+    int out_chn;
+    // index into the pipeline's route keys.
+    int route_id;
+    xpc_pipe_link_t *link;
+    xpc_counters_t stats;
+} xpc_pipe_route_t;
+
+typedef struct {
+    xpc_pipeline_t *pipe;
+    int fd;
+    int cpu;
+    pthread_t thread;
+    bool started;
+    // byte order of the input, changed by endianness negotiation.
+    const xpc_hdr_codec_t *codec;
+    // the egress thread of the same fd, if it is also an output.
+    xpc_pipe_egress_t *peer;
+    // sorted by to_chn.
+    xpc_pipe_route_t *routes;
+    int n_routes;
+    xpc_counters_t rx;
+    uint64_t resync_count;
+    uint64_t resync_skipped;
+
+    // the message being parsed, as in xpc_in_ctx_t.
+    uint8_t hdr_wire[sizeof(txpc_hdr_t)];
+    int hdr_offset;
+    txpc_hdr_t hdr;
+    bool inflight;
+    bool resyncing;
+    bool neg;
+    uint8_t neg_payload[XPC_NEG_PAYLOAD_MAX];
+    // the route of the message, NULL while it is being dropped.
+    xpc_pipe_route_t *route;
+    // where its payload goes in the ring, and how much of it is missing.
+    uint8_t *dst;
+    int payload_offset;
+    uint64_t start_ns;
+    uint8_t buf[XPC_PIPELINE_READ_BYTES];
+} xpc_pipe_ingress_t;
+
+struct xpc_pipe_egress {
+    xpc_pipeline_t *pipe;
+    int fd;
+    int cpu;
+    pthread_t thread;
+    bool started;
+    // rung by ingress threads when the egress thread is asleep.
+    int bell;
+    // byte order of the output, read by every ingress thread routing to it.
+    const xpc_hdr_codec_t *codec;
+    xpc_pipe_link_t **links;
+    int n_links;
+    xpc_counters_t tx;
+    // by route id, NULL for routes toward other outputs.
+    xpc_hist_t **latency;
+    // messages gathered for one write, and where each of them came from.
+    uint8_t *batch;
+    int batch_cap;
+    xpc_pipe_rec_t *origins;
+};
+
+struct xpc_pipeline {
+    xpc_router_t *router;
+    uint32_t queue_bytes;
+    // readable once the threads are asked to stop.
+    int stop_fd;
+    bool stopping;
+    bool running;
+    xpc_pipe_ingress_t *ingress;
+    int n_ingress;
+    xpc_pipe_egress_t *egress;
+    int n_egress;
+    xpc_pipe_link_t *links;
+    int n_links;
+    xpc_switch_tbl_entry_t *route_keys;
+    int n_routes;
+};
+
+/**
+ * Counters have a single writer and are read by xpc_pipeline_sync from
+ * another thread.
+ */
+static inline void xpc_pipe_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void xpc_pipe_load(xpc_counters_t *dst, xpc_counters_t *src) {
+    dst->msgs = __atomic_load_n(&src->msgs, __ATOMIC_RELAXED);
+    dst->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+    for(int i = 0; i < XPC_DROP_NREASONS; i++) {
+        dst->drops[i] = __atomic_load_n(&src->drops[i], __ATOMIC_RELAXED);
+    }
+}
+
+static bool xpc_pipe_stopping(xpc_pipeline_t *pipe) {
+    return __atomic_load_n(&pipe->stopping, __ATOMIC_ACQUIRE);
+}
+
+static void xpc_pipe_ring(int bell) {
+    uint64_t one = 1;
+    if(write(bell, &one, sizeof(one)) != sizeof(one)) {
+        // EAGAIN: the counter is saturated, the thread is woken anyway.
+    }
+}
+
+static int xpc_pipe_route_cmp(const void *a, const void *b) {
+    const xpc_pipe_route_t *c = a;
+    const xpc_pipe_route_t *d = b;
+    return (c->to_chn > d->to_chn) - (c->to_chn < d->to_chn);
+}
+
+static xpc_pipe_route_t *xpc_pipe_find_route(xpc_pipe_ingress_t *in, int to_chn) {
+    xpc_pipe_route_t key = {.to_chn = to_chn};
+    return bsearch(
+        &key, in->routes, in->n_routes, sizeof(xpc_pipe_route_t),
+        xpc_pipe_route_cmp
+    );
+}
+
+static void *xpc_pipe_lookup(void *arg, int fd, int to_chn) {
+    return xpc_pipe_find_route(arg, to_chn);
+}
+
+/**
+ * Finish the message whose payload is complete.
+ */
+static void xpc_pipe_end(xpc_pipe_ingress_t *in) {
+    in->inflight = false;
+    if(in->neg) {
+        if(in->hdr.type == TXPC_NEG_TYPE_ENDIANNESS) {
+            in->codec = (in->hdr.size > 0) ?
+                xpc_hdr_codec_select(in->neg_payload[0] != 0):in->codec;
+            if(in->peer != NULL) {
+                __atomic_store_n(&in->peer->codec, in->codec, __ATOMIC_RELAXED);
+            }
+        }
+        return;
+    }
+    if(in->route == NULL) {
+        return;
+    }
+    uint64_t msg_len = sizeof(txpc_hdr_t) + in->hdr.size;
+    xpc_pipe_add(&in->rx.msgs, 1);
+    xpc_pipe_add(&in->rx.bytes, msg_len);
+    xpc_pipe_add(&in->route->stats.msgs, 1);
+    xpc_pipe_add(&in->route->stats.bytes, msg_len);
+    if(xpc_ring_commit(&in->route->link->tx)) {
+        xpc_pipe_ring(in->route->link->egress->bell);
+    }
+}
+
+/**
+ * Act on a complete header: route the message into a ring, or drop it, or
+ * slide along one byte if the header is corrupt.
+ */
+static void xpc_pipe_begin(xpc_pipe_ingress_t *in) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    xpc_drop_reason_t reason = XPC_DROP_NO_ROUTE;
+    void *found = NULL;
+    xpc_hdr_input_t hin = {
+        .fd = in->fd, .codec = in->codec,
+        .lookup = xpc_pipe_lookup, .lookup_arg = in,
+        .rx = &in->rx, .resync_count = &in->resync_count,
+        .resync_skipped = &in->resync_skipped
+    };
+    // credits are not granted and compression is not offered here, the
+    // sender goes on without.
+    xpc_hdr_kind_t kind = xpc_hdr_take(
+        in->pipe->router, &hin, in->hdr_wire, &in->hdr, in->resyncing, &found
+    );
+    xpc_pipe_route_t *route = found;
+    in->codec = hin.codec;
+    if(kind == XPC_HDR_BAD) {
+        // there is no lookahead here, slide along one byte at a time.
+        in->resyncing = true;
+        memmove(in->hdr_wire, in->hdr_wire + 1, hdr_len - 1);
+        in->hdr_offset = hdr_len - 1;
+        return;
+    }
+    in->neg = kind == XPC_HDR_NEG;
+    in->resyncing = false;
+    in->inflight = true;
+    in->payload_offset = 0;
+    in->route = NULL;
+    in->dst = NULL;
+    if(!in->neg) {
+        uint32_t rec_len = sizeof(xpc_pipe_rec_t) + hdr_len + in->hdr.size;
+        uint8_t *rec = NULL;
+        if(route != NULL) {
+            reason = (rec_len > xpc_ring_max_record(&route->link->tx)) ?
+                XPC_DROP_NO_BUFFER:XPC_DROP_QUEUE_FULL;
+            rec = xpc_ring_reserve(&route->link->tx, rec_len);
+        }
+        if(rec != NULL) {
+            xpc_pipe_rec_t origin = {
+                .ingress_ns = in->start_ns, .route_id = route->route_id
+            };
+            txpc_hdr_t out_hdr = in->hdr;
+            out_hdr.to = route->out_chn;
+            memcpy(rec, &origin, sizeof(origin));
+            const xpc_hdr_codec_t *codec = __atomic_load_n(
+                &route->link->egress->codec, __ATOMIC_RELAXED
+            );
+            codec->encode(rec + sizeof(origin), &out_hdr);
+            in->dst = rec + sizeof(origin) + hdr_len;
+            in->route = route;
+        }
+        else {
+            xpc_pipe_add(&in->rx.drops[reason], 1);
+            if(route != NULL) {
+                xpc_pipe_add(&route->stats.drops[reason], 1);
+            }
+        }
+    }
+    if(in->hdr.size == 0) {
+        xpc_pipe_end(in);
+    }
+}
+
+/**
+ * Parse bytes read from an input.
+ */
+static void xpc_pipe_parse(
+        xpc_pipe_ingress_t *in, const uint8_t *p, int n, uint64_t now) {
+    const int hdr_len = sizeof(txpc_hdr_t);
+    while(n > 0) {
+        if(!in->inflight) {
+            int take = hdr_len - in->hdr_offset;
+            take = (take < n) ? take:n;
+            if(in->hdr_offset == 0) {
+                in->start_ns = now;
+            }
+            memcpy(in->hdr_wire + in->hdr_offset, p, take);
+            in->hdr_offset += take;
+            p += take;
+            n -= take;
+            if(in->hdr_offset == hdr_len) {
+                in->hdr_offset = 0;
+                xpc_pipe_begin(in);
+            }
+            continue;
+        }
+        int take = in->hdr.size - in->payload_offset;
+        take = (take < n) ? take:n;
+        if(in->dst != NULL) {
+            memcpy(in->dst + in->payload_offset, p, take);
+        }
+        else if(in->neg && in->payload_offset < XPC_NEG_PAYLOAD_MAX) {
+            int keep = XPC_NEG_PAYLOAD_MAX - in->payload_offset;
+            memcpy(
+                in->neg_payload + in->payload_offset, p, (take < keep) ? take:keep
+            );
+        }
+        in->payload_offset += take;
+        p += take;
+        n -= take;
+        if(in->payload_offset == in->hdr.size) {
+            xpc_pipe_end(in);
+        }
+    }
+}
+
+static void *xpc_pipe_ingress_main(void *arg) {
+    xpc_pipe_ingress_t *in = arg;
+    struct pollfd pfd[2] = {
+        {.fd = in->fd, .events = POLLIN},
+        {.fd = in->pipe->stop_fd, .events = POLLIN}
+    };
+    while(!xpc_pipe_stopping(in->pipe)) {
+        int n = read(in->fd, in->buf, sizeof(in->buf));
+        if(n > 0) {
+            xpc_pipe_parse(in, in->buf, n, xpc_monotonic_ns());
+            continue;
+        }
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            // the input is gone.
+            break;
+        }
+        if(poll(pfd, 2, -1) > 0 && pfd[1].revents != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Put the egress thread to sleep until an ingress thread rings its doorbell.
+ */
+static void xpc_pipe_egress_wait(xpc_pipe_egress_t *eg) {
+    uint64_t rung;
+    int asleep = 0;
+    struct pollfd pfd[2] = {
+        {.fd = eg->bell, .events = POLLIN},
+        {.fd = eg->pipe->stop_fd, .events = POLLIN}
+    };
+    for(; asleep < eg->n_links; asleep++) {
+        if(!xpc_ring_consumer_sleep(&eg->links[asleep]->rx)) {
+            goto awake;
+        }
+    }
+    poll(pfd, 2, -1);
+    if(read(eg->bell, &rung, sizeof(rung)) != sizeof(rung)) {
+        // EAGAIN: woken to stop.
+    }
+awake:
+    for(int i = 0; i < asleep; i++) {
+        xpc_ring_consumer_wake(&eg->links[i]->rx);
+    }
+}
+
+/**
+ * Write a whole batch, waiting for the output as long as necessary.
+ * @return 0 once it is written, or -1 if it was not (the pipeline is
+ * stopping, or the output failed).
+ */
+static int xpc_pipe_write_all(xpc_pipe_egress_t *eg, int len) {
+    int written = 0;
+    struct pollfd pfd[2] = {
+        {.fd = eg->fd, .events = POLLOUT},
+        {.fd = eg->pipe->stop_fd, .events = POLLIN}
+    };
+    while(written < len) {
+        int n = write(eg->fd, eg->batch + written, len - written);
+        if(n > 0) {
+            written += n;
+            continue;
+        }
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        if(poll(pfd, 2, -1) > 0 && pfd[1].revents != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *xpc_pipe_egress_main(void *arg) {
+    xpc_pipe_egress_t *eg = arg;
+    int next = 0;
+    while(!xpc_pipe_stopping(eg->pipe)) {
+        int len = 0;
+        int n_msgs = 0;
+        bool full = false;
+        // the rings take turns at being drained first.
+        for(int i = 0; i < eg->n_links && !full; i++) {
+            xpc_ring_t *rx = &eg->links[(next + i) % eg->n_links]->rx;
+            uint32_t rec_len;
+            const uint8_t *rec;
+            while((rec = xpc_ring_peek(rx, &rec_len)) != NULL) {
+                int msg_len = rec_len - sizeof(xpc_pipe_rec_t);
+                if(len + msg_len > eg->batch_cap) {
+                    full = true;
+                    break;
+                }
+                memcpy(&eg->origins[n_msgs++], rec, sizeof(xpc_pipe_rec_t));
+                memcpy(eg->batch + len, rec + sizeof(xpc_pipe_rec_t), msg_len);
+                len += msg_len;
+                // producers never wait for room, they drop.
+                xpc_ring_release(rx);
+            }
+        }
+        next = (eg->n_links > 0) ? (next + 1) % eg->n_links:0;
+        if(n_msgs == 0) {
+            xpc_pipe_egress_wait(eg);
+            continue;
+        }
+        if(xpc_pipe_write_all(eg, len) != 0) {
+            // a batch the output refused is lost, as it would be on a
+            // stopping pipeline.
+            continue;
+        }
+        uint64_t now = xpc_monotonic_ns();
+        for(int i = 0; i < n_msgs; i++) {
+            xpc_hist_t *latency = eg->latency[eg->origins[i].route_id];
+            if(latency != NULL) {
+                xpc_hist_record(latency, now - eg->origins[i].ingress_ns);
+            }
+        }
+        xpc_pipe_add(&eg->tx.msgs, n_msgs);
+        xpc_pipe_add(&eg->tx.bytes, len);
+    }
+    return NULL;
+}
+
+static xpc_pipe_ingress_t *xpc_pipe_find_ingress(xpc_pipeline_t *self, int fd) {
+    for(int i = 0; i < self->n_ingress; i++) {
+        if(self->ingress[i].fd == fd) {
+            return &self->ingress[i];
+        }
+    }
+    return NULL;
+}
+
+static xpc_pipe_egress_t *xpc_pipe_find_egress(xpc_pipeline_t *self, int fd) {
+    for(int i = 0; i < self->n_egress; i++) {
+        if(self->egress[i].fd == fd) {
+            return &self->egress[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the ring from an ingress thread to an egress thread, creating it if
+ * this is the first route between them.
+ */
+static xpc_pipe_link_t *xpc_pipe_link(
+        xpc_pipeline_t *self, xpc_pipe_ingress_t *in, xpc_pipe_egress_t *eg) {
+    for(int i = 0; i < in->n_routes; i++) {
+        if(in->routes[i].link->egress == eg) {
+            return in->routes[i].link;
+        }
+    }
+    xpc_pipe_link_t *link = &self->links[self->n_links];
+    link->ctl = aligned_alloc(XPC_RING_CACHE_LINE, sizeof(xpc_ring_ctl_t));
+    link->data = malloc(self->queue_bytes);
+    if(link->ctl == NULL || link->data == NULL) {
+        free(link->ctl);
+        free(link->data);
+        return NULL;
+    }
+    memset(link->ctl, 0, sizeof(xpc_ring_ctl_t));
+    xpc_ring_init(&link->tx, link->ctl, link->data, self->queue_bytes);
+    xpc_ring_init(&link->rx, link->ctl, link->data, self->queue_bytes);
+    link->egress = eg;
+    eg->links[eg->n_links++] = link;
+    self->n_links++;
+    return link;
+}
+
+xpc_pipeline_t *create_xpc_pipeline(xpc_router_t *router, uint32_t queue_bytes) {
+    xpc_router_t *ctx = router;
+    xpc_pipeline_t *r = calloc(1, sizeof(xpc_pipeline_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->router = router;
+    r->stop_fd = -1;
+    r->queue_bytes = (queue_bytes == 0) ? XPC_PIPELINE_QUEUE_BYTES:queue_bytes;
+    if((r->queue_bytes & (r->queue_bytes - 1)) != 0
+            || r->queue_bytes < 2 * (sizeof(xpc_pipe_rec_t) + sizeof(txpc_hdr_t))) {
+        errno = EINVAL;
+        goto bad_pipeline;
+    }
+    // listeners, their clients and capturing need the event loop.
+    if(ctx->capture != NULL) {
+        errno = ENOTSUP;
+        goto bad_pipeline;
+    }
+    r->n_ingress = hashmap_size(ctx->in_contexts);
+    r->n_egress = hashmap_size(ctx->out_contexts);
+    r->n_routes = hashmap_size(ctx->switch_tbl);
+    r->ingress = calloc(r->n_ingress + 1, sizeof(xpc_pipe_ingress_t));
+    r->egress = calloc(r->n_egress + 1, sizeof(xpc_pipe_egress_t));
+    r->links = calloc(r->n_routes + 1, sizeof(xpc_pipe_link_t));
+    r->route_keys = calloc(r->n_routes + 1, sizeof(xpc_switch_tbl_entry_t));
+    r->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->ingress == NULL || r->egress == NULL || r->links == NULL
+            || r->route_keys == NULL || r->stop_fd == -1) {
+        goto bad_pipeline;
+    }
+    for(int i = 0; i < r->n_egress; i++) {
+        r->egress[i].bell = -1;
+    }
+
+    int n = 0;
+    iter_context *it = create_hashmap_keys_iterator(ctx->out_contexts);
+    for(int *pfd = iter_next(it); pfd != NULL; pfd = iter_next(it)) {
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, *pfd);
+        xpc_pipe_egress_t *eg = &r->egress[n++];
+        eg->pipe = r;
+        eg->fd = *pfd;
+        eg->cpu = -1;
+        eg->codec = out_ctx->codec;
+        eg->tx = out_ctx->tx;
+        if(out_ctx->fanout || out_ctx->seqpacket || out_ctx->spill != NULL
+                || out_ctx->sink != NULL) {
+            errno = ENOTSUP;
+            iter_free(it);
+            goto bad_pipeline;
+        }
+    }
+    iter_free(it);
+    n = 0;
+    it = create_hashmap_keys_iterator(ctx->in_contexts);
+    for(int *pfd = iter_next(it); pfd != NULL; pfd = iter_next(it)) {
+        xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, *pfd);
+        xpc_pipe_ingress_t *in = &r->ingress[n++];
+        in->pipe = r;
+        in->fd = *pfd;
+        in->cpu = -1;
+        in->codec = in_ctx->codec;
+        in->rx = in_ctx->rx;
+        in->resync_count = in_ctx->resync_count;
+        in->resync_skipped = in_ctx->resync_skipped;
+        in->routes = calloc(r->n_routes + 1, sizeof(xpc_pipe_route_t));
+        if(in_ctx->kind != XPC_IN_STREAM || in->routes == NULL) {
+            errno = (in->routes == NULL) ? ENOMEM:ENOTSUP;
+            iter_free(it);
+            goto bad_pipeline;
+        }
+    }
+    iter_free(it);
+    for(int i = 0; i < r->n_ingress; i++) {
+        r->ingress[i].peer = xpc_pipe_find_egress(r, r->ingress[i].fd);
+    }
+
+    for(int i = 0; i < r->n_egress; i++) {
+        xpc_pipe_egress_t *eg = &r->egress[i];
+        // the batch always has room for the largest message, larger ones
+        // never fit in a ring anyway.
+        int largest = sizeof(txpc_hdr_t) + ctx->max_msg_size;
+        eg->batch_cap = (largest > XPC_PIPELINE_WRITE_BYTES) ?
+            largest:XPC_PIPELINE_WRITE_BYTES;
+        if(eg->batch_cap > r->queue_bytes / 2) {
+            eg->batch_cap = r->queue_bytes / 2;
+        }
+        eg->batch = malloc(eg->batch_cap);
+        eg->origins = calloc(
+            eg->batch_cap / sizeof(txpc_hdr_t) + 1, sizeof(xpc_pipe_rec_t)
+        );
+        eg->links = calloc(r->n_ingress + 1, sizeof(xpc_pipe_link_t *));
+        eg->latency = calloc(r->n_routes + 1, sizeof(xpc_hist_t *));
+        eg->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(eg->batch == NULL || eg->origins == NULL || eg->links == NULL
+                || eg->latency == NULL || eg->bell == -1) {
+            goto bad_pipeline;
+        }
+    }
+
+    n = 0;
+    it = create_hashmap_keys_iterator(ctx->switch_tbl);
+    for(xpc_switch_tbl_entry_t *k = iter_next(it); k != NULL; k = iter_next(it)) {
+        xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)k);
+        xpc_pipe_ingress_t *in = xpc_pipe_find_ingress(r, k->fd);
+        xpc_pipe_egress_t *eg = xpc_pipe_find_egress(r, route->dst.fd);
+        if(in == NULL || eg == NULL) {
+            continue;
+        }
+        if(route->hook != NULL || route->limit != NULL) {
+            iter_free(it);
+            errno = ENOTSUP;
+            goto bad_pipeline;
+        }
+        xpc_pipe_link_t *link = xpc_pipe_link(r, in, eg);
+        eg->latency[n] = create_xpc_hist();
+        if(link == NULL || eg->latency[n] == NULL) {
+            iter_free(it);
+            goto bad_pipeline;
+        }
+        xpc_pipe_route_t *pr = &in->routes[in->n_routes++];
+        pr->to_chn = k->to_chn;
+        pr->out_chn = route->dst.to_chn;
+        pr->route_id = n;
+        pr->link = link;
+        pr->stats = route->stats;
+        r->route_keys[n++] = *k;
+    }
+    iter_free(it);
+    r->n_routes = n;
+    for(int i = 0; i < r->n_ingress; i++) {
+        qsort(
+            r->ingress[i].routes, r->ingress[i].n_routes,
+            sizeof(xpc_pipe_route_t), xpc_pipe_route_cmp
+        );
+    }
+    goto done;
+
+bad_pipeline:
+    xpc_pipeline_free(r);
+    r = NULL;
+done:
+    return r;
+}
+
+int xpc_pipeline_set_cpu(xpc_pipeline_t *self, int fd, bool egress, int cpu) {
+    if(egress) {
+        xpc_pipe_egress_t *eg = xpc_pipe_find_egress(self, fd);
+        if(eg == NULL) {
+            return -1;
+        }
+        eg->cpu = cpu;
+    }
+    else {
+        xpc_pipe_ingress_t *in = xpc_pipe_find_ingress(self, fd);
+        if(in == NULL) {
+            return -1;
+        }
+        in->cpu = cpu;
+    }
+    return 0;
+}
+
+/**
+ * Start a thread, pinned to a CPU unless cpu is -1. Signals are blocked in
+ * it, they are left to the thread which started the pipeline.
+ */
+static int xpc_pipe_spawn(
+        pthread_t *thread, int cpu, void *(*fn)(void *), void *arg) {
+    pthread_attr_t attr;
+    cpu_set_t set;
+    sigset_t all, old;
+    sigfillset(&all);
+    int err = pthread_attr_init(&attr);
+    if(err == 0 && cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = (cpu < CPU_SETSIZE) ?
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set):EINVAL;
+    }
+    if(err == 0) {
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        err = pthread_create(thread, &attr, fn, arg);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    errno = err;
+    return (err == 0) ? 0:-1;
+}
+
+/**
+ * Stop and join whichever threads were started.
+ */
+static void xpc_pipe_join(xpc_pipeline_t *self) {
+    uint64_t one = 1;
+    __atomic_store_n(&self->stopping, true, __ATOMIC_RELEASE);
+    if(write(self->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        // the counter is already set.
+    }
+    for(int i = 0; i < self->n_ingress; i++) {
+        if(self->ingress[i].started) {
+            pthread_join(self->ingress[i].thread, NULL);
+            self->ingress[i].started = false;
+        }
+    }
+    for(int i = 0; i < self->n_egress; i++) {
+        if(self->egress[i].started) {
+            pthread_join(self->egress[i].thread, NULL);
+            self->egress[i].started = false;
+        }
+    }
+}
+
+int xpc_pipeline_start(xpc_pipeline_t *self) {
+    if(self->running) {
+        return 0;
+    }
+    // outputs first, so nothing is routed toward a thread not yet running.
+    for(int i = 0; i < self->n_egress; i++) {
+        xpc_pipe_egress_t *eg = &self->egress[i];
+        if(xpc_pipe_spawn(&eg->thread, eg->cpu, xpc_pipe_egress_main, eg) != 0) {
+            goto bad_start;
+        }
+        eg->started = true;
+    }
+    for(int i = 0; i < self->n_ingress; i++) {
+        xpc_pipe_ingress_t *in = &self->ingress[i];
+        if(xpc_pipe_spawn(&in->thread, in->cpu, xpc_pipe_ingress_main, in) != 0) {
+            goto bad_start;
+        }
+        in->started = true;
+    }
+    self->running = true;
+    return 0;
+
+bad_start:;
+    int err = errno;
+    xpc_pipe_join(self);
+    errno = err;
+    return -1;
+}
+
+void xpc_pipeline_sync(xpc_pipeline_t *self) {
+    xpc_router_t *ctx = self->router;
+    for(int i = 0; i < self->n_ingress; i++) {
+        xpc_pipe_ingress_t *in = &self->ingress[i];
+        xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, in->fd);
+        if(in_ctx != NULL) {
+            xpc_pipe_load(&in_ctx->rx, &in->rx);
+            in_ctx->resync_count =
+                __atomic_load_n(&in->resync_count, __ATOMIC_RELAXED);
+            in_ctx->resync_skipped =
+                __atomic_load_n(&in->resync_skipped, __ATOMIC_RELAXED);
+        }
+        for(int j = 0; j < in->n_routes; j++) {
+            xpc_switch_tbl_entry_t key = self->route_keys[in->routes[j].route_id];
+            xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+            if(route != NULL) {
+                xpc_pipe_load(&route->stats, &in->routes[j].stats);
+            }
+        }
+    }
+    for(int i = 0; i < self->n_egress; i++) {
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(
+            ctx->out_contexts, self->egress[i].fd
+        );
+        if(out_ctx != NULL) {
+            xpc_pipe_load(&out_ctx->tx, &self->egress[i].tx);
+        }
+    }
+}
+
+void xpc_pipeline_stop(xpc_pipeline_t *self) {
+    xpc_router_t *ctx = self->router;
+    if(!self->running) {
+        return;
+    }
+    xpc_pipe_join(self);
+    self->running = false;
+    xpc_pipeline_sync(self);
+    // the threads are gone, their byte orders and histograms can be read.
+    for(int i = 0; i < self->n_ingress; i++) {
+        xpc_in_ctx_t *in_ctx = hashmap_fetch(
+            ctx->in_contexts, self->ingress[i].fd
+        );
+        if(in_ctx != NULL) {
+            in_ctx->codec = self->ingress[i].codec;
+        }
+    }
+    for(int i = 0; i < self->n_egress; i++) {
+        xpc_pipe_egress_t *eg = &self->egress[i];
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, eg->fd);
+        if(out_ctx != NULL) {
+            out_ctx->codec = eg->codec;
+        }
+        for(int j = 0; j < self->n_routes; j++) {
+            xpc_switch_tbl_entry_t key = self->route_keys[j];
+            xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+            if(eg->latency[j] != NULL && route != NULL && route->latency != NULL) {
+                xpc_hist_merge(route->latency, eg->latency[j]);
+                xpc_hist_reset(eg->latency[j]);
+            }
+        }
+    }
+}
+
+void xpc_pipeline_free(xpc_pipeline_t *self) {
+    if(self != NULL) {
+        xpc_pipeline_stop(self);
+        if(self->ingress != NULL) {
+            for(int i = 0; i < self->n_ingress; i++) {
+                free(self->ingress[i].routes);
+            }
+        }
+        if(self->egress != NULL) {
+            for(int i = 0; i < self->n_egress; i++) {
+                xpc_pipe_egress_t *eg = &self->egress[i];
+                if(eg->latency != NULL) {
+                    for(int j = 0; j < self->n_routes; j++) {
+                        free(eg->latency[j]);
+                    }
+                }
+                free(eg->latency);
+                free(eg->links);
+                free(eg->batch);
+                free(eg->origins);
+                if(eg->bell != -1) {
+                    close(eg->bell);
+                }
+            }
+        }
+        if(self->links != NULL) {
+            for(int i = 0; i < self->n_links; i++) {
+                free(self->links[i].ctl);
+                free(self->links[i].data);
+            }
+        }
+        if(self->stop_fd != -1) {
+            close(self->stop_fd);
+        }
+        free(self->ingress);
+        free(self->egress);
+        free(self->links);
+        free(self->route_keys);
+        free(self);
+    }
+}
@@ -0,0 +1,376 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <tinyxpc/tinyxpc.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/hashmap_iterator.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_hist.h>
+#include <xpc_capture.h>
+#include <epoll_app.h>
+
+/**
+ * Feed a capture back through a router.
+ * Every fd in the capture is replaced by a socketpair, and a router is set
+ * up with the routes the captured messages took. A feeder thread writes the
+ * messages to the inputs at the times they originally arrived, scaled by
+ * -s, or as fast as possible with -f. The router runs on this thread with
+ * epoll_app as main does, and the outputs are drained here too.
+ *
+ * The result is printed as one JSON object on stdout, the latency is the
+ * router's own per-route measurement.
+ *
+ * usage: xpc_replay [-s speed | -f] <capture>
+ *   -s  replay this many times faster than captured (default 1)
+ *   -f  replay as fast as possible
+ */
+
+#define REPLAY_MAX_DEVICES 64
+// the run ends if nothing arrives for this long after the last write.
+#define REPLAY_IDLE_NS 2000000000ull
+
+typedef struct {
+    int captured_fd;
+    // the router uses router_fd, the replay uses replay_fd.
+    int router_fd;
+    int replay_fd;
+} replay_dev_t;
+
+typedef struct {
+    const xpc_capture_hdr_t *capture;
+    size_t capture_len;
+    double speed;
+    bool full_speed;
+
+    replay_dev_t inputs[REPLAY_MAX_DEVICES];
+    int ninputs;
+    replay_dev_t outputs[REPLAY_MAX_DEVICES];
+    int noutputs;
+
+    uint64_t records;
+    uint64_t expected_bytes;
+    uint64_t first_ingress_ns;
+    uint64_t last_ingress_ns;
+    int max_msg_len;
+
+    // written by the feeder thread.
+    uint64_t start_ns;
+    bool feed_done;
+    bool stop;
+
+    uint64_t received_bytes;
+    uint64_t last_recv_ns;
+    uint64_t last_progress_ns;
+
+    epoll_app_t *app;
+    xpc_router_t *xpc;
+} replay_t;
+
+/**
+ * Find the stand-in for a captured fd, opening one if there is none yet.
+ */
+static replay_dev_t *replay_device(replay_dev_t *devs, int *ndevs, int fd) {
+    for(int i = 0; i < *ndevs; i++) {
+        if(devs[i].captured_fd == fd) {
+            return &devs[i];
+        }
+    }
+    if(*ndevs == REPLAY_MAX_DEVICES) {
+        errno = EMFILE;
+        return NULL;
+    }
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return NULL;
+    }
+    replay_dev_t *r = &devs[(*ndevs)++];
+    r->captured_fd = fd;
+    r->router_fd = sv[0];
+    r->replay_fd = sv[1];
+    if(fcntl(sv[0], F_SETFL, O_NONBLOCK) != 0) {
+        return NULL;
+    }
+    return r;
+}
+
+static bool is_output(replay_t *self, int fd) {
+    for(int i = 0; i < self->noutputs; i++) {
+        if(self->outputs[i].replay_fd == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Open the stand-ins and set up the routes of the captured messages.
+ */
+static int replay_setup(replay_t *self) {
+    const xpc_capture_rec_t *rec = NULL;
+    while((rec = xpc_capture_next(self->capture, rec)) != NULL) {
+        if(rec->msg_len < sizeof(txpc_hdr_t)) {
+            continue;
+        }
+        replay_dev_t *in = replay_device(
+            self->inputs, &self->ninputs, rec->in_fd
+        );
+        replay_dev_t *out = replay_device(
+            self->outputs, &self->noutputs, rec->out_fd
+        );
+        if(in == NULL || out == NULL) {
+            return -1;
+        }
+        if(self->records == 0) {
+            self->first_ingress_ns = rec->ingress_ns;
+        }
+        self->last_ingress_ns = rec->ingress_ns;
+        self->records++;
+        self->expected_bytes += rec->msg_len;
+        if(rec->msg_len > self->max_msg_len) {
+            self->max_msg_len = rec->msg_len;
+        }
+        // setting a route again only redirects it.
+        if(xpc_set_route(self->xpc, in->router_fd, out->router_fd,
+                rec->in_chn, rec->out_chn) != 0) {
+            return -1;
+        }
+    }
+    self->xpc->max_msg_size = (self->max_msg_len > self->xpc->max_msg_size) ?
+        self->max_msg_len:self->xpc->max_msg_size;
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, int len) {
+    int off = 0;
+    while(off < len) {
+        int n = write(fd, buf + off, len - off);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void *feeder_main(void *arg) {
+    replay_t *self = arg;
+    const xpc_hdr_codec_t *host = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    uint8_t *buf = malloc(self->max_msg_len);
+    const xpc_capture_rec_t *rec = NULL;
+    uint64_t start = xpc_monotonic_ns();
+    __atomic_store_n(&self->start_ns, start, __ATOMIC_RELEASE);
+    while(buf != NULL && (rec = xpc_capture_next(self->capture, rec)) != NULL
+            && !__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+        if(rec->msg_len < sizeof(txpc_hdr_t)) {
+            continue;
+        }
+        if(!self->full_speed) {
+            uint64_t due = start + (uint64_t)(
+                (rec->ingress_ns - self->first_ingress_ns) / self->speed
+            );
+            struct timespec ts = {
+                .tv_sec = due / 1000000000ull,
+                .tv_nsec = due % 1000000000ull
+            };
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                    == EINTR);
+        }
+        // the message was captured as it left the router, it goes back in
+        // on the channel it arrived on and in the router's byte order.
+        txpc_hdr_t hdr;
+        const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(
+            rec->flags & XPC_CAPTURE_BIG_ENDIAN
+        );
+        memcpy(buf, xpc_capture_msg_bytes(rec), rec->msg_len);
+        codec->decode(&hdr, buf);
+        hdr.to = rec->in_chn;
+        host->encode(buf, &hdr);
+        replay_dev_t *in = replay_device(
+            self->inputs, &self->ninputs, rec->in_fd
+        );
+        if(write_all(in->replay_fd, buf, rec->msg_len) != 0) {
+            break;
+        }
+    }
+    free(buf);
+    __atomic_store_n(&self->feed_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int replay_add_fd(void *ctx, int fd) {
+    return epoll_app_add_fd(ctx, fd, EPOLLOUT | EPOLLHUP);
+}
+
+static int replay_del_fd(void *ctx, int fd) {
+    return epoll_app_del_fd(ctx, fd);
+}
+
+static void replay_in(void *ctx, int fd) {
+    replay_t *self = ctx;
+    if(!is_output(self, fd)) {
+        xpc_accumulate_msg(self->xpc, fd);
+        return;
+    }
+    uint8_t buf[65536];
+    int n;
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        self->received_bytes += n;
+        self->last_recv_ns = xpc_monotonic_ns();
+    }
+}
+
+static void replay_out(void *ctx, int fd) {
+    replay_t *self = ctx;
+    xpc_write_msg(self->xpc, fd);
+}
+
+/**
+ * Stop once every captured byte came out, or once nothing has arrived for a
+ * while after the last message was fed in.
+ */
+static int replay_poll(void *ctx) {
+    replay_t *self = ctx;
+    uint64_t now = xpc_monotonic_ns();
+    if(self->last_recv_ns > self->last_progress_ns
+            || !__atomic_load_n(&self->feed_done, __ATOMIC_ACQUIRE)) {
+        self->last_progress_ns = now;
+    }
+    if(self->received_bytes >= self->expected_bytes
+            || now - self->last_progress_ns > REPLAY_IDLE_NS) {
+        self->app->run_mainloop = false;
+    }
+    int timeout_ms = xpc_router_poll(self->xpc);
+    return (timeout_ms == -1 || timeout_ms > 10) ? 10:timeout_ms;
+}
+
+static void print_json(replay_t *self, const char *path, double elapsed_s) {
+    double secs = (elapsed_s > 0) ? elapsed_s:1e-9;
+    uint64_t forwarded = 0;
+    xpc_hist_t *latency = create_xpc_hist();
+    iter_context *it = create_hashmap_values_iterator(self->xpc->switch_tbl);
+    for(xpc_route_t *route = iter_next(it); route != NULL;
+            route = iter_next(it)) {
+        forwarded += route->stats.msgs;
+        if(latency != NULL) {
+            xpc_hist_merge(latency, route->latency);
+        }
+    }
+    iter_free(it);
+    printf("{\"capture\": \"%s\", \"speed\": ", path);
+    if(self->full_speed) {
+        printf("\"full\", ");
+    }
+    else {
+        printf("%g, ", self->speed);
+    }
+    printf("\"records\": %llu, \"lost\": %llu, \"captured_span_s\": %.6f, ",
+        (unsigned long long)self->records,
+        (unsigned long long)self->capture->lost,
+        (self->last_ingress_ns - self->first_ingress_ns) / 1e9);
+    printf("\"forwarded\": %llu, \"bytes\": %llu, \"expected_bytes\": %llu, "
+        "\"elapsed_s\": %.6f, \"msgs_per_s\": %.1f, \"mb_per_s\": %.3f, ",
+        (unsigned long long)forwarded,
+        (unsigned long long)self->received_bytes,
+        (unsigned long long)self->expected_bytes, elapsed_s,
+        forwarded / secs, self->received_bytes / secs / 1e6);
+    printf("\"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+        "\"max\": %llu}}\n",
+        (unsigned long long)((latency != NULL) ?
+            xpc_hist_percentile(latency, 50.0):0),
+        (unsigned long long)((latency != NULL) ?
+            xpc_hist_percentile(latency, 99.0):0),
+        (unsigned long long)((latency != NULL) ?
+            xpc_hist_percentile(latency, 99.9):0),
+        (unsigned long long)((latency != NULL) ? latency->max:0));
+    free(latency);
+}
+
+int main(int argc, char **argv) {
+    int status = 1;
+    int opt;
+    pthread_t feeder;
+    replay_t *self = calloc(1, sizeof(replay_t));
+    if(self == NULL) {
+        return 1;
+    }
+    self->speed = 1.0;
+    while((opt = getopt(argc, argv, "s:f")) != -1) {
+        switch(opt) {
+            case 's': self->speed = strtod(optarg, NULL); break;
+            case 'f': self->full_speed = true; break;
+            default:
+                optind = argc + 1;
+            break;
+        }
+    }
+    if(optind != argc - 1 || !(self->speed > 0)) {
+        fprintf(stderr, "usage: %s [-s speed | -f] <capture>\n", argv[0]);
+        goto done;
+    }
+    self->capture = xpc_capture_map(argv[optind], &self->capture_len);
+    if(self->capture == NULL) {
+        perror(argv[optind]);
+        goto done;
+    }
+
+    self->app = create_epoll_app(1, self);
+    self->xpc = initialize_xpc_router();
+    if(self->app == NULL || self->xpc == NULL) {
+        goto done;
+    }
+    if(replay_setup(self) != 0) {
+        perror("replay");
+        goto done;
+    }
+    for(int i = 0; i < self->ninputs; i++) {
+        epoll_app_add_fd(self->app, self->inputs[i].router_fd,
+            EPOLLIN | EPOLLHUP | EPOLLRDHUP);
+    }
+    for(int i = 0; i < self->noutputs; i++) {
+        fcntl(self->outputs[i].replay_fd, F_SETFL, O_NONBLOCK);
+        epoll_app_add_fd(self->app, self->outputs[i].replay_fd, EPOLLIN);
+    }
+    self->xpc->io_event_context = self->app;
+    self->xpc->io_add_fd_cb = replay_add_fd;
+    self->xpc->io_del_fd_cb = replay_del_fd;
+    self->app->epollin_cb = replay_in;
+    self->app->epollout_cb = replay_out;
+    self->app->timeout_cb = replay_poll;
+    self->last_progress_ns = xpc_monotonic_ns();
+
+    if(pthread_create(&feeder, NULL, feeder_main, self) != 0) {
+        goto done;
+    }
+    epoll_app_mainloop(self->app);
+    __atomic_store_n(&self->stop, true, __ATOMIC_RELEASE);
+    pthread_join(feeder, NULL);
+
+    uint64_t end = (self->last_recv_ns != 0) ?
+        self->last_recv_ns:xpc_monotonic_ns();
+    print_json(self, argv[optind], (end - self->start_ns) / 1e9);
+    status = (self->received_bytes == self->expected_bytes) ? 0:2;
+done:
+    for(int i = 0; i < self->ninputs; i++) {
+        close(self->inputs[i].router_fd);
+        close(self->inputs[i].replay_fd);
+    }
+    for(int i = 0; i < self->noutputs; i++) {
+        close(self->outputs[i].router_fd);
+        close(self->outputs[i].replay_fd);
+    }
+    xpc_router_destroy(self->xpc);
+    destroy_epoll_app(self->app);
+    xpc_capture_unmap(self->capture, self->capture_len);
+    free(self);
+    return status;
+}
@@ -0,0 +1,77 @@
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <xpc_resync.h>
+#include <xpc_endian.h>
+#include <tinyxpc/tinyxpc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void xpc_resync_filter_init(xpc_resync_filter_t *self, const xpc_hdr_codec_t *codec) {
+    txpc_hdr_t hdr = {0};
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    // the low byte of the to-channel is the first byte which changes when
+    // to goes from 0 to 1, wherever the byte order puts it.
+    hdr.to = 1;
+    codec->encode(wire, &hdr);
+    self->filter_off = 0;
+    for(int i = 0; i < sizeof(txpc_hdr_t); i++) {
+        if(wire[i] != 0) {
+            self->filter_off = i;
+            break;
+        }
+    }
+    self->n_values = 0;
+    memset(self->value_set, 0, sizeof(self->value_set));
+    xpc_resync_filter_add(self, 0);
+}
+
+void xpc_resync_filter_add(xpc_resync_filter_t *self, int to_chn) {
+    uint8_t v = to_chn & 0xff;
+    if(self->value_set[v >> 6] & (1ull << (v & 63))) {
+        return;
+    }
+    self->value_set[v >> 6] |= 1ull << (v & 63);
+    // past the vector limit, n_values keeps counting so the scan knows to
+    // use the table.
+    if(self->n_values < XPC_RESYNC_MAX_VALUES) {
+        self->values[self->n_values] = v;
+    }
+    self->n_values++;
+}
+
+static inline bool in_set(const xpc_resync_filter_t *self, uint8_t v) {
+    return (self->value_set[v >> 6] >> (v & 63)) & 1;
+}
+
+int xpc_resync_find(
+        const xpc_resync_filter_t *self, const uint8_t *buf, int start, int limit) {
+    const uint8_t *p = buf + self->filter_off;
+    int i = start;
+#ifdef __SSE2__
+    if(self->n_values <= XPC_RESYNC_MAX_VALUES) {
+        __m128i wanted[XPC_RESYNC_MAX_VALUES];
+        for(int v = 0; v < self->n_values; v++) {
+            wanted[v] = _mm_set1_epi8((char)self->values[v]);
+        }
+        for(; i + 16 <= limit; i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i hits = _mm_cmpeq_epi8(chunk, wanted[0]);
+            for(int v = 1; v < self->n_values; v++) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, wanted[v]));
+            }
+            int mask = _mm_movemask_epi8(hits);
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+    for(; i < limit; i++) {
+        if(in_set(self, p[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,185 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xpc_ring.h>
+
+#define XPC_RING_PAD(n) \
+    (((uint64_t)(n) + XPC_RING_ALIGN - 1) & ~(uint64_t)(XPC_RING_ALIGN - 1))
+#define XPC_RING_MIN_BYTES 64
+#define XPC_RING_MAX_BYTES (1u << 30)
+
+/**
+ * Bytes taken by a record of len bytes, including its length.
+ */
+static inline uint64_t xpc_ring_rec_bytes(uint32_t len) {
+    return XPC_RING_PAD(sizeof(uint32_t) + (uint64_t)len);
+}
+
+size_t xpc_ring_area_size(uint32_t ring_bytes) {
+    return sizeof(xpc_ring_area_t) + 2 * (sizeof(xpc_ring_ctl_t) + ring_bytes);
+}
+
+void xpc_ring_area_init(xpc_ring_area_t *area, uint32_t ring_bytes) {
+    xpc_ring_ctl_t *to_router = (xpc_ring_ctl_t *)(area + 1);
+    area->version = XPC_RING_VERSION;
+    area->ring_bytes = ring_bytes;
+    to_router->consumer_waiting = 1;
+    __atomic_store_n(&area->magic, XPC_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+int xpc_ring_area_open(
+        xpc_ring_area_t *area, size_t len, xpc_ring_t *to_router,
+        xpc_ring_t *to_client) {
+    if(len < sizeof(xpc_ring_area_t)
+            || __atomic_load_n(&area->magic, __ATOMIC_ACQUIRE) != XPC_RING_MAGIC
+            || area->version != XPC_RING_VERSION) {
+        return -1;
+    }
+    // the size is read once, the other side could change it.
+    uint32_t ring_bytes = area->ring_bytes;
+    if(ring_bytes < XPC_RING_MIN_BYTES || ring_bytes > XPC_RING_MAX_BYTES
+            || (ring_bytes & (ring_bytes - 1)) != 0
+            || xpc_ring_area_size(ring_bytes) > len) {
+        return -1;
+    }
+    uint8_t *p = (uint8_t *)(area + 1);
+    xpc_ring_t *rings[2] = {to_router, to_client};
+    for(int i = 0; i < 2; i++) {
+        xpc_ring_init(
+            rings[i], (xpc_ring_ctl_t *)p, p + sizeof(xpc_ring_ctl_t), ring_bytes
+        );
+        p += sizeof(xpc_ring_ctl_t) + ring_bytes;
+    }
+    return 0;
+}
+
+void xpc_ring_init(xpc_ring_t *self, xpc_ring_ctl_t *ctl, void *data, uint32_t size) {
+    memset(self, 0, sizeof(xpc_ring_t));
+    self->ctl = ctl;
+    self->data = data;
+    self->size = size;
+}
+
+uint32_t xpc_ring_max_record(const xpc_ring_t *self) {
+    // a record and the space skipped at the end before it always fit.
+    return self->size / 2 - sizeof(uint32_t);
+}
+
+/**
+ * Check whether need bytes fit after the producer's position.
+ */
+static bool xpc_ring_fits(xpc_ring_t *self, uint64_t need) {
+    if(self->pos + need - self->peer_pos <= self->size) {
+        return true;
+    }
+    self->peer_pos = __atomic_load_n(&self->ctl->tail, __ATOMIC_ACQUIRE);
+    return self->pos + need - self->peer_pos <= self->size;
+}
+
+/**
+ * Bytes a record of len bytes needs at the producer's position, counting
+ * the end of the ring it would have to skip.
+ */
+static uint64_t xpc_ring_need(const xpc_ring_t *self, uint32_t len) {
+    uint64_t need = xpc_ring_rec_bytes(len);
+    uint32_t off = self->pos & (self->size - 1);
+    return (off + need > self->size) ? need + (self->size - off):need;
+}
+
+void *xpc_ring_reserve(xpc_ring_t *self, uint32_t len) {
+    if(len > xpc_ring_max_record(self)
+            || !xpc_ring_fits(self, xpc_ring_need(self, len))) {
+        return NULL;
+    }
+    uint32_t off = self->pos & (self->size - 1);
+    if(off + xpc_ring_rec_bytes(len) > self->size) {
+        // the marker is published along with the record.
+        memcpy(self->data + off, &(uint32_t){XPC_RING_WRAP}, sizeof(uint32_t));
+        self->pos += self->size - off;
+        off = 0;
+    }
+    self->rec_len = len;
+    return self->data + off + sizeof(uint32_t);
+}
+
+bool xpc_ring_commit(xpc_ring_t *self) {
+    uint32_t off = self->pos & (self->size - 1);
+    memcpy(self->data + off, &self->rec_len, sizeof(uint32_t));
+    self->pos += xpc_ring_rec_bytes(self->rec_len);
+    __atomic_store_n(&self->ctl->head, self->pos, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&self->ctl->consumer_waiting, __ATOMIC_RELAXED) != 0;
+}
+
+const void *xpc_ring_peek(xpc_ring_t *self, uint32_t *len) {
+    uint32_t rec_len;
+    while(!self->broken) {
+        if(self->pos == self->peer_pos) {
+            self->peer_pos = __atomic_load_n(&self->ctl->head, __ATOMIC_ACQUIRE);
+            if(self->pos == self->peer_pos) {
+                return NULL;
+            }
+        }
+        // the other side may be hostile or buggy, nothing it wrote is
+        // trusted to stay within the ring.
+        uint64_t avail = self->peer_pos - self->pos;
+        uint32_t off = self->pos & (self->size - 1);
+        if(avail > self->size || avail % XPC_RING_ALIGN != 0) {
+            break;
+        }
+        memcpy(&rec_len, self->data + off, sizeof(uint32_t));
+        if(rec_len == XPC_RING_WRAP) {
+            if(avail <= self->size - off) {
+                break;
+            }
+            self->pos += self->size - off;
+            continue;
+        }
+        if(rec_len > xpc_ring_max_record(self)
+                || xpc_ring_rec_bytes(rec_len) > avail
+                || off + xpc_ring_rec_bytes(rec_len) > self->size) {
+            break;
+        }
+        self->rec_len = rec_len;
+        *len = rec_len;
+        return self->data + off + sizeof(uint32_t);
+    }
+    self->broken = true;
+    return NULL;
+}
+
+bool xpc_ring_release(xpc_ring_t *self) {
+    self->pos += xpc_ring_rec_bytes(self->rec_len);
+    __atomic_store_n(&self->ctl->tail, self->pos, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&self->ctl->producer_waiting, __ATOMIC_RELAXED) != 0;
+}
+
+bool xpc_ring_consumer_sleep(xpc_ring_t *self) {
+    __atomic_store_n(&self->ctl->consumer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    self->peer_pos = __atomic_load_n(&self->ctl->head, __ATOMIC_ACQUIRE);
+    if(self->peer_pos != self->pos) {
+        xpc_ring_consumer_wake(self);
+        return false;
+    }
+    return true;
+}
+
+void xpc_ring_consumer_wake(xpc_ring_t *self) {
+    __atomic_store_n(&self->ctl->consumer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+bool xpc_ring_producer_sleep(xpc_ring_t *self, uint32_t len) {
+    __atomic_store_n(&self->ctl->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(xpc_ring_fits(self, xpc_ring_need(self, len))) {
+        xpc_ring_producer_wake(self);
+        return false;
+    }
+    return true;
+}
+
+void xpc_ring_producer_wake(xpc_ring_t *self) {
+    __atomic_store_n(&self->ctl->producer_waiting, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <tinyxpc/tinyxpc.h>
+#include <alibc/containers/dynabuf.h>
+#include <alibc/containers/array.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_rt.h>
+
+struct xpc_rt {
+    uint64_t warm_ns;
+    uint64_t next_ns;
+    bool warm;
+    // counted by the caller, may be NULL.
+    const uint64_t *alloc_count;
+    // totals as of the last check.
+    uint64_t faults;
+    uint64_t heap;
+    uint64_t allocs;
+    uint64_t misses;
+    // increases since warm-up.
+    xpc_rt_usage_t since;
+};
+
+/**
+ * Write to every page of a buffer, so that it is backed by memory.
+ */
+static void xpc_rt_touch(void *buf, size_t len) {
+    memset(buf, 0, len);
+}
+
+static void xpc_rt_touch_stack(void) {
+    volatile uint8_t stack[XPC_RT_STACK_BYTES];
+    for(size_t i = 0; i < sizeof(stack); i += 1024) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Grow the pool of an output so that no message outgrows a buffer, and its
+ * stage so that it holds what it is flushed at, then touch them.
+ */
+static int xpc_rt_prefault_output(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    msg_queue_t *queue = out_ctx->msg_queue;
+    int msg_size = sizeof(txpc_hdr_t) + ctx->max_msg_size;
+    int nbufs = array_size(queue->cleared_buffers)
+        + hashmap_size(queue->inflight_buffers);
+    if(xpc_msg_queue_reserve(queue, (nbufs > 0) ? nbufs:1, msg_size) != 0) {
+        return -1;
+    }
+    for(int i = 0; i < array_size(queue->cleared_buffers); i++) {
+        msg_buf_t *buf = *(msg_buf_t **)array_fetch(queue->cleared_buffers, i);
+        xpc_rt_touch(buf->buf->buf, buf->buf->capacity);
+    }
+    if(out_ctx->coalesce_bytes > 0) {
+        int stage_size = out_ctx->coalesce_bytes + msg_size;
+        if(out_ctx->stage->capacity < stage_size
+                && dynabuf_resize(out_ctx->stage, stage_size) != 0) {
+            return -1;
+        }
+        // the bytes already staged are kept.
+        xpc_rt_touch(
+            (uint8_t *)out_ctx->stage->buf + out_ctx->stage_len,
+            out_ctx->stage->capacity - out_ctx->stage_len
+        );
+    }
+    return 0;
+}
+
+/**
+ * Grow the tables of contexts and routes, and the lists of their keys, to
+ * hold XPC_RT_SPARE_FDS and XPC_RT_SPARE_ROUTES more, by adding placeholders
+ * under keys no fd has and removing them again.
+ */
+static int xpc_rt_prefault_tables(xpc_router_t *ctx) {
+    int status = -1;
+    int n = 0;
+    xpc_in_ctx_t in_ctx = {0};
+    xpc_out_ctx_t out_ctx = {0};
+    xpc_route_t route = {0};
+    int n_in = array_size(ctx->in_fds) + XPC_RT_SPARE_FDS;
+    int n_out = array_size(ctx->out_fds) + XPC_RT_SPARE_FDS;
+    int n_routes = array_size(ctx->route_keys) + XPC_RT_SPARE_ROUTES;
+    if(array_resize(ctx->in_fds, n_in) != 0
+            || array_resize(ctx->out_fds, n_out) != 0
+            || array_resize(ctx->route_keys, n_routes) != 0) {
+        goto done;
+    }
+    for(n = 0; n < XPC_RT_SPARE_FDS; n++) {
+        hashmap_set(ctx->in_contexts, -1 - n, &in_ctx);
+        if(hashmap_status(ctx->in_contexts) != ALC_HASHMAP_SUCCESS) {
+            goto done;
+        }
+        hashmap_set(ctx->out_contexts, -1 - n, &out_ctx);
+        if(hashmap_status(ctx->out_contexts) != ALC_HASHMAP_SUCCESS) {
+            goto done;
+        }
+    }
+    for(int i = 0; i < XPC_RT_SPARE_ROUTES; i++) {
+        xpc_switch_tbl_entry_t key = {.fd = -1 - i, .to_chn = 0};
+        hashmap_set(ctx->switch_tbl, *(void**)&key, &route);
+        if(hashmap_status(ctx->switch_tbl) != ALC_HASHMAP_SUCCESS) {
+            n = (i > n) ? i:n;
+            goto done;
+        }
+    }
+    n = (XPC_RT_SPARE_ROUTES > n) ? XPC_RT_SPARE_ROUTES:n;
+    status = 0;
+done:
+    // removing a key which was not added does nothing.
+    for(int i = 0; i <= n; i++) {
+        xpc_switch_tbl_entry_t key = {.fd = -1 - i, .to_chn = 0};
+        hashmap_remove(ctx->in_contexts, -1 - i);
+        hashmap_remove(ctx->out_contexts, -1 - i);
+        hashmap_remove(ctx->switch_tbl, *(void**)&key);
+    }
+    return status;
+}
+
+/**
+ * Pin the calling thread and set its scheduling policy.
+ */
+static int xpc_rt_set_thread(int cpu, int priority) {
+    int err = 0;
+    if(cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = (cpu < CPU_SETSIZE) ?
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set):EINVAL;
+    }
+    if(err == 0 && priority > 0) {
+        struct sched_param param = {.sched_priority = priority};
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    errno = err;
+    return (err == 0) ? 0:-1;
+}
+
+/**
+ * Read the totals, and add what went up since the last check.
+ */
+static void xpc_rt_sample(xpc_router_t *ctx, xpc_rt_t *self) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    struct mallinfo2 heap = mallinfo2();
+    uint64_t faults = usage.ru_minflt + usage.ru_majflt;
+    uint64_t bytes = heap.arena + heap.hblkhd;
+    uint64_t allocs = (self->alloc_count != NULL) ?
+        __atomic_load_n(self->alloc_count, __ATOMIC_RELAXED):0;
+    uint64_t misses = 0;
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(
+            ctx->out_contexts, *(int *)array_fetch(ctx->out_fds, i)
+        );
+        misses += out_ctx->msg_queue->pool_misses;
+    }
+    if(self->warm) {
+        // outputs which were freed take their counts with them.
+        self->since.page_faults += (faults > self->faults) ? faults - self->faults:0;
+        self->since.heap_bytes += (bytes > self->heap) ? bytes - self->heap:0;
+        self->since.allocations += allocs - self->allocs;
+        self->since.pool_misses += (misses > self->misses) ? misses - self->misses:0;
+    }
+    self->faults = faults;
+    self->heap = bytes;
+    self->allocs = allocs;
+    self->misses = misses;
+}
+
+int xpc_rt_enable(xpc_router_t *ctx, const xpc_rt_opts_t *opts) {
+    int status = -1;
+    xpc_rt_t *r = calloc(1, sizeof(xpc_rt_t));
+    if(r == NULL) {
+        goto done;
+    }
+    if(opts->priority < 0 || opts->priority > sched_get_priority_max(SCHED_FIFO)) {
+        errno = EINVAL;
+        goto bad_rt;
+    }
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(
+            ctx->out_contexts, *(int *)array_fetch(ctx->out_fds, i)
+        );
+        if(xpc_rt_prefault_output(ctx, out_ctx) != 0) {
+            errno = ENOMEM;
+            goto bad_rt;
+        }
+    }
+    if(xpc_rt_prefault_tables(ctx) != 0) {
+        errno = ENOMEM;
+        goto bad_rt;
+    }
+    xpc_rt_touch_stack();
+    if(opts->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        goto bad_rt;
+    }
+    if(xpc_rt_set_thread(opts->cpu, opts->priority) != 0) {
+        goto bad_rt;
+    }
+    // freed memory stays with the process, so it is not faulted in again.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    r->alloc_count = opts->alloc_count;
+    r->warm_ns = xpc_monotonic_ns() + (uint64_t)opts->warmup_ms * 1000000;
+    r->next_ns = r->warm_ns;
+    xpc_rt_free(ctx->rt);
+    ctx->rt = r;
+    status = 0;
+    goto done;
+
+bad_rt:
+    free(r);
+done:
+    return status;
+}
+
+int xpc_rt_poll(xpc_router_t *ctx) {
+    xpc_rt_t *self = ctx->rt;
+    if(self == NULL) {
+        return -1;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    if(now >= self->next_ns) {
+        xpc_rt_usage_t before = self->since;
+        xpc_rt_sample(ctx, self);
+        self->warm = true;
+        if(memcmp(&before, &self->since, sizeof(before)) != 0) {
+            fprintf(stderr, "realtime: %llu page faults, %llu heap bytes, "
+                "%llu allocations, %llu message buffers allocated since "
+                "warm-up\n",
+                (unsigned long long)self->since.page_faults,
+                (unsigned long long)self->since.heap_bytes,
+                (unsigned long long)self->since.allocations,
+                (unsigned long long)self->since.pool_misses);
+        }
+        self->next_ns = now + (uint64_t)XPC_RT_CHECK_MS * 1000000;
+    }
+    // round up, epoll timeouts are in milliseconds.
+    return (self->next_ns - now + 999999) / 1000000;
+}
+
+int xpc_rt_violations(xpc_router_t *ctx, xpc_rt_usage_t *usage) {
+    if(ctx->rt == NULL || !ctx->rt->warm) {
+        return -1;
+    }
+    xpc_rt_sample(ctx, ctx->rt);
+    *usage = ctx->rt->since;
+    return 0;
+}
+
+void xpc_rt_free(xpc_rt_t *self) {
+    free(self);
+}
@@ -0,0 +1,173 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_sched.h>
+
+/**
+ * Bytes a weight is worth in one round.
+ */
+static int64_t xpc_sched_share(xpc_router_t *ctx, int weight) {
+    return (int64_t)ctx->sched_quantum * ((weight > 0) ? weight:1);
+}
+
+/**
+ * Give an fd its share for a round. At most one share of overshoot is
+ * carried, the fd is then served once in the round whatever is left, so a
+ * message much larger than the share cannot starve it.
+ */
+static int64_t xpc_sched_refill(xpc_router_t *ctx, int64_t deficit, int weight) {
+    int64_t share = xpc_sched_share(ctx, weight);
+    return ((deficit > -share) ? deficit:-share) + share;
+}
+
+int xpc_sched_enable(xpc_router_t *ctx, int quantum) {
+    if(quantum < 0) {
+        return -1;
+    }
+    ctx->sched_quantum = quantum;
+    return 0;
+}
+
+int xpc_sched_set_fd_weight(xpc_router_t *ctx, int fd, int weight) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    if((in_ctx == NULL && out_ctx == NULL) || weight < 0) {
+        return -1;
+    }
+    if(in_ctx != NULL) {
+        in_ctx->sched_weight = weight;
+    }
+    if(out_ctx != NULL) {
+        out_ctx->sched_weight = weight;
+    }
+    return 0;
+}
+
+int xpc_sched_set_route_weight(xpc_router_t *ctx, int ifd, int ito, int weight) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL || weight < 0) {
+        return -1;
+    }
+    route->sched_weight = weight;
+    return 0;
+}
+
+int xpc_sched_read(xpc_router_t *ctx, int fd) {
+    int bytes_read = 0;
+    int rd_bytes = 0;
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(ctx->sched_quantum == 0 || in_ctx == NULL) {
+        return xpc_accumulate_msg(ctx, fd);
+    }
+    in_ctx->sched_deficit = xpc_sched_refill(
+        ctx, in_ctx->sched_deficit, in_ctx->sched_weight
+    );
+    do {
+        rd_bytes = xpc_accumulate_msg(ctx, fd);
+        // a client may have closed, and new clients move the contexts.
+        in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+        if(in_ctx == NULL) {
+            break;
+        }
+        if(rd_bytes <= 0) {
+            // nothing more to read, nothing is kept for later.
+            in_ctx->sched_deficit = 0;
+            break;
+        }
+        in_ctx->sched_deficit -= rd_bytes;
+        bytes_read += rd_bytes;
+    } while(in_ctx->sched_deficit > 0);
+    return bytes_read;
+}
+
+int xpc_sched_write(xpc_router_t *ctx, int fd) {
+    int bytes_written = 0;
+    int wr_bytes = 0;
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    if(ctx->sched_quantum == 0 || out_ctx == NULL) {
+        return xpc_write_msg(ctx, fd);
+    }
+    out_ctx->sched_deficit = xpc_sched_refill(
+        ctx, out_ctx->sched_deficit, out_ctx->sched_weight
+    );
+    do {
+        wr_bytes = xpc_write_msg(ctx, fd);
+        // a client may have closed, or a retired output been freed.
+        out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+        if(out_ctx == NULL) {
+            break;
+        }
+        if(wr_bytes <= 0) {
+            out_ctx->sched_deficit = 0;
+            break;
+        }
+        out_ctx->sched_deficit -= wr_bytes;
+        bytes_written += wr_bytes;
+    } while(out_ctx->sched_deficit > 0);
+    return bytes_written;
+}
+
+typedef struct {
+    xpc_router_t *router;
+    xpc_out_ctx_t *out_ctx;
+    // messages seen from routes which are scheduled.
+    int waiting;
+} xpc_sched_pick_t;
+
+static xpc_route_t *xpc_sched_route(xpc_router_t *ctx, const msg_buf_t *buf) {
+    if(buf->src_fd < 0) {
+        return NULL;
+    }
+    xpc_switch_tbl_entry_t key = {.fd = buf->src_fd, .to_chn = buf->src_chn};
+    return hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+}
+
+/**
+ * Accept a message if its route has some of its share left. A route gets
+ * its share for the round of the output the first time one of its
+ * messages is seen in it.
+ */
+static bool xpc_sched_pick(void *arg, const msg_buf_t *buf) {
+    xpc_sched_pick_t *pick = arg;
+    xpc_route_t *route = xpc_sched_route(pick->router, buf);
+    if(route == NULL) {
+        return true;
+    }
+    pick->waiting++;
+    if(route->sched_round != pick->out_ctx->sched_round) {
+        int64_t share = xpc_sched_share(pick->router, route->sched_weight);
+        route->sched_round = pick->out_ctx->sched_round;
+        route->sched_deficit += share;
+        // what was left when it had nothing waiting is not saved up.
+        if(route->sched_deficit > share) {
+            route->sched_deficit = share;
+        }
+    }
+    return route->sched_deficit > 0;
+}
+
+msg_buf_t *xpc_sched_dequeue(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    msg_buf_t *msg_buf = NULL;
+    xpc_sched_pick_t pick = {.router = ctx, .out_ctx = out_ctx, .waiting = 0};
+    if(ctx->sched_quantum == 0) {
+        return xpc_msg_dequeue_final(out_ctx->msg_queue);
+    }
+    do {
+        pick.waiting = 0;
+        msg_buf = xpc_msg_dequeue_select(
+            out_ctx->msg_queue, xpc_sched_pick, &pick
+        );
+        if(msg_buf == NULL && pick.waiting > 0) {
+            // every route with messages waiting used up its share.
+            out_ctx->sched_round++;
+        }
+    } while(msg_buf == NULL && pick.waiting > 0);
+    xpc_route_t *route = (msg_buf == NULL) ? NULL:xpc_sched_route(ctx, msg_buf);
+    if(route != NULL) {
+        route->sched_deficit -= msg_buf->size;
+    }
+    return msg_buf;
+}
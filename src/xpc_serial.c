@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+// termios2 lives in the kernel headers, which clash with <termios.h>, so
+// this file does not use the libc termios interface at all.
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include <xpc_serial.h>
+
+int xpc_serial_configure(
+        int fd, const xpc_serial_opts_t *opts, xpc_serial_status_t *status) {
+    struct termios2 tio;
+    int r = -1;
+    if(opts->baud <= 0 || opts->vmin < 0 || opts->vmin > 255
+            || opts->vtime_ds < 0 || opts->vtime_ds > 255) {
+        errno = EINVAL;
+        goto done;
+    }
+    if(ioctl(fd, TCGETS2, &tio) == -1) {
+        goto done;
+    }
+
+    // raw mode, the same as cfmakeraw.
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL
+        | IXON | IXOFF | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+
+    // the same arbitrary rate in both directions.
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = opts->baud;
+    tio.c_ospeed = opts->baud;
+
+    tio.c_cc[VMIN] = opts->vmin;
+    tio.c_cc[VTIME] = opts->vtime_ds;
+    if(ioctl(fd, TCSETS2, &tio) == -1) {
+        goto done;
+    }
+
+    bool low_latency = false;
+    struct serial_struct serial;
+    if(ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        if(opts->low_latency) {
+            serial.flags |= ASYNC_LOW_LATENCY;
+        }
+        else {
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+        }
+        // read it back, some drivers accept the call and ignore the flag.
+        if(ioctl(fd, TIOCSSERIAL, &serial) == 0
+                && ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+            low_latency = (serial.flags & ASYNC_LOW_LATENCY) != 0;
+        }
+    }
+
+    if(status != NULL) {
+        // the driver rounds the rate to what its clock can divide down to.
+        if(ioctl(fd, TCGETS2, &tio) == -1) {
+            goto done;
+        }
+        status->baud = tio.c_ospeed;
+        status->low_latency = low_latency;
+    }
+    r = 0;
+done:
+    return r;
+}
+
+int xpc_serial_open(
+        const char *path, const xpc_serial_opts_t *opts,
+        xpc_serial_status_t *status) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd == -1) {
+        goto done;
+    }
+
+    // set the port as being exclusive
+    ioctl(fd, TIOCEXCL, NULL);
+
+    if(xpc_serial_configure(fd, opts, status) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+done:
+    return fd;
+}
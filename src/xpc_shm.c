@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xpc_utils.h>
+#include <xpc_clients.h>
+#include <xpc_shm.h>
+#include <xpc_ring.h>
+#include <alibc/containers/hashmap.h>
+
+/**
+ * Ring a doorbell. A full eventfd counter still wakes its reader, so
+ * failures are ignored.
+ */
+static void xpc_shm_ring(int bell) {
+    uint64_t one = 1;
+    if(write(bell, &one, sizeof(one)) != sizeof(one)) {
+        // EAGAIN: the counter is saturated, the reader is woken anyway.
+    }
+}
+
+/**
+ * Check that a doorbell passed by a client is an eventfd, and make it
+ * non-blocking, so ringing or draining it never blocks the router.
+ */
+static int xpc_shm_bell(int bell) {
+    char link[32];
+    char target[32] = {0};
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", bell);
+    if(bell < 0 || readlink(link, target, sizeof(target) - 1) == -1
+            || strcmp(target, "anon_inode:[eventfd]") != 0) {
+        return -1;
+    }
+    int flags = fcntl(bell, F_GETFL);
+    if(flags == -1 || fcntl(bell, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int xpc_shm_attach(
+        xpc_router_t *ctx, int cfd, int memfd, int router_bell, int client_bell) {
+    int status = -1;
+    struct stat st;
+    // a client shrinking the area under the mapping would fault the router.
+    const int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+    xpc_in_ctx_t bell_ctx = {0};
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    xpc_shm_link_t *r = calloc(1, sizeof(xpc_shm_link_t));
+    if(r == NULL) {
+        close(router_bell);
+        close(client_bell);
+        goto done;
+    }
+    r->cfd = cfd;
+    r->router_bell = router_bell;
+    r->client_bell = client_bell;
+    if(in_ctx == NULL || in_ctx->kind != XPC_IN_SEQPACKET || in_ctx->shm != NULL
+            || xpc_shm_bell(router_bell) != 0 || xpc_shm_bell(client_bell) != 0
+            || (fcntl(memfd, F_GET_SEALS) & seals) != seals
+            || fstat(memfd, &st) != 0
+            || st.st_size < (off_t)sizeof(xpc_ring_area_t)) {
+        goto bad_link;
+    }
+    r->lfd = in_ctx->listen_fd;
+    r->area_len = st.st_size;
+    r->area = mmap(
+        NULL, r->area_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0
+    );
+    if(r->area == MAP_FAILED) {
+        r->area = NULL;
+        goto bad_link;
+    }
+    if(xpc_ring_area_open(r->area, r->area_len, &r->rx, &r->tx) != 0) {
+        goto bad_link;
+    }
+
+    bell_ctx.kind = XPC_IN_SHM;
+    bell_ctx.listen_fd = r->lfd;
+    bell_ctx.codec = in_ctx->codec;
+    bell_ctx.shm = r;
+    hashmap_set(ctx->in_contexts, router_bell, &bell_ctx);
+    if(hashmap_status(ctx->in_contexts) != ALC_HASHMAP_SUCCESS) {
+        goto bad_link;
+    }
+    if(xpc_keys_add(ctx->in_fds, &router_bell, sizeof(router_bell)) != 0
+            || (ctx->io_watch_fd_cb != NULL
+                && ctx->io_watch_fd_cb(ctx->io_event_context, router_bell) != 0)) {
+        hashmap_remove(ctx->in_contexts, router_bell);
+        xpc_keys_remove(ctx->in_fds, &router_bell, sizeof(router_bell));
+        goto bad_link;
+    }
+    // the table may have moved when the doorbell was added.
+    in_ctx = hashmap_fetch(ctx->in_contexts, cfd);
+    in_ctx->shm = r;
+    status = 0;
+    goto done;
+
+bad_link:
+    xpc_shm_link_free(r);
+done:
+    close(memfd);
+    return status;
+}
+
+int xpc_shm_recv(xpc_router_t *ctx, int router_bell) {
+    int bytes_read = 0;
+    uint64_t rung;
+    bool wake_client = false;
+    xpc_in_ctx_t *bell_ctx = hashmap_fetch(ctx->in_contexts, router_bell);
+    if(bell_ctx == NULL || bell_ctx->shm == NULL) {
+        goto done;
+    }
+    xpc_shm_link_t *link = bell_ctx->shm;
+    if(read(router_bell, &rung, sizeof(rung)) != sizeof(rung)) {
+        // EAGAIN: called without the doorbell having rung.
+    }
+    xpc_ring_consumer_wake(&link->rx);
+    for(int i = 0; i < XPC_SHM_RECV_BATCH; i++) {
+        uint32_t len;
+        const uint8_t *msg = xpc_ring_peek(&link->rx, &len);
+        if(msg == NULL) {
+            if(link->rx.broken) {
+                // closing the client detaches it as well.
+                xpc_client_close(ctx, link->cfd);
+                goto done;
+            }
+            if(xpc_ring_consumer_sleep(&link->rx)) {
+                break;
+            }
+            continue;
+        }
+        xpc_client_deliver(ctx, link->cfd, msg, len);
+        bytes_read += len;
+        wake_client = xpc_ring_release(&link->rx) || wake_client;
+        if(i == XPC_SHM_RECV_BATCH - 1) {
+            // the client is not told to ring while the router is awake, so
+            // the router rings itself to come back for the rest.
+            xpc_shm_ring(link->router_bell);
+        }
+    }
+    if(wake_client) {
+        xpc_shm_ring(link->client_bell);
+    }
+done:
+    return bytes_read;
+}
+
+int xpc_shm_send(
+        xpc_router_t *ctx, xpc_shm_link_t *link, const msg_buf_t *msg_buf) {
+    uint8_t *dst = xpc_ring_reserve(&link->tx, msg_buf->size);
+    if(dst == NULL) {
+        return -1;
+    }
+    memcpy(dst, (uint8_t *)msg_buf->buf->buf + msg_buf->wr_offset, msg_buf->size);
+    if(xpc_ring_commit(&link->tx)) {
+        xpc_shm_ring(link->client_bell);
+    }
+    return 0;
+}
+
+void xpc_shm_detach(xpc_router_t *ctx, xpc_shm_link_t *link) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, link->cfd);
+    if(in_ctx != NULL) {
+        in_ctx->shm = NULL;
+    }
+    if(ctx->io_forget_fd_cb != NULL) {
+        ctx->io_forget_fd_cb(ctx->io_event_context, link->router_bell);
+    }
+    hashmap_remove(ctx->in_contexts, link->router_bell);
+    xpc_keys_remove(
+        ctx->in_fds, &link->router_bell, sizeof(link->router_bell)
+    );
+    xpc_shm_link_free(link);
+}
+
+void xpc_shm_link_free(xpc_shm_link_t *link) {
+    if(link != NULL) {
+        if(link->area != NULL) {
+            munmap(link->area, link->area_len);
+        }
+        close(link->router_bell);
+        close(link->client_bell);
+        free(link);
+    }
+}
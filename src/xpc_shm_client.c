@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_endian.h>
+#include <xpc_clients.h>
+#include <xpc_ring.h>
+#include <xpc_shm_client.h>
+
+struct xpc_shm_client {
+    int sock;
+    int router_bell;
+    int client_bell;
+    xpc_ring_area_t *area;
+    size_t area_len;
+    xpc_ring_t to_router;
+    xpc_ring_t from_router;
+    const xpc_hdr_codec_t *codec;
+};
+
+/**
+ * Send a control message to the router over the socket, with fds attached
+ * if n_fds is not 0.
+ */
+static int xpc_shm_client_control(
+        xpc_shm_client_t *self, int type, const void *payload, int len,
+        const int *fds, int n_fds) {
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    txpc_hdr_t hdr = {.to = 0, .from = 0, .type = type, .size = len};
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(3 * sizeof(int))];
+    } cbuf;
+    struct iovec iov[2] = {
+        {.iov_base = wire, .iov_len = sizeof(wire)},
+        {.iov_base = (void *)payload, .iov_len = len}
+    };
+    struct msghdr mh = {.msg_iov = iov, .msg_iovlen = (len > 0) ? 2:1};
+    self->codec->encode(wire, &hdr);
+    if(n_fds > 0) {
+        memset(&cbuf, 0, sizeof(cbuf));
+        mh.msg_control = cbuf.buf;
+        mh.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, n_fds * sizeof(int));
+    }
+    return (sendmsg(self->sock, &mh, MSG_NOSIGNAL) == sizeof(wire) + len) ?
+        0:-1;
+}
+
+xpc_shm_client_t *xpc_shm_client_connect(const char *path, uint32_t ring_bytes) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int err = 0;
+    int memfd = -1;
+    xpc_shm_client_t *r = calloc(1, sizeof(xpc_shm_client_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->sock = r->router_bell = r->client_bell = -1;
+    r->codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    ring_bytes = (ring_bytes == 0) ? XPC_SHM_CLIENT_RING_BYTES:ring_bytes;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        goto bad_client;
+    }
+    strcpy(addr.sun_path, path);
+    r->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(r->sock == -1
+            || connect(r->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        goto bad_client;
+    }
+
+    r->area_len = xpc_ring_area_size(ring_bytes);
+    memfd = memfd_create("xpc_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    // the router only maps an area whose size is fixed.
+    if(memfd == -1 || ftruncate(memfd, r->area_len) != 0 || fcntl(
+            memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        goto bad_client;
+    }
+    r->area = mmap(
+        NULL, r->area_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0
+    );
+    if(r->area == MAP_FAILED) {
+        r->area = NULL;
+        goto bad_client;
+    }
+    xpc_ring_area_init(r->area, ring_bytes);
+    if(xpc_ring_area_open(
+            r->area, r->area_len, &r->to_router, &r->from_router) != 0) {
+        errno = EINVAL;
+        goto bad_client;
+    }
+    r->router_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->client_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->router_bell == -1 || r->client_bell == -1) {
+        goto bad_client;
+    }
+    int fds[3] = {memfd, r->router_bell, r->client_bell};
+    if(xpc_shm_client_control(r, XPC_CLIENT_SHM_ATTACH, NULL, 0, fds, 3) != 0) {
+        goto bad_client;
+    }
+    goto done;
+
+bad_client:
+    err = errno;
+    xpc_shm_client_close(r);
+    r = NULL;
+    errno = err;
+done:
+    // the mapping keeps the memory, and the router has its own fd.
+    if(memfd != -1) {
+        close(memfd);
+    }
+    return r;
+}
+
+int xpc_shm_client_subscribe(
+        xpc_shm_client_t *self, const uint32_t *chns, int n, bool subscribe) {
+    return xpc_shm_client_control(
+        self, subscribe ? XPC_CLIENT_SUBSCRIBE:XPC_CLIENT_UNSUBSCRIBE,
+        chns, n * sizeof(uint32_t), NULL, 0
+    );
+}
+
+int xpc_shm_client_send(
+        xpc_shm_client_t *self, const txpc_hdr_t *hdr, const void *payload) {
+    uint64_t len = sizeof(txpc_hdr_t) + (uint64_t)hdr->size;
+    if(len > xpc_ring_max_record(&self->to_router)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint8_t *dst = xpc_ring_reserve(&self->to_router, len);
+    if(dst == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if(self->to_router.ctl->producer_waiting) {
+        xpc_ring_producer_wake(&self->to_router);
+    }
+    self->codec->encode(dst, hdr);
+    memcpy(dst + sizeof(txpc_hdr_t), payload, hdr->size);
+    if(xpc_ring_commit(&self->to_router)) {
+        uint64_t one = 1;
+        if(write(self->router_bell, &one, sizeof(one)) != sizeof(one)) {
+            // the counter is saturated, the router is woken anyway.
+        }
+    }
+    return 0;
+}
+
+int xpc_shm_client_recv(
+        xpc_shm_client_t *self, txpc_hdr_t *hdr, void *payload, int max) {
+    uint32_t len;
+    const uint8_t *msg = xpc_ring_peek(&self->from_router, &len);
+    if(msg == NULL || len < sizeof(txpc_hdr_t)) {
+        errno = (msg == NULL && !self->from_router.broken) ? EAGAIN:EPROTO;
+        return -1;
+    }
+    int payload_len = len - sizeof(txpc_hdr_t);
+    if(payload_len > max) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // whoever receives is awake, however it was woken.
+    if(self->from_router.ctl->consumer_waiting) {
+        xpc_ring_consumer_wake(&self->from_router);
+    }
+    self->codec->decode(hdr, msg);
+    memcpy(payload, msg + sizeof(txpc_hdr_t), payload_len);
+    // the router never waits for room, it drops what does not fit.
+    xpc_ring_release(&self->from_router);
+    return payload_len;
+}
+
+int xpc_shm_client_fd(xpc_shm_client_t *self) {
+    return self->client_bell;
+}
+
+bool xpc_shm_client_arm(xpc_shm_client_t *self, int send_len) {
+    if(!xpc_ring_consumer_sleep(&self->from_router)) {
+        return false;
+    }
+    if(send_len > 0 && !xpc_ring_producer_sleep(
+            &self->to_router, sizeof(txpc_hdr_t) + send_len)) {
+        xpc_ring_consumer_wake(&self->from_router);
+        return false;
+    }
+    return true;
+}
+
+int xpc_shm_client_wait(xpc_shm_client_t *self, int send_len, int timeout_ms) {
+    int status = 0;
+    uint64_t rung;
+    if(!xpc_shm_client_arm(self, send_len)) {
+        return 0;
+    }
+    // the socket only reports the router hanging up.
+    struct pollfd pfd[2] = {
+        {.fd = self->client_bell, .events = POLLIN},
+        {.fd = self->sock, .events = 0}
+    };
+    if(poll(pfd, 2, timeout_ms) < 0) {
+        status = (errno == EINTR) ? 0:-1;
+    }
+    else if(pfd[1].revents & (POLLHUP | POLLERR)) {
+        errno = EPIPE;
+        status = -1;
+    }
+    if(read(self->client_bell, &rung, sizeof(rung)) != sizeof(rung)) {
+        // EAGAIN: woken by the timeout or a hangup.
+    }
+    xpc_ring_consumer_wake(&self->from_router);
+    xpc_ring_producer_wake(&self->to_router);
+    return status;
+}
+
+void xpc_shm_client_close(xpc_shm_client_t *self) {
+    if(self != NULL) {
+        if(self->area != NULL) {
+            munmap(self->area, self->area_len);
+        }
+        if(self->sock != -1) close(self->sock);
+        if(self->router_bell != -1) close(self->router_bell);
+        if(self->client_bell != -1) close(self->client_bell);
+        free(self);
+    }
+}
@@ -0,0 +1,462 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_sink.h>
+
+struct xpc_sink {
+    // the directory of the segments, owned by whoever opened it.
+    int dir_fd;
+    char *base;
+    xpc_sink_opts_t opts;
+    bool big_endian;
+    // offset of the first record of each segment.
+    uint64_t data_off;
+    // the segment being written, -1 and NULL if there is none.
+    int fd;
+    uint8_t *map;
+    // bytes of the segment between two index entries.
+    uint64_t index_step;
+    // offset up to which the sync policy was applied.
+    uint64_t synced;
+    // CLOCK_MONOTONIC times the segment is finished and synced at.
+    uint64_t rotate_ns;
+    uint64_t sync_ns;
+    xpc_sink_stats_t stats;
+};
+
+#define XPC_SINK_PAD(n) \
+    (((n) + XPC_SINK_ALIGN - 1) & ~(size_t)(XPC_SINK_ALIGN - 1))
+
+#define XPC_SINK_NAME_MAX 24
+
+static uint64_t xpc_realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static xpc_sink_hdr_t *xpc_sink_hdr(xpc_sink_t *self) {
+    return (xpc_sink_hdr_t *)self->map;
+}
+
+/**
+ * Create, allocate and map a new segment, named after the current time.
+ */
+static int xpc_sink_start(xpc_sink_t *self) {
+    int err = 0;
+    char name[strlen(self->base) + XPC_SINK_NAME_MAX];
+    uint64_t ms = xpc_realtime_ns() / 1000000;
+    // segments started within the same millisecond take the next one.
+    for(int i = 0; i < 1000; i++, ms++) {
+        snprintf(name, sizeof(name), "%s.%llu", self->base, (unsigned long long)ms);
+        self->fd = openat(
+            self->dir_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644
+        );
+        if(self->fd != -1 || errno != EEXIST) {
+            break;
+        }
+    }
+    if(self->fd == -1) {
+        return -1;
+    }
+    // a full disk fails here, rather than with SIGBUS when archiving.
+    if((err = posix_fallocate(self->fd, 0, self->opts.segment_bytes)) != 0) {
+        errno = err;
+        goto bad_segment;
+    }
+    self->map = mmap(
+        NULL, self->opts.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+        self->fd, 0
+    );
+    if(self->map == MAP_FAILED) {
+        self->map = NULL;
+        goto bad_segment;
+    }
+    xpc_sink_hdr_t *hdr = xpc_sink_hdr(self);
+    hdr->version = XPC_SINK_VERSION;
+    hdr->flags = self->big_endian ? XPC_SINK_BIG_ENDIAN:0;
+    hdr->index_max = self->opts.index_max;
+    hdr->index_count = 0;
+    hdr->reserved = 0;
+    hdr->data_off = self->data_off;
+    hdr->end = hdr->data_off;
+    hdr->capacity = self->opts.segment_bytes;
+    hdr->first_ns = 0;
+    hdr->last_ns = 0;
+    __atomic_store_n(&hdr->magic, XPC_SINK_MAGIC, __ATOMIC_RELEASE);
+
+    uint64_t now = xpc_monotonic_ns();
+    self->index_step = (hdr->capacity - hdr->data_off) / hdr->index_max;
+    self->synced = 0;
+    self->sync_ns = now + (uint64_t)self->opts.sync_ms * 1000000;
+    self->rotate_ns = now + (uint64_t)self->opts.rotate_ms * 1000000;
+    self->stats.segments++;
+    return 0;
+
+bad_segment:
+    err = errno;
+    close(self->fd);
+    self->fd = -1;
+    unlinkat(self->dir_fd, name, 0);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Apply the sync policy to what was added to the segment since last time.
+ */
+static void xpc_sink_sync(xpc_sink_t *self) {
+    xpc_sink_hdr_t *hdr = xpc_sink_hdr(self);
+    uint64_t end = hdr->end;
+    if(self->synced == end) {
+        return;
+    }
+    if(self->opts.sync == XPC_SINK_SYNC_ASYNC) {
+        // the header and index change along with the records.
+        sync_file_range(self->fd, 0, hdr->data_off, SYNC_FILE_RANGE_WRITE);
+        sync_file_range(
+            self->fd, self->synced, end - self->synced, SYNC_FILE_RANGE_WRITE
+        );
+    }
+    else if(self->opts.sync == XPC_SINK_SYNC_DATA) {
+        fdatasync(self->fd);
+    }
+    if(self->opts.sync != XPC_SINK_SYNC_NONE) {
+        self->stats.syncs++;
+    }
+    self->synced = end;
+}
+
+/**
+ * Close the segment being written, truncated to its records.
+ */
+static void xpc_sink_finish(xpc_sink_t *self) {
+    xpc_sink_hdr_t *hdr = xpc_sink_hdr(self);
+    uint64_t end = hdr->end;
+    __atomic_or_fetch(&hdr->flags, XPC_SINK_CLOSED, __ATOMIC_RELEASE);
+    munmap(self->map, self->opts.segment_bytes);
+    self->map = NULL;
+    if(ftruncate(self->fd, end) != 0) {
+        // the unused tail stays, readers stop at hdr->end anyway.
+    }
+    // once more, for the flag and what is left.
+    if(self->opts.sync == XPC_SINK_SYNC_ASYNC) {
+        sync_file_range(self->fd, 0, end, SYNC_FILE_RANGE_WRITE);
+        self->stats.syncs++;
+    }
+    else if(self->opts.sync == XPC_SINK_SYNC_DATA) {
+        fdatasync(self->fd);
+        self->stats.syncs++;
+    }
+    close(self->fd);
+    self->fd = -1;
+}
+
+/**
+ * Append a message to the segment being written, starting a new one if it
+ * is full or there is none.
+ */
+static int xpc_sink_append(
+        xpc_sink_t *self, const msg_buf_t *msg_buf, uint64_t time_ns) {
+    size_t rec_len = XPC_SINK_PAD(sizeof(xpc_sink_rec_t) + msg_buf->size);
+    if(rec_len > self->opts.segment_bytes - self->data_off) {
+        // larger than a whole segment.
+        return -1;
+    }
+    if(self->map != NULL
+            && xpc_sink_hdr(self)->end + rec_len > self->opts.segment_bytes) {
+        xpc_sink_finish(self);
+    }
+    if(self->map == NULL && xpc_sink_start(self) != 0) {
+        return -1;
+    }
+    xpc_sink_hdr_t *hdr = xpc_sink_hdr(self);
+    xpc_sink_rec_t *rec = (xpc_sink_rec_t *)(self->map + hdr->end);
+    // the wall clock may step back, xpc_sink_seek needs times in order.
+    time_ns = (time_ns > hdr->last_ns) ? time_ns:hdr->last_ns;
+    rec->rec_len = rec_len;
+    rec->msg_len = msg_buf->size;
+    rec->time_ns = time_ns;
+    rec->ingress_ns = msg_buf->ingress_ns;
+    rec->in_fd = msg_buf->src_fd;
+    rec->in_chn = msg_buf->src_chn;
+    memcpy(rec + 1, msg_buf->buf->buf, msg_buf->size);
+
+    // the first record at or past each step is indexed.
+    uint32_t n = hdr->index_count;
+    if(n < hdr->index_max && hdr->end >= hdr->data_off + n * self->index_step) {
+        xpc_sink_index_t *index = (xpc_sink_index_t *)(hdr + 1);
+        index[n].time_ns = time_ns;
+        index[n].offset = hdr->end;
+        __atomic_store_n(&hdr->index_count, n + 1, __ATOMIC_RELEASE);
+    }
+    if(hdr->first_ns == 0) {
+        hdr->first_ns = time_ns;
+    }
+    hdr->last_ns = time_ns;
+    if(self->synced == hdr->end) {
+        // the oldest bytes not synced yet wait at most sync_ms.
+        self->sync_ns = xpc_monotonic_ns() + (uint64_t)self->opts.sync_ms * 1000000;
+    }
+    // a reader of the live segment sees whole records only.
+    __atomic_store_n(&hdr->end, hdr->end + rec_len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int xpc_sink_open(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if(slash == NULL) {
+        return open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if(slash == path) {
+        return open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    char dir[slash - path + 1];
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    return open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+int xpc_sink_enable(
+        xpc_router_t *ctx, int fd, const char *path, const xpc_sink_opts_t *opts) {
+    int status = -1;
+    xpc_sink_t *r = NULL;
+    const char *base = strrchr(path, '/');
+    base = (base == NULL) ? path:base + 1;
+    uint64_t data_off = XPC_SINK_PAD(
+        sizeof(xpc_sink_hdr_t) + (uint64_t)opts->index_max * sizeof(xpc_sink_index_t)
+    );
+    if(opts->index_max == 0 || opts->segment_bytes <= data_off
+            || opts->segment_bytes > UINT32_MAX || base[0] == '\0') {
+        errno = EINVAL;
+        goto done;
+    }
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    if(out_ctx == NULL) {
+        out_ctx = xpc_add_output(ctx, fd);
+    }
+    if(out_ctx == NULL) {
+        errno = ENOMEM;
+        goto done;
+    }
+    if(out_ctx->sink != NULL || out_ctx->fanout || out_ctx->seqpacket
+            || out_ctx->spill != NULL) {
+        errno = EINVAL;
+        goto done;
+    }
+    r = calloc(1, sizeof(xpc_sink_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->base = strdup(base);
+    if(r->base == NULL) {
+        free(r);
+        goto done;
+    }
+    r->dir_fd = fd;
+    r->opts = *opts;
+    r->data_off = data_off;
+    r->big_endian = out_ctx->codec->big_endian;
+    r->fd = -1;
+    r->map = NULL;
+    out_ctx->sink = r;
+    ctx->sinks++;
+    status = 0;
+done:
+    return status;
+}
+
+void xpc_sink_drain(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    xpc_sink_t *self = out_ctx->sink;
+    msg_buf_t *msg_buf = NULL;
+    uint64_t now = xpc_monotonic_ns();
+    uint64_t time_ns = xpc_realtime_ns();
+    if(self->map != NULL && self->opts.rotate_ms > 0 && now >= self->rotate_ns
+            && xpc_sink_hdr(self)->end > xpc_sink_hdr(self)->data_off) {
+        xpc_sink_finish(self);
+    }
+    while((msg_buf = xpc_msg_dequeue_final(out_ctx->msg_queue)) != NULL) {
+        if(xpc_sink_append(self, msg_buf, time_ns) != 0) {
+            self->stats.lost++;
+            if(msg_buf->src_fd >= 0) {
+                xpc_count_drop(
+                    ctx, msg_buf->src_fd, msg_buf->src_chn, XPC_DROP_QUEUE_FULL
+                );
+            }
+        }
+        else {
+            self->stats.msgs++;
+            self->stats.bytes += msg_buf->size;
+            out_ctx->tx.msgs++;
+            out_ctx->tx.bytes += msg_buf->size;
+            xpc_record_latency(
+                ctx, msg_buf->src_fd, msg_buf->src_chn, now - msg_buf->ingress_ns
+            );
+        }
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+    }
+    if(self->map != NULL && self->opts.sync != XPC_SINK_SYNC_NONE
+            && xpc_sink_hdr(self)->end - self->synced >= self->opts.sync_bytes) {
+        xpc_sink_sync(self);
+    }
+}
+
+int xpc_sink_poll(xpc_router_t *ctx) {
+    uint64_t next_ns = UINT64_MAX;
+    if(ctx->sinks == 0) {
+        return -1;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(
+            ctx->out_contexts, *(int *)array_fetch(ctx->out_fds, i)
+        );
+        xpc_sink_t *self = out_ctx->sink;
+        if(self == NULL || self->map == NULL) {
+            continue;
+        }
+        xpc_sink_hdr_t *hdr = xpc_sink_hdr(self);
+        if(self->opts.rotate_ms > 0 && now >= self->rotate_ns) {
+            if(hdr->end > hdr->data_off) {
+                // the next message starts a new one.
+                xpc_sink_finish(self);
+                continue;
+            }
+            self->rotate_ns = now + (uint64_t)self->opts.rotate_ms * 1000000;
+        }
+        if(self->opts.rotate_ms > 0 && self->rotate_ns < next_ns) {
+            next_ns = self->rotate_ns;
+        }
+        if(self->opts.sync == XPC_SINK_SYNC_NONE || self->synced == hdr->end) {
+            continue;
+        }
+        if(now >= self->sync_ns) {
+            xpc_sink_sync(self);
+        }
+        else if(self->sync_ns < next_ns) {
+            next_ns = self->sync_ns;
+        }
+    }
+    if(next_ns == UINT64_MAX) {
+        return -1;
+    }
+    // round up, epoll timeouts are in milliseconds.
+    return (next_ns - now + 999999) / 1000000;
+}
+
+int xpc_sink_get_stats(xpc_router_t *ctx, int fd, xpc_sink_stats_t *stats) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    if(out_ctx == NULL || out_ctx->sink == NULL) {
+        return -1;
+    }
+    *stats = out_ctx->sink->stats;
+    return 0;
+}
+
+void xpc_sink_free(xpc_sink_t *self) {
+    if(self != NULL) {
+        if(self->map != NULL) {
+            xpc_sink_finish(self);
+        }
+        free(self->base);
+        free(self);
+    }
+}
+
+const xpc_sink_hdr_t *xpc_sink_map(const char *path, size_t *len) {
+    const xpc_sink_hdr_t *r = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        goto done;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(xpc_sink_hdr_t)) {
+        errno = EINVAL;
+        goto done;
+    }
+    r = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(r == MAP_FAILED) {
+        r = NULL;
+        goto done;
+    }
+    if(__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != XPC_SINK_MAGIC
+            || r->version != XPC_SINK_VERSION || r->end > st.st_size
+            || r->data_off > r->end || r->index_count > r->index_max
+            || r->data_off < sizeof(xpc_sink_hdr_t)
+                + (uint64_t)r->index_max * sizeof(xpc_sink_index_t)) {
+        munmap((void *)r, st.st_size);
+        r = NULL;
+        errno = EINVAL;
+        goto done;
+    }
+    *len = st.st_size;
+done:
+    if(fd != -1) {
+        close(fd);
+    }
+    return r;
+}
+
+void xpc_sink_unmap(const xpc_sink_hdr_t *hdr, size_t len) {
+    if(hdr != NULL) {
+        munmap((void *)hdr, len);
+    }
+}
+
+/**
+ * The record at an offset, or NULL if there is no complete one.
+ */
+static const xpc_sink_rec_t *xpc_sink_rec_at(
+        const xpc_sink_hdr_t *hdr, uint64_t off) {
+    uint64_t end = __atomic_load_n(&hdr->end, __ATOMIC_ACQUIRE);
+    if(off < hdr->data_off || off + sizeof(xpc_sink_rec_t) > end) {
+        return NULL;
+    }
+    const xpc_sink_rec_t *r = (const xpc_sink_rec_t *)((const uint8_t *)hdr + off);
+    // a damaged record ends the segment.
+    if(r->rec_len < sizeof(xpc_sink_rec_t) + r->msg_len
+            || off + r->rec_len > end) {
+        return NULL;
+    }
+    return r;
+}
+
+const xpc_sink_rec_t *xpc_sink_next(
+        const xpc_sink_hdr_t *hdr, const xpc_sink_rec_t *rec) {
+    uint64_t off = (rec == NULL) ?
+        hdr->data_off:((const uint8_t *)rec - (const uint8_t *)hdr) + rec->rec_len;
+    return xpc_sink_rec_at(hdr, off);
+}
+
+const xpc_sink_rec_t *xpc_sink_seek(const xpc_sink_hdr_t *hdr, uint64_t time_ns) {
+    const xpc_sink_index_t *index = (const xpc_sink_index_t *)(hdr + 1);
+    uint32_t count = __atomic_load_n(&hdr->index_count, __ATOMIC_ACQUIRE);
+    // the last entry older than time_ns, records before it are older too.
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(index[mid].time_ns < time_ns) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    const xpc_sink_rec_t *rec = (lo == 0) ?
+        xpc_sink_next(hdr, NULL):xpc_sink_rec_at(hdr, index[lo - 1].offset);
+    while(rec != NULL && rec->time_ns < time_ns) {
+        rec = xpc_sink_next(hdr, rec);
+    }
+    return rec;
+}
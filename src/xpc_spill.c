@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <alibc/containers/dynabuf.h>
+#include <alibc/containers/hashmap.h>
+#include <xpc_utils.h>
+#include <xpc_msg_queue.h>
+#include <xpc_spill.h>
+
+typedef struct {
+    // the number in the name of the file.
+    uint64_t seq;
+    // NULL while it is neither written nor read.
+    uint8_t *map;
+    // offset past the last record, of the next record to read, and past
+    // what was advised to be read ahead.
+    size_t end;
+    size_t rd;
+    size_t ra;
+} xpc_spill_seg_t;
+
+struct xpc_spill {
+    char *path;
+    int64_t mem_bytes;
+    size_t seg_len;
+    // ring of the segments which exist, the oldest is read and the newest
+    // written.
+    xpc_spill_seg_t *segs;
+    int max_segs;
+    int head;
+    uint64_t next_seq;
+    // the oldest message could not be fed back, and when to try again.
+    bool stalled;
+    uint64_t retry_ns;
+    xpc_spill_stats_t stats;
+};
+
+#define XPC_SPILL_PAD(n) \
+    (((n) + XPC_SPILL_ALIGN - 1) & ~(size_t)(XPC_SPILL_ALIGN - 1))
+
+static void xpc_spill_seg_name(
+        const xpc_spill_t *self, uint64_t seq, char *name, size_t len) {
+    snprintf(name, len, "%s.%llu", self->path, (unsigned long long)seq);
+}
+
+/**
+ * Map a segment, creating its file if asked to.
+ */
+static int xpc_spill_seg_map(xpc_spill_t *self, xpc_spill_seg_t *seg, bool create) {
+    int status = -1;
+    int err = 0;
+    char name[strlen(self->path) + 24];
+    xpc_spill_seg_name(self, seg->seq, name, sizeof(name));
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC:0);
+    int fd = open(name, flags, 0600);
+    if(fd == -1) {
+        goto done;
+    }
+    // a full disk fails here, rather than with SIGBUS when spilling.
+    if(create && (err = posix_fallocate(fd, 0, self->seg_len)) != 0) {
+        errno = err;
+        goto done;
+    }
+    seg->map = mmap(
+        NULL, self->seg_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    if(seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        goto done;
+    }
+    status = 0;
+done:
+    if(fd != -1) {
+        err = errno;
+        close(fd);
+        if(status != 0 && create) {
+            unlink(name);
+        }
+        errno = err;
+    }
+    return status;
+}
+
+static void xpc_spill_seg_unmap(xpc_spill_t *self, xpc_spill_seg_t *seg) {
+    if(seg->map != NULL) {
+        munmap(seg->map, self->seg_len);
+        seg->map = NULL;
+    }
+}
+
+static void xpc_spill_seg_remove(xpc_spill_t *self, xpc_spill_seg_t *seg) {
+    char name[strlen(self->path) + 24];
+    xpc_spill_seg_unmap(self, seg);
+    xpc_spill_seg_name(self, seg->seq, name, sizeof(name));
+    unlink(name);
+}
+
+static xpc_spill_seg_t *xpc_spill_seg(xpc_spill_t *self, int i) {
+    return &self->segs[(self->head + i) % self->max_segs];
+}
+
+/**
+ * Start a new segment after the newest one.
+ */
+static xpc_spill_seg_t *xpc_spill_rotate(xpc_spill_t *self) {
+    xpc_spill_seg_t *tail = xpc_spill_seg(self, self->stats.segments - 1);
+    if(self->stats.segments == self->max_segs) {
+        return NULL;
+    }
+    xpc_spill_seg_t *seg = xpc_spill_seg(self, self->stats.segments);
+    memset(seg, 0, sizeof(*seg));
+    seg->seq = self->next_seq;
+    if(xpc_spill_seg_map(self, seg, true) != 0) {
+        return NULL;
+    }
+    self->next_seq++;
+    self->stats.segments++;
+    // the page cache keeps what was written, the oldest stays mapped to be
+    // read.
+    if(self->stats.segments > 2) {
+        xpc_spill_seg_unmap(self, tail);
+    }
+    return seg;
+}
+
+/**
+ * Append a message to the newest segment, rotating when it is full.
+ */
+static int xpc_spill_append(xpc_spill_t *self, const msg_buf_t *msg_buf) {
+    size_t rec_len = XPC_SPILL_PAD(sizeof(xpc_spill_rec_t) + msg_buf->size);
+    xpc_spill_seg_t *seg = xpc_spill_seg(self, self->stats.segments - 1);
+    if(rec_len > self->seg_len) {
+        return -1;
+    }
+    if(seg->end + rec_len > self->seg_len) {
+        seg = xpc_spill_rotate(self);
+        if(seg == NULL) {
+            return -1;
+        }
+    }
+    xpc_spill_rec_t *rec = (xpc_spill_rec_t *)(seg->map + seg->end);
+    rec->rec_len = rec_len;
+    rec->msg_len = msg_buf->size;
+    rec->ingress_ns = msg_buf->ingress_ns;
+    rec->src_fd = msg_buf->src_fd;
+    rec->src_chn = msg_buf->src_chn;
+    rec->flags = msg_buf->flags;
+    rec->reserved = 0;
+    memcpy(rec + 1, msg_buf->buf->buf, msg_buf->size);
+    seg->end += rec_len;
+    self->stats.msgs++;
+    self->stats.bytes += msg_buf->size;
+    self->stats.spilled++;
+    return 0;
+}
+
+/**
+ * Get the oldest segment, mapped and read ahead of.
+ */
+static xpc_spill_seg_t *xpc_spill_head(xpc_spill_t *self) {
+    xpc_spill_seg_t *seg = xpc_spill_seg(self, 0);
+    if(seg->map == NULL) {
+        if(xpc_spill_seg_map(self, seg, false) != 0) {
+            return NULL;
+        }
+        madvise(seg->map, self->seg_len, MADV_SEQUENTIAL);
+    }
+    if(seg->rd + XPC_SPILL_READAHEAD / 2 >= seg->ra && seg->ra < seg->end) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t from = seg->ra & ~(page - 1);
+        size_t len = self->seg_len - from;
+        len = (len < XPC_SPILL_READAHEAD) ? len:XPC_SPILL_READAHEAD;
+        madvise(seg->map + from, len, MADV_WILLNEED);
+        seg->ra = from + len;
+    }
+    return seg;
+}
+
+int xpc_spill_enable(
+        xpc_router_t *ctx, int ofd, const char *path, int64_t mem_bytes,
+        uint32_t segment_bytes, int max_segments) {
+    int status = -1;
+    xpc_spill_t *r = NULL;
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL || out_ctx->spill != NULL || out_ctx->fanout
+            || out_ctx->sink != NULL || mem_bytes < 0 || max_segments < 0) {
+        errno = EINVAL;
+        goto done;
+    }
+    r = calloc(1, sizeof(xpc_spill_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->mem_bytes = mem_bytes;
+    r->seg_len = (segment_bytes > 0) ? segment_bytes:XPC_SPILL_SEGMENT_BYTES;
+    r->max_segs = (max_segments > 0) ? max_segments:XPC_SPILL_SEGMENTS;
+    r->path = strdup(path);
+    r->segs = calloc(r->max_segs, sizeof(xpc_spill_seg_t));
+    if(r->path == NULL || r->segs == NULL) {
+        goto bad_spill;
+    }
+    // the first segment is created now, so a bad path fails here.
+    if(xpc_spill_seg_map(r, &r->segs[0], true) != 0) {
+        goto bad_spill;
+    }
+    r->next_seq = 1;
+    r->stats.segments = 1;
+    out_ctx->spill = r;
+    status = 0;
+    goto done;
+
+bad_spill:
+    free(r->path);
+    free(r->segs);
+    free(r);
+done:
+    return status;
+}
+
+void xpc_spill_offload(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    xpc_spill_t *self = out_ctx->spill;
+    msg_queue_t *queue = out_ctx->msg_queue;
+    while(self->stats.msgs > 0 || queue->queued_bytes > self->mem_bytes) {
+        msg_buf_t *msg_buf = xpc_msg_dequeue_final(queue);
+        if(msg_buf == NULL) {
+            break;
+        }
+        if(xpc_spill_append(self, msg_buf) != 0) {
+            self->stats.dropped++;
+            if(msg_buf->src_fd >= 0) {
+                xpc_count_drop(
+                    ctx, msg_buf->src_fd, msg_buf->src_chn, XPC_DROP_QUEUE_FULL
+                );
+            }
+        }
+        xpc_msg_clear(queue, msg_buf->buf_id);
+    }
+}
+
+/**
+ * Count a message which could not be fed back, the output is retried by
+ * xpc_spill_poll rather than left waiting for a write event.
+ */
+static void xpc_spill_stall(xpc_router_t *ctx, xpc_spill_t *self) {
+    self->stats.stalls++;
+    self->stats.last_errno = errno;
+    self->retry_ns = xpc_monotonic_ns() + XPC_SPILL_RETRY_MS * 1000000ull;
+    if(!self->stalled) {
+        self->stalled = true;
+        ctx->spill_stalled++;
+    }
+}
+
+msg_buf_t *xpc_spill_dequeue(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    xpc_spill_t *self = out_ctx->spill;
+    msg_buf_t *msg_buf = NULL;
+    if(self->stats.msgs == 0) {
+        goto done;
+    }
+    xpc_spill_seg_t *seg = xpc_spill_head(self);
+    if(seg == NULL) {
+        xpc_spill_stall(ctx, self);
+        goto done;
+    }
+    const xpc_spill_rec_t *rec = (const xpc_spill_rec_t *)(seg->map + seg->rd);
+    msg_buf = xpc_msg_getbuf(out_ctx->msg_queue, -1);
+    if(msg_buf == NULL) {
+        xpc_spill_stall(ctx, self);
+        goto done;
+    }
+    if(msg_buf->buf->capacity < rec->msg_len
+            && dynabuf_resize(msg_buf->buf, rec->msg_len) != 0) {
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        msg_buf = NULL;
+        xpc_spill_stall(ctx, self);
+        goto done;
+    }
+    if(self->stalled) {
+        self->stalled = false;
+        ctx->spill_stalled--;
+    }
+    memcpy(msg_buf->buf->buf, rec + 1, rec->msg_len);
+    msg_buf->size = rec->msg_len;
+    msg_buf->flags = rec->flags;
+    msg_buf->ingress_ns = rec->ingress_ns;
+    msg_buf->src_fd = rec->src_fd;
+    msg_buf->src_chn = rec->src_chn;
+    // counted as queued until it is cleared, like any dequeued message.
+    msg_buf->final_size = msg_buf->size;
+    msg_buf->dequeued = true;
+    out_ctx->msg_queue->queued_bytes += msg_buf->size;
+    seg->rd += rec->rec_len;
+    self->stats.msgs--;
+    self->stats.bytes -= rec->msg_len;
+    self->stats.drained++;
+    if(seg->rd < seg->end) {
+        goto done;
+    }
+    if(self->stats.segments > 1) {
+        xpc_spill_seg_remove(self, seg);
+        self->head = (self->head + 1) % self->max_segs;
+        self->stats.segments--;
+    }
+    else {
+        // nothing is spilled, the last segment is written from the start.
+        seg->end = 0;
+        seg->rd = 0;
+        seg->ra = 0;
+    }
+done:
+    return msg_buf;
+}
+
+int xpc_spill_poll(xpc_router_t *ctx) {
+    uint64_t next_ns = UINT64_MAX;
+    int stalled = 0;
+    if(ctx->spill_stalled == 0) {
+        return -1;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    // recounted, a stalled output may have been freed since.
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        int *pfd = array_fetch(ctx->out_fds, i);
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, *pfd);
+        xpc_spill_t *self = out_ctx->spill;
+        if(self == NULL || !self->stalled) {
+            continue;
+        }
+        if(now >= self->retry_ns) {
+            // stalls again on the write event if it still cannot be fed back.
+            self->stalled = false;
+            if(ctx->io_add_fd_cb != NULL) {
+                ctx->io_add_fd_cb(ctx->io_event_context, *pfd);
+            }
+            continue;
+        }
+        stalled++;
+        next_ns = (self->retry_ns < next_ns) ? self->retry_ns:next_ns;
+    }
+    ctx->spill_stalled = stalled;
+    if(next_ns == UINT64_MAX) {
+        return -1;
+    }
+    return (next_ns - now + 999999) / 1000000;
+}
+
+bool xpc_spill_pending(const xpc_spill_t *self) {
+    return self != NULL && self->stats.msgs > 0;
+}
+
+int xpc_spill_get_stats(xpc_router_t *ctx, int ofd, xpc_spill_stats_t *stats) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL || out_ctx->spill == NULL) {
+        return -1;
+    }
+    *stats = out_ctx->spill->stats;
+    return 0;
+}
+
+void xpc_spill_free(xpc_spill_t *self) {
+    if(self != NULL) {
+        for(int i = 0; i < self->stats.segments; i++) {
+            xpc_spill_seg_remove(self, xpc_spill_seg(self, i));
+        }
+        free(self->segs);
+        free(self->path);
+        free(self);
+    }
+}
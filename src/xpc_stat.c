@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <xpc_utils.h>
+#include <xpc_stats.h>
+
+/**
+ * Print the statistics a router publishes.
+ * usage: xpc_stat <statistics file>
+ */
+
+static const char *kind_name(int kind) {
+    switch(kind) {
+        case XPC_IN_STREAM: return "stream";
+        case XPC_IN_LISTENER: return "listener";
+        case XPC_IN_SEQPACKET: return "client";
+        case XPC_IN_SHM: return "shm";
+        default: return "output";
+    }
+}
+
+static uint64_t total_drops(const xpc_counters_t *c) {
+    uint64_t r = 0;
+    for(int i = 0; i < XPC_DROP_NREASONS; i++) {
+        r += c->drops[i];
+    }
+    return r;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    size_t len = 0;
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <statistics file>\n", argv[0]);
+        return 1;
+    }
+    const xpc_stats_page_t *page = xpc_stats_map(argv[1], &len);
+    if(page == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    xpc_stats_page_t *snap = malloc(len);
+    if(snap == NULL || xpc_stats_snapshot(page, snap, len) != 0) {
+        fprintf(stderr, "could not read a consistent snapshot\n");
+        status = 1;
+        goto done;
+    }
+
+    printf("%-6s %-8s %12s %14s %12s %14s %12s %12s\n",
+        "fd", "kind", "rx_msgs", "rx_bytes", "tx_msgs", "tx_bytes",
+        "queue_bytes", "queue_peak");
+    for(uint32_t i = 0; i < snap->n_fds; i++) {
+        const xpc_stats_fd_t *fd = &xpc_stats_fds(snap)[i];
+        printf("%-6d %-8s %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %14" PRIu64
+            " %12" PRId64 " %12" PRId64 "\n",
+            fd->fd, kind_name(fd->kind), fd->rx.msgs, fd->rx.bytes,
+            fd->tx.msgs, fd->tx.bytes, fd->queue_bytes, fd->queue_peak_bytes);
+        printf("       pool hits %" PRIu64 " misses %" PRIu64 ", drops",
+            fd->pool_hits, fd->pool_misses);
+        for(int r = 0; r < XPC_DROP_NREASONS; r++) {
+            printf(" %s %" PRIu64, xpc_drop_reason_names[r],
+                fd->rx.drops[r] + fd->tx.drops[r]);
+        }
+        printf("\n");
+    }
+
+    printf("\n%-16s %-16s %12s %14s %12s %10s %10s %10s %10s\n",
+        "route", "", "msgs", "bytes", "drops",
+        "p50_us", "p99_us", "p999_us", "max_us");
+    for(uint32_t i = 0; i < snap->n_routes; i++) {
+        const xpc_stats_route_t *route = &xpc_stats_routes(snap)[i];
+        char in[32], out[32];
+        snprintf(in, sizeof(in), "%d:%d", route->in_fd, route->in_chn);
+        snprintf(out, sizeof(out), "-> %d:%d", route->out_fd, route->out_chn);
+        const xpc_stats_latency_t *lat = &route->latency;
+        printf("%-16s %-16s %12" PRIu64 " %14" PRIu64 " %12" PRIu64
+            " %10.1f %10.1f %10.1f %10.1f\n",
+            in, out, route->stats.msgs, route->stats.bytes,
+            total_drops(&route->stats), lat->p50_ns / 1e3, lat->p99_ns / 1e3,
+            lat->p999_ns / 1e3, lat->max_ns / 1e3);
+    }
+    if(snap->truncated) {
+        printf("(more fds or routes exist than the file has room for)\n");
+    }
+done:
+    free(snap);
+    xpc_stats_unmap(page, len);
+    return status;
+}
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xpc_utils.h>
+#include <xpc_stats.h>
+#include <xpc_hist.h>
+#include <alibc/containers/hashmap.h>
+
+// attempts at copying a page before giving up on a busy writer.
+#define XPC_STATS_READ_TRIES 100
+
+struct xpc_stats_export {
+    char *path;
+    xpc_stats_page_t *page;
+    size_t len;
+    uint32_t interval_ms;
+    uint64_t next_ns;
+};
+
+const char *const xpc_drop_reason_names[XPC_DROP_NREASONS] = {
+    [XPC_DROP_NO_ROUTE] = "no_route",
+    [XPC_DROP_NO_BUFFER] = "no_buffer",
+    [XPC_DROP_MALFORMED] = "malformed",
+    [XPC_DROP_QUEUE_FULL] = "queue_full",
+    [XPC_DROP_FILTERED] = "filtered",
+    [XPC_DROP_SAMPLED] = "sampled",
+    [XPC_DROP_RATE_LIMITED] = "rate_limited",
+};
+
+static size_t xpc_stats_len(int max_fds, int max_routes) {
+    return sizeof(xpc_stats_page_t) + max_fds * sizeof(xpc_stats_fd_t)
+        + max_routes * sizeof(xpc_stats_route_t);
+}
+
+/**
+ * Unmap an export, and remove its file unless a new export took its path.
+ */
+static void xpc_stats_export_close(xpc_stats_export_t *self, bool keep_file) {
+    if(self != NULL) {
+        if(self->page != NULL) {
+            munmap(self->page, self->len);
+            if(!keep_file) {
+                unlink(self->path);
+            }
+        }
+        free(self->path);
+        free(self);
+    }
+}
+
+int xpc_stats_enable(
+        xpc_router_t *ctx, const char *path, int max_fds, int max_routes,
+        uint32_t interval_ms) {
+    int status = -1;
+    int fd = -1;
+    char *tmp_path = NULL;
+    xpc_stats_export_t *r = calloc(1, sizeof(xpc_stats_export_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->path = strdup(path);
+    r->len = xpc_stats_len(max_fds, max_routes);
+    r->interval_ms = interval_ms;
+    tmp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if(r->path == NULL || tmp_path == NULL) {
+        goto bad_export;
+    }
+    // written aside and renamed over path, so a reader never maps a file
+    // which is being truncated, even when the old export used path too.
+    strcpy(tmp_path, path);
+    strcat(tmp_path, ".XXXXXX");
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if(fd == -1) {
+        goto bad_export;
+    }
+    if(fchmod(fd, 0644) != 0 || ftruncate(fd, r->len) != 0) {
+        goto bad_file;
+    }
+    r->page = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(r->page == MAP_FAILED) {
+        r->page = NULL;
+        goto bad_file;
+    }
+    r->page->version = XPC_STATS_VERSION;
+    r->page->max_fds = max_fds;
+    r->page->max_routes = max_routes;
+    // readers check the magic last, so it is written last.
+    __atomic_store_n(&r->page->magic, XPC_STATS_MAGIC, __ATOMIC_RELEASE);
+    if(rename(tmp_path, path) != 0) {
+        goto bad_file;
+    }
+
+    xpc_stats_export_t *old = ctx->stats_export;
+    xpc_stats_export_close(old, old != NULL && !strcmp(old->path, path));
+    ctx->stats_export = r;
+    xpc_stats_publish(ctx);
+    status = 0;
+    goto done;
+
+bad_file:
+    unlink(tmp_path);
+bad_export:
+    // the file at path, if any, is not this export's.
+    xpc_stats_export_close(r, true);
+done:
+    if(fd != -1) {
+        close(fd);
+    }
+    free(tmp_path);
+    return status;
+}
+
+void xpc_stats_export_free(xpc_stats_export_t *self) {
+    xpc_stats_export_close(self, false);
+}
+
+/**
+ * Find the record of an fd in a snapshot being written, or add one.
+ */
+static xpc_stats_fd_t *xpc_stats_fd_record(xpc_stats_page_t *page, int fd) {
+    xpc_stats_fd_t *fds = (xpc_stats_fd_t *)xpc_stats_fds(page);
+    for(uint32_t i = 0; i < page->n_fds; i++) {
+        if(fds[i].fd == fd) {
+            return &fds[i];
+        }
+    }
+    if(page->n_fds == page->max_fds) {
+        page->truncated = 1;
+        return NULL;
+    }
+    xpc_stats_fd_t *r = &fds[page->n_fds++];
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->kind = -1;
+    return r;
+}
+
+void xpc_stats_publish(xpc_router_t *ctx) {
+    xpc_stats_export_t *self = ctx->stats_export;
+    if(self == NULL) {
+        return;
+    }
+    xpc_stats_page_t *page = self->page;
+    uint64_t seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    page->n_fds = 0;
+    page->n_routes = 0;
+    page->truncated = 0;
+    for(int i = 0; i < array_size(ctx->in_fds); i++) {
+        int *pfd = array_fetch(ctx->in_fds, i);
+        xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, *pfd);
+        xpc_stats_fd_t *rec = xpc_stats_fd_record(page, *pfd);
+        if(rec != NULL) {
+            rec->kind = in_ctx->kind;
+            rec->rx = in_ctx->rx;
+        }
+    }
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        int *pfd = array_fetch(ctx->out_fds, i);
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, *pfd);
+        xpc_stats_fd_t *rec = xpc_stats_fd_record(page, *pfd);
+        if(rec != NULL) {
+            rec->tx = out_ctx->tx;
+            rec->queue_bytes = out_ctx->msg_queue->queued_bytes;
+            rec->queue_peak_bytes = out_ctx->msg_queue->peak_queued_bytes;
+            rec->pool_hits = out_ctx->msg_queue->pool_hits;
+            rec->pool_misses = out_ctx->msg_queue->pool_misses;
+        }
+    }
+
+    xpc_stats_route_t *routes = (xpc_stats_route_t *)xpc_stats_routes(page);
+    for(int i = 0; i < array_size(ctx->route_keys); i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        if(page->n_routes == page->max_routes) {
+            page->truncated = 1;
+            break;
+        }
+        xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)k);
+        xpc_stats_route_t *rec = &routes[page->n_routes++];
+        rec->in_fd = k->fd;
+        rec->in_chn = k->to_chn;
+        rec->out_fd = route->dst.fd;
+        rec->out_chn = route->dst.to_chn;
+        rec->stats = route->stats;
+        memset(&rec->latency, 0, sizeof(rec->latency));
+        if(route->latency != NULL) {
+            rec->latency.count = route->latency->count;
+            rec->latency.p50_ns = xpc_hist_percentile(route->latency, 50.0);
+            rec->latency.p99_ns = xpc_hist_percentile(route->latency, 99.0);
+            rec->latency.p999_ns = xpc_hist_percentile(route->latency, 99.9);
+            rec->latency.max_ns = route->latency->max;
+        }
+    }
+    page->published_ns = xpc_monotonic_ns();
+
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int xpc_stats_poll(xpc_router_t *ctx) {
+    xpc_stats_export_t *self = ctx->stats_export;
+    if(self == NULL) {
+        return -1;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    if(now >= self->next_ns) {
+        xpc_stats_publish(ctx);
+        self->next_ns = now + (uint64_t)self->interval_ms * 1000000;
+    }
+    // round up, epoll timeouts are in milliseconds.
+    return (self->next_ns - now + 999999) / 1000000;
+}
+
+const xpc_stats_page_t *xpc_stats_map(const char *path, size_t *len) {
+    const xpc_stats_page_t *r = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        goto done;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(xpc_stats_page_t)) {
+        goto done;
+    }
+    r = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(r == MAP_FAILED) {
+        r = NULL;
+        goto done;
+    }
+    if(__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != XPC_STATS_MAGIC
+            || r->version != XPC_STATS_VERSION
+            || xpc_stats_len(r->max_fds, r->max_routes) > st.st_size) {
+        munmap((void *)r, st.st_size);
+        r = NULL;
+        errno = EINVAL;
+        goto done;
+    }
+    *len = st.st_size;
+done:
+    if(fd != -1) {
+        close(fd);
+    }
+    return r;
+}
+
+void xpc_stats_unmap(const xpc_stats_page_t *page, size_t len) {
+    if(page != NULL) {
+        munmap((void *)page, len);
+    }
+}
+
+int xpc_stats_snapshot(const xpc_stats_page_t *page, void *dst, size_t len) {
+    for(int i = 0; i < XPC_STATS_READ_TRIES; i++) {
+        uint64_t before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            continue;
+        }
+        memcpy(dst, page, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,898 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <alibc/containers/array.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/array_iterator.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_clients.h>
+#include <xpc_stats.h>
+#include <xpc_capture.h>
+#include <xpc_credit.h>
+#include <xpc_sched.h>
+#include <xpc_spill.h>
+#include <xpc_sink.h>
+#include <xpc_hook.h>
+#include <xpc_limit.h>
+#include <xpc_rt.h>
+#include <xpc_compress.h>
+#include <xpc_topology.h>
+
+#define XPC_TOPO_MAX_TOKENS 32
+#define XPC_TOPO_LINE_MAX 1024
+
+// defaults for endpoints which do not specify them.
+#define XPC_TOPO_DEFAULT_QUEUE_MSGS 8
+#define XPC_TOPO_DEFAULT_QUEUE_MSG_SIZE 256
+#define XPC_TOPO_DEFAULT_STATS_INTERVAL_MS 1000
+#define XPC_TOPO_DEFAULT_CAPTURE_MB 64
+#define XPC_TOPO_DEFAULT_PIPELINE_QUEUE_KB 256
+#define XPC_TOPO_DEFAULT_BUSY_POLL_BUDGET 50
+#define XPC_TOPO_DEFAULT_SPILL_MEM_KB 1024
+
+// room in the statistics file for fds which are not in the topology, the
+// clients of listeners.
+#define XPC_TOPO_STATS_EXTRA_FDS 64
+
+static int parse_int(const char *v, int *out) {
+    char *end = NULL;
+    errno = 0;
+    long r = strtol(v, &end, 0);
+    if(errno != 0 || end == v || *end != '\0' || r < 0 || r > INT32_MAX) {
+        return -1;
+    }
+    *out = (int)r;
+    return 0;
+}
+
+static int parse_bool(const char *v, bool *out) {
+    if(!strcmp(v, "yes") || !strcmp(v, "true") || !strcmp(v, "1")) {
+        *out = true;
+        return 0;
+    }
+    if(!strcmp(v, "no") || !strcmp(v, "false") || !strcmp(v, "0")) {
+        *out = false;
+        return 0;
+    }
+    return -1;
+}
+
+static int parse_mode(const char *v, int *out) {
+    if(!strcmp(v, "rd")) *out = XPC_TOPO_MODE_RD;
+    else if(!strcmp(v, "wr")) *out = XPC_TOPO_MODE_WR;
+    else if(!strcmp(v, "rdwr")) *out = XPC_TOPO_MODE_RDWR;
+    else return -1;
+    return 0;
+}
+
+/**
+ * Split "key=value" in place.
+ * @return the value, or NULL if there is no '='.
+ */
+static char *split_option(char *tok) {
+    char *eq = strchr(tok, '=');
+    if(eq == NULL) {
+        return NULL;
+    }
+    *eq = '\0';
+    return eq + 1;
+}
+
+xpc_topo_endpoint_t *xpc_topology_find(xpc_topology_t *self, const char *name) {
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(!strcmp(ep->name, name)) {
+            return ep;
+        }
+    }
+    return NULL;
+}
+
+void xpc_topology_close_fd(xpc_topology_t *self, int fd) {
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(ep->fd == fd) {
+            self->connecting -= ep->connecting ? 1:0;
+            ep->connecting = false;
+            ep->fd = -1;
+        }
+    }
+    if(fd > STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+static int find_index(xpc_topology_t *self, const char *name) {
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(!strcmp(ep->name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int parse_endpoint(
+        xpc_topology_t *self, xpc_topo_kind_t kind, char **tok, int ntok,
+        int line) {
+    xpc_topo_endpoint_t ep = {0};
+    if(ntok < 2 || strlen(tok[1]) >= XPC_TOPO_NAME_MAX) {
+        fprintf(stderr, "topology:%d: endpoint needs a short name\n", line);
+        return -1;
+    }
+    if(xpc_topology_find(self, tok[1]) != NULL) {
+        fprintf(stderr, "topology:%d: duplicate endpoint %s\n", line, tok[1]);
+        return -1;
+    }
+    ep.kind = kind;
+    strcpy(ep.name, tok[1]);
+    ep.mode = (kind == XPC_TOPO_FIFO) ? XPC_TOPO_MODE_RD:XPC_TOPO_MODE_RDWR;
+    if(kind == XPC_TOPO_STDIO || kind == XPC_TOPO_FILE) {
+        ep.mode = XPC_TOPO_MODE_WR;
+    }
+    ep.serial = (xpc_serial_opts_t)XPC_SERIAL_OPTS_DEFAULT;
+    ep.big_endian = XPC_HOST_BIG_ENDIAN;
+    ep.queue_msgs = XPC_TOPO_DEFAULT_QUEUE_MSGS;
+    ep.queue_msg_size = XPC_TOPO_DEFAULT_QUEUE_MSG_SIZE;
+    ep.credit_window = XPC_CREDIT_WINDOW;
+    ep.spill_mem_kb = XPC_TOPO_DEFAULT_SPILL_MEM_KB;
+    ep.sink = (xpc_sink_opts_t)XPC_SINK_OPTS_DEFAULT;
+    ep.rx_cpu = -1;
+    ep.tx_cpu = -1;
+    ep.fd = -1;
+
+    for(int i = 2; i < ntok; i++) {
+        char *key = tok[i];
+        char *val = split_option(key);
+        int r = -1;
+        if(val == NULL) {
+            r = -1;
+        }
+        else if(!strcmp(key, "path") && strlen(val) < XPC_TOPO_PATH_MAX) {
+            strcpy(ep.path, val);
+            r = 0;
+        }
+        else if(!strcmp(key, "mode")) {
+            r = parse_mode(val, &ep.mode);
+        }
+        else if(!strcmp(key, "baud")) {
+            r = parse_int(val, &ep.serial.baud);
+            r = (r == 0 && ep.serial.baud > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "vmin")) {
+            r = parse_int(val, &ep.serial.vmin);
+            r = (r == 0 && ep.serial.vmin <= 255) ? 0:-1;
+        }
+        else if(!strcmp(key, "vtime")) {
+            r = parse_int(val, &ep.serial.vtime_ds);
+            r = (r == 0 && ep.serial.vtime_ds <= 255) ? 0:-1;
+        }
+        else if(!strcmp(key, "low_latency")) {
+            r = parse_bool(val, &ep.serial.low_latency);
+        }
+        else if(!strcmp(key, "endian")) {
+            r = 0;
+            if(!strcmp(val, "big")) ep.big_endian = true;
+            else if(!strcmp(val, "little")) ep.big_endian = false;
+            else r = -1;
+        }
+        else if(!strcmp(key, "queue_msgs")) {
+            r = parse_int(val, &ep.queue_msgs);
+        }
+        else if(!strcmp(key, "queue_msg_size")) {
+            r = parse_int(val, &ep.queue_msg_size);
+        }
+        else if(!strcmp(key, "coalesce_bytes")) {
+            r = parse_int(val, &ep.coalesce_bytes);
+        }
+        else if(!strcmp(key, "coalesce_us")) {
+            int us = 0;
+            r = parse_int(val, &us);
+            ep.coalesce_us = us;
+        }
+        else if(!strcmp(key, "credit_window")) {
+            r = parse_int(val, &ep.credit_window);
+            r = (r == 0 && ep.credit_window > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "compress")) {
+            r = parse_bool(val, &ep.compress);
+        }
+        else if(!strcmp(key, "weight")) {
+            r = parse_int(val, &ep.sched_weight);
+            r = (r == 0 && ep.sched_weight > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "spill") && strlen(val) < XPC_TOPO_PATH_MAX) {
+            strcpy(ep.spill_path, val);
+            r = 0;
+        }
+        else if(!strcmp(key, "spill_mem_kb")) {
+            r = parse_int(val, &ep.spill_mem_kb);
+            r = (r == 0 && ep.spill_mem_kb >= 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "spill_segment_kb")) {
+            r = parse_int(val, &ep.spill_segment_kb);
+            r = (r == 0 && ep.spill_segment_kb > 0
+                && ep.spill_segment_kb <= (INT32_MAX >> 10)) ? 0:-1;
+        }
+        else if(!strcmp(key, "spill_segments")) {
+            r = parse_int(val, &ep.spill_segments);
+            r = (r == 0 && ep.spill_segments > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "segment_mb")) {
+            int mb = 0;
+            r = parse_int(val, &mb);
+            r = (r == 0 && mb > 0 && mb < 4096) ? 0:-1;
+            ep.sink.segment_bytes = (size_t)mb << 20;
+        }
+        else if(!strcmp(key, "rotate_s")) {
+            int s = 0;
+            r = parse_int(val, &s);
+            r = (r == 0 && s <= UINT32_MAX / 1000) ? 0:-1;
+            ep.sink.rotate_ms = (uint32_t)s * 1000;
+        }
+        else if(!strcmp(key, "sync")) {
+            r = 0;
+            if(!strcmp(val, "none")) ep.sink.sync = XPC_SINK_SYNC_NONE;
+            else if(!strcmp(val, "async")) ep.sink.sync = XPC_SINK_SYNC_ASYNC;
+            else if(!strcmp(val, "data")) ep.sink.sync = XPC_SINK_SYNC_DATA;
+            else r = -1;
+        }
+        else if(!strcmp(key, "sync_ms")) {
+            int ms = 0;
+            r = parse_int(val, &ms);
+            r = (r == 0 && ms > 0) ? 0:-1;
+            ep.sink.sync_ms = ms;
+        }
+        else if(!strcmp(key, "sync_kb")) {
+            int kb = 0;
+            r = parse_int(val, &kb);
+            r = (r == 0 && kb > 0) ? 0:-1;
+            ep.sink.sync_bytes = (size_t)kb << 10;
+        }
+        else if(!strcmp(key, "rx_cpu")) {
+            r = parse_int(val, &ep.rx_cpu);
+        }
+        else if(!strcmp(key, "tx_cpu")) {
+            r = parse_int(val, &ep.tx_cpu);
+        }
+        if(r != 0) {
+            fprintf(stderr, "topology:%d: bad option %s\n", line, key);
+            return -1;
+        }
+    }
+    if(kind != XPC_TOPO_STDIO && ep.path[0] == '\0') {
+        fprintf(stderr, "topology:%d: %s needs a path\n", line, ep.name);
+        return -1;
+    }
+    if(kind == XPC_TOPO_FILE && ep.mode != XPC_TOPO_MODE_WR) {
+        fprintf(stderr, "topology:%d: %s can only be written\n", line, ep.name);
+        return -1;
+    }
+    if(kind == XPC_TOPO_STDIO && ep.mode == XPC_TOPO_MODE_RDWR) {
+        // stdin and stdout are two fds, an endpoint has one.
+        fprintf(stderr, "topology:%d: %s is either read or written\n", line, ep.name);
+        return -1;
+    }
+    array_append(self->endpoints, &ep);
+    return 0;
+}
+
+/**
+ * Parse "name:channel" into an endpoint index and a channel.
+ */
+static int parse_route_end(
+        xpc_topology_t *self, char *tok, int mode, int *ep, int *chn, int line) {
+    char *colon = strrchr(tok, ':');
+    if(colon == NULL) {
+        fprintf(stderr, "topology:%d: expected name:channel\n", line);
+        return -1;
+    }
+    *colon = '\0';
+    *ep = find_index(self, tok);
+    if(*ep == -1) {
+        fprintf(stderr, "topology:%d: unknown endpoint %s\n", line, tok);
+        return -1;
+    }
+    xpc_topo_endpoint_t *endpoint = array_fetch(self->endpoints, *ep);
+    if(!(endpoint->mode & mode)) {
+        fprintf(stderr, "topology:%d: %s cannot be used in this direction\n",
+            line, tok);
+        return -1;
+    }
+    if(parse_int(colon + 1, chn) != 0 || *chn == 0) {
+        // channel 0 is reserved for negotiation.
+        fprintf(stderr, "topology:%d: bad channel %s\n", line, colon + 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_route(xpc_topology_t *self, char **tok, int ntok, int line) {
+    xpc_topo_route_t route = {0};
+    int i = 1;
+    int limit_status = 0;
+    if(ntok < 3) {
+        fprintf(stderr, "topology:%d: route needs a source and destination\n",
+            line);
+        return -1;
+    }
+    if(parse_route_end(
+            self, tok[i++], XPC_TOPO_MODE_RD,
+            &route.in_ep, &route.in_chn, line) != 0) {
+        return -1;
+    }
+    if(!strcmp(tok[i], "->")) {
+        i++;
+    }
+    if(i >= ntok || parse_route_end(
+            self, tok[i++], XPC_TOPO_MODE_WR,
+            &route.out_ep, &route.out_chn, line) != 0) {
+        return -1;
+    }
+    for(; i < ntok; i++) {
+        if(!strcmp(tok[i], "no_coalesce")) {
+            route.flags |= XPC_ROUTE_NO_COALESCE;
+        }
+        else if(!strcmp(tok[i], "cut_through")) {
+            route.flags |= XPC_ROUTE_CUT_THROUGH;
+        }
+        else if(!strncmp(tok[i], "weight=", 7)) {
+            if(parse_int(tok[i] + 7, &route.weight) != 0 || route.weight <= 0) {
+                fprintf(stderr, "topology:%d: bad route weight\n", line);
+                return -1;
+            }
+        }
+        else if(!strncmp(tok[i], "hook=", 5)) {
+            char *colon = strrchr(tok[i] + 5, ':');
+            if(colon == NULL || colon == tok[i] + 5 || colon[1] == '\0'
+                    || colon - (tok[i] + 5) >= XPC_TOPO_PATH_MAX
+                    || strlen(colon + 1) >= XPC_TOPO_NAME_MAX) {
+                fprintf(stderr, "topology:%d: expected hook=path:symbol\n", line);
+                return -1;
+            }
+            *colon = '\0';
+            strcpy(route.hook_path, tok[i] + 5);
+            strcpy(route.hook_symbol, colon + 1);
+        }
+        else if(!strncmp(tok[i], "hook_arg=", 9)
+                && strlen(tok[i] + 9) < XPC_TOPO_PATH_MAX) {
+            strcpy(route.hook_arg, tok[i] + 9);
+        }
+        else if((limit_status = xpc_limit_parse_flag(&route.limit, tok[i])) != 1) {
+            if(limit_status != 0) {
+                fprintf(stderr, "topology:%d: bad route limit %s\n", line, tok[i]);
+                return -1;
+            }
+        }
+        else {
+            fprintf(stderr, "topology:%d: unknown route flag %s\n", line, tok[i]);
+            return -1;
+        }
+    }
+    if(route.limit.burst > 0 && route.limit.rate == 0) {
+        fprintf(stderr, "topology:%d: burst needs rate_msgs or rate_bytes\n", line);
+        return -1;
+    }
+    // a second route would silently replace the first in the switch table.
+    for(int j = 0; j < array_size(self->routes); j++) {
+        xpc_topo_route_t *other = array_fetch(self->routes, j);
+        if(other->in_ep == route.in_ep && other->in_chn == route.in_chn) {
+            xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, route.in_ep);
+            fprintf(stderr, "topology:%d: %s:%d is already routed on line %d\n",
+                line, ep->name, route.in_chn, other->line);
+            return -1;
+        }
+    }
+    route.line = line;
+    array_append(self->routes, &route);
+    return 0;
+}
+
+static int parse_router(xpc_topology_t *self, char **tok, int ntok, int line) {
+    for(int i = 1; i < ntok; i++) {
+        char *key = tok[i];
+        char *val = split_option(key);
+        int r = -1;
+        if(val == NULL) {
+            r = -1;
+        }
+        else if(!strcmp(key, "max_msg_size")) {
+            r = parse_int(val, &self->max_msg_size);
+        }
+        else if(!strcmp(key, "strict_channels")) {
+            r = parse_bool(val, &self->strict_channels);
+        }
+        else if(!strcmp(key, "stats") && strlen(val) < XPC_TOPO_PATH_MAX) {
+            strcpy(self->stats_path, val);
+            r = 0;
+        }
+        else if(!strcmp(key, "stats_interval_ms")) {
+            r = parse_int(val, &self->stats_interval_ms);
+            r = (r == 0 && self->stats_interval_ms > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "capture") && strlen(val) < XPC_TOPO_PATH_MAX) {
+            strcpy(self->capture_path, val);
+            r = 0;
+        }
+        else if(!strcmp(key, "capture_mb")) {
+            r = parse_int(val, &self->capture_mb);
+            r = (r == 0 && self->capture_mb > 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "pipeline")) {
+            r = parse_bool(val, &self->pipeline);
+        }
+        else if(!strcmp(key, "pipeline_queue_kb")) {
+            int kb = 0;
+            r = parse_int(val, &kb);
+            // the rings are sized in bytes, a power of two.
+            r = (r == 0 && kb > 0 && kb <= (1 << 20) && (kb & (kb - 1)) == 0) ?
+                0:-1;
+            self->pipeline_queue_kb = kb;
+        }
+        else if(!strcmp(key, "control") && strlen(val) < XPC_TOPO_PATH_MAX) {
+            strcpy(self->control_path, val);
+            r = 0;
+        }
+        else if(!strcmp(key, "busy_poll_us")) {
+            r = parse_int(val, &self->busy_poll_us);
+            r = (r == 0 && self->busy_poll_us >= 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "busy_poll_budget")) {
+            r = parse_int(val, &self->busy_poll_budget);
+            r = (r == 0 && self->busy_poll_budget > 0 && self->busy_poll_budget <= 100) ?
+                0:-1;
+        }
+        else if(!strcmp(key, "realtime")) {
+            r = parse_bool(val, &self->realtime);
+        }
+        else if(!strcmp(key, "rt_cpu")) {
+            r = parse_int(val, &self->rt_cpu);
+        }
+        else if(!strcmp(key, "rt_priority")) {
+            r = parse_int(val, &self->rt_priority);
+            r = (r == 0 && self->rt_priority >= 0 && self->rt_priority <= 99) ? 0:-1;
+        }
+        else if(!strcmp(key, "rt_warmup_ms")) {
+            r = parse_int(val, &self->rt_warmup_ms);
+            r = (r == 0 && self->rt_warmup_ms >= 0) ? 0:-1;
+        }
+        else if(!strcmp(key, "sched_quantum")) {
+            r = parse_int(val, &self->sched_quantum);
+            r = (r == 0 && self->sched_quantum >= 0) ? 0:-1;
+        }
+        if(r != 0) {
+            fprintf(stderr, "topology:%d: bad option %s\n", line, key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+xpc_topology_t *xpc_topology_load(const char *path) {
+    char line[XPC_TOPO_LINE_MAX];
+    char *tok[XPC_TOPO_MAX_TOKENS];
+    int line_no = 0;
+    xpc_topology_t *r = NULL;
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        perror(path);
+        goto done;
+    }
+    r = malloc(sizeof(xpc_topology_t));
+    if(r == NULL) {
+        goto done;
+    }
+    r->endpoints = create_array(4, sizeof(xpc_topo_endpoint_t));
+    r->routes = create_array(4, sizeof(xpc_topo_route_t));
+    r->max_msg_size = XPC_DEFAULT_MAX_MSG_SIZE;
+    r->strict_channels = false;
+    r->stats_path[0] = '\0';
+    r->stats_interval_ms = XPC_TOPO_DEFAULT_STATS_INTERVAL_MS;
+    r->capture_path[0] = '\0';
+    r->capture_mb = XPC_TOPO_DEFAULT_CAPTURE_MB;
+    r->pipeline = false;
+    r->pipeline_queue_kb = XPC_TOPO_DEFAULT_PIPELINE_QUEUE_KB;
+    r->control_path[0] = '\0';
+    r->sched_quantum = 0;
+    r->busy_poll_us = 0;
+    r->busy_poll_budget = XPC_TOPO_DEFAULT_BUSY_POLL_BUDGET;
+    r->realtime = false;
+    r->rt_cpu = -1;
+    r->rt_priority = 0;
+    r->rt_warmup_ms = XPC_RT_WARMUP_MS;
+    r->connecting = 0;
+    r->connect_ns = 0;
+    if(r->endpoints == NULL || r->routes == NULL) {
+        goto bad_file;
+    }
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        int ntok = 0;
+        int status = 0;
+        char *save = NULL;
+        line_no++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+        for(char *t = strtok_r(line, " \t\r\n", &save);
+                t != NULL && ntok < XPC_TOPO_MAX_TOKENS;
+                t = strtok_r(NULL, " \t\r\n", &save)) {
+            tok[ntok++] = t;
+        }
+        if(ntok == 0) {
+            continue;
+        }
+
+        if(!strcmp(tok[0], "device")) {
+            status = parse_endpoint(r, XPC_TOPO_DEVICE, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "fifo")) {
+            status = parse_endpoint(r, XPC_TOPO_FIFO, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "socket")) {
+            status = parse_endpoint(r, XPC_TOPO_SOCKET, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "stdio")) {
+            status = parse_endpoint(r, XPC_TOPO_STDIO, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "listen")) {
+            status = parse_endpoint(r, XPC_TOPO_LISTEN, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "file")) {
+            status = parse_endpoint(r, XPC_TOPO_FILE, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "route")) {
+            status = parse_route(r, tok, ntok, line_no);
+        }
+        else if(!strcmp(tok[0], "router")) {
+            status = parse_router(r, tok, ntok, line_no);
+        }
+        else {
+            fprintf(stderr, "topology:%d: unknown declaration %s\n",
+                line_no, tok[0]);
+            status = -1;
+        }
+        if(status != 0) {
+            goto bad_file;
+        }
+    }
+    goto done;
+
+bad_file:
+    xpc_topology_free(r);
+    r = NULL;
+done:
+    if(f != NULL) {
+        fclose(f);
+    }
+    return r;
+}
+
+static int open_device(xpc_topo_endpoint_t *ep) {
+    int fd = xpc_serial_open(ep->path, &ep->serial, &ep->serial_status);
+    if(fd != -1 && ep->serial_status.baud != ep->serial.baud) {
+        fprintf(stderr, "%s: asked for %d baud, the port runs at %d\n",
+            ep->name, ep->serial.baud, ep->serial_status.baud);
+    }
+    if(fd != -1 && ep->serial.low_latency && !ep->serial_status.low_latency) {
+        fprintf(stderr, "%s: low latency mode is not supported\n", ep->name);
+    }
+    return fd;
+}
+
+static int open_fifo(xpc_topo_endpoint_t *ep) {
+    if(mkfifo(ep->path, 0660) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    // opening both ends means the open neither blocks nor fails while the
+    // other side is absent, and its coming and going raises no hangups.
+    return open(ep->path, O_RDWR | O_NONBLOCK);
+}
+
+/**
+ * Connect the socket of an endpoint, again if it is not connected yet.
+ * @return 0 once it is connected, -1 otherwise (errno is set).
+ */
+static int connect_socket(xpc_topo_endpoint_t *ep) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, ep->path);
+    if(connect(ep->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+            || errno == EISCONN) {
+        return 0;
+    }
+    return -1;
+}
+
+static int open_socket(xpc_topology_t *self, xpc_topo_endpoint_t *ep) {
+    if(strlen(ep->path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    ep->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(ep->fd == -1) {
+        return -1;
+    }
+    if(connect_socket(ep) != 0) {
+        // the server may not be up yet, it is tried again later.
+        fprintf(stderr, "connect %s (%s): %s, retrying\n",
+            ep->name, ep->path, strerror(errno));
+        ep->connecting = true;
+        self->connecting++;
+        self->connect_ns = xpc_monotonic_ns()
+            + (uint64_t)XPC_TOPO_CONNECT_RETRY_MS * 1000000;
+    }
+    return ep->fd;
+}
+
+static int open_stdio(xpc_topo_endpoint_t *ep) {
+    int fd = (ep->mode == XPC_TOPO_MODE_RD) ? STDIN_FILENO:STDOUT_FILENO;
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    return fd;
+}
+
+int xpc_topology_open(xpc_topology_t *self) {
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(ep->fd != -1) {
+            continue;
+        }
+        switch(ep->kind) {
+            case XPC_TOPO_DEVICE:
+                ep->fd = open_device(ep);
+            break;
+            case XPC_TOPO_FIFO:
+                ep->fd = open_fifo(ep);
+            break;
+            case XPC_TOPO_SOCKET:
+                ep->fd = open_socket(self, ep);
+            break;
+            case XPC_TOPO_STDIO:
+                ep->fd = open_stdio(ep);
+            break;
+            case XPC_TOPO_LISTEN:
+                ep->fd = xpc_listen_seqpacket(ep->path);
+            break;
+            case XPC_TOPO_FILE:
+                ep->fd = xpc_sink_open(ep->path);
+            break;
+        }
+        if(ep->fd == -1) {
+            int err = errno;
+            fprintf(stderr, "open %s (%s): %s\n", ep->name, ep->path, strerror(err));
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int xpc_topology_connect_poll(xpc_topology_t *self, xpc_router_t *router) {
+    if(self->connecting == 0) {
+        return -1;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    if(now < self->connect_ns) {
+        // round up, epoll timeouts are in milliseconds.
+        return (self->connect_ns - now + 999999) / 1000000;
+    }
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(!ep->connecting || connect_socket(ep) != 0) {
+            continue;
+        }
+        fprintf(stderr, "%s: connected\n", ep->name);
+        ep->connecting = false;
+        self->connecting--;
+        if(hashmap_fetch(router->in_contexts, ep->fd) != NULL
+                && router->io_watch_fd_cb != NULL) {
+            router->io_watch_fd_cb(router->io_event_context, ep->fd);
+        }
+        if(hashmap_fetch(router->out_contexts, ep->fd) != NULL
+                && router->io_add_fd_cb != NULL) {
+            router->io_add_fd_cb(router->io_event_context, ep->fd);
+        }
+    }
+    if(self->connecting == 0) {
+        return -1;
+    }
+    self->connect_ns = now + (uint64_t)XPC_TOPO_CONNECT_RETRY_MS * 1000000;
+    return XPC_TOPO_CONNECT_RETRY_MS;
+}
+
+bool xpc_topology_connecting(xpc_topology_t *self, int fd) {
+    for(int i = 0; self->connecting > 0 && i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(ep->fd == fd) {
+            return ep->connecting;
+        }
+    }
+    return false;
+}
+
+xpc_router_t *xpc_topology_build_router(xpc_topology_t *self) {
+    xpc_router_t *r = initialize_xpc_router_sized(
+        array_size(self->endpoints), array_size(self->routes)
+    );
+    if(r == NULL) {
+        goto done;
+    }
+    r->max_msg_size = self->max_msg_size;
+    r->strict_channels = self->strict_channels;
+    xpc_sched_enable(r, self->sched_quantum);
+
+    iter_context *it = create_array_iterator(self->routes);
+    for(xpc_topo_route_t *route = iter_next(it); route; route = iter_next(it)) {
+        xpc_topo_endpoint_t *in = array_fetch(self->endpoints, route->in_ep);
+        xpc_topo_endpoint_t *out = array_fetch(self->endpoints, route->out_ep);
+        if(xpc_set_route(r, in->fd, out->fd, route->in_chn, route->out_chn) != 0
+                || xpc_set_route_flags(r, in->fd, route->in_chn, route->flags) != 0
+                || (route->weight > 0 && xpc_sched_set_route_weight(
+                    r, in->fd, route->in_chn, route->weight) != 0)) {
+            iter_free(it);
+            goto bad_router;
+        }
+        if(route->hook_path[0] != '\0') {
+            xpc_hook_t *hook = xpc_hook_load(
+                route->hook_path, route->hook_symbol, route->hook_arg
+            );
+            if(hook == NULL) {
+                iter_free(it);
+                goto bad_router;
+            }
+            xpc_set_route_hook(r, in->fd, route->in_chn, hook);
+        }
+        if(xpc_set_route_limit(r, in->fd, route->in_chn, &route->limit) != 0) {
+            iter_free(it);
+            goto bad_router;
+        }
+    }
+    iter_free(it);
+
+    // only now do the contexts exist for the per-endpoint settings.
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(ep->sched_weight > 0
+                && xpc_sched_set_fd_weight(r, ep->fd, ep->sched_weight) != 0) {
+            fprintf(stderr, "%s: weight is set, but nothing is routed to or from it\n",
+                ep->name);
+            goto bad_router;
+        }
+        if(ep->kind == XPC_TOPO_LISTEN) {
+            // clients get their own queues, and always use host byte order.
+            if(xpc_add_listener(r, ep->fd) != 0) {
+                goto bad_router;
+            }
+            continue;
+        }
+        xpc_set_endianness(r, ep->fd, ep->big_endian);
+        if(ep->compress && xpc_compress_allow(r, ep->fd, true) != 0) {
+            fprintf(stderr, "%s: compress is set, but nothing is routed from it\n",
+                ep->name);
+            goto bad_router;
+        }
+        if(xpc_reserve_output(r, ep->fd, ep->queue_msgs, ep->queue_msg_size) != 0) {
+            // not an output.
+            if(ep->spill_path[0] != '\0') {
+                fprintf(stderr, "%s: spill is set, but nothing is routed to it\n",
+                    ep->name);
+                goto bad_router;
+            }
+            if(ep->kind == XPC_TOPO_FILE) {
+                fprintf(stderr, "%s: nothing is routed to it\n", ep->name);
+                goto bad_router;
+            }
+            continue;
+        }
+        if(xpc_set_coalescing(r, ep->fd, ep->coalesce_bytes, ep->coalesce_us) != 0
+                || xpc_set_credit_window(r, ep->fd, ep->credit_window) != 0) {
+            goto bad_router;
+        }
+        if(ep->spill_path[0] != '\0' && xpc_spill_enable(
+                r, ep->fd, ep->spill_path, (int64_t)ep->spill_mem_kb << 10,
+                (uint32_t)ep->spill_segment_kb << 10, ep->spill_segments) != 0) {
+            perror(ep->spill_path);
+            goto bad_router;
+        }
+        if(ep->kind == XPC_TOPO_FILE
+                && xpc_sink_enable(r, ep->fd, ep->path, &ep->sink) != 0) {
+            perror(ep->path);
+            goto bad_router;
+        }
+    }
+
+    if(self->stats_path[0] != '\0' && xpc_stats_enable(
+            r, self->stats_path,
+            array_size(self->endpoints) + XPC_TOPO_STATS_EXTRA_FDS,
+            array_size(self->routes), self->stats_interval_ms) != 0) {
+        perror(self->stats_path);
+        goto bad_router;
+    }
+    if(self->capture_path[0] != '\0' && xpc_capture_enable(
+            r, self->capture_path, (size_t)self->capture_mb << 20) != 0) {
+        perror(self->capture_path);
+        goto bad_router;
+    }
+    // last, so that everything it prefaults exists.
+    xpc_rt_opts_t rt = XPC_RT_OPTS_DEFAULT;
+    rt.cpu = self->pipeline ? -1:self->rt_cpu;
+    rt.priority = self->rt_priority;
+    rt.warmup_ms = self->rt_warmup_ms;
+    if(self->realtime && xpc_rt_enable(r, &rt) != 0) {
+        perror("realtime");
+        goto bad_router;
+    }
+    goto done;
+
+bad_router:
+    xpc_router_destroy(r);
+    r = NULL;
+done:
+    return r;
+}
+
+xpc_pipeline_t *xpc_topology_build_pipeline(
+        xpc_topology_t *self, xpc_router_t *router) {
+    xpc_pipeline_t *r = create_xpc_pipeline(
+        router, (uint32_t)self->pipeline_queue_kb << 10
+    );
+    if(r == NULL) {
+        if(errno == ENOTSUP) {
+            fprintf(stderr, "pipeline: listeners, capture, spill, sinks, "
+                "hooks and rate limits need the event loop\n");
+        }
+        else {
+            perror("pipeline");
+        }
+        goto done;
+    }
+    for(int i = 0; i < array_size(self->endpoints); i++) {
+        xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+        if(ep->rx_cpu >= 0
+                && xpc_pipeline_set_cpu(r, ep->fd, false, ep->rx_cpu) != 0) {
+            fprintf(stderr, "%s: rx_cpu is set, but nothing is routed from it\n",
+                ep->name);
+            goto bad_pipeline;
+        }
+        if(ep->tx_cpu >= 0
+                && xpc_pipeline_set_cpu(r, ep->fd, true, ep->tx_cpu) != 0) {
+            fprintf(stderr, "%s: tx_cpu is set, but nothing is routed to it\n",
+                ep->name);
+            goto bad_pipeline;
+        }
+    }
+    goto done;
+
+bad_pipeline:
+    xpc_pipeline_free(r);
+    r = NULL;
+done:
+    return r;
+}
+
+void xpc_topology_free(xpc_topology_t *self) {
+    if(self != NULL) {
+        if(self->endpoints != NULL) {
+            for(int i = 0; i < array_size(self->endpoints); i++) {
+                xpc_topo_endpoint_t *ep = array_fetch(self->endpoints, i);
+                if(ep->fd > STDERR_FILENO) {
+                    close(ep->fd);
+                }
+            }
+        }
+        array_free(self->endpoints);
+        array_free(self->routes);
+        free(self);
+    }
+}
@@ -4,7 +4,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <xpc_utils.h>
+#include <xpc_clients.h>
+#include <xpc_stats.h>
+#include <xpc_capture.h>
+#include <xpc_credit.h>
+#include <xpc_compress.h>
+#include <xpc_shm.h>
+#include <xpc_sched.h>
+#include <xpc_rt.h>
+#include <xpc_spill.h>
+#include <xpc_sink.h>
+#include <xpc_hook.h>
+#include <xpc_limit.h>
 #include <tinyxpc/tinyxpc.h>
 #include <xpc_msg_queue.h>
 #include <alibc/containers/dynabuf.h>
@@ -21,9 +34,9 @@ static int8_t xpc_switch_cmp(void *a, void *b) {
     xpc_switch_tbl_entry_t c = *(xpc_switch_tbl_entry_t*)&a;
     xpc_switch_tbl_entry_t d = *(xpc_switch_tbl_entry_t*)&b;
     int8_t status = 0;
-    // only useful for equality checking for now.
-    if(c.fd < d.fd) status = -1;
-    if(c.to_chn != d.to_chn) status = 1;
+    // order by fd, then by channel.
+    if(c.fd != d.fd) status = (c.fd < d.fd) ? -1:1;
+    else if(c.to_chn != d.to_chn) status = (c.to_chn < d.to_chn) ? -1:1;
     return status;
 }
 
@@ -32,6 +45,30 @@ static int xpc_switch_hash(void *a) {
     return t.fd + t.to_chn;
 }
 
+static bool xpc_stage_fill(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx);
+
+/**
+ * Check whether a message may be written to an output while it arrives.
+ * Coalesced and datagram outputs need it whole, and compression changes it
+ * once it is whole.
+ */
+static bool xpc_cut_through_ok(xpc_in_ctx_t *in_ctx, xpc_out_ctx_t *out_ctx) {
+    return out_ctx->cut_through_id < 0 && out_ctx->coalesce_bytes == 0
+        && out_ctx->stage_len == 0 && !out_ctx->seqpacket && !out_ctx->fanout
+        && out_ctx->lz_tx == NULL && in_ctx->lz_rx == NULL
+        && out_ctx->spill == NULL && out_ctx->sink == NULL;
+}
+
+void xpc_record_latency(
+        xpc_router_t *ctx, int src_fd, int src_chn, uint64_t latency_ns) {
+    xpc_switch_tbl_entry_t key = {.fd = src_fd, .to_chn = src_chn};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    // the route may have been removed while the message was queued.
+    if(route != NULL && route->latency != NULL) {
+        xpc_hist_record(route->latency, latency_ns);
+    }
+}
+
 xpc_out_ctx_t *create_xpc_out_ctx(xpc_out_ctx_t *target) {
     xpc_out_ctx_t *r = target;
     if(r == NULL) {
@@ -39,12 +76,39 @@ xpc_out_ctx_t *create_xpc_out_ctx(xpc_out_ctx_t *target) {
     }
     r->msg_queue = create_msg_queue();
     if(r->msg_queue == NULL) {
-        free(r);
+        // target belongs to the caller, don't free it.
         r = NULL;
         goto done;
     }
     // no buffer in use.
     r->current_buf_id = -1;
+    r->cut_through_id = -1;
+    r->cut_through_waiting = false;
+    r->codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    // coalescing is off until xpc_set_coalescing is called.
+    r->coalesce_bytes = 0;
+    r->coalesce_delay_us = 0;
+    r->stage = NULL;
+    r->stage_len = 0;
+    r->stage_wr = 0;
+    r->stage_flushing = false;
+    r->stage_deadline_ns = 0;
+    r->stage_msgs = 0;
+    r->stage_origins = NULL;
+    r->seqpacket = false;
+    r->fanout = false;
+    r->retired = false;
+    r->credit_window = XPC_CREDIT_WINDOW;
+    r->credit_routes = 0;
+    r->credit_outstanding = 0;
+    r->lz_tx = NULL;
+    r->lz_tx_active = false;
+    r->sched_weight = 0;
+    r->sched_deficit = 0;
+    r->sched_round = 0;
+    r->spill = NULL;
+    r->sink = NULL;
+    memset(&r->tx, 0, sizeof(r->tx));
 done:
     return r;
 }
@@ -52,10 +116,22 @@ done:
 void xpc_out_ctx_free(xpc_out_ctx_t *self) {
     if(self != NULL) {
         xpc_msg_queue_destroy(self->msg_queue);
+        dynabuf_free(self->stage);
+        dynabuf_free(self->stage_origins);
+        xpc_lz_free(self->lz_tx);
+        xpc_spill_free(self->spill);
+        xpc_sink_free(self->sink);
     }
 }
 
 xpc_router_t *initialize_xpc_router() {
+    return initialize_xpc_router_sized(4, 4);
+}
+
+xpc_router_t *initialize_xpc_router_sized(int max_fds, int max_routes) {
+    // tables are kept at most half full.
+    int fd_slots = 2 * ((max_fds > 2) ? max_fds:2);
+    int route_slots = 2 * ((max_routes > 2) ? max_routes:2);
     xpc_router_t *r = malloc(sizeof(xpc_router_t));
     if(r == NULL) {
         goto done;
@@ -63,7 +139,7 @@ xpc_router_t *initialize_xpc_router() {
 
     // initialize the fd buffers list
     r->in_contexts = create_hashmap(
-        4, sizeof(int), sizeof(xpc_in_ctx_t),
+        fd_slots, sizeof(int), sizeof(xpc_in_ctx_t),
         alc_default_hash_i32, alc_default_cmp_i32, NULL
     );
     if(r->in_contexts == NULL) {
@@ -73,7 +149,7 @@ xpc_router_t *initialize_xpc_router() {
     }
 
     r->out_contexts = create_hashmap(
-        4, sizeof(int), sizeof(xpc_out_ctx_t),
+        fd_slots, sizeof(int), sizeof(xpc_out_ctx_t),
         alc_default_hash_i32, alc_default_cmp_i32, NULL
     );
     if(r->out_contexts == NULL) {
@@ -83,7 +159,7 @@ xpc_router_t *initialize_xpc_router() {
         goto done;
     }
     r->switch_tbl = create_hashmap(
-        4, sizeof(xpc_switch_tbl_entry_t), sizeof(xpc_switch_tbl_entry_t),
+        route_slots, sizeof(xpc_switch_tbl_entry_t), sizeof(xpc_route_t),
         xpc_switch_hash, xpc_switch_cmp, NULL);
     if(r->switch_tbl == NULL) {
         hashmap_free(r->out_contexts);
@@ -92,12 +168,97 @@ xpc_router_t *initialize_xpc_router() {
         r = NULL;
         goto done;
     }
+    r->subscriptions = create_hashmap(
+        route_slots, sizeof(xpc_switch_tbl_entry_t), sizeof(array_t*),
+        xpc_switch_hash, xpc_switch_cmp, NULL);
+    if(r->subscriptions == NULL) {
+        hashmap_free(r->switch_tbl);
+        hashmap_free(r->out_contexts);
+        hashmap_free(r->in_contexts);
+        free(r);
+        r = NULL;
+        goto done;
+    }
+    r->in_fds = create_array(fd_slots, sizeof(int));
+    r->out_fds = create_array(fd_slots, sizeof(int));
+    r->route_keys = create_array(route_slots, sizeof(xpc_switch_tbl_entry_t));
+    if(r->in_fds == NULL || r->out_fds == NULL || r->route_keys == NULL) {
+        array_free(r->in_fds);
+        array_free(r->out_fds);
+        array_free(r->route_keys);
+        hashmap_free(r->subscriptions);
+        hashmap_free(r->switch_tbl);
+        hashmap_free(r->out_contexts);
+        hashmap_free(r->in_contexts);
+        free(r);
+        r = NULL;
+        goto done;
+    }
+    r->coalesce_pending = 0;
+    r->cut_throughs = 0;
+    r->max_msg_size = XPC_DEFAULT_MAX_MSG_SIZE;
+    r->strict_channels = false;
+    r->crc_polyn = 0;
+    r->big_endian = XPC_HOST_BIG_ENDIAN;
+    r->io_event_context = NULL;
+    r->io_add_fd_cb = NULL;
+    r->io_del_fd_cb = NULL;
+    r->io_watch_fd_cb = NULL;
+    r->io_forget_fd_cb = NULL;
+    r->io_close_fd_cb = NULL;
+    r->stats_export = NULL;
+    r->capture = NULL;
+    r->rt = NULL;
+    r->retired_outputs = 0;
+    r->sinks = 0;
+    r->spill_stalled = 0;
+    r->credit_inputs = 0;
+    r->credit_grants = NULL;
+    r->sched_quantum = 0;
 done:
     return r;
 }
 
+int xpc_keys_add(array_t *keys, const void *key, size_t len) {
+    // like the table keys, these are no larger than a pointer, and are
+    // passed by value.
+    void *val = NULL;
+    memcpy(&val, key, len);
+    return (array_append(keys, val) == 0) ? 0:-1;
+}
+
+void xpc_keys_remove(array_t *keys, const void *key, size_t len) {
+    for(int i = 0; i < array_size(keys); i++) {
+        if(memcmp(array_fetch(keys, i), key, len) == 0) {
+            array_remove(keys, i);
+            return;
+        }
+    }
+}
+
 void xpc_router_destroy(xpc_router_t *ctx) {
     if(ctx != NULL) {
+        iter_context *in_it = create_hashmap_keys_iterator(ctx->in_contexts);
+        for(int *pfd = iter_next(in_it); pfd != NULL; pfd = iter_next(in_it)) {
+            xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, *pfd);
+            free(in_ctx->rx_buf);
+            xpc_lz_free(in_ctx->lz_rx);
+            // accepted clients belong to the router.
+            if(in_ctx->kind == XPC_IN_SEQPACKET) {
+                close(*pfd);
+            }
+            else if(in_ctx->kind == XPC_IN_SHM) {
+                xpc_shm_link_free(in_ctx->shm);
+            }
+        }
+        iter_free(in_it);
+        iter_context *sub_it = create_hashmap_values_iterator(ctx->subscriptions);
+        for(array_t **subs = iter_next(sub_it); subs != NULL;
+                subs = iter_next(sub_it)) {
+            array_free(*subs);
+        }
+        iter_free(sub_it);
+        hashmap_free(ctx->subscriptions);
         hashmap_free(ctx->in_contexts);
         iter_context *it = create_hashmap_values_iterator(ctx->out_contexts);
         xpc_out_ctx_t *next = (xpc_out_ctx_t *)iter_next(it);
@@ -105,17 +266,382 @@ void xpc_router_destroy(xpc_router_t *ctx) {
             xpc_out_ctx_free(next);
             next = (xpc_out_ctx_t *)iter_next(it);
         }
+        iter_free(it);
         hashmap_free(ctx->out_contexts);
+        iter_context *route_it = create_hashmap_values_iterator(ctx->switch_tbl);
+        for(xpc_route_t *route = iter_next(route_it); route != NULL;
+                route = iter_next(route_it)) {
+            free(route->latency);
+            xpc_hook_free(route->hook);
+            xpc_limit_free(route->limit);
+        }
+        iter_free(route_it);
         hashmap_free(ctx->switch_tbl);
+        array_free(ctx->in_fds);
+        array_free(ctx->out_fds);
+        array_free(ctx->route_keys);
+        xpc_stats_export_free(ctx->stats_export);
+        xpc_capture_free(ctx->capture);
+        xpc_rt_free(ctx->rt);
+        dynabuf_free(ctx->credit_grants);
         free(ctx);
     }
 }
 
 
-int xpc_accumulate_msg(xpc_router_t *ctx, int fd) {
+/**
+ * read(2) from an input, noting when it reached end of file or failed.
+ */
+static int xpc_in_read_fd(xpc_in_ctx_t *in_ctx, int fd, void *dst, int len) {
+    int n = read(fd, dst, len);
+    if((n == 0 && len > 0) || (n == -1 && errno != EAGAIN
+            && errno != EWOULDBLOCK && errno != EINTR)) {
+        in_ctx->hangup = true;
+    }
+    return n;
+}
+
+/**
+ * Read from an input, taking bytes left over from resynchronization first.
+ * Behaves like read(2) otherwise.
+ */
+static int xpc_in_read(xpc_in_ctx_t *in_ctx, int fd, void *dst, int len) {
+    int pending = in_ctx->rx_end - in_ctx->rx_start;
+    if(pending > 0) {
+        int n = (pending < len) ? pending:len;
+        memcpy(dst, in_ctx->rx_buf + in_ctx->rx_start, n);
+        in_ctx->rx_start += n;
+        return n;
+    }
+    return xpc_in_read_fd(in_ctx, fd, dst, len);
+}
+
+static inline void xpc_hdr_count(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+bool xpc_hdr_valid(
+        xpc_router_t *ctx, xpc_hdr_input_t *in, const txpc_hdr_t *hdr,
+        bool strict, void **route) {
+    void *found = NULL;
+    bool valid = true;
+    if(hdr->to == 0 && hdr->from == 0) {
+        switch(hdr->type) {
+            case TXPC_NEG_TYPE_CRC_CONFIG:
+            case TXPC_NEG_TYPE_DISCONNECT:
+            case TXPC_NEG_TYPE_ENDIANNESS:
+            case TXPC_NEG_TYPE_REPORT_VERSION:
+            case XPC_NEG_TYPE_CREDIT:
+            case XPC_NEG_TYPE_COMPRESS:
+                valid = !strict || hdr->size <= XPC_NEG_PAYLOAD_MAX;
+            break;
+            default:
+                valid = false;
+        }
+    }
+    else if((uint64_t)hdr->size > (uint64_t)ctx->max_msg_size) {
+        valid = false;
+    }
+    else {
+        found = in->lookup(in->lookup_arg, in->fd, hdr->to);
+        valid = !strict || found != NULL;
+    }
+    if(route != NULL) {
+        *route = found;
+    }
+    return valid;
+}
+
+xpc_hdr_kind_t xpc_hdr_take(
+        xpc_router_t *ctx, xpc_hdr_input_t *in, const uint8_t *wire,
+        txpc_hdr_t *hdr, bool resyncing, void **route) {
+    in->codec->decode(hdr, wire);
+    bool neg = hdr->to == 0 && hdr->from == 0;
+    if(neg) {
+        const xpc_hdr_codec_t *codec = xpc_hdr_codec_detect(wire, in->codec);
+        if(codec != NULL && codec != in->codec) {
+            in->codec = codec;
+            codec->decode(hdr, wire);
+        }
+    }
+    if(!xpc_hdr_valid(ctx, in, hdr, resyncing || ctx->strict_channels, route)) {
+        if(!resyncing) {
+            xpc_hdr_count(in->resync_count);
+            xpc_hdr_count(&in->rx->drops[XPC_DROP_MALFORMED]);
+        }
+        xpc_hdr_count(in->resync_skipped);
+        return XPC_HDR_BAD;
+    }
+    return neg ? XPC_HDR_NEG:XPC_HDR_MSG;
+}
+
+static void *xpc_switch_lookup(void *arg, int fd, int to_chn) {
+    xpc_router_t *ctx = arg;
+    xpc_switch_tbl_entry_t key = {.fd = fd, .to_chn = to_chn};
+    return hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+}
+
+static xpc_hdr_input_t xpc_in_hdr_input(
+        xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    return (xpc_hdr_input_t){
+        .fd = fd, .codec = in_ctx->codec,
+        .lookup = xpc_switch_lookup, .lookup_arg = ctx,
+        .rx = &in_ctx->rx, .resync_count = &in_ctx->resync_count,
+        .resync_skipped = &in_ctx->resync_skipped
+    };
+}
+
+/**
+ * Give bytes back to an input, they are read again before anything else.
+ * @return 0 on success, -1 if the input has no lookahead buffer.
+ */
+static int xpc_in_unread(xpc_in_ctx_t *in_ctx, const uint8_t *bytes, int n) {
+    if(in_ctx->rx_buf == NULL) {
+        return -1;
+    }
+    if(in_ctx->rx_start >= n) {
+        // the bytes came out of the lookahead buffer, put them back.
+        in_ctx->rx_start -= n;
+    }
+    else {
+        // nothing else is pending if the bytes came from the fd.
+        int pending = in_ctx->rx_end - in_ctx->rx_start;
+        memmove(in_ctx->rx_buf + n, in_ctx->rx_buf + in_ctx->rx_start, pending);
+        in_ctx->rx_start = 0;
+        in_ctx->rx_end = n + pending;
+    }
+    memcpy(in_ctx->rx_buf + in_ctx->rx_start, bytes, n);
+    return 0;
+}
+
+/**
+ * Enter resynchronization after xpc_hdr_take rejected the header in
+ * hdr_wire. The search for the next header starts at its second byte.
+ */
+static void xpc_resync_begin(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    // whatever is skipped was part of the compression history.
+    if(in_ctx->lz_rx != NULL) {
+        xpc_compress_lost(ctx, fd, in_ctx);
+    }
+    if(xpc_in_unread(in_ctx, in_ctx->hdr_wire + 1, sizeof(txpc_hdr_t) - 1) != 0) {
+        // no lookahead buffer, slide along one byte at a time.
+        memmove(in_ctx->hdr_wire, in_ctx->hdr_wire + 1, sizeof(txpc_hdr_t) - 1);
+        in_ctx->hdr_offset = sizeof(txpc_hdr_t) - 1;
+        return;
+    }
+    // candidates are headers sent to a channel routed from this fd.
+    xpc_resync_filter_init(&in_ctx->resync_filter, in_ctx->codec);
+    // by index, an iterator would be allocated.
+    for(int i = 0; i < array_size(ctx->route_keys); i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        if(k->fd == fd) {
+            xpc_resync_filter_add(&in_ctx->resync_filter, k->to_chn);
+        }
+    }
+    in_ctx->resyncing = true;
+}
+
+/**
+ * Confirm a candidate header found while resynchronizing. If the header
+ * after it is also buffered, it has to be valid as well.
+ */
+static bool xpc_resync_confirm(
+        xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx, int offset) {
+    txpc_hdr_t hdr;
+    xpc_hdr_input_t in = xpc_in_hdr_input(ctx, fd, in_ctx);
+    in_ctx->codec->decode(&hdr, in_ctx->rx_buf + offset);
+    if(!xpc_hdr_valid(ctx, &in, &hdr, true, NULL)) {
+        return false;
+    }
+    int64_t next = (int64_t)offset + sizeof(txpc_hdr_t) + hdr.size;
+    if(next + (int64_t)sizeof(txpc_hdr_t) <= in_ctx->rx_end) {
+        in_ctx->codec->decode(&hdr, in_ctx->rx_buf + next);
+        return xpc_hdr_valid(ctx, &in, &hdr, true, NULL);
+    }
+    return true;
+}
+
+/**
+ * Scan an input for the next plausible header.
+ * On success the header is stored as the inflight message's header, and the
+ * bytes after it are left in the lookahead buffer.
+ */
+static int xpc_resync_scan(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    int bytes_read = 0;
+    int rd_bytes = 0;
+    const int hdr_len = sizeof(txpc_hdr_t);
+    while(true) {
+        int start = in_ctx->rx_start;
+        while(in_ctx->rx_end - in_ctx->rx_start >= hdr_len) {
+            int found = xpc_resync_find(
+                &in_ctx->resync_filter, in_ctx->rx_buf,
+                in_ctx->rx_start, in_ctx->rx_end - hdr_len + 1
+            );
+            if(found < 0) {
+                in_ctx->rx_start = in_ctx->rx_end - hdr_len + 1;
+                break;
+            }
+            if(xpc_resync_confirm(ctx, fd, in_ctx, found)) {
+                in_ctx->resync_skipped += found - start;
+                memcpy(in_ctx->hdr_wire, in_ctx->rx_buf + found, hdr_len);
+                in_ctx->codec->decode(&in_ctx->msg_hdr, in_ctx->hdr_wire);
+                in_ctx->rx_start = found + hdr_len;
+                in_ctx->resyncing = false;
+                in_ctx->hdr_offset = 0;
+                in_ctx->buf_id = -1;
+                in_ctx->buf_offset = 0;
+                in_ctx->msg_inflight = true;
+                in_ctx->msg_start_ns = xpc_monotonic_ns();
+                goto done;
+            }
+            in_ctx->rx_start = found + 1;
+        }
+        in_ctx->resync_skipped += in_ctx->rx_start - start;
+        // keep the unscanned tail, it may be the start of a header.
+        memmove(
+            in_ctx->rx_buf, in_ctx->rx_buf + in_ctx->rx_start,
+            in_ctx->rx_end - in_ctx->rx_start
+        );
+        in_ctx->rx_end -= in_ctx->rx_start;
+        in_ctx->rx_start = 0;
+        rd_bytes = xpc_in_read_fd(
+            in_ctx, fd, in_ctx->rx_buf + in_ctx->rx_end,
+            XPC_RESYNC_BUF_SIZE - in_ctx->rx_end
+        );
+        if(rd_bytes <= 0) {
+            goto done;
+        }
+        in_ctx->rx_end += rd_bytes;
+        bytes_read += rd_bytes;
+    }
+done:
+    return bytes_read;
+}
+
+/**
+ * Read the payload of a negotiation message into the input context, and act
+ * on it once it is complete.
+ */
+static int xpc_accumulate_neg(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    int bytes_read = 0;
+    int rd_bytes = 0;
+    while(in_ctx->buf_offset < in_ctx->msg_hdr.size) {
+        int remaining = in_ctx->msg_hdr.size - in_ctx->buf_offset;
+        uint8_t *dst = ctx->discard_buf;
+        int len = sizeof(ctx->discard_buf);
+        // keep what fits, anything past that is read and thrown away.
+        if(in_ctx->buf_offset < XPC_NEG_PAYLOAD_MAX) {
+            dst = in_ctx->neg_payload + in_ctx->buf_offset;
+            len = XPC_NEG_PAYLOAD_MAX - in_ctx->buf_offset;
+        }
+        rd_bytes = xpc_in_read(in_ctx, fd, dst, (remaining < len) ? remaining:len);
+        if(rd_bytes <= 0) {
+            goto done;
+        }
+        in_ctx->buf_offset += rd_bytes;
+        bytes_read += rd_bytes;
+    }
+
+    // the whole message is here.
+    switch(in_ctx->msg_hdr.type) {
+        case TXPC_NEG_TYPE_CRC_CONFIG:
+        break;
+        case TXPC_NEG_TYPE_DISCONNECT:
+        break;
+        case TXPC_NEG_TYPE_ENDIANNESS:
+            // the first payload byte states the byte order (nonzero is big
+            // endian). Without one, the byte order the header was detected
+            // in is used.
+            if(in_ctx->msg_hdr.size > 0) {
+                xpc_set_endianness(ctx, fd, in_ctx->neg_payload[0] != 0);
+            }
+            else {
+                xpc_set_endianness(ctx, fd, in_ctx->codec->big_endian);
+            }
+        break;
+        case TXPC_NEG_TYPE_REPORT_VERSION:
+        break;
+        case XPC_NEG_TYPE_CREDIT:
+            xpc_credit_enable(
+                ctx, fd, in_ctx->msg_hdr.size == 0 || in_ctx->neg_payload[0] != 0
+            );
+        break;
+        case XPC_NEG_TYPE_COMPRESS:
+            xpc_compress_neg(
+                ctx, fd, in_ctx, in_ctx->neg_payload, in_ctx->msg_hdr.size
+            );
+        break;
+        // not supporting other neg types for now
+    }
+    in_ctx->msg_inflight = false;
+done:
+    return bytes_read;
+}
+
+void xpc_count_drop(
+        xpc_router_t *ctx, int fd, int to_chn, xpc_drop_reason_t reason) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(in_ctx == NULL) {
+        return;
+    }
+    in_ctx->rx.drops[reason]++;
+    for(int i = 0; i < in_ctx->n_drop_chns; i++) {
+        if(in_ctx->drop_chns[i].chn == to_chn) {
+            in_ctx->drop_chns[i].count++;
+            return;
+        }
+    }
+    if(in_ctx->n_drop_chns == XPC_DROP_CHANNELS) {
+        in_ctx->drops_other++;
+        return;
+    }
+    in_ctx->drop_chns[in_ctx->n_drop_chns++] =
+        (xpc_drop_slot_t){.chn = to_chn, .count = 1};
+}
+
+/**
+ * Consume the payload of a message which is being dropped.
+ * The payload is read into the router's scratch buffer, which is shared by
+ * all inputs, so a dropped message never holds a queue buffer.
+ */
+static int xpc_discard_payload(xpc_router_t *ctx, int fd, xpc_in_ctx_t *in_ctx) {
+    int bytes_read = 0;
+    int rd_bytes = 0;
+    while(in_ctx->buf_offset < in_ctx->msg_hdr.size) {
+        int remaining = in_ctx->msg_hdr.size - in_ctx->buf_offset;
+        uint8_t *dst = ctx->discard_buf;
+        int len = sizeof(ctx->discard_buf);
+        if(in_ctx->lz_discard) {
+            // kept whole, it is history of a compressed input.
+            dst = xpc_compress_discard_buf(in_ctx);
+            len = remaining;
+        }
+        rd_bytes = xpc_in_read(in_ctx, fd, dst, (remaining < len) ? remaining:len);
+        if(rd_bytes <= 0) {
+            goto done;
+        }
+        in_ctx->buf_offset += rd_bytes;
+        bytes_read += rd_bytes;
+    }
+    if(in_ctx->lz_discard) {
+        xpc_compress_discarded(ctx, fd, in_ctx);
+    }
+    // the next byte on this fd is the start of a header.
+    in_ctx->discarding = false;
+    in_ctx->msg_inflight = false;
+done:
+    return bytes_read;
+}
+
+static int xpc_accumulate_once(xpc_router_t *ctx, int fd) {
     msg_buf_t *msg_buf = NULL;
     xpc_out_ctx_t *out_ctx = NULL;
+    xpc_route_t *sw_ent = NULL;
+    void *route = NULL;
+    bool taken = false;
+    xpc_drop_reason_t drop_reason = XPC_DROP_NO_ROUTE;
     int bytes_read = 0;
+    int rd_bytes = 0;
     // get the context for this input fd
     xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
     if(hashmap_status(ctx->in_contexts) != ALC_HASHMAP_SUCCESS) {
@@ -125,112 +651,492 @@ int xpc_accumulate_msg(xpc_router_t *ctx, int fd) {
     // If a message is not in-flight, the to-channel is not available.
     // Read into a temporary buffer first until the header is obtained,
     // then use the inflight message logic.
-    if(!in_ctx->msg_inflight) {
-        // need a new buffer from xpc_msg_getbuf
-        in_ctx->buf_id = -1;
-        in_ctx->buf_offset = 0;
-
-        // obtain the header, blocking (necessary to be able to continue
-        // processing data from this fd).
-        while(bytes_read < sizeof(txpc_hdr_t)) {
-            bytes_read += read(
-                fd, &in_ctx->msg_hdr + bytes_read, sizeof(txpc_hdr_t)
-            );
+    if(in_ctx->resyncing) {
+        bytes_read += xpc_resync_scan(ctx, fd, in_ctx);
+        if(in_ctx->resyncing) {
+            goto done;
         }
-        in_ctx->msg_inflight = true;
     }
-    // A message is now inflight, so the stored header of this fd is valid.
-    // Fetch the switch table entry for this fd.
-    xpc_switch_tbl_entry_t key = {.fd = fd, .to_chn = in_ctx->msg_hdr.to};
-    xpc_switch_tbl_entry_t *sw_ent = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
-    if(sw_ent == NULL) {
-        // couldn't find that route, just drop the message.
-        // this implies reading and ignoring the number of bytes in the size
-        // header.
+    else if(!in_ctx->msg_inflight) {
+        // obtain the header. The fd is non-blocking, so a partial header is
+        // kept in the input context until the rest of it arrives.
+        rd_bytes = xpc_in_read(
+            in_ctx, fd, in_ctx->hdr_wire + in_ctx->hdr_offset,
+            sizeof(txpc_hdr_t) - in_ctx->hdr_offset
+        );
+        if(rd_bytes <= 0) {
+            goto done;
+        }
+        if(in_ctx->hdr_offset == 0) {
+            // forwarding latency is measured from here.
+            in_ctx->msg_start_ns = xpc_monotonic_ns();
+        }
+        bytes_read += rd_bytes;
+        in_ctx->hdr_offset += rd_bytes;
+        if(in_ctx->hdr_offset < sizeof(txpc_hdr_t)) {
+            goto done;
+        }
+        in_ctx->hdr_offset = 0;
+        xpc_hdr_input_t in = xpc_in_hdr_input(ctx, fd, in_ctx);
+        xpc_hdr_kind_t kind = xpc_hdr_take(
+            ctx, &in, in_ctx->hdr_wire, &in_ctx->msg_hdr, false, &route
+        );
+        in_ctx->codec = in.codec;
+        if(kind == XPC_HDR_BAD) {
+            // the stream is misaligned or corrupt, trusting the size would
+            // only make it worse.
+            xpc_resync_begin(ctx, fd, in_ctx);
+            if(in_ctx->resyncing) {
+                bytes_read += xpc_resync_scan(ctx, fd, in_ctx);
+            }
+            if(!in_ctx->msg_inflight) {
+                goto done;
+            }
+        }
+        else {
+            // need a new buffer from xpc_msg_getbuf
+            taken = true;
+            in_ctx->buf_id = -1;
+            in_ctx->buf_offset = 0;
+            in_ctx->msg_inflight = true;
+        }
+    }
+
+    // strange design choice, but we handle negotiation messages here.
+    // This is because it is known ahead of time that these messages will
+    // never go anywhere except back to the sender, and many of them will
+    // simply never elicit a response.
+    if(in_ctx->msg_hdr.to == 0 && in_ctx->msg_hdr.from == 0) {
+        bytes_read += xpc_accumulate_neg(ctx, fd, in_ctx);
+        goto done;
+    }
+    if(in_ctx->discarding) {
+        bytes_read += xpc_discard_payload(ctx, fd, in_ctx);
         goto done;
     }
 
+    // A message is now inflight, so the stored header of this fd is valid.
+    // Fetch the switch table entry for this fd, xpc_hdr_take found it if
+    // the header was just read.
+    sw_ent = taken ? route:xpc_switch_lookup(ctx, fd, in_ctx->msg_hdr.to);
+    if(in_ctx->buf_id < 0) {
+        if(sw_ent == NULL) {
+            // couldn't find that route, just drop the message.
+            // this implies reading and ignoring the number of bytes in the
+            // size header.
+            goto drop;
+        }
+        in_ctx->out_fd = sw_ent->dst.fd;
+        in_ctx->out_chn = sw_ent->dst.to_chn;
+        if(in_ctx->credit_flow && !xpc_credit_take(
+                ctx, sw_ent, sizeof(txpc_hdr_t) + in_ctx->msg_hdr.size)) {
+            // the sender overran its credit.
+            drop_reason = XPC_DROP_QUEUE_FULL;
+            goto drop;
+        }
+        if(sw_ent->limit != NULL && !xpc_limit_admit(
+                sw_ent->limit, sizeof(txpc_hdr_t) + in_ctx->msg_hdr.size,
+                in_ctx->msg_start_ns, &drop_reason)) {
+            // left out before a buffer is taken for it.
+            goto drop;
+        }
+    }
+    else if(sw_ent != NULL && sw_ent->dst.fd != in_ctx->out_fd) {
+        // the route was redirected while the message was inflight. Its
+        // buffer belongs to the old output, it is delivered there but not
+        // counted on the new route.
+        sw_ent = NULL;
+    }
+
     // Fetch the output queue associated with the fd this message is going to.
-    out_ctx = hashmap_fetch(ctx->out_contexts, sw_ent->fd);
+    // Retired outputs are kept until their buffers are drained, so this
+    // holds for a message which lost its route as well.
+    out_ctx = hashmap_fetch(ctx->out_contexts, in_ctx->out_fd);
     if(out_ctx == NULL) {
         // no queue for this fd. here we make the assumption that any fd
         // in the routing table is already open, so a lack of an fd must be
         // an error in the caller.
-        goto done;
+        goto drop;
     }
     // NOTE: possible efficiency improvement: store the buffers in a minheap,
     // and now that the message size is known (spec chg.), get one that is
     // optimally sized for this message
+    bool new_msg = in_ctx->buf_id < 0;
     msg_buf = xpc_msg_getbuf(out_ctx->msg_queue, in_ctx->buf_id);
+    drop_reason = XPC_DROP_NO_BUFFER;
     // couldn't obtain a buffer, it doesn't exist and no memory remains.
     if(msg_buf == NULL) {
-        goto done;
+        goto drop;
     }
-    in_ctx->msg_inflight = true;
-    in_ctx->buf_id = msg_buf->buf_id;
-    memcpy(msg_buf->buf->buf, &in_ctx->msg_hdr, sizeof(txpc_hdr_t));
-    /*in_ctx->buf_offset += sizeof(txpc_hdr_t);*/
-
-    
-    // this makes sure there is space to read into, and also limits the size
-    // of read so that we guarantee that a new function call to accumulate_msg
-    // happens at the message boundary.
-    if(msg_buf->buf->capacity < in_ctx->msg_hdr.size + sizeof(txpc_hdr_t)) {
-        dynabuf_resize(msg_buf->buf, in_ctx->msg_hdr.size + sizeof(txpc_hdr_t));
+    int msg_len = sizeof(txpc_hdr_t) + in_ctx->msg_hdr.size;
+    if(new_msg) {
+        // this makes sure there is space to read into.
+        if(msg_buf->buf->capacity < msg_len
+                && dynabuf_resize(msg_buf->buf, msg_len) != 0) {
+            xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+            goto drop;
+        }
+        // the header is rewritten for the output channel, in the byte order
+        // of the output.
+        txpc_hdr_t out_hdr = in_ctx->msg_hdr;
+        out_hdr.to = in_ctx->out_chn;
+        out_ctx->codec->encode(msg_buf->buf->buf, &out_hdr);
+        msg_buf->flags = sw_ent->flags;
+        msg_buf->ingress_ns = in_ctx->msg_start_ns;
+        msg_buf->src_fd = fd;
+        msg_buf->src_chn = in_ctx->msg_hdr.to;
+        in_ctx->buf_id = msg_buf->buf_id;
+        in_ctx->buf_offset = sizeof(txpc_hdr_t);
+        msg_buf->size = in_ctx->buf_offset;
+        if((sw_ent->flags & XPC_ROUTE_CUT_THROUGH) && sw_ent->hook == NULL
+                && xpc_cut_through_ok(in_ctx, out_ctx)) {
+            out_ctx->cut_through_id = msg_buf->buf_id;
+            out_ctx->cut_through_waiting = true;
+            out_ctx->cut_through_ns = in_ctx->msg_start_ns;
+            ctx->cut_throughs++;
+        }
     }
+
+    // the size of the read is limited so that we guarantee that a new
+    // function call to accumulate_msg happens at the message boundary.
     // XXX the associated fd M U S T  be opened with O_NONBLOCK, or this will
     // cause a lot of deadlocks.
-    int rd_bytes = read(
-        fd,
-        msg_buf->buf->buf + in_ctx->buf_offset,
-        msg_buf->buf->capacity - in_ctx->buf_offset
-    );
-    if(rd_bytes == -1) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            // no more data is available. do we do anything?
+    if(in_ctx->buf_offset < msg_len) {
+        rd_bytes = xpc_in_read(
+            in_ctx, fd,
+            (uint8_t *)msg_buf->buf->buf + in_ctx->buf_offset,
+            msg_len - in_ctx->buf_offset
+        );
+        if(rd_bytes == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                // no more data is available. do we do anything?
+            }
+        }
+        else {
+            in_ctx->buf_offset += rd_bytes;
+            // update the size of the actual contents of this message.
+            msg_buf->size = in_ctx->buf_offset;
+            bytes_read += rd_bytes;
+            if(rd_bytes > 0 && out_ctx->cut_through_id == in_ctx->buf_id) {
+                out_ctx->cut_through_ns = xpc_monotonic_ns();
+            }
         }
     }
+    if(out_ctx->cut_through_id == in_ctx->buf_id && out_ctx->cut_through_waiting
+            && in_ctx->buf_offset < msg_len) {
+        // the output wrote everything received of it so far, there is more.
+        out_ctx->cut_through_waiting = false;
+        if(ctx->io_add_fd_cb != NULL) {
+            ctx->io_add_fd_cb(ctx->io_event_context, in_ctx->out_fd);
+        }
+    }
+
+    if(in_ctx->buf_offset == msg_len) {
+        if(in_ctx->lz_rx != NULL && xpc_compress_ingress(
+                ctx, fd, in_ctx, out_ctx, msg_buf) != 0) {
+            drop_reason = XPC_DROP_MALFORMED;
+            goto drop;
+        }
+        int out_chn = in_ctx->out_chn;
+        if(sw_ent != NULL && sw_ent->hook != NULL
+                && out_ctx->cut_through_id != in_ctx->buf_id
+                && !xpc_hook_run(ctx, sw_ent, out_ctx, msg_buf, &out_chn)) {
+            // dropped, or redirected off the output of the route.
+            in_ctx->msg_inflight = false;
+            in_ctx->rx.msgs++;
+            in_ctx->rx.bytes += msg_len;
+            goto done;
+        }
+        if(ctx->capture != NULL) {
+            xpc_capture_msg(
+                ctx, msg_buf, in_ctx->out_fd, out_chn, out_ctx->codec->big_endian
+            );
+        }
+        xpc_msg_finalize(out_ctx->msg_queue, in_ctx->buf_id);
+        if(out_ctx->cut_through_id == in_ctx->buf_id) {
+            out_ctx->cut_through_id = -1;
+            out_ctx->cut_through_waiting = false;
+            ctx->cut_throughs--;
+            if(out_ctx->current_buf_id == in_ctx->buf_id) {
+                // the rest of it is written like any other message. It stays
+                // marked final until it is cleared, the output does not
+                // dequeue anything else meanwhile.
+                msg_buf->size -= msg_buf->wr_offset;
+            }
+        }
+        in_ctx->msg_inflight = false;
+        in_ctx->rx.msgs++;
+        in_ctx->rx.bytes += msg_len;
+        if(sw_ent != NULL) {
+            sw_ent->stats.msgs++;
+            sw_ent->stats.bytes += msg_len;
+        }
+        xpc_output_ready(ctx, in_ctx->out_fd, out_ctx);
+    }
+
+    // a crc can be done here as well, if the message is complete.
+    goto done;
+
+drop:
+    // skip exactly the payload, so the stream stays aligned on headers.
+    xpc_count_drop(ctx, fd, in_ctx->msg_hdr.to, drop_reason);
+    if(sw_ent != NULL) {
+        sw_ent->stats.drops[drop_reason]++;
+    }
+    if(in_ctx->buf_id >= 0 && out_ctx != NULL) {
+        // part of the payload was already read into a buffer.
+        xpc_msg_clear(out_ctx->msg_queue, in_ctx->buf_id);
+        in_ctx->buf_offset -= sizeof(txpc_hdr_t);
+    }
     else {
-        // bytes_read was filled by grabbing the header if this is the first
-        // call for this message.
-        in_ctx->buf_offset += rd_bytes + bytes_read;
-        // update the size of the actual contents of this message.
-        msg_buf->size = in_ctx->buf_offset;
-        bytes_read = in_ctx->buf_offset;
+        in_ctx->buf_offset = 0;
+    }
+    if(in_ctx->lz_rx != NULL && in_ctx->buf_offset < in_ctx->msg_hdr.size) {
+        xpc_compress_discard(ctx, fd, in_ctx);
     }
+    in_ctx->buf_id = -1;
+    in_ctx->discarding = true;
+    bytes_read += xpc_discard_payload(ctx, fd, in_ctx);
+done:
+    return bytes_read;
+}
 
-    // strange design choice, but we handle negotiation messages here.
-    // This is because it is known ahead of time that these messages will
-    // never go anywhere except back to the sender, and many of them will
-    // simply never elicit a response.
-    if(in_ctx->msg_hdr.to == 0 && in_ctx->msg_hdr.from == 0) {
-        // negotiation sub-protocol, we handle these
-        switch(in_ctx->msg_hdr.type) {
-            case TXPC_NEG_TYPE_CRC_CONFIG:
-            break;
-            case TXPC_NEG_TYPE_DISCONNECT:
-            break;
-            case TXPC_NEG_TYPE_ENDIANNESS:
+/**
+ * Drop the message an output writes while it arrives, when its input hung
+ * up or stalled. What was written of it is lost to the peer, the rest of it
+ * is skipped by the input, and the output carries on with other messages.
+ */
+static void xpc_cut_through_abort(
+        xpc_router_t *ctx, int ofd, xpc_out_ctx_t *out_ctx) {
+    msg_buf_t *msg_buf = xpc_msg_getbuf(
+        out_ctx->msg_queue, out_ctx->cut_through_id
+    );
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, msg_buf->src_fd);
+    if(in_ctx != NULL && in_ctx->msg_inflight
+            && in_ctx->buf_id == out_ctx->cut_through_id) {
+        xpc_count_drop(ctx, msg_buf->src_fd, in_ctx->msg_hdr.to, XPC_DROP_MALFORMED);
+        in_ctx->buf_offset -= sizeof(txpc_hdr_t);
+        in_ctx->buf_id = -1;
+        in_ctx->discarding = true;
+    }
+    if(out_ctx->current_buf_id == out_ctx->cut_through_id) {
+        out_ctx->current_buf_id = -1;
+    }
+    xpc_msg_clear(out_ctx->msg_queue, out_ctx->cut_through_id);
+    out_ctx->cut_through_id = -1;
+    out_ctx->cut_through_waiting = false;
+    ctx->cut_throughs--;
+    if(ctx->io_add_fd_cb != NULL) {
+        ctx->io_add_fd_cb(ctx->io_event_context, ofd);
+    }
+}
+
+void xpc_output_ready(xpc_router_t *ctx, int ofd, xpc_out_ctx_t *out_ctx) {
+    if(out_ctx->fanout) {
+        xpc_client_fanout(ctx, ofd, out_ctx);
+        return;
+    }
+    if(out_ctx->sink != NULL) {
+        // archived right away, a sink is never written to.
+        xpc_sink_drain(ctx, out_ctx);
+        return;
+    }
+    if(out_ctx->spill != NULL) {
+        xpc_spill_offload(ctx, out_ctx);
+    }
+    // coalesced outputs are only woken up once their stage is due, instead
+    // of once per message.
+    bool wake = out_ctx->coalesce_bytes == 0 || xpc_stage_fill(ctx, out_ctx);
+    // tell the io event manager to watch the output fd again.
+    if(wake && ctx->io_add_fd_cb != NULL) {
+        ctx->io_add_fd_cb(ctx->io_event_context, ofd);
+    }
+}
+
+msg_buf_t *xpc_neg_getbuf(xpc_router_t *ctx, int fd, int type, int size) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    msg_buf_t *msg_buf = NULL;
+    if(out_ctx == NULL) {
+        goto done;
+    }
+    txpc_hdr_t hdr = {.to = 0, .from = 0, .type = type, .size = size};
+    int len = sizeof(txpc_hdr_t) + size;
+    msg_buf = xpc_msg_getbuf(out_ctx->msg_queue, -1);
+    if(msg_buf == NULL) {
+        goto done;
+    }
+    if(msg_buf->buf->capacity < len && dynabuf_resize(msg_buf->buf, len) != 0) {
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+        msg_buf = NULL;
+        goto done;
+    }
+    out_ctx->codec->encode(msg_buf->buf->buf, &hdr);
+    msg_buf->size = len;
+    // a peer waiting on the router should not wait for coalescing as well.
+    msg_buf->flags = XPC_ROUTE_NO_COALESCE;
+    msg_buf->ingress_ns = xpc_monotonic_ns();
+    // no route, no latency is recorded for it.
+    msg_buf->src_fd = -1;
+    msg_buf->src_chn = 0;
+done:
+    return msg_buf;
+}
+
+void xpc_neg_finalize(xpc_router_t *ctx, int fd, msg_buf_t *msg_buf) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    xpc_msg_finalize(out_ctx->msg_queue, msg_buf->buf_id);
+    xpc_output_ready(ctx, fd, out_ctx);
+}
+
+int xpc_accumulate_msg(xpc_router_t *ctx, int fd) {
+    int bytes_read = 0;
+    int rd_bytes = 0;
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    // sockets are not byte streams, they need no framing.
+    if(in_ctx != NULL && in_ctx->kind == XPC_IN_LISTENER) {
+        xpc_client_accept(ctx, fd);
+        return 0;
+    }
+    if(in_ctx != NULL && in_ctx->kind == XPC_IN_SEQPACKET) {
+        return xpc_client_recv(ctx, fd);
+    }
+    if(in_ctx != NULL && in_ctx->kind == XPC_IN_SHM) {
+        return xpc_shm_recv(ctx, fd);
+    }
+    // bytes left over from resynchronization do not raise io events, so they
+    // are processed before returning.
+    do {
+        rd_bytes = xpc_accumulate_once(ctx, fd);
+        bytes_read += rd_bytes;
+        in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    } while(rd_bytes > 0 && in_ctx != NULL && in_ctx->rx_end > in_ctx->rx_start);
+    if(in_ctx != NULL && in_ctx->hangup) {
+        // level-triggered events would report it again and again.
+        xpc_input_hangup(ctx, fd);
+    }
+    return bytes_read;
+}
+
+/**
+ * Take the next message to write from the spill of an output, or from its
+ * queue if nothing is spilled.
+ */
+static msg_buf_t *xpc_out_dequeue(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    // what is on disk is older than anything left in memory.
+    if(xpc_spill_pending(out_ctx->spill)) {
+        return xpc_spill_dequeue(ctx, out_ctx);
+    }
+    return xpc_sched_dequeue(ctx, out_ctx);
+}
+
+/**
+ * Move finalized messages from the queue of an output into its coalescing
+ * stage, unless the stage is already being written.
+ * @return true if the stage should be written now.
+ */
+static bool xpc_stage_fill(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx) {
+    msg_buf_t *msg_buf = NULL;
+    uint64_t now = xpc_monotonic_ns();
+    bool flush = out_ctx->stage_flushing;
+
+    // move finalized messages into the stage until the threshold is met.
+    while(!flush && out_ctx->stage_len < out_ctx->coalesce_bytes) {
+        msg_buf = xpc_out_dequeue(ctx, out_ctx);
+        if(msg_buf == NULL) {
             break;
-            case TXPC_NEG_TYPE_REPORT_VERSION:
+        }
+        if(out_ctx->stage->capacity < out_ctx->stage_len + msg_buf->size) {
+            if(dynabuf_resize(
+                    out_ctx->stage, out_ctx->stage_len + msg_buf->size) != 0) {
+                // keep the message for later, write what is staged.
+                xpc_msg_finalize(out_ctx->msg_queue, msg_buf->buf_id);
+                flush = true;
+                break;
+            }
+        }
+        if(out_ctx->stage_origins->capacity <= out_ctx->stage_msgs
+                && dynabuf_resize(
+                    out_ctx->stage_origins,
+                    2 * out_ctx->stage_origins->capacity) != 0) {
+            xpc_msg_finalize(out_ctx->msg_queue, msg_buf->buf_id);
+            flush = true;
             break;
-            // not supporting other neg types for now
         }
-    }
-    else {
-        // tell the io event manager to watch the output fd again.
-        if(ctx->io_add_fd_cb != NULL) {
-            ctx->io_add_fd_cb(ctx->io_event_context, sw_ent->fd);
+        if(out_ctx->lz_tx != NULL) {
+            // only now is it certain to be written next.
+            xpc_compress_egress(ctx, out_ctx, msg_buf);
         }
-        if(msg_buf->size == sizeof(txpc_hdr_t) + in_ctx->msg_hdr.size) {
-            xpc_msg_finalize(out_ctx->msg_queue, in_ctx->buf_id);
-            in_ctx->msg_inflight = false;
+        if(out_ctx->stage_len == 0) {
+            out_ctx->stage_deadline_ns =
+                now + (uint64_t)out_ctx->coalesce_delay_us * 1000;
+            ctx->coalesce_pending++;
         }
+        memcpy(
+            (uint8_t *)out_ctx->stage->buf + out_ctx->stage_len,
+            (uint8_t *)msg_buf->buf->buf + msg_buf->wr_offset, msg_buf->size
+        );
+        out_ctx->stage_len += msg_buf->size;
+        xpc_msg_origin_t *origin =
+            (xpc_msg_origin_t *)out_ctx->stage_origins->buf + out_ctx->stage_msgs;
+        origin->ingress_ns = msg_buf->ingress_ns;
+        origin->src_fd = msg_buf->src_fd;
+        origin->src_chn = msg_buf->src_chn;
+        out_ctx->stage_msgs++;
+        // latency-critical routes take everything staged before them along.
+        flush = flush || (msg_buf->flags & XPC_ROUTE_NO_COALESCE);
+        xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
     }
+    flush = out_ctx->stage_len > 0 && (
+        flush || out_ctx->stage_len >= out_ctx->coalesce_bytes
+        || now >= out_ctx->stage_deadline_ns
+    );
+    out_ctx->stage_flushing = flush;
+    return flush;
+}
 
-    // a crc can be done here as well, if the message is complete.
+/**
+ * Write the coalescing stage of an output once it is due.
+ */
+static int xpc_write_staged(xpc_router_t *ctx, xpc_out_ctx_t *out_ctx, int fd) {
+    int bytes_written = 0;
+    if(!xpc_stage_fill(ctx, out_ctx)) {
+        // wait for more messages or for the deadline, xpc_coalesce_poll will
+        // hand this fd back to the io event manager when it passes.
+        if(ctx->io_del_fd_cb != NULL) {
+            ctx->io_del_fd_cb(ctx->io_event_context, fd);
+        }
+        goto done;
+    }
+
+    bytes_written = write(
+        fd, (uint8_t *)out_ctx->stage->buf + out_ctx->stage_wr,
+        out_ctx->stage_len - out_ctx->stage_wr
+    );
+    if(bytes_written < 0) {
+        // EAGAIN, try again on the next write event.
+        bytes_written = 0;
+        goto done;
+    }
+    out_ctx->stage_wr += bytes_written;
+    if(out_ctx->stage_wr == out_ctx->stage_len) {
+        uint64_t now = xpc_monotonic_ns();
+        xpc_msg_origin_t *origins = out_ctx->stage_origins->buf;
+        for(int i = 0; i < out_ctx->stage_msgs; i++) {
+            xpc_record_latency(
+                ctx, origins[i].src_fd, origins[i].src_chn,
+                now - origins[i].ingress_ns
+            );
+        }
+        out_ctx->tx.msgs += out_ctx->stage_msgs;
+        out_ctx->tx.bytes += out_ctx->stage_len;
+        out_ctx->stage_msgs = 0;
+        out_ctx->stage_len = 0;
+        out_ctx->stage_wr = 0;
+        out_ctx->stage_flushing = false;
+        ctx->coalesce_pending--;
+    }
 done:
-    return bytes_read;
+    return bytes_written;
 }
 
 int xpc_write_msg(xpc_router_t *ctx, int fd) {
@@ -242,27 +1148,98 @@ int xpc_write_msg(xpc_router_t *ctx, int fd) {
         goto done;
     }
 
+    if(out_ctx->coalesce_bytes > 0 || out_ctx->stage_len > 0) {
+        bytes_written = xpc_write_staged(ctx, out_ctx, fd);
+        goto done;
+    }
+
     // get finalized message, ensure it's the inflight one if there is a buffer
     // being sent right now.
     if(out_ctx->current_buf_id == -1) {
-        msg_buf = xpc_msg_dequeue_final(out_ctx->msg_queue);
+        msg_buf = xpc_out_dequeue(ctx, out_ctx);
         // there are no complete messages
         if(msg_buf != NULL) {
             out_ctx->current_buf_id = msg_buf->buf_id;
+            if(out_ctx->lz_tx != NULL) {
+                xpc_compress_egress(ctx, out_ctx, msg_buf);
+            }
+        }
+        else if(out_ctx->cut_through_id >= 0) {
+            // nothing complete is waiting, start on the message arriving.
+            out_ctx->current_buf_id = out_ctx->cut_through_id;
+            msg_buf = xpc_msg_getbuf(out_ctx->msg_queue, out_ctx->current_buf_id);
         }
     }
     else {
         msg_buf = xpc_msg_getbuf(out_ctx->msg_queue, out_ctx->current_buf_id);
     }
 
-    if(msg_buf != NULL) {
-        bytes_written = write(fd, msg_buf->buf->buf + msg_buf->wr_offset, msg_buf->size);
-        msg_buf->size -= bytes_written;
+    if(msg_buf != NULL && msg_buf->buf_id == out_ctx->cut_through_id) {
+        // size is what was received so far, not what is left to write.
+        int avail = msg_buf->size - msg_buf->wr_offset;
+        if(avail == 0) {
+            // xpc_accumulate_msg hands the fd back once more of it arrives.
+            out_ctx->cut_through_waiting = true;
+            if(ctx->io_del_fd_cb != NULL) {
+                ctx->io_del_fd_cb(ctx->io_event_context, fd);
+            }
+            goto done;
+        }
+        bytes_written = write(
+            fd, (uint8_t *)msg_buf->buf->buf + msg_buf->wr_offset, avail
+        );
+        if(bytes_written < 0) {
+            // EAGAIN, try again on the next write event.
+            bytes_written = 0;
+            goto done;
+        }
         msg_buf->wr_offset += bytes_written;
-        // no data to write, we can clear
+    }
+    else if(msg_buf != NULL && out_ctx->seqpacket) {
+        // a datagram is sent whole or not at all.
+        bytes_written = send(
+            fd, msg_buf->buf->buf, msg_buf->size, MSG_DONTWAIT | MSG_NOSIGNAL
+        );
+        if(bytes_written < 0) {
+            bytes_written = 0;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                // the client is gone.
+                xpc_client_close(ctx, fd);
+            }
+            goto done;
+        }
+        out_ctx->tx.msgs++;
+        out_ctx->tx.bytes += bytes_written;
+        xpc_record_latency(
+            ctx, msg_buf->src_fd, msg_buf->src_chn,
+            xpc_monotonic_ns() - msg_buf->ingress_ns
+        );
         xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
         out_ctx->current_buf_id = -1;
     }
+    else if(msg_buf != NULL) {
+        bytes_written = write(
+            fd, (uint8_t *)msg_buf->buf->buf + msg_buf->wr_offset, msg_buf->size
+        );
+        if(bytes_written < 0) {
+            // EAGAIN, try again on the next write event.
+            bytes_written = 0;
+            goto done;
+        }
+        msg_buf->size -= bytes_written;
+        msg_buf->wr_offset += bytes_written;
+        if(msg_buf->size == 0) {
+            out_ctx->tx.msgs++;
+            out_ctx->tx.bytes += msg_buf->final_size;
+            xpc_record_latency(
+                ctx, msg_buf->src_fd, msg_buf->src_chn,
+                xpc_monotonic_ns() - msg_buf->ingress_ns
+            );
+            // no data to write, we can clear
+            xpc_msg_clear(out_ctx->msg_queue, msg_buf->buf_id);
+            out_ctx->current_buf_id = -1;
+        }
+    }
     else {
         // no messages are available for this fd
         // tell the io event system to not continue raising write ready events.
@@ -274,31 +1251,180 @@ done:
     return bytes_written;
 }
 
+/**
+ * Check whether any route still leads to an output.
+ */
+static bool xpc_output_routed(xpc_router_t *ctx, int ofd) {
+    bool routed = false;
+    for(int i = 0; i < array_size(ctx->route_keys) && !routed; i++) {
+        xpc_switch_tbl_entry_t *k = array_fetch(ctx->route_keys, i);
+        xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)k);
+        routed = route->dst.fd == ofd;
+    }
+    return routed;
+}
+
+/**
+ * Free a retired output if nothing is left in its queue or stage, and no
+ * input is receiving a message into it.
+ * @return true if it was freed.
+ */
+static bool xpc_output_reclaim(xpc_router_t *ctx, int ofd) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL || !out_ctx->retired
+            || hashmap_size(out_ctx->msg_queue->inflight_buffers) > 0
+            || out_ctx->stage_len > 0 || out_ctx->current_buf_id != -1
+            || xpc_spill_pending(out_ctx->spill)) {
+        return false;
+    }
+    if(ctx->io_del_fd_cb != NULL) {
+        ctx->io_del_fd_cb(ctx->io_event_context, ofd);
+    }
+    ctx->sinks -= (out_ctx->sink != NULL) ? 1:0;
+    xpc_out_ctx_free(out_ctx);
+    hashmap_remove(ctx->out_contexts, ofd);
+    xpc_keys_remove(ctx->out_fds, &ofd, sizeof(ofd));
+    ctx->retired_outputs--;
+    return true;
+}
+
+/**
+ * Retire an output once the last route to it is gone. Listeners and clients
+ * keep their contexts, they are not created by routes.
+ */
+static void xpc_output_retire(xpc_router_t *ctx, int ofd) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, ofd);
+    if(out_ctx == NULL || out_ctx->retired || out_ctx->fanout
+            || out_ctx->seqpacket || xpc_output_routed(ctx, ofd)) {
+        return;
+    }
+    // credits are granted through it, or it keeps a compression history.
+    if(in_ctx != NULL && (in_ctx->credit_flow || in_ctx->lz_rx != NULL)) {
+        return;
+    }
+    out_ctx->retired = true;
+    ctx->retired_outputs++;
+    xpc_output_reclaim(ctx, ofd);
+}
+
+xpc_out_ctx_t *xpc_add_output(xpc_router_t *ctx, int ofd) {
+    xpc_out_ctx_t out_ctx = {0};
+    xpc_out_ctx_t *r = hashmap_fetch(ctx->out_contexts, ofd);
+    if(r != NULL) {
+        goto done;
+    }
+    if(create_xpc_out_ctx(&out_ctx) == NULL) {
+        goto done;
+    }
+    // fds which are both inputs and outputs share one byte order.
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, ofd);
+    out_ctx.codec = (in_ctx != NULL) ?
+        in_ctx->codec:xpc_hdr_codec_select(ctx->big_endian);
+    hashmap_set(ctx->out_contexts, ofd, &out_ctx);
+    if(hashmap_status(ctx->out_contexts) != ALC_HASHMAP_SUCCESS) {
+        xpc_out_ctx_free(&out_ctx);
+        goto done;
+    }
+    if(xpc_keys_add(ctx->out_fds, &ofd, sizeof(ofd)) != 0) {
+        xpc_out_ctx_free(&out_ctx);
+        hashmap_remove(ctx->out_contexts, ofd);
+        goto done;
+    }
+    r = hashmap_fetch(ctx->out_contexts, ofd);
+done:
+    return r;
+}
+
 int xpc_set_route(xpc_router_t *ctx, int ifd, int ofd, int ito, int oto) {
     int status = 0;
+    xpc_switch_tbl_entry_t old_dst = {.fd = -1, .to_chn = 0};
     xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
-    xpc_switch_tbl_entry_t val = {.fd = ofd, .to_chn = oto};
-    // does this union save stack space? no idea!
-    union {
-        xpc_in_ctx_t in_ctx;
-        xpc_out_ctx_t out_ctx;
-    } ctxts = {0};
+    xpc_route_t val = {.dst = {.fd = ofd, .to_chn = oto}, .flags = 0};
+    xpc_in_ctx_t new_in_ctx = {0};
     // XXX this is because sizeof(xpc_switch_tbl_entry_t) = 8.
     // thus, the dynabuf copies by value, and we need to pass the struct,
     // not a pointer to it.  now THAT is a frustrating little gotcha.
-    hashmap_set(ctx->switch_tbl, *(void**)&key, *(void**)&val);
-    if((status = hashmap_status(ctx->switch_tbl)) != ALC_HASHMAP_SUCCESS) {
-        goto done;
+    // xpc_route_t is larger, so it is copied from the pointer as usual.
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route != NULL) {
+        // redirecting a route keeps its statistics.
+        old_dst = route->dst;
+        route->dst = val.dst;
     }
-    
-    hashmap_set(ctx->in_contexts, ifd, &ctxts.in_ctx);
-    if((status = hashmap_status(ctx->in_contexts)) != ALC_HASHMAP_SUCCESS) {
-        goto done;
+    else {
+        val.latency = create_xpc_hist();
+        if(val.latency == NULL) {
+            status = -1;
+            goto done;
+        }
+        hashmap_set(ctx->switch_tbl, *(void**)&key, &val);
+        if((status = hashmap_status(ctx->switch_tbl)) != ALC_HASHMAP_SUCCESS) {
+            free(val.latency);
+            goto done;
+        }
+        if((status = xpc_keys_add(ctx->route_keys, &key, sizeof(key))) != 0) {
+            free(val.latency);
+            hashmap_remove(ctx->switch_tbl, *(void**)&key);
+            goto done;
+        }
     }
-    if(hashmap_fetch(ctx->out_contexts, ofd) == NULL) {
-        create_xpc_out_ctx(&ctxts.out_ctx);
-        hashmap_set(ctx->out_contexts, ofd, &ctxts.out_ctx);
-        status = (hashmap_status(ctx->out_contexts) != ALC_HASHMAP_SUCCESS);
+
+    // an input may have several routes, only the first one creates its
+    // context. Replacing it would lose the state of an inflight message.
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, ifd);
+    if(in_ctx == NULL) {
+        xpc_out_ctx_t *ofd_ctx = hashmap_fetch(ctx->out_contexts, ifd);
+        new_in_ctx.codec = (ofd_ctx != NULL) ?
+            ofd_ctx->codec:xpc_hdr_codec_select(ctx->big_endian);
+        // resynchronizing does not allocate while forwarding.
+        new_in_ctx.rx_buf = malloc(XPC_RESYNC_BUF_SIZE);
+        if(new_in_ctx.rx_buf == NULL) {
+            status = -1;
+            goto bad_route;
+        }
+        hashmap_set(ctx->in_contexts, ifd, &new_in_ctx);
+        if((status = hashmap_status(ctx->in_contexts)) != ALC_HASHMAP_SUCCESS) {
+            goto bad_rx_buf;
+        }
+        if((status = xpc_keys_add(ctx->in_fds, &ifd, sizeof(ifd))) != 0) {
+            goto bad_in_ctx;
+        }
+    }
+    xpc_out_ctx_t *out_ctx = xpc_add_output(ctx, ofd);
+    if(out_ctx == NULL) {
+        status = -1;
+        goto bad_in_fds;
+    }
+    if(out_ctx->retired) {
+        // routed to again before it drained.
+        out_ctx->retired = false;
+        ctx->retired_outputs--;
+    }
+    if(old_dst.fd != -1 && old_dst.fd != ofd) {
+        xpc_output_retire(ctx, old_dst.fd);
+    }
+    goto done;
+
+// nothing is left of a route which could not be set.
+bad_in_fds:
+    if(in_ctx == NULL) {
+        xpc_keys_remove(ctx->in_fds, &ifd, sizeof(ifd));
+    }
+bad_in_ctx:
+    if(in_ctx == NULL) {
+        hashmap_remove(ctx->in_contexts, ifd);
+    }
+bad_rx_buf:
+    free(new_in_ctx.rx_buf);
+bad_route:
+    if(route != NULL) {
+        route->dst = old_dst;
+    }
+    else {
+        free(val.latency);
+        hashmap_remove(ctx->switch_tbl, *(void**)&key);
+        xpc_keys_remove(ctx->route_keys, &key, sizeof(key));
     }
 done:
     return status;
@@ -307,8 +1433,270 @@ done:
 
 int xpc_remove_route(xpc_router_t *ctx, int ifd, int ito) {
     xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL) {
+        return -1;
+    }
+    int ofd = route->dst.fd;
+    // the input keeps its context, it may be receiving a message, and its
+    // byte order and statistics outlive any one route.
+    free(route->latency);
+    xpc_hook_free(route->hook);
+    xpc_limit_free(route->limit);
     hashmap_remove(ctx->switch_tbl, *(void**)&key);
-    hashmap_remove(ctx->in_contexts, *(void**)&key);
-    // what about the output context?
-    return hashmap_status(ctx->switch_tbl) != ALC_HASHMAP_SUCCESS;
+    xpc_keys_remove(ctx->route_keys, &key, sizeof(key));
+    xpc_output_retire(ctx, ofd);
+    return 0;
+}
+
+void xpc_input_hangup(xpc_router_t *ctx, int fd) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(in_ctx == NULL) {
+        return;
+    }
+    if(in_ctx->kind == XPC_IN_SEQPACKET) {
+        xpc_client_close(ctx, fd);
+        return;
+    }
+    if(in_ctx->kind != XPC_IN_STREAM) {
+        return;
+    }
+    // the rest of the message will never arrive.
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, in_ctx->out_fd);
+    if(in_ctx->msg_inflight && in_ctx->buf_id >= 0 && out_ctx != NULL
+            && out_ctx->cut_through_id == in_ctx->buf_id) {
+        // its output is not held up waiting for it.
+        xpc_cut_through_abort(ctx, in_ctx->out_fd, out_ctx);
+    }
+    else if(in_ctx->msg_inflight && !in_ctx->discarding) {
+        xpc_count_drop(ctx, fd, in_ctx->msg_hdr.to, XPC_DROP_MALFORMED);
+        if(in_ctx->buf_id >= 0 && out_ctx != NULL) {
+            xpc_msg_clear(out_ctx->msg_queue, in_ctx->buf_id);
+        }
+    }
+    // backwards, removing a key moves the ones after it.
+    for(int i = array_size(ctx->route_keys) - 1; i >= 0; i--) {
+        xpc_switch_tbl_entry_t key =
+            *(xpc_switch_tbl_entry_t *)array_fetch(ctx->route_keys, i);
+        if(key.fd == fd) {
+            xpc_remove_route(ctx, fd, key.to_chn);
+        }
+    }
+    ctx->credit_inputs -= in_ctx->credit_flow ? 1:0;
+    free(in_ctx->rx_buf);
+    xpc_lz_free(in_ctx->lz_rx);
+    hashmap_remove(ctx->in_contexts, fd);
+    xpc_keys_remove(ctx->in_fds, &fd, sizeof(fd));
+    if(ctx->io_forget_fd_cb != NULL) {
+        ctx->io_forget_fd_cb(ctx->io_event_context, fd);
+    }
+    // an output kept for credits or compression goes with its input.
+    xpc_output_retire(ctx, fd);
+    if(hashmap_fetch(ctx->out_contexts, fd) != NULL) {
+        // still written to, only reading stops.
+        if(ctx->io_add_fd_cb != NULL) {
+            ctx->io_add_fd_cb(ctx->io_event_context, fd);
+        }
+        return;
+    }
+    if(ctx->io_close_fd_cb != NULL) {
+        ctx->io_close_fd_cb(ctx->io_event_context, fd);
+    }
+    else {
+        close(fd);
+    }
+}
+
+void xpc_set_endianness(xpc_router_t *ctx, int fd, bool big_endian) {
+    const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(big_endian);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(in_ctx != NULL) {
+        in_ctx->codec = codec;
+    }
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, fd);
+    if(out_ctx != NULL) {
+        out_ctx->codec = codec;
+    }
+}
+
+int xpc_set_route_flags(xpc_router_t *ctx, int ifd, int ito, uint32_t flags) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    if(route == NULL) {
+        return -1;
+    }
+    route->flags = flags;
+    return 0;
+}
+
+int xpc_set_coalescing(
+        xpc_router_t *ctx, int ofd, int max_bytes, uint32_t max_delay_us) {
+    int status = -1;
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL) {
+        goto done;
+    }
+    // datagrams cannot be merged.
+    if(max_bytes > 0 && (out_ctx->seqpacket || out_ctx->fanout)) {
+        goto done;
+    }
+    if(max_bytes > 0 && out_ctx->stage == NULL) {
+        out_ctx->stage = create_dynabuf(max_bytes, sizeof(char));
+        if(out_ctx->stage == NULL) {
+            goto done;
+        }
+    }
+    if(max_bytes > 0 && out_ctx->stage_origins == NULL) {
+        out_ctx->stage_origins = create_dynabuf(16, sizeof(xpc_msg_origin_t));
+        if(out_ctx->stage_origins == NULL) {
+            goto done;
+        }
+    }
+    // whatever is staged already goes out at the next write event.
+    if(max_bytes <= 0 && out_ctx->stage_len > 0) {
+        out_ctx->stage_flushing = true;
+    }
+    out_ctx->coalesce_bytes = (max_bytes > 0) ? max_bytes:0;
+    out_ctx->coalesce_delay_us = max_delay_us;
+    status = 0;
+done:
+    return status;
+}
+
+int xpc_coalesce_poll(xpc_router_t *ctx) {
+    int timeout_ms = -1;
+    if(ctx->coalesce_pending == 0) {
+        goto done;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        int *pfd = array_fetch(ctx->out_fds, i);
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, *pfd);
+        if(out_ctx->stage_len == 0 || out_ctx->stage_flushing) {
+            continue;
+        }
+        if(now >= out_ctx->stage_deadline_ns) {
+            out_ctx->stage_flushing = true;
+            if(ctx->io_add_fd_cb != NULL) {
+                ctx->io_add_fd_cb(ctx->io_event_context, *pfd);
+            }
+            continue;
+        }
+        // round up, epoll timeouts are in milliseconds.
+        int wait_ms = (out_ctx->stage_deadline_ns - now + 999999) / 1000000;
+        if(timeout_ms == -1 || wait_ms < timeout_ms) {
+            timeout_ms = wait_ms;
+        }
+    }
+done:
+    return timeout_ms;
+}
+
+/**
+ * Drop the messages outputs write while they arrive, once nothing more of
+ * them arrived for XPC_CUT_THROUGH_STALL_MS.
+ * @return the number of milliseconds until the next one may stall, or -1
+ * if there is none.
+ */
+static int xpc_cut_through_poll(xpc_router_t *ctx) {
+    int timeout_ms = -1;
+    if(ctx->cut_throughs == 0) {
+        goto done;
+    }
+    uint64_t now = xpc_monotonic_ns();
+    const uint64_t stall_ns = (uint64_t)XPC_CUT_THROUGH_STALL_MS * 1000000;
+    for(int i = 0; i < array_size(ctx->out_fds); i++) {
+        int ofd = *(int *)array_fetch(ctx->out_fds, i);
+        xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+        if(out_ctx->cut_through_id < 0) {
+            continue;
+        }
+        if(now - out_ctx->cut_through_ns >= stall_ns) {
+            xpc_cut_through_abort(ctx, ofd, out_ctx);
+            continue;
+        }
+        // round up, epoll timeouts are in milliseconds.
+        int wait_ms = (out_ctx->cut_through_ns + stall_ns - now + 999999) / 1000000;
+        if(timeout_ms == -1 || wait_ms < timeout_ms) {
+            timeout_ms = wait_ms;
+        }
+    }
+done:
+    return timeout_ms;
+}
+
+/**
+ * Free the retired outputs which have drained.
+ */
+static void xpc_reclaim_poll(xpc_router_t *ctx) {
+    if(ctx->retired_outputs == 0) {
+        return;
+    }
+    // backwards, a reclaimed output leaves the list.
+    for(int i = array_size(ctx->out_fds) - 1; i >= 0; i--) {
+        int ofd = *(int *)array_fetch(ctx->out_fds, i);
+        xpc_output_reclaim(ctx, ofd);
+    }
+}
+
+int xpc_router_poll(xpc_router_t *ctx) {
+    xpc_reclaim_poll(ctx);
+    xpc_credit_poll(ctx);
+    int timeout_ms = xpc_coalesce_poll(ctx);
+    int cut_ms = xpc_cut_through_poll(ctx);
+    if(timeout_ms == -1 || (cut_ms != -1 && cut_ms < timeout_ms)) {
+        timeout_ms = cut_ms;
+    }
+    int stats_ms = xpc_stats_poll(ctx);
+    if(timeout_ms == -1 || (stats_ms != -1 && stats_ms < timeout_ms)) {
+        timeout_ms = stats_ms;
+    }
+    int rt_ms = xpc_rt_poll(ctx);
+    if(timeout_ms == -1 || (rt_ms != -1 && rt_ms < timeout_ms)) {
+        timeout_ms = rt_ms;
+    }
+    int sink_ms = xpc_sink_poll(ctx);
+    if(timeout_ms == -1 || (sink_ms != -1 && sink_ms < timeout_ms)) {
+        timeout_ms = sink_ms;
+    }
+    int spill_ms = xpc_spill_poll(ctx);
+    if(timeout_ms == -1 || (spill_ms != -1 && spill_ms < timeout_ms)) {
+        timeout_ms = spill_ms;
+    }
+    return timeout_ms;
+}
+
+uint64_t xpc_get_drop_count(xpc_router_t *ctx, int fd, int to_chn) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    for(int i = 0; in_ctx != NULL && i < in_ctx->n_drop_chns; i++) {
+        if(in_ctx->drop_chns[i].chn == to_chn) {
+            return in_ctx->drop_chns[i].count;
+        }
+    }
+    return 0;
+}
+
+const xpc_hist_t *xpc_get_route_latency(xpc_router_t *ctx, int ifd, int ito) {
+    xpc_switch_tbl_entry_t key = {.fd = ifd, .to_chn = ito};
+    xpc_route_t *route = hashmap_fetch(ctx->switch_tbl, *(void**)&key);
+    return (route == NULL) ? NULL:route->latency;
+}
+
+int xpc_get_resync_stats(
+        xpc_router_t *ctx, int fd, uint64_t *events, uint64_t *skipped_bytes) {
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(ctx->in_contexts, fd);
+    if(in_ctx == NULL) {
+        return -1;
+    }
+    *events = in_ctx->resync_count;
+    *skipped_bytes = in_ctx->resync_skipped;
+    return 0;
+}
+
+int xpc_reserve_output(xpc_router_t *ctx, int ofd, int nbufs, int buf_size) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(ctx->out_contexts, ofd);
+    if(out_ctx == NULL) {
+        return -1;
+    }
+    return xpc_msg_queue_reserve(out_ctx->msg_queue, nbufs, buf_size);
 }
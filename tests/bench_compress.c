@@ -0,0 +1,295 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_lz.h>
+#include <xpc_compress.h>
+
+/**
+ * Compression benchmark.
+ * Messages of a workload are forwarded by the router from an application
+ * onto a link whose peer negotiated compression, and the peer decompresses
+ * and checks every one of them. The bytes on the link give the throughput a
+ * serial link of the given baud rate (8N1, 10 bits a byte) would have with
+ * compression, against the same messages uncompressed. Each workload is run
+ * once without compression as well, for the cost in the router.
+ *
+ * Workloads:
+ *   telemetry  binary samples: a sequence number, a timestamp, noisy IMU
+ *              readings and slowly changing housekeeping values
+ *   log        text log lines from a few templates
+ *   random     random bytes, which compression should leave alone
+ *
+ * One JSON object per workload and mode is printed on stdout.
+ *
+ * usage: bench_compress [-m messages] [-b baud] [-w workload]
+ */
+
+#define BENCH_MAX_PAYLOAD 256
+
+typedef struct {
+    const char *name;
+    int (*gen)(uint8_t *dst, int seq, uint64_t *rng);
+} workload_t;
+
+typedef struct {
+    xpc_router_t *xpc;
+    // the router has app[0] and dev[0], the peers app[1] and dev[1].
+    int app[2];
+    int dev[2];
+    xpc_lz_t *peer_rx;
+    const xpc_hdr_codec_t *codec;
+} bench_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void put_le(uint8_t *dst, uint64_t v, int len) {
+    for(int i = 0; i < len; i++) {
+        dst[i] = v >> (8 * i);
+    }
+}
+
+static int gen_telemetry(uint8_t *dst, int seq, uint64_t *rng) {
+    int off = 0;
+    put_le(dst + off, seq, 4);
+    off += 4;
+    // 100 Hz.
+    put_le(dst + off, 1700000000000ull + seq * 10ull, 8);
+    off += 8;
+    // accelerometer and gyroscope, around a resting value with some noise.
+    static const int rest[6] = {12, -40, 16384, 3, -2, 0};
+    for(int i = 0; i < 6; i++) {
+        put_le(dst + off, rest[i] + (int)(xorshift64(rng) % 9) - 4, 2);
+        off += 2;
+    }
+    // battery millivolts, temperature, mode flags.
+    put_le(dst + off, 12600 - seq / 500, 2);
+    off += 2;
+    put_le(dst + off, 41 + (seq / 3000) % 3, 1);
+    off += 1;
+    put_le(dst + off, 0x05, 1);
+    off += 1;
+    memcpy(dst + off, "NODE-07A", 8);
+    return off + 8;
+}
+
+static int gen_log(uint8_t *dst, int seq, uint64_t *rng) {
+    static const char *fmts[] = {
+        "[%8.3f] motor: rpm=%d current=%d.%dA temp=%dC\n",
+        "[%8.3f] nav: fix=3D sats=%d hdop=0.%d alt=%dm\n",
+        "[%8.3f] power: bus=%dmV load=%d%% charge=%d.%d%%\n",
+    };
+    int k = xorshift64(rng) % 3;
+    double t = seq * 0.01;
+    int a = 1500 + xorshift64(rng) % 50;
+    int b = xorshift64(rng) % 10;
+    int c = xorshift64(rng) % 10;
+    int d = 40 + xorshift64(rng) % 3;
+    return snprintf((char *)dst, BENCH_MAX_PAYLOAD, fmts[k], t, a, b, c, d);
+}
+
+static int gen_random(uint8_t *dst, int seq, uint64_t *rng) {
+    for(int i = 0; i < 64; i += 8) {
+        put_le(dst + i, xorshift64(rng), 8);
+    }
+    return 64;
+}
+
+static const workload_t workloads[] = {
+    {"telemetry", gen_telemetry},
+    {"log", gen_log},
+    {"random", gen_random},
+};
+
+static int write_msg(bench_t *b, int fd, int to, int type,
+        const uint8_t *payload, int len) {
+    uint8_t wire[sizeof(txpc_hdr_t) + BENCH_MAX_PAYLOAD];
+    txpc_hdr_t hdr = {.to = to, .from = (to == 0) ? 0:1, .type = type, .size = len};
+    b->codec->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, len);
+    int n = sizeof(txpc_hdr_t) + len;
+    return (write(fd, wire, n) == n) ? 0:-1;
+}
+
+/**
+ * Read one message the router wrote.
+ * @return the payload length, or -1 if there is none.
+ */
+static int read_msg(bench_t *b, int fd, txpc_hdr_t *hdr, uint8_t *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    if(read(fd, wire, sizeof(wire)) != sizeof(wire)) {
+        return -1;
+    }
+    b->codec->decode(hdr, wire);
+    if(hdr->size > BENCH_MAX_PAYLOAD
+            || read(fd, payload, hdr->size) != (ssize_t)hdr->size) {
+        return -1;
+    }
+    return hdr->size;
+}
+
+static void forward(bench_t *b, int ifd, int ofd) {
+    while(xpc_accumulate_msg(b->xpc, ifd) > 0);
+    while(xpc_write_msg(b->xpc, ofd) > 0);
+}
+
+static int bench_open(bench_t *b) {
+    memset(b, 0, sizeof(*b));
+    b->codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b->app) != 0
+            || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b->dev) != 0) {
+        return -1;
+    }
+    b->xpc = initialize_xpc_router();
+    b->peer_rx = create_xpc_lz();
+    if(b->xpc == NULL || b->peer_rx == NULL
+            || xpc_set_route(b->xpc, b->app[0], b->dev[0], 1, 1) != 0
+            || xpc_set_route(b->xpc, b->dev[0], b->app[0], 1, 1) != 0
+            || xpc_compress_allow(b->xpc, b->dev[0], true) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_close(bench_t *b) {
+    xpc_router_destroy(b->xpc);
+    xpc_lz_free(b->peer_rx);
+    for(int i = 0; i < 2; i++) {
+        close(b->app[i]);
+        close(b->dev[i]);
+    }
+}
+
+static int run(const workload_t *w, bool compress, int msgs, int baud) {
+    int status = -1;
+    bench_t b;
+    uint8_t payload[BENCH_MAX_PAYLOAD];
+    uint8_t wire[BENCH_MAX_PAYLOAD];
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    uint64_t raw_bytes = 0;
+    uint64_t wire_bytes = 0;
+    uint64_t router_ns = 0;
+    uint64_t decode_ns = 0;
+    int compressed = 0;
+    txpc_hdr_t hdr;
+    if(bench_open(&b) != 0) {
+        goto done;
+    }
+    if(compress) {
+        uint8_t on = XPC_COMPRESS_ON;
+        if(write_msg(&b, b.dev[1], 0, XPC_NEG_TYPE_COMPRESS, &on, 1) != 0) {
+            goto done;
+        }
+        forward(&b, b.dev[0], b.dev[0]);
+        if(read_msg(&b, b.dev[1], &hdr, wire) != 1 || wire[0] != XPC_COMPRESS_ON) {
+            goto done;
+        }
+    }
+
+    for(int i = 0; i < msgs; i++) {
+        int len = w->gen(payload, i, &rng);
+        if(write_msg(&b, b.app[1], 1, 3, payload, len) != 0) {
+            goto done;
+        }
+        uint64_t t0 = now_ns();
+        forward(&b, b.app[0], b.dev[0]);
+        uint64_t t1 = now_ns();
+        router_ns += t1 - t0;
+        int n = read_msg(&b, b.dev[1], &hdr, wire);
+        if(n < 0) {
+            goto done;
+        }
+        const uint8_t *raw = wire;
+        t0 = now_ns();
+        if(hdr.type & XPC_COMPRESS_TYPE_FLAG) {
+            n = xpc_lz_decompress(b.peer_rx, wire, n, &raw);
+            compressed++;
+        }
+        else {
+            xpc_lz_append(b.peer_rx, wire, n);
+        }
+        decode_ns += now_ns() - t0;
+        if(n != len || memcmp(raw, payload, len) != 0) {
+            fprintf(stderr, "%s: message %d differs\n", w->name, i);
+            goto done;
+        }
+        raw_bytes += sizeof(txpc_hdr_t) + len;
+        wire_bytes += sizeof(txpc_hdr_t) + hdr.size;
+    }
+
+    // what a serial link carries in a second, at 10 bits a byte.
+    double link_bytes = baud / 10.0;
+    double plain_msgs = link_bytes / ((double)raw_bytes / msgs);
+    double link_msgs = link_bytes / ((double)wire_bytes / msgs);
+    printf("{\"benchmark\": \"bench_compress\", \"workload\": \"%s\", "
+        "\"compress\": %s, \"msgs\": %d, \"baud\": %d, "
+        "\"raw_bytes\": %llu, \"wire_bytes\": %llu, \"ratio\": %.3f, "
+        "\"compressed_msgs\": %d, \"router_ns_per_msg\": %.1f, "
+        "\"decode_ns_per_msg\": %.1f, \"plain_msgs_per_s\": %.1f, "
+        "\"link_msgs_per_s\": %.1f, \"link_payload_kb_per_s\": %.2f, "
+        "\"speedup\": %.3f}\n",
+        w->name, compress ? "true":"false", msgs, baud,
+        (unsigned long long)raw_bytes, (unsigned long long)wire_bytes,
+        (double)raw_bytes / wire_bytes, compressed,
+        (double)router_ns / msgs, (double)decode_ns / msgs,
+        plain_msgs, link_msgs,
+        link_msgs * ((double)raw_bytes / msgs - sizeof(txpc_hdr_t)) / 1024,
+        link_msgs / plain_msgs);
+    fflush(stdout);
+    status = 0;
+done:
+    bench_close(&b);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    int msgs = 100000;
+    int baud = 921600;
+    const char *only = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "m:b:w:")) != -1) {
+        switch(opt) {
+            case 'm': msgs = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'w': only = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-m messages] [-b baud] "
+                    "[-w workload]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(msgs <= 0 || baud <= 0) {
+        fprintf(stderr, "messages and baud must be positive\n");
+        return 1;
+    }
+    for(int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if(only != NULL && strcmp(only, workloads[i].name) != 0) {
+            continue;
+        }
+        if(run(&workloads[i], false, msgs, baud) != 0
+                || run(&workloads[i], true, msgs, baud) != 0) {
+            fprintf(stderr, "%s failed\n", workloads[i].name);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,404 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <xpc_msg_queue.h>
+
+/**
+ * Message queue microbenchmark.
+ * Each queue implementation is driven through the same operations at queue
+ * depths from 1 to -d (default 100000), by powers of ten:
+ *   fill      getbuf for depth new messages
+ *   finalize  finalize them in a shuffled order, as interleaved inputs do
+ *   dequeue   dequeue every finalized message
+ *   clear     clear them in a shuffled order
+ *   churn     with depth messages queued, get and finalize a new message,
+ *             then dequeue and clear one, as a busy output does
+ * One JSON object per implementation, depth and operation is printed on
+ * stdout, with ns/op and allocations/op. Phases stop early once they take
+ * longer than -t milliseconds (default 1000), the ops field says how many
+ * operations were timed. Larger depths are skipped for an implementation
+ * once one of its phases stops early.
+ *
+ * usage: bench_msg_queue [-d max depth] [-t ms per phase] [-n churn ops]
+ *                        [-q implementation]
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (see meson.build).
+ */
+
+#define BENCH_MSG_SIZE 64
+
+static uint64_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+/**
+ * Operations a queue implementation provides. Buffers are named by id.
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *q);
+    // a buffer for a new message, -1 on failure.
+    int (*get_new)(void *q);
+    int (*finalize)(void *q, int id);
+    // a finalized buffer, -1 if there are none.
+    int (*dequeue)(void *q);
+    int (*clear)(void *q, int id);
+} queue_impl_t;
+
+/**
+ * xpc_msg_queue, as the router uses it.
+ */
+static void *xpc_create(void) {
+    return create_msg_queue();
+}
+
+static void xpc_destroy(void *q) {
+    xpc_msg_queue_destroy(q);
+}
+
+static int xpc_get_new(void *q) {
+    msg_buf_t *buf = xpc_msg_getbuf(q, -1);
+    if(buf == NULL) {
+        return -1;
+    }
+    buf->size = BENCH_MSG_SIZE;
+    return buf->buf_id;
+}
+
+static int xpc_finalize(void *q, int id) {
+    return xpc_msg_finalize(q, id);
+}
+
+static int xpc_dequeue(void *q) {
+    msg_buf_t *buf = xpc_msg_dequeue_final(q);
+    return (buf == NULL) ? -1:buf->buf_id;
+}
+
+static int xpc_clear(void *q, int id) {
+    return xpc_msg_clear(q, id);
+}
+
+/**
+ * A reference for comparison: ids index a slab, free ids are kept on a
+ * stack, and finalized ids in a FIFO ring. Every operation is O(1).
+ */
+typedef struct {
+    msg_buf_t **bufs;
+    int *free_ids;
+    int nfree;
+    int *ring;
+    int ring_head;
+    int ring_len;
+    int cap;
+} slab_fifo_t;
+
+static void *slab_create(void) {
+    return calloc(1, sizeof(slab_fifo_t));
+}
+
+static void slab_destroy(void *q) {
+    slab_fifo_t *s = q;
+    for(int i = 0; i < s->cap; i++) {
+        msg_buf_free(s->bufs[i]);
+    }
+    free(s->bufs);
+    free(s->free_ids);
+    free(s->ring);
+    free(s);
+}
+
+static int slab_grow(slab_fifo_t *s) {
+    int cap = (s->cap == 0) ? 16:2 * s->cap;
+    msg_buf_t **bufs = realloc(s->bufs, cap * sizeof(*bufs));
+    if(bufs == NULL) {
+        return -1;
+    }
+    s->bufs = bufs;
+    int *free_ids = realloc(s->free_ids, cap * sizeof(int));
+    if(free_ids == NULL) {
+        return -1;
+    }
+    s->free_ids = free_ids;
+    int *ring = malloc(cap * sizeof(int));
+    if(ring == NULL) {
+        return -1;
+    }
+    // unwrap the ring into the new one.
+    for(int i = 0; i < s->ring_len; i++) {
+        ring[i] = s->ring[(s->ring_head + i) % s->cap];
+    }
+    free(s->ring);
+    s->ring = ring;
+    s->ring_head = 0;
+    for(int i = cap - 1; i >= s->cap; i--) {
+        s->bufs[i] = NULL;
+        s->free_ids[s->nfree++] = i;
+    }
+    s->cap = cap;
+    return 0;
+}
+
+static int slab_get_new(void *q) {
+    slab_fifo_t *s = q;
+    if(s->nfree == 0 && slab_grow(s) != 0) {
+        return -1;
+    }
+    int id = s->free_ids[--s->nfree];
+    if(s->bufs[id] == NULL) {
+        s->bufs[id] = create_msg_buf();
+        if(s->bufs[id] == NULL) {
+            s->nfree++;
+            return -1;
+        }
+    }
+    s->bufs[id]->buf_id = id;
+    s->bufs[id]->size = BENCH_MSG_SIZE;
+    return id;
+}
+
+static int slab_finalize(void *q, int id) {
+    slab_fifo_t *s = q;
+    s->ring[(s->ring_head + s->ring_len++) % s->cap] = id;
+    return 0;
+}
+
+static int slab_dequeue(void *q) {
+    slab_fifo_t *s = q;
+    if(s->ring_len == 0) {
+        return -1;
+    }
+    int id = s->ring[s->ring_head];
+    s->ring_head = (s->ring_head + 1) % s->cap;
+    s->ring_len--;
+    return id;
+}
+
+static int slab_clear(void *q, int id) {
+    slab_fifo_t *s = q;
+    s->bufs[id]->size = 0;
+    s->free_ids[s->nfree++] = id;
+    return 0;
+}
+
+static const queue_impl_t impls[] = {
+    {
+        "xpc_msg_queue", xpc_create, xpc_destroy,
+        xpc_get_new, xpc_finalize, xpc_dequeue, xpc_clear
+    },
+    {
+        "slab_fifo", slab_create, slab_destroy,
+        slab_get_new, slab_finalize, slab_dequeue, slab_clear
+    },
+};
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t start_allocs;
+    uint64_t budget_ns;
+    uint64_t ops;
+    // the phase ran out of time.
+    bool truncated;
+} phase_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void phase_begin(phase_t *p, uint64_t budget_ns) {
+    p->budget_ns = budget_ns;
+    p->ops = 0;
+    p->truncated = false;
+    p->start_allocs = allocations;
+    p->start_ns = now_ns();
+}
+
+/**
+ * Whether a phase has run out of time. The clock is read after each power
+ * of two operations and then every 1024, so slow operations are noticed
+ * early and fast ones are not slowed down by it.
+ */
+static bool phase_over(phase_t *p) {
+    bool check = (p->ops & (p->ops - 1)) == 0 || (p->ops & 1023) == 0;
+    if(check && p->ops > 0 && now_ns() - p->start_ns > p->budget_ns) {
+        p->truncated = true;
+    }
+    return p->truncated;
+}
+
+static void phase_end(
+        phase_t *p, const queue_impl_t *impl, int depth, const char *op) {
+    uint64_t elapsed = now_ns() - p->start_ns;
+    uint64_t allocs = allocations - p->start_allocs;
+    double ops = (p->ops > 0) ? p->ops:1;
+    printf("{\"benchmark\": \"bench_msg_queue\", \"impl\": \"%s\", "
+        "\"depth\": %d, \"op\": \"%s\", \"ops\": %llu, "
+        "\"ns_per_op\": %.1f, \"allocs_per_op\": %.3f, \"complete\": %s}\n",
+        impl->name, depth, op, (unsigned long long)p->ops,
+        elapsed / ops, allocs / ops, p->truncated ? "false":"true");
+    fflush(stdout);
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void shuffle(int *ids, int n, uint64_t *rng) {
+    for(int i = n - 1; i > 0; i--) {
+        int j = xorshift64(rng) % (i + 1);
+        int t = ids[i];
+        ids[i] = ids[j];
+        ids[j] = t;
+    }
+}
+
+/**
+ * Run every phase at one depth.
+ * @return 0 if all of them finished, 1 if one ran out of time, -1 on failure.
+ */
+static int run_depth(
+        const queue_impl_t *impl, int depth, uint64_t budget_ns,
+        uint64_t churn_ops) {
+    int status = -1;
+    bool truncated = false;
+    phase_t p;
+    uint64_t rng = 0x9e3779b97f4a7c15ull ^ depth;
+    int *ids = malloc(depth * sizeof(int));
+    void *q = impl->create();
+    if(ids == NULL || q == NULL) {
+        goto done;
+    }
+
+    // each phase works on what the one before it got through.
+    int n = 0;
+    phase_begin(&p, budget_ns);
+    for(; n < depth && !phase_over(&p); n++, p.ops++) {
+        if((ids[n] = impl->get_new(q)) < 0) {
+            goto done;
+        }
+    }
+    phase_end(&p, impl, depth, "fill");
+    truncated |= p.truncated;
+
+    shuffle(ids, n, &rng);
+    phase_begin(&p, budget_ns);
+    int nfinal = 0;
+    for(; nfinal < n && !phase_over(&p); nfinal++, p.ops++) {
+        impl->finalize(q, ids[nfinal]);
+    }
+    phase_end(&p, impl, depth, "finalize");
+    truncated |= p.truncated;
+
+    phase_begin(&p, budget_ns);
+    n = 0;
+    for(; n < nfinal && !phase_over(&p); n++, p.ops++) {
+        if((ids[n] = impl->dequeue(q)) < 0) {
+            goto done;
+        }
+    }
+    phase_end(&p, impl, depth, "dequeue");
+    truncated |= p.truncated;
+
+    shuffle(ids, n, &rng);
+    phase_begin(&p, budget_ns);
+    int ncleared = 0;
+    for(; ncleared < n && !phase_over(&p); ncleared++, p.ops++) {
+        impl->clear(q, ids[ncleared]);
+    }
+    phase_end(&p, impl, depth, "clear");
+    truncated |= p.truncated;
+
+    // churn starts with depth messages queued, unless a phase was cut short.
+    for(int i = 0; i < ncleared && !truncated; i++) {
+        int id = impl->get_new(q);
+        if(id < 0) {
+            goto done;
+        }
+        impl->finalize(q, id);
+    }
+    phase_begin(&p, budget_ns);
+    while(p.ops < churn_ops && !phase_over(&p)) {
+        int id = impl->get_new(q);
+        if(id < 0) {
+            goto done;
+        }
+        impl->finalize(q, id);
+        impl->clear(q, impl->dequeue(q));
+        p.ops++;
+    }
+    phase_end(&p, impl, depth, "churn");
+    truncated |= p.truncated;
+    status = truncated ? 1:0;
+done:
+    if(q != NULL) {
+        impl->destroy(q);
+    }
+    free(ids);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    int max_depth = 100000;
+    uint64_t budget_ms = 1000;
+    uint64_t churn_ops = 100000;
+    const char *only = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "d:t:n:q:")) != -1) {
+        switch(opt) {
+            case 'd': max_depth = atoi(optarg); break;
+            case 't': budget_ms = strtoull(optarg, NULL, 10); break;
+            case 'n': churn_ops = strtoull(optarg, NULL, 10); break;
+            case 'q': only = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-d max depth] [-t ms per phase] "
+                    "[-n churn ops] [-q implementation]\n", argv[0]);
+                return 1;
+        }
+    }
+    for(int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if(only != NULL && strcmp(only, impls[i].name) != 0) {
+            continue;
+        }
+        for(int depth = 1; depth <= max_depth; depth *= 10) {
+            int r = run_depth(&impls[i], depth, budget_ms * 1000000, churn_ops);
+            if(r < 0) {
+                fprintf(stderr, "%s failed at depth %d\n", impls[i].name, depth);
+                return 1;
+            }
+            if(r > 0) {
+                fprintf(stderr, "%s is too slow past depth %d\n",
+                    impls[i].name, depth);
+                break;
+            }
+        }
+    }
+    return 0;
+}
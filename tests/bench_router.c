@@ -0,0 +1,679 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_hist.h>
+#include <xpc_hook.h>
+#include <epoll_app.h>
+
+/**
+ * End-to-end router benchmark.
+ * A generator thread writes frames into stand-in devices (socketpairs, or
+ * ptys with -p), the router forwards them on this thread with epoll_app as
+ * main does, and a sink thread reads them back from the outputs. Each frame
+ * carries the time it was written, so the sink measures the latency through
+ * the whole path.
+ *
+ * The result is printed as one JSON object on stdout.
+ *
+ * usage: bench_router [-m messages] [-r msgs/s] [-s sizes] [-c channels]
+ *                     [-i inputs] [-o outputs] [-S seed] [-p] [-B baud] [-x]
+ *                     [-P us] [-H hook]
+ *   -m  number of messages to send (default 100000)
+ *   -r  send rate in messages per second, 0 is as fast as possible (default)
+ *   -s  payload sizes: "N" bytes, "MIN-MAX" uniform, or "exp:MEAN"
+ *   -c  channel mix, a list of channel[:weight] (default "1")
+ *   -i  number of input devices (default 1)
+ *   -o  number of output devices (default 1), channel c goes to c % outputs
+ *   -p  use ptys in raw mode instead of socketpairs
+ *   -B  emulate serial lines of this baud rate (8N1, 10 bits a byte): the
+ *       generator writes each frame a few bytes at a time as the line would
+ *       deliver them, and the sink counts a frame as received once the
+ *       output line would have carried its last byte
+ *   -x  set XPC_ROUTE_CUT_THROUGH on the routes
+ *   -P  busy poll for up to this many microseconds after input arrives, with
+ *       the whole of the router thread as budget, see epoll_app_set_busy_poll
+ *   -H  run a hook on every route, see xpc_hook.h: "pass" forwards each
+ *       message untouched, "rewrite" reads the whole payload and rewrites
+ *       the header, which costs what a filter looking into messages would
+ *
+ * System calls made by the router are counted by wrapping them at link time
+ * (see meson.build), calls from the generator and sink are not counted.
+ */
+
+#define BENCH_MAX_DEVICES 16
+#define BENCH_MAX_CHANNELS 64
+// the payload starts with the send time and a sequence number.
+#define BENCH_MIN_PAYLOAD 16
+#define BENCH_MAX_PAYLOAD 4096
+// the run ends if nothing arrives for this long after the last send.
+#define BENCH_IDLE_NS 2000000000ull
+// bytes an emulated serial line delivers at once.
+#define BENCH_LINE_CHUNK 64
+
+typedef enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP,
+} size_dist_t;
+
+typedef struct {
+    // options
+    uint64_t messages;
+    uint64_t rate;
+    size_dist_t size_dist;
+    int size_a;
+    int size_b;
+    const char *size_spec;
+    int channels[BENCH_MAX_CHANNELS];
+    int weights[BENCH_MAX_CHANNELS];
+    int nchannels;
+    int total_weight;
+    const char *channel_spec;
+    int ninputs;
+    int noutputs;
+    uint64_t seed;
+    bool pty;
+    uint64_t baud;
+    bool cut_through;
+    uint32_t busy_poll_us;
+    const char *hook;
+
+    // the generator writes gen_fds, the router reads in_fds and writes
+    // out_fds, and the sink reads sink_fds.
+    int gen_fds[BENCH_MAX_DEVICES];
+    int in_fds[BENCH_MAX_DEVICES];
+    int out_fds[BENCH_MAX_DEVICES];
+    int sink_fds[BENCH_MAX_DEVICES];
+
+    // shared between the threads.
+    uint64_t sent;
+    bool gen_done;
+    bool sink_done;
+    bool stop;
+    uint64_t received;
+    uint64_t received_bytes;
+    uint64_t first_send_ns;
+    uint64_t last_recv_ns;
+    xpc_hist_t *latency;
+    // for the router thread to notice when the sink stops making progress.
+    uint64_t last_received;
+    uint64_t last_progress_ns;
+
+    epoll_app_t *app;
+    xpc_router_t *xpc;
+    // CPU time of the router thread.
+    double router_cpu_s;
+} bench_t;
+
+static __thread bool count_syscalls = false;
+static uint64_t router_syscalls = 0;
+
+#define BENCH_WRAP(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params { \
+        if(count_syscalls) router_syscalls++; \
+        return __real_##name args; \
+    }
+
+BENCH_WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, recv, (int fd, void *buf, size_t n, int flags),
+    (fd, buf, n, flags))
+BENCH_WRAP(ssize_t, send, (int fd, const void *buf, size_t n, int flags),
+    (fd, buf, n, flags))
+BENCH_WRAP(int, epoll_wait,
+    (int epfd, struct epoll_event *ev, int max, int timeout),
+    (epfd, ev, max, timeout))
+BENCH_WRAP(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event *ev),
+    (epfd, op, fd, ev))
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static int parse_sizes(bench_t *b, const char *spec) {
+    char *end = NULL;
+    b->size_spec = spec;
+    if(strncmp(spec, "exp:", 4) == 0) {
+        b->size_dist = SIZE_EXP;
+        b->size_a = strtol(spec + 4, &end, 10);
+        b->size_b = b->size_a;
+    }
+    else {
+        b->size_a = strtol(spec, &end, 10);
+        b->size_b = b->size_a;
+        b->size_dist = SIZE_FIXED;
+        if(*end == '-') {
+            b->size_dist = SIZE_UNIFORM;
+            b->size_b = strtol(end + 1, &end, 10);
+        }
+    }
+    if(*end != '\0' || b->size_a < BENCH_MIN_PAYLOAD
+            || b->size_a > BENCH_MAX_PAYLOAD || b->size_b < b->size_a
+            || b->size_b > BENCH_MAX_PAYLOAD) {
+        fprintf(stderr, "bad sizes '%s', payloads are %d to %d bytes\n",
+            spec, BENCH_MIN_PAYLOAD, BENCH_MAX_PAYLOAD);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_channels(bench_t *b, const char *spec) {
+    char *copy = strdup(spec);
+    char *save = NULL;
+    int status = -1;
+    b->channel_spec = spec;
+    b->nchannels = 0;
+    b->total_weight = 0;
+    for(char *tok = strtok_r(copy, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        char *end = NULL;
+        long chn = strtol(tok, &end, 10);
+        long weight = 1;
+        if(*end == ':') {
+            weight = strtol(end + 1, &end, 10);
+        }
+        if(*end != '\0' || chn <= 0 || chn > UINT16_MAX || weight <= 0
+                || b->nchannels == BENCH_MAX_CHANNELS) {
+            fprintf(stderr, "bad channel '%s'\n", tok);
+            goto done;
+        }
+        b->channels[b->nchannels] = chn;
+        b->weights[b->nchannels] = weight;
+        b->total_weight += weight;
+        b->nchannels++;
+    }
+    status = (b->nchannels > 0) ? 0:-1;
+done:
+    free(copy);
+    return status;
+}
+
+static int next_size(bench_t *b, uint64_t *rng) {
+    switch(b->size_dist) {
+        case SIZE_UNIFORM:
+            return b->size_a + xorshift64(rng) % (b->size_b - b->size_a + 1);
+        case SIZE_EXP: {
+            // inverse transform of a uniform (0, 1].
+            double u = ((xorshift64(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+            double v = -log(u) * b->size_a;
+            int r = (int)v;
+            if(r < BENCH_MIN_PAYLOAD) r = BENCH_MIN_PAYLOAD;
+            if(r > BENCH_MAX_PAYLOAD) r = BENCH_MAX_PAYLOAD;
+            return r;
+        }
+        default:
+            return b->size_a;
+    }
+}
+
+static int next_channel(bench_t *b, uint64_t *rng) {
+    int pick = xorshift64(rng) % b->total_weight;
+    for(int i = 0; i < b->nchannels; i++) {
+        pick -= b->weights[i];
+        if(pick < 0) {
+            return b->channels[i];
+        }
+    }
+    return b->channels[0];
+}
+
+static int write_all(int fd, const uint8_t *buf, int len) {
+    int done = 0;
+    while(done < len) {
+        int n = write(fd, buf + done, len - done);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void sleep_until(uint64_t due) {
+    struct timespec ts = {
+        .tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull
+    };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/**
+ * Write a frame as a serial line of b->baud delivers it, a chunk at a time
+ * once its last byte would have arrived. line_free is when the line is done
+ * with the frame before.
+ */
+static int write_paced(bench_t *b, int fd, const uint8_t *buf, int len,
+        uint64_t *line_free) {
+    uint64_t now = xpc_monotonic_ns();
+    uint64_t start = (*line_free > now) ? *line_free:now;
+    for(int off = 0; off < len; off += BENCH_LINE_CHUNK) {
+        int n = (len - off < BENCH_LINE_CHUNK) ? len - off:BENCH_LINE_CHUNK;
+        sleep_until(start + (off + n) * 10000000000ull / b->baud);
+        if(write_all(fd, buf + off, n) != 0) {
+            return -1;
+        }
+    }
+    *line_free = start + len * 10000000000ull / b->baud;
+    return 0;
+}
+
+static void *generator_main(void *arg) {
+    bench_t *b = arg;
+    uint64_t rng = b->seed;
+    uint8_t frame[sizeof(txpc_hdr_t) + BENCH_MAX_PAYLOAD];
+    const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    memset(frame, 0xa5, sizeof(frame));
+    uint64_t start = xpc_monotonic_ns();
+    uint64_t line_free[BENCH_MAX_DEVICES] = {0};
+    __atomic_store_n(&b->first_send_ns, start, __ATOMIC_RELEASE);
+    for(uint64_t seq = 0; seq < b->messages; seq++) {
+        if(__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        txpc_hdr_t hdr = {
+            .to = next_channel(b, &rng), .from = 1, .type = 0,
+            .size = next_size(b, &rng)
+        };
+        if(b->rate > 0) {
+            sleep_until(start + seq * 1000000000ull / b->rate);
+        }
+        codec->encode(frame, &hdr);
+        uint64_t now = xpc_monotonic_ns();
+        memcpy(frame + sizeof(txpc_hdr_t), &now, sizeof(now));
+        memcpy(frame + sizeof(txpc_hdr_t) + sizeof(now), &seq, sizeof(seq));
+        int dev = seq % b->ninputs;
+        int len = sizeof(txpc_hdr_t) + hdr.size;
+        if(((b->baud > 0) ?
+                write_paced(b, b->gen_fds[dev], frame, len, &line_free[dev]):
+                write_all(b->gen_fds[dev], frame, len)) != 0) {
+            perror("generator write");
+            break;
+        }
+        __atomic_store_n(&b->sent, seq + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&b->gen_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+typedef struct {
+    uint8_t buf[2 * (sizeof(txpc_hdr_t) + BENCH_MAX_PAYLOAD)];
+    int len;
+    // when the emulated output line is done with what was read so far.
+    uint64_t line_free;
+} sink_buf_t;
+
+/**
+ * Take the complete frames out of what was read from an output.
+ */
+static void sink_frames(bench_t *b, sink_buf_t *sb, uint64_t now) {
+    const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    const int hdr_len = sizeof(txpc_hdr_t);
+    int off = 0;
+    while(sb->len - off >= hdr_len) {
+        txpc_hdr_t hdr;
+        codec->decode(&hdr, sb->buf + off);
+        int frame_len = hdr_len + hdr.size;
+        if(sb->len - off < frame_len) {
+            break;
+        }
+        uint64_t sent_ns;
+        memcpy(&sent_ns, sb->buf + off + hdr_len, sizeof(sent_ns));
+        xpc_hist_record(b->latency, now - sent_ns);
+        b->received_bytes += frame_len;
+        __atomic_store_n(&b->received, b->received + 1, __ATOMIC_RELEASE);
+        off += frame_len;
+    }
+    memmove(sb->buf, sb->buf + off, sb->len - off);
+    sb->len -= off;
+}
+
+static void *sink_main(void *arg) {
+    bench_t *b = arg;
+    struct pollfd pfds[BENCH_MAX_DEVICES];
+    sink_buf_t *bufs = calloc(b->noutputs, sizeof(sink_buf_t));
+    if(bufs == NULL) {
+        goto done;
+    }
+    for(int i = 0; i < b->noutputs; i++) {
+        pfds[i].fd = b->sink_fds[i];
+        pfds[i].events = POLLIN;
+    }
+    while(!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        if(__atomic_load_n(&b->gen_done, __ATOMIC_ACQUIRE)
+                && b->received == __atomic_load_n(&b->sent, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if(poll(pfds, b->noutputs, 100) <= 0) {
+            continue;
+        }
+        for(int i = 0; i < b->noutputs; i++) {
+            if(!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            sink_buf_t *sb = &bufs[i];
+            int n = read(pfds[i].fd, sb->buf + sb->len, sizeof(sb->buf) - sb->len);
+            if(n > 0) {
+                uint64_t now = xpc_monotonic_ns();
+                sb->len += n;
+                if(b->baud > 0) {
+                    // the bytes leave the router no faster than the line
+                    // carries them.
+                    sb->line_free = (sb->line_free > now) ? sb->line_free:now;
+                    sb->line_free += n * 10000000000ull / b->baud;
+                    sink_frames(b, sb, sb->line_free);
+                }
+                else {
+                    sink_frames(b, sb, now);
+                }
+                b->last_recv_ns = now;
+            }
+        }
+    }
+done:
+    free(bufs);
+    __atomic_store_n(&b->sink_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int bench_add_fd(void *ctx, int fd) {
+    return epoll_app_add_fd(ctx, fd, EPOLLOUT | EPOLLHUP);
+}
+
+static int bench_del_fd(void *ctx, int fd) {
+    return epoll_app_del_fd(ctx, fd);
+}
+
+static bench_t *bench_global;
+
+/**
+ * Stop the router once the sink has everything, or once nothing has
+ * arrived for a while after the last send.
+ */
+static int bench_poll(void *ctx) {
+    bench_t *b = bench_global;
+    uint64_t now = xpc_monotonic_ns();
+    uint64_t received = __atomic_load_n(&b->received, __ATOMIC_ACQUIRE);
+    if(received != b->last_received
+            || !__atomic_load_n(&b->gen_done, __ATOMIC_ACQUIRE)) {
+        b->last_received = received;
+        b->last_progress_ns = now;
+    }
+    if(__atomic_load_n(&b->sink_done, __ATOMIC_ACQUIRE)
+            || now - b->last_progress_ns > BENCH_IDLE_NS) {
+        __atomic_store_n(&b->stop, true, __ATOMIC_RELEASE);
+        b->app->run_mainloop = false;
+    }
+    int timeout_ms = xpc_router_poll(ctx);
+    return (timeout_ms == -1 || timeout_ms > 10) ? 10:timeout_ms;
+}
+
+/**
+ * Open a stand-in device. The router gets *router_fd, non-blocking, and the
+ * benchmark gets *bench_fd.
+ */
+static int open_device(bool pty, int *router_fd, int *bench_fd) {
+    if(!pty) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+            return -1;
+        }
+        *router_fd = sv[0];
+        *bench_fd = sv[1];
+        return fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    }
+    // the router opens the terminal side like a serial port.
+    struct termios tio;
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(master == -1 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(slave == -1 || tcgetattr(slave, &tio) != 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    if(tcsetattr(slave, TCSANOW, &tio) != 0) {
+        return -1;
+    }
+    *router_fd = slave;
+    *bench_fd = master;
+    return 0;
+}
+
+static xpc_hook_verdict_t bench_hook_pass(void *state, xpc_hook_msg_t *msg) {
+    return XPC_HOOK_PASS;
+}
+
+static xpc_hook_verdict_t bench_hook_rewrite(void *state, xpc_hook_msg_t *msg) {
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < msg->hdr.size; i++) {
+        sum += msg->payload[i];
+    }
+    // the sink does not look at the type.
+    msg->hdr.type = sum;
+    return XPC_HOOK_REWRITE;
+}
+
+static const xpc_hook_def_t bench_hooks[] = {
+    {.abi = XPC_HOOK_ABI, .fn = bench_hook_pass},
+    {.abi = XPC_HOOK_ABI, .fn = bench_hook_rewrite},
+};
+
+static const char *bench_hook_names[] = {"pass", "rewrite"};
+
+static const xpc_hook_def_t *find_hook(const char *name) {
+    for(int i = 0; i < sizeof(bench_hooks) / sizeof(bench_hooks[0]); i++) {
+        if(!strcmp(name, bench_hook_names[i])) {
+            return &bench_hooks[i];
+        }
+    }
+    fprintf(stderr, "bad hook %s, expected pass or rewrite\n", name);
+    return NULL;
+}
+
+/**
+ * Count the messages the hooks of all routes ran on.
+ */
+static uint64_t hook_calls(bench_t *b) {
+    uint64_t calls = 0;
+    xpc_hook_stats_t stats;
+    for(int i = 0; i < b->ninputs; i++) {
+        for(int c = 0; c < b->nchannels; c++) {
+            if(xpc_hook_get_stats(b->xpc, b->in_fds[i], b->channels[c], &stats) != 0) {
+                continue;
+            }
+            for(int v = 0; v < XPC_HOOK_NVERDICTS; v++) {
+                calls += stats.verdicts[v];
+            }
+        }
+    }
+    return calls;
+}
+
+static void print_json(bench_t *b, double elapsed_s) {
+    double secs = (elapsed_s > 0) ? elapsed_s:1e-9;
+    uint64_t received = b->received;
+    printf("{\"benchmark\": \"bench_router\", \"transport\": \"%s\", "
+        "\"inputs\": %d, \"outputs\": %d, \"channels\": \"%s\", "
+        "\"sizes\": \"%s\", \"rate\": %llu, \"baud\": %llu, "
+        "\"cut_through\": %s, \"busy_poll_us\": %u, \"hook\": \"%s\", "
+        "\"hook_calls\": %llu, ",
+        b->pty ? "pty":"socketpair", b->ninputs, b->noutputs,
+        b->channel_spec, b->size_spec, (unsigned long long)b->rate,
+        (unsigned long long)b->baud, b->cut_through ? "true":"false",
+        b->busy_poll_us, (b->hook != NULL) ? b->hook:"none",
+        (unsigned long long)hook_calls(b));
+    printf("\"sent\": %llu, \"received\": %llu, \"lost\": %llu, "
+        "\"elapsed_s\": %.6f, \"msgs_per_s\": %.1f, \"mb_per_s\": %.3f, "
+        "\"syscalls_per_msg\": %.3f, \"router_cpu_s\": %.3f, "
+        "\"busy_poll_hits\": %llu, ",
+        (unsigned long long)b->sent, (unsigned long long)received,
+        (unsigned long long)(b->sent - received), elapsed_s,
+        received / secs, b->received_bytes / secs / 1e6,
+        (received > 0) ? (double)router_syscalls / received:0.0,
+        b->router_cpu_s, (unsigned long long)b->app->busy_poll.hits);
+    printf("\"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+        "\"max\": %llu}}\n",
+        (unsigned long long)xpc_hist_percentile(b->latency, 50.0),
+        (unsigned long long)xpc_hist_percentile(b->latency, 99.0),
+        (unsigned long long)xpc_hist_percentile(b->latency, 99.9),
+        (unsigned long long)b->latency->max);
+}
+
+int main(int argc, char **argv) {
+    int status = 1;
+    int opt;
+    pthread_t gen_thread, sink_thread;
+    bench_t *b = calloc(1, sizeof(bench_t));
+    if(b == NULL) {
+        return 1;
+    }
+    b->messages = 100000;
+    b->ninputs = 1;
+    b->noutputs = 1;
+    b->seed = 0x9e3779b97f4a7c15ull;
+    parse_sizes(b, "64");
+    parse_channels(b, "1");
+    while((opt = getopt(argc, argv, "m:r:s:c:i:o:S:pB:xP:H:")) != -1) {
+        switch(opt) {
+            case 'm': b->messages = strtoull(optarg, NULL, 10); break;
+            case 'r': b->rate = strtoull(optarg, NULL, 10); break;
+            case 's':
+                if(parse_sizes(b, optarg) != 0) goto done;
+            break;
+            case 'c':
+                if(parse_channels(b, optarg) != 0) goto done;
+            break;
+            case 'i': b->ninputs = atoi(optarg); break;
+            case 'o': b->noutputs = atoi(optarg); break;
+            case 'S': b->seed = strtoull(optarg, NULL, 0) | 1; break;
+            case 'p': b->pty = true; break;
+            case 'B': b->baud = strtoull(optarg, NULL, 10); break;
+            case 'x': b->cut_through = true; break;
+            case 'P': b->busy_poll_us = strtoul(optarg, NULL, 10); break;
+            case 'H':
+                if(find_hook(optarg) == NULL) goto done;
+                b->hook = optarg;
+            break;
+            default:
+                fprintf(stderr, "usage: %s [-m messages] [-r msgs/s] [-s sizes] "
+                    "[-c channels] [-i inputs] [-o outputs] [-S seed] [-p] "
+                    "[-B baud] [-x] [-P us] [-H hook]\n",
+                    argv[0]);
+                goto done;
+        }
+    }
+    if(b->ninputs < 1 || b->ninputs > BENCH_MAX_DEVICES
+            || b->noutputs < 1 || b->noutputs > BENCH_MAX_DEVICES) {
+        fprintf(stderr, "between 1 and %d inputs and outputs\n",
+            BENCH_MAX_DEVICES);
+        goto done;
+    }
+
+    b->latency = create_xpc_hist();
+    b->app = create_epoll_app(1, NULL);
+    b->xpc = initialize_xpc_router_sized(
+        b->ninputs + b->noutputs, b->ninputs * b->nchannels
+    );
+    if(b->latency == NULL || b->app == NULL || b->xpc == NULL) {
+        goto done;
+    }
+    for(int i = 0; i < b->ninputs; i++) {
+        if(open_device(b->pty, &b->in_fds[i], &b->gen_fds[i]) != 0) {
+            perror("input device");
+            goto done;
+        }
+        epoll_app_add_fd(b->app, b->in_fds[i], EPOLLIN | EPOLLHUP | EPOLLRDHUP);
+    }
+    for(int i = 0; i < b->noutputs; i++) {
+        if(open_device(b->pty, &b->out_fds[i], &b->sink_fds[i]) != 0) {
+            perror("output device");
+            goto done;
+        }
+    }
+    for(int i = 0; i < b->ninputs; i++) {
+        for(int c = 0; c < b->nchannels; c++) {
+            int chn = b->channels[c];
+            if(xpc_set_route(b->xpc, b->in_fds[i],
+                    b->out_fds[chn % b->noutputs], chn, chn) != 0) {
+                goto done;
+            }
+            if(b->cut_through && xpc_set_route_flags(
+                    b->xpc, b->in_fds[i], chn, XPC_ROUTE_CUT_THROUGH) != 0) {
+                goto done;
+            }
+            if(b->hook != NULL && xpc_set_route_hook(b->xpc, b->in_fds[i], chn,
+                    xpc_hook_create(find_hook(b->hook), NULL)) != 0) {
+                goto done;
+            }
+        }
+    }
+    b->xpc->io_event_context = b->app;
+    b->xpc->io_add_fd_cb = bench_add_fd;
+    b->xpc->io_del_fd_cb = bench_del_fd;
+    b->app->cb_ctx = b->xpc;
+    b->app->epollin_cb = (epoll_cb_t *)xpc_accumulate_msg;
+    b->app->epollout_cb = (epoll_cb_t *)xpc_write_msg;
+    b->app->timeout_cb = bench_poll;
+    epoll_app_set_busy_poll(b->app, b->busy_poll_us, 100);
+    bench_global = b;
+    b->last_progress_ns = xpc_monotonic_ns();
+
+    if(pthread_create(&sink_thread, NULL, sink_main, b) != 0) {
+        goto done;
+    }
+    if(pthread_create(&gen_thread, NULL, generator_main, b) != 0) {
+        __atomic_store_n(&b->stop, true, __ATOMIC_RELEASE);
+        pthread_join(sink_thread, NULL);
+        goto done;
+    }
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    count_syscalls = true;
+    epoll_app_mainloop(b->app);
+    count_syscalls = false;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    b->router_cpu_s = (cpu_end.tv_sec - cpu_start.tv_sec)
+        + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    __atomic_store_n(&b->stop, true, __ATOMIC_RELEASE);
+    pthread_join(gen_thread, NULL);
+    pthread_join(sink_thread, NULL);
+
+    uint64_t end = (b->last_recv_ns != 0) ? b->last_recv_ns:xpc_monotonic_ns();
+    print_json(b, (end - b->first_send_ns) / 1e9);
+    status = (b->received == b->sent) ? 0:2;
+done:
+    for(int i = 0; i < BENCH_MAX_DEVICES; i++) {
+        if(b->in_fds[i] > 0) close(b->in_fds[i]);
+        if(b->gen_fds[i] > 0) close(b->gen_fds[i]);
+        if(b->out_fds[i] > 0) close(b->out_fds[i]);
+        if(b->sink_fds[i] > 0) close(b->sink_fds[i]);
+    }
+    xpc_router_destroy(b->xpc);
+    destroy_epoll_app(b->app);
+    free(b->latency);
+    free(b);
+    return status;
+}
@@ -0,0 +1,439 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_hist.h>
+#include <xpc_clients.h>
+#include <xpc_shm_client.h>
+#include <epoll_app.h>
+
+/**
+ * Local client transport benchmark: FIFOs against shared memory rings.
+ * A client on one thread sends messages to the router on another and gets
+ * them back: over a pair of FIFOs routed to each other, or over the rings
+ * of a listener client (see xpc_shm.h) routed from one channel to another.
+ * At most -w messages are outstanding, each carries the time it was sent,
+ * so the round trip latency is measured by the client.
+ *
+ * One JSON object is printed per transport. System calls are counted by
+ * wrapping them at link time (see meson.build), on both threads.
+ *
+ * usage: bench_shm [-m messages] [-s size] [-w window] [-t fifo|shm|both]
+ *   -m  number of messages (default 100000)
+ *   -s  payload size in bytes (default 64)
+ *   -w  most messages outstanding at once (default 256)
+ *   -t  transports to run (default both)
+ */
+
+// the payload starts with the send time.
+#define BENCH_MIN_PAYLOAD 8
+// larger FIFO writes would not be atomic.
+#define BENCH_MAX_PAYLOAD 4000
+// a run ends if nothing arrives for this long.
+#define BENCH_IDLE_NS 2000000000ull
+
+static uint64_t syscalls = 0;
+
+#define BENCH_WRAP(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params { \
+        __atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED); \
+        return __real_##name args; \
+    }
+
+BENCH_WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+BENCH_WRAP(ssize_t, recv, (int fd, void *buf, size_t n, int flags),
+    (fd, buf, n, flags))
+BENCH_WRAP(ssize_t, send, (int fd, const void *buf, size_t n, int flags),
+    (fd, buf, n, flags))
+BENCH_WRAP(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags),
+    (fd, msg, flags))
+BENCH_WRAP(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags),
+    (fd, msg, flags))
+BENCH_WRAP(int, poll, (struct pollfd *fds, nfds_t n, int timeout),
+    (fds, n, timeout))
+BENCH_WRAP(int, epoll_wait,
+    (int epfd, struct epoll_event *ev, int max, int timeout),
+    (epfd, ev, max, timeout))
+BENCH_WRAP(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event *ev),
+    (epfd, op, fd, ev))
+
+typedef struct bench bench_t;
+
+/**
+ * A transport as the client sees it. try_send and try_recv return false
+ * when they would block.
+ */
+typedef struct {
+    const char *name;
+    int (*setup)(bench_t *b);
+    bool (*try_send)(bench_t *b, const txpc_hdr_t *hdr, const uint8_t *payload);
+    bool (*try_recv)(bench_t *b, uint64_t *sent_ns);
+    void (*wait)(bench_t *b, bool send_blocked);
+    void (*teardown)(bench_t *b);
+} transport_t;
+
+struct bench {
+    // options
+    uint64_t messages;
+    int size;
+    int window;
+    char dir[64];
+
+    epoll_app_t *app;
+    xpc_router_t *xpc;
+    bool stop;
+
+    // fifo transport: the client writes fifo_in and reads fifo_out.
+    int router_in;
+    int router_out;
+    int fifo_in;
+    int fifo_out;
+    uint8_t rx_buf[2 * (sizeof(txpc_hdr_t) + BENCH_MAX_PAYLOAD)];
+    int rx_len;
+
+    // shm transport.
+    int lfd;
+    xpc_shm_client_t *client;
+};
+
+static const int epoll_rd_flags = EPOLLIN | EPOLLHUP | EPOLLRDHUP;
+static const int epoll_wr_flags = EPOLLOUT | EPOLLHUP;
+
+// as in main.
+static int app_add_fd(void *ctx, int fd) {
+    int flags = epoll_app_get_flags(ctx, fd);
+    if(flags == -1) {
+        return epoll_app_add_fd(ctx, fd, epoll_wr_flags);
+    }
+    if(flags & EPOLLOUT) {
+        return 0;
+    }
+    return epoll_app_mod_fd(ctx, fd, flags | EPOLLOUT);
+}
+
+static int app_del_fd(void *ctx, int fd) {
+    int flags = epoll_app_get_flags(ctx, fd);
+    if(flags == -1 || !(flags & EPOLLOUT)) {
+        return 0;
+    }
+    if(flags & EPOLLIN) {
+        return epoll_app_mod_fd(ctx, fd, flags & ~EPOLLOUT);
+    }
+    return epoll_app_del_fd(ctx, fd);
+}
+
+static int app_watch_fd(void *ctx, int fd) {
+    return epoll_app_add_fd(ctx, fd, epoll_rd_flags);
+}
+
+static int app_forget_fd(void *ctx, int fd) {
+    return epoll_app_del_fd(ctx, fd);
+}
+
+static bench_t *bench_global;
+
+static int bench_poll(void *ctx) {
+    if(__atomic_load_n(&bench_global->stop, __ATOMIC_ACQUIRE)) {
+        bench_global->app->run_mainloop = false;
+    }
+    int timeout_ms = xpc_router_poll(ctx);
+    return (timeout_ms == -1 || timeout_ms > 10) ? 10:timeout_ms;
+}
+
+static void *router_main(void *arg) {
+    bench_t *b = arg;
+    epoll_app_mainloop(b->app);
+    return NULL;
+}
+
+static int fifo_setup(bench_t *b) {
+    char in_path[96], out_path[96];
+    snprintf(in_path, sizeof(in_path), "%s/in", b->dir);
+    snprintf(out_path, sizeof(out_path), "%s/out", b->dir);
+    if(mkfifo(in_path, 0600) != 0 || mkfifo(out_path, 0600) != 0) {
+        return -1;
+    }
+    // a FIFO opened for writing without blocking needs a reader first.
+    b->router_in = open(in_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    b->fifo_in = open(in_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    b->fifo_out = open(out_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    b->router_out = open(out_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    unlink(in_path);
+    unlink(out_path);
+    if(b->router_in == -1 || b->fifo_in == -1 || b->fifo_out == -1
+            || b->router_out == -1) {
+        return -1;
+    }
+    if(xpc_set_route(b->xpc, b->router_in, b->router_out, 1, 2) != 0) {
+        return -1;
+    }
+    return epoll_app_add_fd(b->app, b->router_in, epoll_rd_flags);
+}
+
+static bool fifo_try_send(
+        bench_t *b, const txpc_hdr_t *hdr, const uint8_t *frame) {
+    // writes up to PIPE_BUF bytes are all or nothing.
+    return write(b->fifo_in, frame, sizeof(txpc_hdr_t) + hdr->size) > 0;
+}
+
+static bool fifo_try_recv(bench_t *b, uint64_t *sent_ns) {
+    const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    const int hdr_len = sizeof(txpc_hdr_t);
+    txpc_hdr_t hdr;
+    while(true) {
+        if(b->rx_len >= hdr_len) {
+            codec->decode(&hdr, b->rx_buf);
+            int frame_len = hdr_len + hdr.size;
+            if(b->rx_len >= frame_len) {
+                memcpy(sent_ns, b->rx_buf + hdr_len, sizeof(*sent_ns));
+                memmove(b->rx_buf, b->rx_buf + frame_len, b->rx_len - frame_len);
+                b->rx_len -= frame_len;
+                return true;
+            }
+        }
+        int n = read(b->fifo_out, b->rx_buf + b->rx_len,
+            sizeof(b->rx_buf) - b->rx_len);
+        if(n <= 0) {
+            return false;
+        }
+        b->rx_len += n;
+    }
+}
+
+static void fifo_wait(bench_t *b, bool send_blocked) {
+    struct pollfd pfd[2] = {
+        {.fd = b->fifo_out, .events = POLLIN},
+        {.fd = b->fifo_in, .events = send_blocked ? POLLOUT:0}
+    };
+    poll(pfd, 2, 100);
+}
+
+static void fifo_teardown(bench_t *b) {
+    int fds[4] = {b->router_in, b->router_out, b->fifo_in, b->fifo_out};
+    for(int i = 0; i < 4; i++) {
+        if(fds[i] > 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+static int shm_setup(bench_t *b) {
+    char path[96];
+    uint32_t chn = 2;
+    snprintf(path, sizeof(path), "%s/sock", b->dir);
+    b->lfd = xpc_listen_seqpacket(path);
+    if(b->lfd == -1 || xpc_add_listener(b->xpc, b->lfd) != 0
+            || xpc_set_route(b->xpc, b->lfd, b->lfd, 1, 2) != 0
+            || epoll_app_add_fd(b->app, b->lfd, epoll_rd_flags) != 0) {
+        return -1;
+    }
+    // the router thread is not running yet, accepting and attaching is
+    // done here.
+    b->client = xpc_shm_client_connect(path, 0);
+    if(b->client == NULL
+            || xpc_shm_client_subscribe(b->client, &chn, 1, true) != 0) {
+        return -1;
+    }
+    xpc_accumulate_msg(b->xpc, b->lfd);
+    unlink(path);
+    return 0;
+}
+
+static bool shm_try_send(
+        bench_t *b, const txpc_hdr_t *hdr, const uint8_t *frame) {
+    return xpc_shm_client_send(b->client, hdr, frame + sizeof(txpc_hdr_t)) == 0;
+}
+
+static bool shm_try_recv(bench_t *b, uint64_t *sent_ns) {
+    txpc_hdr_t hdr;
+    uint8_t payload[BENCH_MAX_PAYLOAD];
+    if(xpc_shm_client_recv(b->client, &hdr, payload, sizeof(payload)) < 0) {
+        return false;
+    }
+    memcpy(sent_ns, payload, sizeof(*sent_ns));
+    return true;
+}
+
+static void shm_wait(bench_t *b, bool send_blocked) {
+    xpc_shm_client_wait(b->client, send_blocked ? b->size:0, 100);
+}
+
+static void shm_teardown(bench_t *b) {
+    xpc_shm_client_close(b->client);
+    if(b->lfd > 0) {
+        close(b->lfd);
+    }
+}
+
+static const transport_t transports[] = {
+    {"fifo", fifo_setup, fifo_try_send, fifo_try_recv, fifo_wait, fifo_teardown},
+    {"shm", shm_setup, shm_try_send, shm_try_recv, shm_wait, shm_teardown},
+};
+
+/**
+ * Run one transport, and print its results.
+ * @return 0 if every message came back.
+ */
+static int run(bench_t *b, const transport_t *t) {
+    int status = -1;
+    pthread_t router;
+    bool router_started = false;
+    uint8_t frame[sizeof(txpc_hdr_t) + BENCH_MAX_PAYLOAD];
+    uint64_t sent = 0, received = 0;
+    xpc_hist_t *latency = create_xpc_hist();
+    const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+    snprintf(b->dir, sizeof(b->dir), "/tmp/bench_shm.XXXXXX");
+    b->app = create_epoll_app(1, NULL);
+    b->xpc = initialize_xpc_router();
+    b->stop = false;
+    b->rx_len = 0;
+    if(latency == NULL || b->app == NULL || b->xpc == NULL
+            || mkdtemp(b->dir) == NULL) {
+        goto done;
+    }
+    b->xpc->io_event_context = b->app;
+    b->xpc->io_add_fd_cb = app_add_fd;
+    b->xpc->io_del_fd_cb = app_del_fd;
+    b->xpc->io_watch_fd_cb = app_watch_fd;
+    b->xpc->io_forget_fd_cb = app_forget_fd;
+    b->app->cb_ctx = b->xpc;
+    b->app->epollin_cb = (epoll_cb_t *)xpc_accumulate_msg;
+    b->app->epollout_cb = (epoll_cb_t *)xpc_write_msg;
+    b->app->timeout_cb = bench_poll;
+    bench_global = b;
+    if(t->setup(b) != 0) {
+        perror(t->name);
+        goto done;
+    }
+    if(pthread_create(&router, NULL, router_main, b) != 0) {
+        goto done;
+    }
+    router_started = true;
+
+    memset(frame, 0xa5, sizeof(frame));
+    txpc_hdr_t hdr = {.to = 1, .from = 1, .type = 0, .size = b->size};
+    codec->encode(frame, &hdr);
+    uint64_t calls_before = __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+    uint64_t start = xpc_monotonic_ns();
+    uint64_t last_progress = start;
+    while(received < b->messages) {
+        bool progress = false;
+        bool send_blocked = false;
+        while(sent < b->messages && sent - received < b->window) {
+            uint64_t now = xpc_monotonic_ns();
+            memcpy(frame + sizeof(txpc_hdr_t), &now, sizeof(now));
+            if(!t->try_send(b, &hdr, frame)) {
+                send_blocked = true;
+                break;
+            }
+            sent++;
+            progress = true;
+        }
+        uint64_t sent_ns;
+        while(t->try_recv(b, &sent_ns)) {
+            xpc_hist_record(latency, xpc_monotonic_ns() - sent_ns);
+            received++;
+            progress = true;
+        }
+        uint64_t now = xpc_monotonic_ns();
+        if(progress) {
+            last_progress = now;
+        }
+        else if(now - last_progress > BENCH_IDLE_NS) {
+            break;
+        }
+        else {
+            t->wait(b, send_blocked);
+        }
+    }
+    uint64_t end = xpc_monotonic_ns();
+    uint64_t calls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED) - calls_before;
+    double secs = (end > start) ? (end - start) / 1e9:1e-9;
+
+    printf("{\"benchmark\": \"bench_shm\", \"transport\": \"%s\", "
+        "\"messages\": %llu, \"size\": %d, \"window\": %d, ",
+        t->name, (unsigned long long)b->messages, b->size, b->window);
+    printf("\"received\": %llu, \"elapsed_s\": %.6f, \"msgs_per_s\": %.1f, "
+        "\"mb_per_s\": %.3f, \"syscalls_per_msg\": %.3f, ",
+        (unsigned long long)received, secs, received / secs,
+        received * (sizeof(txpc_hdr_t) + b->size) / secs / 1e6,
+        (received > 0) ? (double)calls / received:0.0);
+    printf("\"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+        "\"max\": %llu}}\n",
+        (unsigned long long)xpc_hist_percentile(latency, 50.0),
+        (unsigned long long)xpc_hist_percentile(latency, 99.0),
+        (unsigned long long)xpc_hist_percentile(latency, 99.9),
+        (unsigned long long)latency->max);
+    fflush(stdout);
+    status = (received == b->messages) ? 0:2;
+done:
+    __atomic_store_n(&b->stop, true, __ATOMIC_RELEASE);
+    if(router_started) {
+        pthread_join(router, NULL);
+    }
+    t->teardown(b);
+    xpc_router_destroy(b->xpc);
+    destroy_epoll_app(b->app);
+    rmdir(b->dir);
+    free(latency);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    int opt;
+    const char *which = "both";
+    bench_t *b = calloc(1, sizeof(bench_t));
+    if(b == NULL) {
+        return 1;
+    }
+    b->messages = 100000;
+    b->size = 64;
+    b->window = 256;
+    while((opt = getopt(argc, argv, "m:s:w:t:")) != -1) {
+        switch(opt) {
+            case 'm': b->messages = strtoull(optarg, NULL, 10); break;
+            case 's': b->size = atoi(optarg); break;
+            case 'w': b->window = atoi(optarg); break;
+            case 't': which = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-m messages] [-s size] [-w window] "
+                    "[-t fifo|shm|both]\n", argv[0]);
+                free(b);
+                return 1;
+        }
+    }
+    if(b->size < BENCH_MIN_PAYLOAD || b->size > BENCH_MAX_PAYLOAD
+            || b->window < 1) {
+        fprintf(stderr, "payloads are %d to %d bytes, the window at least 1\n",
+            BENCH_MIN_PAYLOAD, BENCH_MAX_PAYLOAD);
+        free(b);
+        return 1;
+    }
+    for(int i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+        if(strcmp(which, "both") != 0 && strcmp(which, transports[i].name) != 0) {
+            continue;
+        }
+        b->router_in = b->router_out = b->fifo_in = b->fifo_out = -1;
+        b->lfd = -1;
+        b->client = NULL;
+        if(run(b, &transports[i]) != 0) {
+            status = 2;
+        }
+    }
+    free(b);
+    return status;
+}
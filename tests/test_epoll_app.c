@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <epoll_app.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define GAP_US 2000
+
+typedef struct {
+    epoll_app_t *app;
+    // the loop reads p[0], the timeout callback writes p[1].
+    int p[2];
+    // messages to send, and how many were read.
+    int send;
+    int received;
+    bool written;
+    uint64_t stop_ns;
+} loop_state_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int init(void **state) {
+    loop_state_t *st = calloc(1, sizeof(loop_state_t));
+    if(st == NULL || pipe2(st->p, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->app = create_epoll_app(1, st);
+    if(st->app == NULL || epoll_app_add_fd(st->app, st->p[0], EPOLLIN) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    loop_state_t *st = *state;
+    destroy_epoll_app(st->app);
+    close(st->p[0]);
+    close(st->p[1]);
+    free(st);
+    return 0;
+}
+
+static void on_read(void *ctx, int fd) {
+    loop_state_t *st = ctx;
+    char c;
+    while(read(fd, &c, 1) == 1) {
+        st->received++;
+    }
+    st->written = false;
+}
+
+/**
+ * Send a message GAP_US after the last one was read, until all are sent,
+ * then stop the loop at stop_ns.
+ */
+static int on_timeout(void *ctx) {
+    loop_state_t *st = ctx;
+    if(st->received < st->send && !st->written) {
+        usleep(GAP_US);
+        assert_int_equal(write(st->p[1], "x", 1), 1);
+        st->written = true;
+    }
+    if(st->received == st->send && now_ns() >= st->stop_ns) {
+        st->app->run_mainloop = false;
+    }
+    return 5;
+}
+
+static void run(loop_state_t *st, int send, uint64_t linger_ns) {
+    st->send = send;
+    st->app->epollin_cb = on_read;
+    st->app->timeout_cb = on_timeout;
+    st->stop_ns = 0;
+    epoll_app_mainloop(st->app);
+    // the loop is kept running for a while after the last message.
+    st->stop_ns = now_ns() + linger_ns;
+    st->app->run_mainloop = true;
+    epoll_app_mainloop(st->app);
+}
+
+static void test_no_busy_poll(void **state) {
+    loop_state_t *st = *state;
+    run(st, 10, 0);
+    assert_int_equal(st->received, 10);
+    assert_int_equal(st->app->busy_poll.hits, 0);
+    assert_int_equal(st->app->busy_poll.spent_ns, 0);
+}
+
+static void test_busy_poll(void **state) {
+    loop_state_t *st = *state;
+    assert_int_equal(epoll_app_set_busy_poll(st->app, 100000, 0), -1);
+    assert_int_equal(epoll_app_set_busy_poll(st->app, 100000, 100), 0);
+    run(st, 10, 0);
+    assert_int_equal(st->received, 10);
+    // the first two arrivals make the first gap, the rest are polled for.
+    assert_true(st->app->busy_poll.hits >= 8);
+    assert_true(st->app->busy_poll.gap_ns >= GAP_US * 1000ull);
+}
+
+static void test_gap_too_long(void **state) {
+    loop_state_t *st = *state;
+    // messages arrive further apart than the window, it stays shut.
+    assert_int_equal(epoll_app_set_busy_poll(st->app, GAP_US / 4, 100), 0);
+    run(st, 10, 0);
+    assert_int_equal(st->received, 10);
+    assert_int_equal(st->app->busy_poll.hits, 0);
+    assert_int_equal(st->app->busy_poll.spent_ns, 0);
+}
+
+static void test_budget(void **state) {
+    loop_state_t *st = *state;
+    // the window is longer than the budget, which cuts it short once input
+    // stops arriving.
+    assert_int_equal(epoll_app_set_busy_poll(st->app, 100000, 1), 0);
+    run(st, 3, 20000000);
+    epoll_busy_poll_t *bp = &st->app->busy_poll;
+    assert_true(bp->until_ns > bp->last_ns + bp->budget_ns);
+    assert_true(bp->spent_ns >= bp->budget_ns);
+    assert_true(bp->spent_ns < 2 * bp->budget_ns);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_no_busy_poll, init, finish),
+        cmocka_unit_test_setup_teardown(test_busy_poll, init, finish),
+        cmocka_unit_test_setup_teardown(test_gap_too_long, init, finish),
+        cmocka_unit_test_setup_teardown(test_budget, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
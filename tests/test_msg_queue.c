@@ -57,10 +57,10 @@ static void test_finalize_dequeue(void **state) {
         int create_new_buffer = -1;
         xpc_msg_getbuf(q, create_new_buffer);
     }
-    // finalize a few of them
+    // finalize a few of them, out of the order of their ids
+    xpc_msg_finalize(q, 7);
     xpc_msg_finalize(q, 1);
     xpc_msg_finalize(q, 3);
-    xpc_msg_finalize(q, 7);
 
     // XXX
     // we need a way to represent buffers that are finalized, but haven't been
@@ -68,21 +68,45 @@ static void test_finalize_dequeue(void **state) {
     // status on each, and that would theoretically work, but it's ugly.
     // doing that for now...
     // dequeue three times
+    // they come out in the order they were finalized.
     msg_buf_t *buf1 = xpc_msg_dequeue_final(q);
     assert_non_null(buf1);
+    assert_int_equal(buf1->buf_id, 7);
     msg_buf_t *buf2 = xpc_msg_dequeue_final(q);
     assert_non_null(buf2);
-    assert_ptr_not_equal(buf1, buf2);
+    assert_int_equal(buf2->buf_id, 1);
+    // one put back is dequeued next.
+    xpc_msg_finalize(q, 1);
+    buf2 = xpc_msg_dequeue_final(q);
+    assert_int_equal(buf2->buf_id, 1);
     msg_buf_t *buf3 = xpc_msg_dequeue_final(q);
     assert_non_null(buf3);
-    assert_ptr_not_equal(buf2, buf3);
-    assert_ptr_not_equal(buf1, buf3);
+    assert_int_equal(buf3->buf_id, 3);
 
     // there are no more buffers to dequeue
     msg_buf_t *buf4 = xpc_msg_dequeue_final(q);
     assert_null(buf4);
 }
 
+static void test_clear_final(void **state) {
+    msg_queue_t *q = *state;
+    for(int i = 0; i < 4; i++) {
+        xpc_msg_getbuf(q, -1);
+    }
+    xpc_msg_finalize(q, 2);
+    xpc_msg_finalize(q, 0);
+    xpc_msg_finalize(q, 3);
+    // cleared before it was dequeued, its id is then reused.
+    assert_int_equal(xpc_msg_clear(q, 0), 0);
+    msg_buf_t *buf = xpc_msg_getbuf(q, -1);
+    assert_int_equal(buf->buf_id, 0);
+    xpc_msg_finalize(q, 0);
+    assert_int_equal(xpc_msg_dequeue_final(q)->buf_id, 2);
+    assert_int_equal(xpc_msg_dequeue_final(q)->buf_id, 3);
+    assert_int_equal(xpc_msg_dequeue_final(q)->buf_id, 0);
+    assert_null(xpc_msg_dequeue_final(q));
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test_setup_teardown(
@@ -95,6 +119,11 @@ int main(void) {
             init,
             finish
         ),
+        cmocka_unit_test_setup_teardown(
+            test_clear_final,
+            init,
+            finish
+        ),
     };
 
     int r = cmocka_run_group_tests(tests, NULL, NULL);
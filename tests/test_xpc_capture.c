@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_capture.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char path[64];
+    xpc_router_t *xpc;
+    int in_pipe[2];
+    int out_pipe[2];
+} capture_state_t;
+
+static int send_msg(int fd, int to, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 32];
+    txpc_hdr_t hdr = {.to = to, .from = 1, .type = 0, .size = strlen(payload)};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, hdr.size);
+    int len = sizeof(txpc_hdr_t) + hdr.size;
+    assert_int_equal(write(fd, wire, len), len);
+    return len;
+}
+
+static int init(void **state) {
+    capture_state_t *st = calloc(1, sizeof(capture_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "/tmp/test_xpc_capture.%d", getpid());
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || pipe2(st->in_pipe, O_NONBLOCK) != 0
+            || pipe2(st->out_pipe, O_NONBLOCK) != 0
+            || xpc_set_route(st->xpc, st->in_pipe[0], st->out_pipe[1], 1, 2) != 0
+            || xpc_set_route(st->xpc, st->in_pipe[0], st->out_pipe[1], 3, 4) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    capture_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->in_pipe[0]);
+    close(st->in_pipe[1]);
+    close(st->out_pipe[0]);
+    close(st->out_pipe[1]);
+    unlink(st->path);
+    free(st);
+    return 0;
+}
+
+static void test_records(void **state) {
+    capture_state_t *st = *state;
+    size_t len = 0;
+    assert_int_equal(xpc_capture_enable(st->xpc, st->path, 1 << 16), 0);
+
+    uint64_t before = xpc_monotonic_ns();
+    send_msg(st->in_pipe[1], 1, "one");
+    send_msg(st->in_pipe[1], 3, "three");
+    send_msg(st->in_pipe[1], 9, "unrouted");
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    uint64_t after = xpc_monotonic_ns();
+
+    // the live file can be read while capturing.
+    const xpc_capture_hdr_t *hdr = xpc_capture_map(st->path, &len);
+    assert_non_null(hdr);
+    assert_int_equal(len, 1 << 16);
+    const xpc_capture_rec_t *rec = xpc_capture_next(hdr, NULL);
+    assert_non_null(rec);
+    assert_int_equal(rec->in_fd, st->in_pipe[0]);
+    assert_int_equal(rec->in_chn, 1);
+    assert_int_equal(rec->out_fd, st->out_pipe[1]);
+    assert_int_equal(rec->out_chn, 2);
+    assert_true(rec->ingress_ns >= before && rec->ingress_ns <= after);
+    assert_int_equal(rec->msg_len, sizeof(txpc_hdr_t) + 3);
+    assert_int_equal(rec->rec_len % XPC_CAPTURE_ALIGN, 0);
+    // the message is kept as it was forwarded.
+    txpc_hdr_t msg_hdr;
+    xpc_hdr_codec_select(rec->flags & XPC_CAPTURE_BIG_ENDIAN)->decode(
+        &msg_hdr, xpc_capture_msg_bytes(rec)
+    );
+    assert_int_equal(msg_hdr.to, 2);
+    assert_int_equal(msg_hdr.size, 3);
+    assert_memory_equal(xpc_capture_msg_bytes(rec) + sizeof(txpc_hdr_t), "one", 3);
+
+    rec = xpc_capture_next(hdr, rec);
+    assert_non_null(rec);
+    assert_int_equal(rec->in_chn, 3);
+    assert_int_equal(rec->out_chn, 4);
+    assert_memory_equal(
+        xpc_capture_msg_bytes(rec) + sizeof(txpc_hdr_t), "three", 5
+    );
+    // unrouted messages are not captured.
+    assert_null(xpc_capture_next(hdr, rec));
+    uint64_t end = hdr->end;
+    xpc_capture_unmap(hdr, len);
+
+    // stopping the capture truncates it to its records.
+    xpc_capture_free(st->xpc->capture);
+    st->xpc->capture = NULL;
+    hdr = xpc_capture_map(st->path, &len);
+    assert_non_null(hdr);
+    assert_int_equal(len, end);
+    assert_int_equal(hdr->lost, 0);
+    xpc_capture_unmap(hdr, len);
+}
+
+static void test_lost(void **state) {
+    capture_state_t *st = *state;
+    size_t len = 0;
+    // room for the header and one small record.
+    size_t size = sizeof(xpc_capture_hdr_t) + sizeof(xpc_capture_rec_t) + 16;
+    assert_int_equal(xpc_capture_enable(st->xpc, st->path, size), 0);
+
+    send_msg(st->in_pipe[1], 1, "fits");
+    send_msg(st->in_pipe[1], 1, "does not fit");
+    send_msg(st->in_pipe[1], 3, "nor this");
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    xpc_capture_free(st->xpc->capture);
+    st->xpc->capture = NULL;
+
+    const xpc_capture_hdr_t *hdr = xpc_capture_map(st->path, &len);
+    assert_non_null(hdr);
+    assert_int_equal(hdr->lost, 2);
+    const xpc_capture_rec_t *rec = xpc_capture_next(hdr, NULL);
+    assert_non_null(rec);
+    assert_memory_equal(xpc_capture_msg_bytes(rec) + sizeof(txpc_hdr_t), "fits", 4);
+    assert_null(xpc_capture_next(hdr, rec));
+    xpc_capture_unmap(hdr, len);
+
+    // a file which is not a capture is refused.
+    assert_int_equal(truncate(st->path, 4096), 0);
+    int fd = open(st->path, O_WRONLY);
+    assert_true(fd != -1);
+    assert_int_equal(write(fd, "junk", 4), 4);
+    close(fd);
+    assert_null(xpc_capture_map(st->path, &len));
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_records, init, finish),
+        cmocka_unit_test_setup_teardown(test_lost, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
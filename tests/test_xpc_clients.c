@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_clients.h>
+#include <alibc/containers/iterator.h>
+#include <alibc/containers/hashmap_iterator.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char path[64];
+    xpc_router_t *xpc;
+    int lfd;
+    // stream side: the router reads in_pipe[0] and writes out_pipe[1].
+    int in_pipe[2];
+    int out_pipe[2];
+} clients_state_t;
+
+static const xpc_hdr_codec_t *host_codec(void) {
+    return xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+}
+
+static int make_msg(uint8_t *wire, int to, int type, const void *payload, int size) {
+    txpc_hdr_t hdr = {.to = to, .from = 0, .type = type, .size = size};
+    host_codec()->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, size);
+    return sizeof(txpc_hdr_t) + size;
+}
+
+static int connect_client(clients_state_t *st) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, st->path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert_true(fd != -1);
+    assert_int_equal(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    return fd;
+}
+
+static int find_client(clients_state_t *st, int skip) {
+    iter_context *it = create_hashmap_keys_iterator(st->xpc->in_contexts);
+    int r = -1;
+    for(int *pfd = iter_next(it); pfd != NULL; pfd = iter_next(it)) {
+        xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, *pfd);
+        if(in_ctx->kind == XPC_IN_SEQPACKET && *pfd != skip) {
+            r = *pfd;
+        }
+    }
+    iter_free(it);
+    return r;
+}
+
+static void subscribe(clients_state_t *st, int client, int cfd, uint32_t chn) {
+    uint8_t wire[sizeof(txpc_hdr_t) + sizeof(chn)];
+    int len = make_msg(wire, 0, XPC_CLIENT_SUBSCRIBE, &chn, sizeof(chn));
+    assert_int_equal(send(client, wire, len, 0), len);
+    assert_int_equal(xpc_client_recv(st->xpc, cfd), len);
+}
+
+static int init(void **state) {
+    clients_state_t *st = calloc(1, sizeof(clients_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "/tmp/test_xpc_clients.%d", getpid());
+    st->lfd = xpc_listen_seqpacket(st->path);
+    st->xpc = initialize_xpc_router();
+    if(st->lfd == -1 || st->xpc == NULL
+            || pipe2(st->in_pipe, O_NONBLOCK) != 0
+            || pipe2(st->out_pipe, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    // the stream input fans out to channel 3 of the listener, and channel 5
+    // from clients goes out of the stream output as channel 6.
+    if(xpc_set_route(st->xpc, st->in_pipe[0], st->lfd, 1, 3) != 0
+            || xpc_set_route(st->xpc, st->lfd, st->out_pipe[1], 5, 6) != 0
+            || xpc_add_listener(st->xpc, st->lfd) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    clients_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->lfd);
+    close(st->in_pipe[0]);
+    close(st->in_pipe[1]);
+    close(st->out_pipe[0]);
+    close(st->out_pipe[1]);
+    unlink(st->path);
+    free(st);
+    return 0;
+}
+
+static void test_fanout_to_subscribers(void **state) {
+    clients_state_t *st = *state;
+    uint8_t wire[64];
+    uint8_t rx[64];
+    txpc_hdr_t hdr;
+    int a = connect_client(st);
+    assert_int_equal(xpc_accumulate_msg(st->xpc, st->lfd), 0);
+    int a_fd = find_client(st, -1);
+    int b = connect_client(st);
+    xpc_accumulate_msg(st->xpc, st->lfd);
+    int b_fd = find_client(st, a_fd);
+    assert_true(a_fd != -1 && b_fd != -1 && a_fd != b_fd);
+    // coalescing a datagram socket makes no sense.
+    assert_int_equal(xpc_set_coalescing(st->xpc, a_fd, 128, 100), -1);
+
+    subscribe(st, a, a_fd, 3);
+    int len = make_msg(wire, 1, 0, "hello", 5);
+    assert_int_equal(write(st->in_pipe[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    assert_int_equal(xpc_write_msg(st->xpc, a_fd), len);
+    assert_int_equal(xpc_write_msg(st->xpc, b_fd), 0);
+
+    // one datagram, one whole message, readdressed to the listener channel.
+    assert_int_equal(recv(a, rx, sizeof(rx), MSG_DONTWAIT), len);
+    host_codec()->decode(&hdr, rx);
+    assert_int_equal(hdr.to, 3);
+    assert_int_equal(hdr.size, 5);
+    assert_memory_equal(rx + sizeof(txpc_hdr_t), "hello", 5);
+    assert_int_equal(recv(b, rx, sizeof(rx), MSG_DONTWAIT), -1);
+
+    // after unsubscribing, nothing more arrives.
+    assert_int_equal(xpc_client_unsubscribe(st->xpc, a_fd, 3), 0);
+    assert_int_equal(write(st->in_pipe[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    assert_int_equal(xpc_write_msg(st->xpc, a_fd), 0);
+    close(a);
+    close(b);
+}
+
+static void test_client_to_stream(void **state) {
+    clients_state_t *st = *state;
+    uint8_t wire[64];
+    uint8_t rx[64];
+    txpc_hdr_t hdr;
+    int a = connect_client(st);
+    xpc_accumulate_msg(st->xpc, st->lfd);
+    int a_fd = find_client(st, -1);
+
+    int len = make_msg(wire, 5, 2, "ping", 4);
+    assert_int_equal(send(a, wire, len, 0), len);
+    // unrouted and malformed datagrams are dropped one at a time.
+    int bad_len = make_msg(wire + len, 9, 0, "x", 1);
+    assert_int_equal(send(a, wire + len, bad_len, 0), bad_len);
+    assert_int_equal(send(a, wire, len - 1, 0), len - 1);
+    assert_int_equal(send(a, wire, len, 0), len);
+    xpc_accumulate_msg(st->xpc, a_fd);
+    assert_int_equal(xpc_get_drop_count(st->xpc, a_fd, 9), 1);
+    assert_int_equal(xpc_get_drop_count(st->xpc, a_fd, 5), 1);
+
+    while(xpc_write_msg(st->xpc, st->out_pipe[1]) > 0);
+    assert_int_equal(read(st->out_pipe[0], rx, sizeof(rx)), 2 * len);
+    host_codec()->decode(&hdr, rx);
+    assert_int_equal(hdr.to, 6);
+    assert_int_equal(hdr.type, 2);
+    assert_memory_equal(rx + sizeof(txpc_hdr_t), "ping", 4);
+
+    // a hangup closes the client on the next read.
+    close(a);
+    xpc_accumulate_msg(st->xpc, a_fd);
+    assert_null(hashmap_fetch(st->xpc->in_contexts, a_fd));
+    assert_null(hashmap_fetch(st->xpc->out_contexts, a_fd));
+}
+
+static void test_slow_client_drops(void **state) {
+    clients_state_t *st = *state;
+    uint8_t wire[64];
+    int a = connect_client(st);
+    xpc_accumulate_msg(st->xpc, st->lfd);
+    int a_fd = find_client(st, -1);
+    subscribe(st, a, a_fd, 3);
+
+    int len = make_msg(wire, 1, 0, "z", 1);
+    for(int i = 0; i < XPC_CLIENT_MAX_QUEUED + 4; i++) {
+        assert_int_equal(write(st->in_pipe[1], wire, len), len);
+        while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    }
+    assert_int_equal(xpc_get_drop_count(st->xpc, a_fd, 3), 4);
+    close(a);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_fanout_to_subscribers, init, finish),
+        cmocka_unit_test_setup_teardown(test_client_to_stream, init, finish),
+        cmocka_unit_test_setup_teardown(test_slow_client_drops, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
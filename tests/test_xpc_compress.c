@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_lz.h>
+#include <xpc_compress.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    xpc_router_t *xpc;
+    // a compressed link, the router has dev[0] and its peer dev[1].
+    int dev[2];
+    // an application, app[1] is its end.
+    int app[2];
+    // the peer's ends of the link.
+    xpc_lz_t *peer_tx;
+    xpc_lz_t *peer_rx;
+} compress_state_t;
+
+static const xpc_hdr_codec_t *codec(void) {
+    return xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+}
+
+static int init(void **state) {
+    compress_state_t *st = calloc(1, sizeof(compress_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->dev) != 0
+            || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->app) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    st->peer_tx = create_xpc_lz();
+    st->peer_rx = create_xpc_lz();
+    if(st->xpc == NULL || st->peer_tx == NULL || st->peer_rx == NULL
+            || xpc_set_route(st->xpc, st->dev[0], st->app[0], 1, 1) != 0
+            || xpc_set_route(st->xpc, st->app[0], st->dev[0], 2, 2) != 0
+            || xpc_compress_allow(st->xpc, st->dev[0], true) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    compress_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    xpc_lz_free(st->peer_tx);
+    xpc_lz_free(st->peer_rx);
+    for(int i = 0; i < 2; i++) {
+        close(st->dev[i]);
+        close(st->app[i]);
+    }
+    free(st);
+    return 0;
+}
+
+static void pump(compress_state_t *st) {
+    int moved = 0;
+    do {
+        moved = 0;
+        moved += xpc_accumulate_msg(st->xpc, st->dev[0]);
+        moved += xpc_accumulate_msg(st->xpc, st->app[0]);
+        while(xpc_write_msg(st->xpc, st->dev[0]) > 0) moved++;
+        while(xpc_write_msg(st->xpc, st->app[0]) > 0) moved++;
+    } while(moved > 0);
+}
+
+static void send_msg(int fd, int to, int type, const uint8_t *payload, int len) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 512];
+    // negotiation messages are from 0 as well.
+    txpc_hdr_t hdr = {.to = to, .from = (to == 0) ? 0:1, .type = type, .size = len};
+    codec()->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, len);
+    assert_int_equal(write(fd, wire, sizeof(txpc_hdr_t) + len), sizeof(txpc_hdr_t) + len);
+}
+
+/**
+ * Read one message.
+ * @return its payload length, -1 if nothing is there.
+ */
+static int recv_msg(int fd, txpc_hdr_t *hdr, uint8_t *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    if(read(fd, wire, sizeof(wire)) != sizeof(wire)) {
+        return -1;
+    }
+    codec()->decode(hdr, wire);
+    assert_int_equal(read(fd, payload, hdr->size), hdr->size);
+    return hdr->size;
+}
+
+static void send_neg(int fd, uint8_t what) {
+    send_msg(fd, 0, XPC_NEG_TYPE_COMPRESS, &what, 1);
+}
+
+static void expect_neg(int fd, uint8_t what) {
+    txpc_hdr_t hdr;
+    uint8_t payload[16];
+    assert_int_equal(recv_msg(fd, &hdr, payload), 1);
+    assert_int_equal(hdr.to, 0);
+    assert_int_equal(hdr.from, 0);
+    assert_int_equal(hdr.type, XPC_NEG_TYPE_COMPRESS);
+    assert_int_equal(payload[0], what);
+}
+
+/**
+ * Send a message the way the peer of the link does.
+ * @return true if it was compressed.
+ */
+static bool peer_send(compress_state_t *st, int to, const char *payload) {
+    const uint8_t *packed = NULL;
+    int len = strlen(payload);
+    int n = xpc_lz_compress(st->peer_tx, (const uint8_t *)payload, len, &packed);
+    if(n < 0) {
+        send_msg(st->dev[1], to, 3, (const uint8_t *)payload, len);
+        return false;
+    }
+    send_msg(st->dev[1], to, 3 | XPC_COMPRESS_TYPE_FLAG, packed, n);
+    return true;
+}
+
+/**
+ * Receive a message the way the peer of the link does, and check it.
+ * @return true if it was compressed.
+ */
+static bool peer_expect(compress_state_t *st, int to, const char *payload) {
+    txpc_hdr_t hdr;
+    uint8_t wire[512];
+    const uint8_t *raw = wire;
+    int len = recv_msg(st->dev[1], &hdr, wire);
+    assert_int_equal(hdr.to, to);
+    bool compressed = hdr.type & XPC_COMPRESS_TYPE_FLAG;
+    if(compressed) {
+        len = xpc_lz_decompress(st->peer_rx, wire, len, &raw);
+    }
+    else {
+        xpc_lz_append(st->peer_rx, wire, len);
+    }
+    assert_int_equal(hdr.type & ~XPC_COMPRESS_TYPE_FLAG, 3);
+    assert_int_equal(len, strlen(payload));
+    assert_memory_equal(raw, payload, len);
+    return compressed;
+}
+
+static void app_expect(compress_state_t *st, const char *payload) {
+    txpc_hdr_t hdr;
+    uint8_t wire[512];
+    assert_int_equal(recv_msg(st->app[1], &hdr, wire), strlen(payload));
+    assert_int_equal(hdr.to, 1);
+    assert_int_equal(hdr.type, 3);
+    assert_memory_equal(wire, payload, hdr.size);
+}
+
+static void negotiate(compress_state_t *st) {
+    xpc_lz_reset(st->peer_tx);
+    send_neg(st->dev[1], XPC_COMPRESS_ON);
+    pump(st);
+    expect_neg(st->dev[1], XPC_COMPRESS_ON);
+    xpc_lz_reset(st->peer_rx);
+}
+
+static int telemetry(char *dst, int seq) {
+    return sprintf(dst,
+        "{\"seq\": %d, \"temp_c\": %d.%d, \"state\": \"cruise\"}",
+        seq, 20 + seq % 3, seq % 10);
+}
+
+static xpc_route_t *route(compress_state_t *st) {
+    xpc_switch_tbl_entry_t key = {.fd = st->dev[0], .to_chn = 1};
+    return hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+}
+
+static void test_negotiate(void **state) {
+    compress_state_t *st = *state;
+    char msg[128];
+    int compressed = 0;
+    // not offered on the application's side.
+    send_neg(st->app[1], XPC_COMPRESS_ON);
+    pump(st);
+    txpc_hdr_t hdr;
+    uint8_t payload[16];
+    assert_int_equal(recv_msg(st->app[1], &hdr, payload), 1);
+    assert_int_equal(hdr.type, XPC_NEG_TYPE_COMPRESS);
+    assert_int_equal(payload[0], XPC_COMPRESS_OFF);
+
+    // before it is negotiated, nothing is compressed.
+    telemetry(msg, 0);
+    send_msg(st->app[1], 2, 3, (uint8_t *)msg, strlen(msg));
+    pump(st);
+    assert_false(peer_expect(st, 2, msg));
+
+    negotiate(st);
+    for(int i = 0; i < 20; i++) {
+        telemetry(msg, i);
+        send_msg(st->app[1], 2, 3, (uint8_t *)msg, strlen(msg));
+        pump(st);
+        compressed += peer_expect(st, 2, msg);
+    }
+    assert_true(compressed >= 18);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->dev[0]);
+    assert_true(2 * out_ctx->lz_tx->wire_bytes < out_ctx->lz_tx->raw_bytes);
+
+    compressed = 0;
+    for(int i = 0; i < 20; i++) {
+        telemetry(msg, i);
+        compressed += peer_send(st, 1, msg);
+        pump(st);
+        app_expect(st, msg);
+    }
+    assert_true(compressed >= 18);
+    assert_int_equal(route(st)->stats.msgs, 20);
+
+    // off again, both ways.
+    send_neg(st->dev[1], XPC_COMPRESS_OFF);
+    pump(st);
+    expect_neg(st->dev[1], XPC_COMPRESS_OFF);
+    send_msg(st->app[1], 2, 3, (uint8_t *)msg, strlen(msg));
+    pump(st);
+    assert_false(peer_expect(st, 2, msg));
+}
+
+static void test_lost(void **state) {
+    compress_state_t *st = *state;
+    char msg[128];
+    negotiate(st);
+    telemetry(msg, 1);
+    peer_send(st, 1, msg);
+    pump(st);
+    app_expect(st, msg);
+
+    // a match before the start of the history.
+    const uint8_t bad[] = {5, 0x10, 'a', 0x00, 0x40};
+    send_msg(st->dev[1], 1, 3 | XPC_COMPRESS_TYPE_FLAG, bad, sizeof(bad));
+    pump(st);
+    expect_neg(st->dev[1], XPC_COMPRESS_RESET);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_MALFORMED], 1);
+
+    // compressed messages are dropped until the peer starts over, the
+    // others still get through.
+    assert_true(peer_send(st, 1, msg));
+    pump(st);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_MALFORMED], 2);
+    send_msg(st->dev[1], 1, 3, (uint8_t *)msg, strlen(msg));
+    pump(st);
+    app_expect(st, msg);
+    // it was asked once.
+    uint8_t none[16];
+    assert_int_equal(read(st->dev[1], none, sizeof(none)), -1);
+
+    negotiate(st);
+    telemetry(msg, 2);
+    peer_send(st, 1, msg);
+    assert_true(peer_send(st, 1, msg));
+    pump(st);
+    app_expect(st, msg);
+    app_expect(st, msg);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_MALFORMED], 2);
+}
+
+static void test_dropped_history(void **state) {
+    compress_state_t *st = *state;
+    char msg[128];
+    negotiate(st);
+    // dropped for lack of a route, but the peer counts on it being history.
+    telemetry(msg, 7);
+    peer_send(st, 9, msg);
+    assert_true(peer_send(st, 1, msg));
+    pump(st);
+    app_expect(st, msg);
+    uint8_t none[16];
+    assert_int_equal(read(st->dev[1], none, sizeof(none)), -1);
+}
+
+static void test_too_large(void **state) {
+    compress_state_t *st = *state;
+    char msg[256];
+    st->xpc->max_msg_size = 64;
+    negotiate(st);
+    // small on the wire, over the limit once decompressed.
+    memset(msg, 'a', 200);
+    msg[200] = '\0';
+    assert_true(peer_send(st, 1, msg));
+    pump(st);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_MALFORMED], 1);
+    uint8_t none[16];
+    assert_int_equal(read(st->app[1], none, sizeof(none)), -1);
+
+    // it is still history, the next message refers to it.
+    msg[40] = '\0';
+    assert_true(peer_send(st, 1, msg));
+    pump(st);
+    app_expect(st, msg);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_negotiate, init, finish),
+        cmocka_unit_test_setup_teardown(test_lost, init, finish),
+        cmocka_unit_test_setup_teardown(test_dropped_history, init, finish),
+        cmocka_unit_test_setup_teardown(test_too_large, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
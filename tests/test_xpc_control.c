@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_topology.h>
+#include <xpc_control.h>
+#include <xpc_limit.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char dir[64];
+    char file[128];
+    xpc_topology_t *topo;
+    xpc_router_t *xpc;
+    xpc_control_t *ctl;
+    // the last fd the router asked to watch, and to forget.
+    int watched;
+    int forgotten;
+} control_state_t;
+
+static const char *names[] = {"topology", "a", "b", "c", "ctl"};
+
+static int watch_fd(void *ctx, int fd) {
+    ((control_state_t *)ctx)->watched = fd;
+    return 0;
+}
+
+static int forget_fd(void *ctx, int fd) {
+    ((control_state_t *)ctx)->forgotten = fd;
+    return 0;
+}
+
+static int init(void **state) {
+    control_state_t *st = calloc(1, sizeof(control_state_t));
+    char path[128];
+    if(st == NULL) {
+        return -1;
+    }
+    strcpy(st->dir, "/tmp/test_xpc_control.XXXXXX");
+    if(mkdtemp(st->dir) == NULL) {
+        free(st);
+        return -1;
+    }
+    snprintf(st->file, sizeof(st->file), "%s/topology", st->dir);
+    FILE *f = fopen(st->file, "w");
+    if(f == NULL) {
+        return -1;
+    }
+    fprintf(f,
+        "fifo a path=%1$s/a mode=rd\n"
+        "fifo b path=%1$s/b mode=rdwr\n"
+        "fifo c path=%1$s/c mode=wr\n"
+        "route b:5 -> c:5\n", st->dir
+    );
+    fclose(f);
+    st->topo = xpc_topology_load(st->file);
+    if(st->topo == NULL || xpc_topology_open(st->topo) != 0) {
+        return -1;
+    }
+    st->xpc = xpc_topology_build_router(st->topo);
+    if(st->xpc == NULL) {
+        return -1;
+    }
+    st->xpc->io_event_context = st;
+    st->xpc->io_watch_fd_cb = watch_fd;
+    st->xpc->io_forget_fd_cb = forget_fd;
+    st->watched = -1;
+    st->forgotten = -1;
+    snprintf(path, sizeof(path), "%s/ctl", st->dir);
+    st->ctl = create_xpc_control(st->xpc, st->topo, path);
+    if(st->ctl == NULL) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    control_state_t *st = *state;
+    char path[128];
+    xpc_control_free(st->ctl);
+    xpc_router_destroy(st->xpc);
+    xpc_topology_free(st->topo);
+    for(int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", st->dir, names[i]);
+        unlink(path);
+    }
+    rmdir(st->dir);
+    free(st);
+    return 0;
+}
+
+static int exec(control_state_t *st, const char *cmds, char *reply) {
+    char buf[XPC_CONTROL_CMD_MAX];
+    strcpy(buf, cmds);
+    return xpc_control_exec(st->ctl, buf, reply, XPC_CONTROL_REPLY_MAX);
+}
+
+static int open_peer(control_state_t *st, const char *name, int flags) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", st->dir, name);
+    int fd = open(path, flags | O_NONBLOCK);
+    assert_true(fd != -1);
+    return fd;
+}
+
+static void test_exec(void **state) {
+    control_state_t *st = *state;
+    static char reply[XPC_CONTROL_REPLY_MAX];
+    uint8_t wire[sizeof(txpc_hdr_t) + 8];
+    txpc_hdr_t hdr = {.to = 1, .from = 5, .type = 0, .size = 4};
+    int a = xpc_topology_find(st->topo, "a")->fd;
+    int b = xpc_topology_find(st->topo, "b")->fd;
+
+    assert_int_equal(exec(st, "list\n", reply), 0);
+    assert_string_equal(reply, "ok\nb:5 -> c:5 msgs=0 bytes=0 drops=0\n");
+
+    // a was not an input before, it is watched once routed from.
+    assert_int_equal(exec(st, "# comment\nroute a:1 -> b:2 no_coalesce cut_through weight=2\n", reply), 0);
+    assert_string_equal(reply, "ok\n");
+    assert_int_equal(st->watched, a);
+    assert_non_null(hashmap_fetch(st->xpc->out_contexts, b));
+
+    int a_peer = open_peer(st, "a", O_WRONLY);
+    int b_peer = open_peer(st, "b", O_RDONLY);
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), "ping", 4);
+    assert_int_equal(write(a_peer, wire, sizeof(wire) - 4), sizeof(wire) - 4);
+    while(xpc_accumulate_msg(st->xpc, a) > 0);
+    while(xpc_write_msg(st->xpc, b) > 0);
+    assert_int_equal(read(b_peer, wire, sizeof(wire)), sizeof(txpc_hdr_t) + 4);
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, wire);
+    assert_int_equal(hdr.to, 2);
+
+    // one invalid command and nothing is applied.
+    const char *bad[] = {
+        "route a:1 -> c:3\nunroute a:9\n",
+        "route a:0 -> b:1\n",
+        "route c:1 -> b:1\n",
+        "route a:1 -> x:1\n",
+        "route a:1 -> b:1 fast\n",
+        "route a:1 -> b:1 weight=0\n",
+        "route a:1 -> b:1 sample=x\n",
+        "route a:1 -> b:1 burst=4\n",
+        "route a:1\n",
+        "unroute a:1 b:1\n",
+        "frobnicate\n",
+    };
+    for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        assert_int_equal(exec(st, bad[i], reply), -1);
+        assert_memory_equal(reply, "error: ", strlen("error: "));
+    }
+    assert_int_equal(exec(st, "unroute b:5\nlist", reply), 0);
+    assert_string_equal(reply,
+        "ok\na:1 -> b:2 no_coalesce cut_through weight=2 msgs=1 bytes=14 drops=0\n");
+    // c had no other route, and nothing was waiting for it.
+    assert_null(hashmap_fetch(st->xpc->out_contexts,
+        xpc_topology_find(st->topo, "c")->fd));
+
+    // commands apply in order, a route added earlier can be removed.
+    assert_int_equal(exec(st, "route a:7 -> c:7\nunroute a:7\nlist\n", reply), 0);
+    assert_string_equal(reply,
+        "ok\na:1 -> b:2 no_coalesce cut_through weight=2 msgs=1 bytes=14 drops=0\n");
+
+    // limits are set like the other flags, and removed when left out.
+    xpc_limit_stats_t limit;
+    assert_int_equal(exec(st, "route a:8 -> b:8 sample=4 rate_msgs=10\n", reply), 0);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, a, 8, &limit), 0);
+    assert_int_equal(exec(st, "route a:8 -> b:8\n", reply), 0);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, a, 8, &limit), -1);
+    assert_int_equal(exec(st, "unroute a:8\n", reply), 0);
+
+    close(a_peer);
+    close(b_peer);
+}
+
+static void test_socket(void **state) {
+    control_state_t *st = *state;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char reply[256] = {0};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ctl", st->dir);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert_int_equal(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    // the listener was watched when the control socket was created.
+    int lfd = st->watched;
+    assert_true(xpc_control_owns(st->ctl, lfd));
+    assert_int_equal(xpc_control_recv(st->ctl, lfd), 0);
+    int conn = st->watched;
+    assert_true(conn != lfd);
+    assert_true(xpc_control_owns(st->ctl, conn));
+    assert_false(xpc_control_owns(st->ctl, xpc_topology_find(st->topo, "a")->fd));
+
+    assert_int_equal(send(fd, "list", 4, 0), 4);
+    assert_int_equal(xpc_control_recv(st->ctl, conn), 4);
+    assert_true(recv(fd, reply, sizeof(reply) - 1, 0) > 0);
+    assert_string_equal(reply, "ok\nb:5 -> c:5 msgs=0 bytes=0 drops=0\n");
+
+    close(fd);
+    assert_int_equal(xpc_control_recv(st->ctl, conn), 0);
+    assert_int_equal(st->forgotten, conn);
+    assert_false(xpc_control_owns(st->ctl, conn));
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_exec, init, finish),
+        cmocka_unit_test_setup_teardown(test_socket, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_credit.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define WINDOW 64
+// each message sent by the tests, header included.
+#define MSG_LEN (sizeof(txpc_hdr_t) + 16)
+
+typedef struct {
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads and grants on sv[0].
+    int sv[2];
+    // the output, the router writes p[1].
+    int p[2];
+} credit_state_t;
+
+static const xpc_hdr_codec_t *codec(void) {
+    return xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+}
+
+static int init(void **state) {
+    credit_state_t *st = calloc(1, sizeof(credit_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0
+            || pipe2(st->p, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->sv[0], st->p[1], 1, 1) != 0
+            || xpc_set_credit_window(st->xpc, st->p[1], WINDOW) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    credit_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->p[0]);
+    close(st->p[1]);
+    free(st);
+    return 0;
+}
+
+static void send_credit_neg(credit_state_t *st, int enable) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 1];
+    txpc_hdr_t hdr = {.to = 0, .from = 0, .type = XPC_NEG_TYPE_CREDIT, .size = 0};
+    int len = sizeof(txpc_hdr_t);
+    if(enable != -1) {
+        hdr.size = 1;
+        wire[len++] = enable;
+    }
+    codec()->encode(wire, &hdr);
+    assert_int_equal(write(st->sv[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+}
+
+static void send_msgs(credit_state_t *st, int n) {
+    uint8_t wire[MSG_LEN];
+    txpc_hdr_t hdr = {
+        .to = 1, .from = 1, .type = 0, .size = MSG_LEN - sizeof(txpc_hdr_t)
+    };
+    codec()->encode(wire, &hdr);
+    memset(wire + sizeof(txpc_hdr_t), 'x', hdr.size);
+    for(int i = 0; i < n; i++) {
+        assert_int_equal(write(st->sv[1], wire, MSG_LEN), MSG_LEN);
+    }
+    while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+}
+
+/**
+ * Read what the router wrote to the output.
+ * @return the number of bytes.
+ */
+static int drain_output(credit_state_t *st) {
+    uint8_t buf[1024];
+    while(xpc_write_msg(st->xpc, st->p[1]) > 0);
+    int n = read(st->p[0], buf, sizeof(buf));
+    return (n < 0) ? 0:n;
+}
+
+/**
+ * Write the grants queued for the sender, and check it got exactly one.
+ * @return the bytes granted on channel 1.
+ */
+static uint32_t expect_grant(credit_state_t *st) {
+    uint8_t wire[sizeof(txpc_hdr_t) + XPC_CREDIT_GRANT_SIZE];
+    uint16_t chn = 0;
+    uint32_t bytes = 0;
+    txpc_hdr_t hdr;
+    while(xpc_write_msg(st->xpc, st->sv[0]) > 0);
+    assert_int_equal(read(st->sv[1], wire, sizeof(wire)), sizeof(wire));
+    codec()->decode(&hdr, wire);
+    assert_int_equal(hdr.to, 0);
+    assert_int_equal(hdr.type, XPC_NEG_TYPE_CREDIT);
+    assert_int_equal(hdr.size, XPC_CREDIT_GRANT_SIZE);
+    assert_int_equal(xpc_credit_decode(
+        wire + sizeof(txpc_hdr_t), hdr.size, XPC_HOST_BIG_ENDIAN, &chn, &bytes, 1), 1);
+    assert_int_equal(chn, 1);
+    return bytes;
+}
+
+static xpc_route_t *route(credit_state_t *st) {
+    xpc_switch_tbl_entry_t key = {.fd = st->sv[0], .to_chn = 1};
+    return hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+}
+
+static void test_grant(void **state) {
+    credit_state_t *st = *state;
+    // no grant before the sender asks.
+    xpc_router_poll(st->xpc);
+    while(xpc_write_msg(st->xpc, st->sv[0]) > 0);
+    assert_null(hashmap_fetch(st->xpc->out_contexts, st->sv[0]));
+
+    send_credit_neg(st, -1);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(expect_grant(st), WINDOW);
+
+    // two messages fit, the third overruns the credit.
+    send_msgs(st, 3);
+    assert_int_equal(route(st)->stats.msgs, 2);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_QUEUE_FULL], 1);
+
+    // nothing is granted while the output holds the window.
+    xpc_router_poll(st->xpc);
+    while(xpc_write_msg(st->xpc, st->sv[0]) > 0);
+    uint8_t buf[16];
+    assert_int_equal(read(st->sv[1], buf, sizeof(buf)), -1);
+
+    // once it drained, the credit is topped up to the window.
+    assert_int_equal(drain_output(st), 2 * MSG_LEN);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(expect_grant(st), 2 * MSG_LEN);
+    assert_int_equal(route(st)->credit, WINDOW);
+}
+
+static void test_disable(void **state) {
+    credit_state_t *st = *state;
+    send_credit_neg(st, 1);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(expect_grant(st), WINDOW);
+
+    send_credit_neg(st, 0);
+    send_msgs(st, 4);
+    assert_int_equal(route(st)->stats.drops[XPC_DROP_QUEUE_FULL], 0);
+    assert_int_equal(drain_output(st), 4 * MSG_LEN);
+    xpc_router_poll(st->xpc);
+    while(xpc_write_msg(st->xpc, st->sv[0]) > 0);
+    uint8_t buf[16];
+    assert_int_equal(read(st->sv[1], buf, sizeof(buf)), -1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_grant, init, finish),
+        cmocka_unit_test_setup_teardown(test_disable, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <xpc_hist.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+static void test_buckets(void **state) {
+    // small values are exact.
+    for(uint64_t v = 0; v < (1 << XPC_HIST_SUB_BITS); v++) {
+        assert_int_equal(xpc_hist_bucket(v), v);
+        assert_int_equal(xpc_hist_highest_equivalent(v), v);
+    }
+    // buckets never go backwards, and are never wider than the precision.
+    int last = 0;
+    for(uint64_t v = 1; v < (1ull << XPC_HIST_MAX_BITS); v += v / 7 + 1) {
+        int bucket = xpc_hist_bucket(v);
+        assert_true(bucket >= last);
+        assert_true(bucket < XPC_HIST_BUCKETS);
+        uint64_t high = xpc_hist_highest_equivalent(v);
+        assert_true(high >= v);
+        assert_true(high - v <= v >> XPC_HIST_SUB_BITS);
+        assert_int_equal(xpc_hist_bucket(high), bucket);
+        assert_int_equal(xpc_hist_bucket(high + 1), bucket + 1);
+        last = bucket;
+    }
+    assert_int_equal(xpc_hist_bucket(UINT64_MAX), XPC_HIST_BUCKETS - 1);
+}
+
+static void test_percentiles(void **state) {
+    xpc_hist_t *h = create_xpc_hist();
+    assert_non_null(h);
+    assert_int_equal(xpc_hist_percentile(h, 50.0), 0);
+
+    // 1..1000 microseconds.
+    for(uint64_t i = 1; i <= 1000; i++) {
+        xpc_hist_record(h, i * 1000);
+    }
+    assert_int_equal(h->count, 1000);
+    assert_int_equal(h->min, 1000);
+    assert_int_equal(h->max, 1000000);
+    uint64_t p50 = xpc_hist_percentile(h, 50.0);
+    assert_true(p50 >= 500000 && p50 <= 500000 + (500000 >> XPC_HIST_SUB_BITS));
+    uint64_t p99 = xpc_hist_percentile(h, 99.0);
+    assert_true(p99 >= 990000 && p99 <= 1000000);
+    // percentiles are never past the largest value recorded.
+    assert_int_equal(xpc_hist_percentile(h, 100.0), 1000000);
+
+    // one outlier in 1001 values only shows above p99.9.
+    xpc_hist_record(h, 50000000);
+    assert_int_equal(
+        xpc_hist_percentile(h, 99.9), xpc_hist_highest_equivalent(1000000)
+    );
+    assert_int_equal(xpc_hist_percentile(h, 99.99), 50000000);
+
+    xpc_hist_reset(h);
+    assert_int_equal(h->count, 0);
+    assert_int_equal(xpc_hist_percentile(h, 99.0), 0);
+    free(h);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_buckets),
+        cmocka_unit_test(test_percentiles),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
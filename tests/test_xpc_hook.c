@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_hook.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads sv[0] and writes a[1] and b[1].
+    int sv[2];
+    int a[2];
+    int b[2];
+} hook_state_t;
+
+// what the hook of the tests does, by message type.
+enum {
+    TYPE_UPPER = 1,
+    TYPE_DROP,
+    TYPE_REWRITE,
+    TYPE_REDIRECT_B,
+    TYPE_REDIRECT_A,
+    TYPE_FANOUT,
+};
+
+typedef struct {
+    int dst_fd;
+    int calls;
+} test_hook_state_t;
+
+static int test_hook_fini_calls = 0;
+
+static int test_hook_init(const char *arg, void **state) {
+    if(arg == NULL || !strcmp(arg, "fail")) {
+        return -1;
+    }
+    test_hook_state_t *st = calloc(1, sizeof(test_hook_state_t));
+    st->dst_fd = atoi(arg);
+    *state = st;
+    return 0;
+}
+
+static void test_hook_fini(void *state) {
+    test_hook_fini_calls++;
+    free(state);
+}
+
+static xpc_hook_verdict_t test_hook_fn(void *state, xpc_hook_msg_t *msg) {
+    test_hook_state_t *st = state;
+    st->calls++;
+    switch(msg->hdr.type) {
+        case TYPE_UPPER:
+            for(int i = 0; i < msg->hdr.size; i++) {
+                msg->payload[i] = toupper(msg->payload[i]);
+            }
+            return XPC_HOOK_PASS;
+        case TYPE_DROP:
+            return XPC_HOOK_DROP;
+        case TYPE_REWRITE:
+            msg->hdr.to = 7;
+            msg->hdr.type = 9;
+            msg->hdr.size = 2;
+            return XPC_HOOK_REWRITE;
+        case TYPE_REDIRECT_B:
+            msg->dst[msg->ndst++] = (xpc_switch_tbl_entry_t){st->dst_fd, 5};
+            return XPC_HOOK_REDIRECT;
+        case TYPE_REDIRECT_A:
+            msg->dst[msg->ndst++] = (xpc_switch_tbl_entry_t){msg->route.fd, 6};
+            return XPC_HOOK_REDIRECT;
+        case TYPE_FANOUT:
+            msg->dst[msg->ndst++] = (xpc_switch_tbl_entry_t){st->dst_fd, 8};
+            // not an output, only counted.
+            msg->dst[msg->ndst++] = (xpc_switch_tbl_entry_t){-1, 8};
+            return XPC_HOOK_FANOUT;
+    }
+    return XPC_HOOK_PASS;
+}
+
+// looked up by xpc_hook_load, the test is linked with -rdynamic.
+const xpc_hook_def_t test_hook_def = {
+    .abi = XPC_HOOK_ABI,
+    .init = test_hook_init,
+    .fn = test_hook_fn,
+    .fini = test_hook_fini,
+};
+
+const xpc_hook_def_t test_hook_old_abi = {
+    .abi = XPC_HOOK_ABI + 1,
+    .fn = test_hook_fn,
+};
+
+static int init(void **state) {
+    hook_state_t *st = calloc(1, sizeof(hook_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0
+            || pipe2(st->a, O_NONBLOCK) != 0 || pipe2(st->b, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->sv[0], st->a[1], 1, 1) != 0
+            || xpc_set_route(st->xpc, st->sv[0], st->b[1], 2, 2) != 0) {
+        return -1;
+    }
+    test_hook_fini_calls = 0;
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    hook_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->a[0]);
+    close(st->a[1]);
+    close(st->b[0]);
+    close(st->b[1]);
+    free(st);
+    return 0;
+}
+
+static void send_msg(hook_state_t *st, int to, int type, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    int len = strlen(payload);
+    txpc_hdr_t hdr = {.to = to, .from = 3, .type = type, .size = len};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, len);
+    len += sizeof(txpc_hdr_t);
+    assert_int_equal(write(st->sv[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+}
+
+/**
+ * Write what is queued for an output, and check the next message it wrote.
+ */
+static void expect_msg(
+        hook_state_t *st, int *p, int to, int type, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    txpc_hdr_t hdr;
+    int len = strlen(payload);
+    while(xpc_write_msg(st->xpc, p[1]) > 0);
+    assert_int_equal(read(p[0], wire, sizeof(txpc_hdr_t)), sizeof(txpc_hdr_t));
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, wire);
+    assert_int_equal(hdr.to, to);
+    assert_int_equal(hdr.from, 3);
+    assert_int_equal(hdr.type, type);
+    assert_int_equal(hdr.size, len);
+    assert_int_equal(read(p[0], wire, len), len);
+    assert_memory_equal(wire, payload, len);
+}
+
+static void expect_empty(hook_state_t *st, int *p) {
+    uint8_t byte;
+    while(xpc_write_msg(st->xpc, p[1]) > 0);
+    assert_int_equal(read(p[0], &byte, 1), -1);
+}
+
+static void test_verdicts(void **state) {
+    hook_state_t *st = *state;
+    char arg[16];
+    xpc_hook_stats_t stats;
+    snprintf(arg, sizeof(arg), "%d", st->b[1]);
+    xpc_hook_t *hook = xpc_hook_create(&test_hook_def, arg);
+    assert_non_null(hook);
+    assert_int_equal(xpc_set_route_hook(st->xpc, st->sv[0], 3, hook), -1);
+    assert_int_equal(xpc_set_route_hook(st->xpc, st->sv[0], 1, hook), 0);
+    assert_int_equal(xpc_hook_get_stats(st->xpc, st->sv[0], 2, &stats), -1);
+
+    // changed in place.
+    send_msg(st, 1, TYPE_UPPER, "ping");
+    expect_msg(st, st->a, 1, TYPE_UPPER, "PING");
+    send_msg(st, 1, TYPE_DROP, "ping");
+    expect_empty(st, st->a);
+    assert_int_equal(xpc_get_drop_count(st->xpc, st->sv[0], 1), 1);
+    send_msg(st, 1, TYPE_REWRITE, "ping");
+    expect_msg(st, st->a, 7, 9, "pi");
+
+    // redirected off the output of the route, and onto another channel.
+    send_msg(st, 1, TYPE_REDIRECT_B, "ping");
+    expect_empty(st, st->a);
+    expect_msg(st, st->b, 5, TYPE_REDIRECT_B, "ping");
+    send_msg(st, 1, TYPE_REDIRECT_A, "ping");
+    expect_msg(st, st->a, 6, TYPE_REDIRECT_A, "ping");
+
+    send_msg(st, 1, TYPE_FANOUT, "ping");
+    expect_msg(st, st->a, 1, TYPE_FANOUT, "ping");
+    expect_msg(st, st->b, 8, TYPE_FANOUT, "ping");
+
+    // the other route has no hook.
+    send_msg(st, 2, TYPE_DROP, "pong");
+    expect_msg(st, st->b, 2, TYPE_DROP, "pong");
+
+    assert_int_equal(xpc_hook_get_stats(st->xpc, st->sv[0], 1, &stats), 0);
+    assert_int_equal(stats.verdicts[XPC_HOOK_PASS], 1);
+    assert_int_equal(stats.verdicts[XPC_HOOK_DROP], 1);
+    assert_int_equal(stats.verdicts[XPC_HOOK_REWRITE], 1);
+    assert_int_equal(stats.verdicts[XPC_HOOK_REDIRECT], 2);
+    assert_int_equal(stats.verdicts[XPC_HOOK_FANOUT], 1);
+    assert_int_equal(stats.copies, 2);
+    assert_int_equal(stats.copies_dropped, 1);
+
+    xpc_switch_tbl_entry_t key = {.fd = st->sv[0], .to_chn = 1};
+    xpc_route_t *route = hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+    assert_int_equal(route->stats.msgs, 4);
+    assert_int_equal(route->stats.drops[XPC_DROP_FILTERED], 1);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, st->sv[0]);
+    assert_int_equal(in_ctx->rx.msgs, 7);
+
+    // the hook goes with its route.
+    assert_int_equal(xpc_remove_route(st->xpc, st->sv[0], 1), 0);
+    assert_int_equal(test_hook_fini_calls, 1);
+}
+
+static void test_cut_through(void **state) {
+    hook_state_t *st = *state;
+    char arg[16];
+    snprintf(arg, sizeof(arg), "%d", st->b[1]);
+    assert_int_equal(
+        xpc_set_route_flags(st->xpc, st->sv[0], 1, XPC_ROUTE_CUT_THROUGH), 0
+    );
+    assert_int_equal(xpc_set_route_hook(
+        st->xpc, st->sv[0], 1, xpc_hook_create(&test_hook_def, arg)), 0
+    );
+    // nothing was written before the hook ran.
+    send_msg(st, 1, TYPE_DROP, "ping");
+    expect_empty(st, st->a);
+    send_msg(st, 1, TYPE_UPPER, "ping");
+    expect_msg(st, st->a, 1, TYPE_UPPER, "PING");
+}
+
+static void test_load(void **state) {
+    hook_state_t *st = *state;
+    char arg[16];
+    xpc_hook_stats_t stats;
+    snprintf(arg, sizeof(arg), "%d", st->b[1]);
+    assert_null(xpc_hook_load(NULL, "test_hook_missing", arg));
+    assert_null(xpc_hook_load(NULL, "test_hook_old_abi", arg));
+    assert_null(xpc_hook_load(NULL, "test_hook_def", "fail"));
+    assert_null(xpc_hook_load("/nonexistent/hook.so", "test_hook_def", arg));
+    assert_null(xpc_hook_create(&test_hook_old_abi, arg));
+
+    xpc_hook_t *hook = xpc_hook_load(NULL, "test_hook_def", arg);
+    assert_non_null(hook);
+    assert_int_equal(xpc_set_route_hook(st->xpc, st->sv[0], 2, hook), 0);
+    send_msg(st, 2, TYPE_UPPER, "pong");
+    expect_msg(st, st->b, 2, TYPE_UPPER, "PONG");
+    assert_int_equal(xpc_hook_get_stats(st->xpc, st->sv[0], 2, &stats), 0);
+    assert_int_equal(stats.verdicts[XPC_HOOK_PASS], 1);
+
+    // replacing or removing a hook frees it.
+    assert_int_equal(xpc_set_route_hook(st->xpc, st->sv[0], 2, NULL), 0);
+    assert_int_equal(test_hook_fini_calls, 1);
+    send_msg(st, 2, TYPE_UPPER, "pong");
+    expect_msg(st, st->b, 2, TYPE_UPPER, "pong");
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_verdicts, init, finish),
+        cmocka_unit_test_setup_teardown(test_cut_through, init, finish),
+        cmocka_unit_test_setup_teardown(test_load, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
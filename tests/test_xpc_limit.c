@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_limit.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads sv[0] and writes p[1].
+    int sv[2];
+    int p[2];
+} limit_state_t;
+
+static int init(void **state) {
+    limit_state_t *st = calloc(1, sizeof(limit_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0
+            || pipe2(st->p, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL || xpc_set_route(st->xpc, st->sv[0], st->p[1], 1, 1) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    limit_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->p[0]);
+    close(st->p[1]);
+    free(st);
+    return 0;
+}
+
+static void send_msg(limit_state_t *st, int type, int size) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 256] = {0};
+    txpc_hdr_t hdr = {.to = 1, .from = 3, .type = type, .size = size};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    int len = sizeof(txpc_hdr_t) + size;
+    assert_int_equal(write(st->sv[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+}
+
+/**
+ * Write what is queued, and read back the types of the messages forwarded.
+ * @return the number of messages forwarded.
+ */
+static int recv_types(limit_state_t *st, int *types, int max) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 256];
+    txpc_hdr_t hdr;
+    int n = 0;
+    while(xpc_write_msg(st->xpc, st->p[1]) > 0);
+    while(n < max && read(st->p[0], wire, sizeof(txpc_hdr_t)) == sizeof(txpc_hdr_t)) {
+        xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, wire);
+        assert_int_equal(read(st->p[0], wire, hdr.size), hdr.size);
+        types[n++] = hdr.type;
+    }
+    return n;
+}
+
+static msg_queue_t *out_queue(limit_state_t *st) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->p[1]);
+    return out_ctx->msg_queue;
+}
+
+static void test_sample(void **state) {
+    limit_state_t *st = *state;
+    int types[16];
+    xpc_limit_stats_t stats;
+    xpc_limit_conf_t conf = {.sample = 3};
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 2, &conf), -1);
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &conf), 0);
+    for(int i = 0; i < 8; i++) {
+        send_msg(st, i, 16);
+    }
+    assert_int_equal(recv_types(st, types, 16), 3);
+    assert_int_equal(types[0], 0);
+    assert_int_equal(types[1], 3);
+    assert_int_equal(types[2], 6);
+
+    // messages left out never took a buffer.
+    msg_queue_t *queue = out_queue(st);
+    assert_int_equal(queue->pool_hits + queue->pool_misses, 3);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, st->sv[0], 1, &stats), 0);
+    assert_int_equal(stats.passed, 3);
+    assert_int_equal(stats.sampled, 5);
+    assert_int_equal(stats.limited, 0);
+    assert_int_equal(xpc_get_drop_count(st->xpc, st->sv[0], 1), 5);
+    xpc_switch_tbl_entry_t key = {.fd = st->sv[0], .to_chn = 1};
+    xpc_route_t *route = hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+    assert_int_equal(route->stats.msgs, 3);
+    assert_int_equal(route->stats.drops[XPC_DROP_SAMPLED], 5);
+
+    // the same limit keeps its place in the pattern, none removes it.
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &conf), 0);
+    send_msg(st, 8, 16);
+    send_msg(st, 9, 16);
+    assert_int_equal(recv_types(st, types, 16), 1);
+    assert_int_equal(types[0], 9);
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, NULL), 0);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, st->sv[0], 1, &stats), -1);
+    send_msg(st, 10, 16);
+    send_msg(st, 11, 16);
+    assert_int_equal(recv_types(st, types, 16), 2);
+}
+
+static void test_rate_msgs(void **state) {
+    limit_state_t *st = *state;
+    int types[16];
+    xpc_limit_stats_t stats;
+    xpc_limit_conf_t conf = {.rate = 50, .burst = 2};
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &conf), 0);
+    for(int i = 0; i < 5; i++) {
+        send_msg(st, i, 16);
+    }
+    // the bucket starts full.
+    assert_int_equal(recv_types(st, types, 16), 2);
+    assert_int_equal(types[0], 0);
+    assert_int_equal(types[1], 1);
+    // a token every 20ms.
+    usleep(30000);
+    send_msg(st, 5, 16);
+    send_msg(st, 6, 16);
+    assert_int_equal(recv_types(st, types, 16), 1);
+    assert_int_equal(types[0], 5);
+
+    assert_int_equal(xpc_limit_get_stats(st->xpc, st->sv[0], 1, &stats), 0);
+    assert_int_equal(stats.passed, 3);
+    assert_int_equal(stats.limited, 4);
+    xpc_switch_tbl_entry_t key = {.fd = st->sv[0], .to_chn = 1};
+    xpc_route_t *route = hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+    assert_int_equal(route->stats.drops[XPC_DROP_RATE_LIMITED], 4);
+
+    // a burst without a rate is refused.
+    xpc_limit_conf_t bad = {.burst = 2, .sample = 2};
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &bad), -1);
+}
+
+static void test_rate_bytes(void **state) {
+    limit_state_t *st = *state;
+    int types[16];
+    xpc_limit_stats_t stats;
+    const int hdr_len = sizeof(txpc_hdr_t);
+    xpc_limit_conf_t conf = {.rate = 1, .bytes = true, .burst = 2 * (hdr_len + 8)};
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &conf), 0);
+    // longer than the bucket is deep.
+    send_msg(st, 0, 2 * (hdr_len + 8));
+    send_msg(st, 1, 8);
+    send_msg(st, 2, 8);
+    send_msg(st, 3, 8);
+    assert_int_equal(recv_types(st, types, 16), 2);
+    assert_int_equal(types[0], 1);
+    assert_int_equal(types[1], 2);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, st->sv[0], 1, &stats), 0);
+    assert_int_equal(stats.passed, 2);
+    assert_int_equal(stats.limited, 2);
+    // the stream stayed aligned on the messages it skipped.
+    assert_int_equal(xpc_get_drop_count(st->xpc, st->sv[0], 1), 2);
+}
+
+static void test_sample_then_rate(void **state) {
+    limit_state_t *st = *state;
+    int types[16];
+    xpc_limit_stats_t stats;
+    // sampled out messages do not use up tokens.
+    xpc_limit_conf_t conf = {.rate = 1, .burst = 2, .sample = 2};
+    assert_int_equal(xpc_set_route_limit(st->xpc, st->sv[0], 1, &conf), 0);
+    for(int i = 0; i < 6; i++) {
+        send_msg(st, i, 16);
+    }
+    assert_int_equal(recv_types(st, types, 16), 2);
+    assert_int_equal(types[0], 0);
+    assert_int_equal(types[1], 2);
+    assert_int_equal(xpc_limit_get_stats(st->xpc, st->sv[0], 1, &stats), 0);
+    assert_int_equal(stats.passed, 2);
+    assert_int_equal(stats.sampled, 3);
+    assert_int_equal(stats.limited, 1);
+}
+
+static void test_parse_flag(void **state) {
+    xpc_limit_conf_t conf = {0};
+    assert_int_equal(xpc_limit_parse_flag(&conf, "rate_msgs=100"), 0);
+    assert_int_equal(conf.rate, 100);
+    assert_false(conf.bytes);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "rate_bytes=0x1000"), 0);
+    assert_int_equal(conf.rate, 4096);
+    assert_true(conf.bytes);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "burst=8"), 0);
+    assert_int_equal(conf.burst, 8);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "sample=10"), 0);
+    assert_int_equal(conf.sample, 10);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "weight=2"), 1);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "sample=-1"), -1);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "burst=1x"), -1);
+    assert_int_equal(xpc_limit_parse_flag(&conf, "rate_msgs=4294967296"), -1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_sample, init, finish),
+        cmocka_unit_test_setup_teardown(test_rate_msgs, init, finish),
+        cmocka_unit_test_setup_teardown(test_rate_bytes, init, finish),
+        cmocka_unit_test_setup_teardown(test_sample_then_rate, init, finish),
+        cmocka_unit_test(test_parse_flag),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
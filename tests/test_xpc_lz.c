@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <xpc_lz.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    xpc_lz_t *tx;
+    xpc_lz_t *rx;
+} lz_pair_t;
+
+static int init(void **state) {
+    lz_pair_t *p = malloc(sizeof(lz_pair_t));
+    if(p == NULL) {
+        return -1;
+    }
+    p->tx = create_xpc_lz();
+    p->rx = create_xpc_lz();
+    if(p->tx == NULL || p->rx == NULL) {
+        return -1;
+    }
+    *state = p;
+    return 0;
+}
+
+static int finish(void **state) {
+    lz_pair_t *p = *state;
+    xpc_lz_free(p->tx);
+    xpc_lz_free(p->rx);
+    free(p);
+    return 0;
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * Send a payload through both ends, and check it arrives unchanged.
+ * @return the bytes sent for it, or -1 if it was sent as it is.
+ */
+static int pass(lz_pair_t *p, const uint8_t *src, int len) {
+    const uint8_t *packed = NULL;
+    const uint8_t *raw = NULL;
+    int n = xpc_lz_compress(p->tx, src, len, &packed);
+    if(n < 0) {
+        xpc_lz_append(p->rx, src, len);
+        return -1;
+    }
+    assert_true(n < len);
+    assert_int_equal(xpc_lz_decompress(p->rx, packed, n, &raw), len);
+    assert_memory_equal(raw, src, len);
+    return n;
+}
+
+static int telemetry(char *dst, int seq) {
+    return sprintf(dst,
+        "{\"seq\": %d, \"imu\": {\"ax\": %d, \"ay\": %d, \"az\": 981}, "
+        "\"batt_mv\": %d, \"state\": \"cruise\"}", seq, seq % 7, -(seq % 5),
+        11800 - seq / 10);
+}
+
+static void test_roundtrip(void **state) {
+    lz_pair_t *p = *state;
+    char msg[256];
+    int raw_total = 0;
+    int wire_total = 0;
+    for(int i = 0; i < 1000; i++) {
+        int len = telemetry(msg, i);
+        int n = pass(p, (uint8_t *)msg, len);
+        raw_total += len;
+        wire_total += (n < 0) ? len:n;
+    }
+    // each message is much like the one before it.
+    assert_true(wire_total * 3 < raw_total);
+    assert_int_equal(p->tx->raw_bytes, raw_total);
+    assert_int_equal(p->tx->wire_bytes, wire_total);
+    assert_int_equal(p->rx->wire_bytes, wire_total);
+}
+
+static void test_dictionary(void **state) {
+    lz_pair_t *p = *state;
+    uint8_t msg[48];
+    uint64_t rng = 1;
+    for(int i = 0; i < sizeof(msg); i++) {
+        msg[i] = xorshift64(&rng);
+    }
+    // too short and too random on its own, but not once it was seen.
+    assert_int_equal(pass(p, msg, sizeof(msg)), -1);
+    int n = pass(p, msg, sizeof(msg));
+    assert_true(n > 0 && n < 8);
+    // shorter than XPC_LZ_MIN_PAYLOAD, sent as is, still history.
+    assert_int_equal(pass(p, msg, 4), -1);
+
+    // both ends start over together.
+    xpc_lz_reset(p->tx);
+    xpc_lz_reset(p->rx);
+    assert_int_equal(pass(p, msg, sizeof(msg)), -1);
+}
+
+static void test_incompressible(void **state) {
+    lz_pair_t *p = *state;
+    uint8_t msg[512];
+    uint64_t rng = 7;
+    // the codec backs off, and both ends stay in step meanwhile.
+    for(int i = 0; i < 64; i++) {
+        for(int j = 0; j < sizeof(msg); j++) {
+            msg[j] = xorshift64(&rng);
+        }
+        assert_int_equal(pass(p, msg, sizeof(msg)), -1);
+    }
+    assert_true(p->tx->skip > 0 || p->tx->misses > 0);
+    assert_int_equal(p->tx->wire_bytes, p->tx->raw_bytes);
+
+    // once it is attempted again, repeating data compresses.
+    memset(msg, 'a', sizeof(msg));
+    int n = -1;
+    for(int i = 0; i < 16 && n < 0; i++) {
+        n = pass(p, msg, sizeof(msg));
+    }
+    assert_true(n > 0);
+    assert_int_equal(p->tx->misses, 0);
+}
+
+static void test_window(void **state) {
+    lz_pair_t *p = *state;
+    static uint8_t msg[XPC_LZ_MAX_PAYLOAD + 1];
+    uint64_t rng = 3;
+    // long payloads of a few words, the history is cut down many times.
+    const char *words[] = {"alpha ", "bravo ", "charlie ", "delta ", "echo "};
+    for(int i = 0; i < 20; i++) {
+        int len = 0;
+        int max = (i % 2) ? 300:40000;
+        while(len < max - 8) {
+            const char *w = words[xorshift64(&rng) % 5];
+            memcpy(msg + len, w, strlen(w));
+            len += strlen(w);
+        }
+        assert_true(pass(p, msg, len) > 0);
+    }
+    // the longest payload goes through, anything longer is not history.
+    memset(msg, 'z', sizeof(msg));
+    assert_true(pass(p, msg, XPC_LZ_MAX_PAYLOAD) > 0);
+    int hist = p->tx->hist_len;
+    assert_int_equal(pass(p, msg, sizeof(msg)), -1);
+    assert_int_equal(p->tx->hist_len, hist);
+    assert_int_equal(p->rx->hist_len, hist);
+    assert_true(pass(p, msg, 100) > 0);
+}
+
+static void test_corrupt(void **state) {
+    lz_pair_t *p = *state;
+    const uint8_t *raw = NULL;
+    // the length, a sequence of 1 literal and a match reaching too far back.
+    const uint8_t far[] = {5, 0x10, 'a', 0x02, 0x00};
+    // literals past the end of the payload.
+    const uint8_t truncated[] = {5, 0x50, 'a', 'b'};
+    // a literal left over after the length was reached.
+    const uint8_t trailing[] = {1, 0x10, 'a', 'b'};
+    // no end to the length.
+    const uint8_t endless[] = {0x80, 0x80};
+    assert_int_equal(xpc_lz_decompress(p->rx, far, sizeof(far), &raw), -1);
+    assert_int_equal(xpc_lz_decompress(p->rx, truncated, sizeof(truncated), &raw), -1);
+    assert_int_equal(xpc_lz_decompress(p->rx, trailing, sizeof(trailing), &raw), -1);
+    assert_int_equal(xpc_lz_decompress(p->rx, endless, sizeof(endless), &raw), -1);
+
+    // a match may overlap its own output.
+    const uint8_t run[] = {9, 0x14, 'x', 0x01, 0x00, 0x00};
+    assert_int_equal(xpc_lz_decompress(p->rx, run, sizeof(run), &raw), 9);
+    assert_memory_equal(raw, "xxxxxxxxx", 9);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_roundtrip, init, finish),
+        cmocka_unit_test_setup_teardown(test_dictionary, init, finish),
+        cmocka_unit_test_setup_teardown(test_incompressible, init, finish),
+        cmocka_unit_test_setup_teardown(test_window, init, finish),
+        cmocka_unit_test_setup_teardown(test_corrupt, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_capture.h>
+#include <xpc_pipeline.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    xpc_router_t *xpc;
+    int a[2];
+    int b[2];
+    int out[2];
+} pipeline_state_t;
+
+static const xpc_hdr_codec_t *host_codec(void) {
+    return xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN);
+}
+
+static void send_msg(int fd, int to, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    txpc_hdr_t hdr = {.to = to, .from = 7, .type = 0, .size = strlen(payload)};
+    host_codec()->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, hdr.size);
+    int len = sizeof(txpc_hdr_t) + hdr.size;
+    assert_int_equal(write(fd, wire, len), len);
+}
+
+/**
+ * Read exactly len bytes, waiting up to a second for each part.
+ */
+static int read_full(int fd, uint8_t *dst, int len) {
+    int got = 0;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while(got < len) {
+        if(poll(&pfd, 1, 1000) != 1) {
+            return got;
+        }
+        int n = read(fd, dst + got, len - got);
+        if(n > 0) {
+            got += n;
+        }
+    }
+    return got;
+}
+
+static void expect_msg(int fd, int to, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    txpc_hdr_t hdr;
+    int len = strlen(payload);
+    assert_int_equal(read_full(fd, wire, sizeof(txpc_hdr_t)), sizeof(txpc_hdr_t));
+    host_codec()->decode(&hdr, wire);
+    assert_int_equal(hdr.to, to);
+    assert_int_equal(hdr.from, 7);
+    assert_int_equal(hdr.size, len);
+    assert_int_equal(read_full(fd, wire, len), len);
+    assert_memory_equal(wire, payload, len);
+}
+
+static int init(void **state) {
+    pipeline_state_t *st = calloc(1, sizeof(pipeline_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || pipe2(st->a, O_NONBLOCK) != 0
+            || pipe2(st->b, O_NONBLOCK) != 0
+            || pipe2(st->out, O_NONBLOCK) != 0
+            || xpc_set_route(st->xpc, st->a[0], st->out[1], 1, 2) != 0
+            || xpc_set_route(st->xpc, st->a[0], st->out[1], 5, 6) != 0
+            || xpc_set_route(st->xpc, st->b[0], st->out[1], 3, 4) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    pipeline_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    int *fds[3] = {st->a, st->b, st->out};
+    for(int i = 0; i < 3; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    free(st);
+    return 0;
+}
+
+static void test_forward(void **state) {
+    pipeline_state_t *st = *state;
+    xpc_pipeline_t *pipe = create_xpc_pipeline(st->xpc, 0);
+    assert_non_null(pipe);
+    assert_int_equal(xpc_pipeline_start(pipe), 0);
+
+    // each input is read by its own thread, the order within one input holds.
+    send_msg(st->a[1], 1, "first");
+    expect_msg(st->out[0], 2, "first");
+    send_msg(st->b[1], 3, "other input");
+    expect_msg(st->out[0], 4, "other input");
+    send_msg(st->a[1], 5, "");
+    send_msg(st->a[1], 1, "last");
+    expect_msg(st->out[0], 6, "");
+    expect_msg(st->out[0], 2, "last");
+
+    xpc_pipeline_stop(pipe);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, st->a[0]);
+    assert_int_equal(in_ctx->rx.msgs, 3);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->out[1]);
+    assert_int_equal(out_ctx->tx.msgs, 4);
+    assert_int_equal(
+        out_ctx->tx.bytes, 4 * sizeof(txpc_hdr_t) + strlen("firstother inputlast")
+    );
+    assert_int_equal(xpc_get_route_latency(st->xpc, st->a[0], 1)->count, 2);
+    assert_int_equal(xpc_get_route_latency(st->xpc, st->b[0], 3)->count, 1);
+    xpc_pipeline_free(pipe);
+}
+
+static void test_drops(void **state) {
+    pipeline_state_t *st = *state;
+    // 64 bytes of ring take records of 28 bytes at most.
+    xpc_pipeline_t *pipe = create_xpc_pipeline(st->xpc, 64);
+    assert_non_null(pipe);
+    assert_int_equal(xpc_pipeline_start(pipe), 0);
+
+    send_msg(st->a[1], 9, "unrouted");
+    send_msg(st->a[1], 1, "this one is too large for the ring");
+    // a corrupt header is skipped, up to the next one.
+    uint8_t bad[sizeof(txpc_hdr_t)];
+    txpc_hdr_t bad_hdr = {.to = 1, .from = 7, .type = 0, .size = 0x7fffffff};
+    host_codec()->encode(bad, &bad_hdr);
+    assert_int_equal(write(st->a[1], bad, sizeof(bad)), sizeof(bad));
+    send_msg(st->a[1], 1, "ok");
+    expect_msg(st->out[0], 2, "ok");
+
+    xpc_pipeline_sync(pipe);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, st->a[0]);
+    assert_int_equal(in_ctx->rx.msgs, 1);
+    assert_int_equal(in_ctx->rx.drops[XPC_DROP_NO_ROUTE], 1);
+    assert_int_equal(in_ctx->rx.drops[XPC_DROP_NO_BUFFER], 1);
+    assert_int_equal(in_ctx->rx.drops[XPC_DROP_MALFORMED], 1);
+    assert_int_equal(in_ctx->resync_count, 1);
+    assert_int_equal(in_ctx->resync_skipped, sizeof(txpc_hdr_t));
+    xpc_pipeline_free(pipe);
+}
+
+static void test_pinned(void **state) {
+    pipeline_state_t *st = *state;
+    cpu_set_t set;
+    int cpu = 0;
+    assert_int_equal(sched_getaffinity(0, sizeof(set), &set), 0);
+    while(!CPU_ISSET(cpu, &set)) {
+        cpu++;
+    }
+    xpc_pipeline_t *pipe = create_xpc_pipeline(st->xpc, 0);
+    assert_non_null(pipe);
+    assert_int_equal(xpc_pipeline_set_cpu(pipe, st->a[0], false, cpu), 0);
+    assert_int_equal(xpc_pipeline_set_cpu(pipe, st->out[1], true, cpu), 0);
+    // there is no thread writing an input only.
+    assert_int_equal(xpc_pipeline_set_cpu(pipe, st->a[0], true, cpu), -1);
+    assert_int_equal(xpc_pipeline_start(pipe), 0);
+    send_msg(st->a[1], 1, "pinned");
+    expect_msg(st->out[0], 2, "pinned");
+    xpc_pipeline_free(pipe);
+
+    // a CPU which does not exist fails the start.
+    pipe = create_xpc_pipeline(st->xpc, 0);
+    assert_non_null(pipe);
+    assert_int_equal(xpc_pipeline_set_cpu(pipe, st->b[0], false, 1 << 20), 0);
+    assert_int_equal(xpc_pipeline_start(pipe), -1);
+    xpc_pipeline_free(pipe);
+}
+
+static void test_unsupported(void **state) {
+    pipeline_state_t *st = *state;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_xpc_pipeline.%d", getpid());
+    assert_null(create_xpc_pipeline(st->xpc, 1000));
+    assert_int_equal(xpc_capture_enable(st->xpc, path, 1 << 16), 0);
+    errno = 0;
+    assert_null(create_xpc_pipeline(st->xpc, 0));
+    assert_int_equal(errno, ENOTSUP);
+    unlink(path);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_forward, init, finish),
+        cmocka_unit_test_setup_teardown(test_drops, init, finish),
+        cmocka_unit_test_setup_teardown(test_pinned, init, finish),
+        cmocka_unit_test_setup_teardown(test_unsupported, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_endian.h>
+#include <xpc_resync.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+static int reference_find(
+        const xpc_resync_filter_t *f, const uint8_t *buf, int start, int limit) {
+    for(int i = start; i < limit; i++) {
+        uint8_t v = buf[i + f->filter_off];
+        if((f->value_set[v >> 6] >> (v & 63)) & 1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void test_filter_offset(void **state) {
+    xpc_resync_filter_t f;
+    txpc_hdr_t hdr = {0};
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    hdr.to = 0x2a;
+
+    for(int be = 0; be < 2; be++) {
+        const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(be);
+        xpc_resync_filter_init(&f, codec);
+        codec->encode(wire, &hdr);
+        // the filter byte is the low byte of the to-channel.
+        assert_int_equal(wire[f.filter_off], 0x2a);
+        // negotiation is always a candidate.
+        assert_int_equal(f.n_values, 1);
+        assert_int_equal(f.values[0], 0);
+    }
+}
+
+static void test_find_matches_reference(void **state) {
+    static uint8_t buf[8192];
+    xpc_resync_filter_t f;
+    srand(1234);
+    for(int i = 0; i < sizeof(buf); i++) {
+        buf[i] = rand() & 0xff;
+    }
+
+    // both the vector path and the table path are compared to a plain scan.
+    int value_counts[] = {1, 2, 5, XPC_RESYNC_MAX_VALUES, XPC_RESYNC_MAX_VALUES + 1, 40};
+    for(int c = 0; c < sizeof(value_counts) / sizeof(value_counts[0]); c++) {
+        xpc_resync_filter_init(&f, &xpc_hdr_codec_le);
+        while(f.n_values < value_counts[c]) {
+            xpc_resync_filter_add(&f, rand() & 0xff);
+        }
+        for(int trial = 0; trial < 500; trial++) {
+            int limit = sizeof(buf) - sizeof(txpc_hdr_t);
+            int start = rand() % limit;
+            int end = start + rand() % (limit - start + 1);
+            int pos = start;
+            // walk every candidate in the range.
+            while(true) {
+                int expected = reference_find(&f, buf, pos, end);
+                int found = xpc_resync_find(&f, buf, pos, end);
+                assert_int_equal(found, expected);
+                if(found < 0) {
+                    break;
+                }
+                pos = found + 1;
+            }
+        }
+    }
+}
+
+static void test_find_sparse(void **state) {
+    static uint8_t buf[1 << 16];
+    xpc_resync_filter_t f;
+    memset(buf, 0xff, sizeof(buf));
+    xpc_resync_filter_init(&f, &xpc_hdr_codec_le);
+    xpc_resync_filter_add(&f, 7);
+    int limit = sizeof(buf) - sizeof(txpc_hdr_t);
+    assert_int_equal(xpc_resync_find(&f, buf, 0, limit), -1);
+
+    buf[40000 + f.filter_off] = 7;
+    assert_int_equal(xpc_resync_find(&f, buf, 0, limit), 40000);
+    assert_int_equal(xpc_resync_find(&f, buf, 40001, limit), -1);
+    // the limit is exclusive.
+    assert_int_equal(xpc_resync_find(&f, buf, 0, 40000), -1);
+    assert_int_equal(xpc_resync_find(&f, buf, 0, 40001), 40000);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_filter_offset),
+        cmocka_unit_test(test_find_matches_reference),
+        cmocka_unit_test(test_find_sparse),
+    };
+
+    int r = cmocka_run_group_tests(tests, NULL, NULL);
+    return r;
+}
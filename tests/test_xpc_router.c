@@ -0,0 +1,734 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define FIELD_OFF(f) offsetof(txpc_hdr_t, f)
+#define FIELD_LEN(f) sizeof(((txpc_hdr_t *)0)->f)
+
+// build headers byte by byte, so the tests do not depend on the codecs.
+static void put_field(uint8_t *wire, size_t off, size_t len, uint64_t v, bool be) {
+    for(size_t i = 0; i < len; i++) {
+        int shift = 8 * (be ? (len - 1 - i):i);
+        wire[off + i] = (v >> shift) & 0xff;
+    }
+}
+
+static uint64_t get_field(uint8_t *wire, size_t off, size_t len, bool be) {
+    uint64_t v = 0;
+    for(size_t i = 0; i < len; i++) {
+        int shift = 8 * (be ? (len - 1 - i):i);
+        v |= (uint64_t)wire[off + i] << shift;
+    }
+    return v;
+}
+
+static void put_hdr(uint8_t *wire, int to, int from, int type, int size, bool be) {
+    put_field(wire, FIELD_OFF(to), FIELD_LEN(to), to, be);
+    put_field(wire, FIELD_OFF(from), FIELD_LEN(from), from, be);
+    put_field(wire, FIELD_OFF(type), FIELD_LEN(type), type, be);
+    put_field(wire, FIELD_OFF(size), FIELD_LEN(size), size, be);
+}
+
+static void send_msg(int fd, int to, int from, int type, const char *payload, bool be) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    int size = (payload == NULL) ? 0:strlen(payload);
+    put_hdr(wire, to, from, type, size, be);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, size);
+    assert_int_equal(write(fd, wire, sizeof(txpc_hdr_t) + size), sizeof(txpc_hdr_t) + size);
+}
+
+static void send_endianness(int fd, bool be) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 1];
+    put_hdr(wire, 0, 0, TXPC_NEG_TYPE_ENDIANNESS, 1, be);
+    wire[sizeof(txpc_hdr_t)] = be;
+    assert_int_equal(write(fd, wire, sizeof(wire)), sizeof(wire));
+}
+
+static void pump_input(xpc_router_t *xpc, int fd) {
+    while(xpc_accumulate_msg(xpc, fd) > 0);
+}
+
+/**
+ * Forward one message to fd, read it back from peer and check it.
+ */
+static void expect_msg(xpc_router_t *xpc, int fd, int peer, int to, int from,
+        int type, const char *payload, bool be) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 64] = {0};
+    int size = strlen(payload);
+    while(xpc_write_msg(xpc, fd) > 0);
+    assert_int_equal(read(peer, wire, sizeof(txpc_hdr_t) + size), sizeof(txpc_hdr_t) + size);
+    assert_int_equal(get_field(wire, FIELD_OFF(to), FIELD_LEN(to), be), to);
+    assert_int_equal(get_field(wire, FIELD_OFF(from), FIELD_LEN(from), be), from);
+    assert_int_equal(get_field(wire, FIELD_OFF(type), FIELD_LEN(type), be), type);
+    assert_int_equal(get_field(wire, FIELD_OFF(size), FIELD_LEN(size), be), size);
+    assert_memory_equal(wire + sizeof(txpc_hdr_t), payload, size);
+}
+
+static int init(void **state) {
+    *state = initialize_xpc_router();
+    assert_non_null(*state);
+    return 0;
+}
+
+static int finish(void **state) {
+    xpc_router_destroy(*state);
+    return 0;
+}
+
+static void test_codec_roundtrip(void **state) {
+    txpc_hdr_t hdr = {.to = 3, .from = 5, .type = 7, .size = 0x102};
+    txpc_hdr_t out;
+    uint8_t wire[sizeof(txpc_hdr_t)];
+    uint8_t expected[sizeof(txpc_hdr_t)];
+
+    for(int be = 0; be < 2; be++) {
+        const xpc_hdr_codec_t *codec = xpc_hdr_codec_select(be);
+        assert_int_equal(codec->big_endian, be);
+        codec->encode(wire, &hdr);
+        put_hdr(expected, 3, 5, 7, 0x102, be);
+        assert_memory_equal(wire, expected, sizeof(txpc_hdr_t));
+        codec->decode(&out, wire);
+        assert_memory_equal(&out, &hdr, sizeof(txpc_hdr_t));
+    }
+
+    // negotiation headers are recognized in either byte order.
+    put_hdr(wire, 0, 0, TXPC_NEG_TYPE_ENDIANNESS, 1, true);
+    assert_ptr_equal(
+        xpc_hdr_codec_detect(wire, &xpc_hdr_codec_le), &xpc_hdr_codec_be
+    );
+    put_hdr(wire, 1, 0, TXPC_NEG_TYPE_ENDIANNESS, 1, true);
+    assert_null(xpc_hdr_codec_detect(wire, &xpc_hdr_codec_le));
+}
+
+static void test_mixed_endian_inputs(void **state) {
+    xpc_router_t *xpc = *state;
+    int le_dev[2], be_dev[2], out[2];
+    assert_int_equal(pipe2(le_dev, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(be_dev, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+
+    assert_int_equal(xpc_set_route(xpc, le_dev[0], out[1], 1, 1), 0);
+    assert_int_equal(xpc_set_route(xpc, be_dev[0], out[1], 1, 2), 0);
+
+    // the big endian device announces itself before sending anything.
+    send_endianness(be_dev[1], true);
+    send_msg(be_dev[1], 1, 9, 4, "from a big endian device", true);
+    pump_input(xpc, be_dev[0]);
+    expect_msg(
+        xpc, out[1], out[0], 2, 9, 4, "from a big endian device",
+        XPC_HOST_BIG_ENDIAN
+    );
+
+    send_msg(le_dev[1], 1, 8, 6, "from a little endian device", false);
+    pump_input(xpc, le_dev[0]);
+    expect_msg(
+        xpc, out[1], out[0], 1, 8, 6, "from a little endian device",
+        XPC_HOST_BIG_ENDIAN
+    );
+
+    // and again, to check neither input's byte order leaked into the other.
+    send_msg(be_dev[1], 1, 9, 5, "again", true);
+    pump_input(xpc, be_dev[0]);
+    expect_msg(xpc, out[1], out[0], 2, 9, 5, "again", XPC_HOST_BIG_ENDIAN);
+
+    for(int i = 0; i < 2; i++) {
+        close(le_dev[i]);
+        close(be_dev[i]);
+        close(out[i]);
+    }
+}
+
+static void test_big_endian_output(void **state) {
+    xpc_router_t *xpc = *state;
+    int le_dev[2], be_dev[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, le_dev), 0);
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, be_dev), 0);
+
+    // traffic in both directions between two devices of different byte order
+    assert_int_equal(xpc_set_route(xpc, le_dev[0], be_dev[0], 3, 4), 0);
+    assert_int_equal(xpc_set_route(xpc, be_dev[0], le_dev[0], 4, 3), 0);
+
+    // negotiation on the input side selects the byte order for the output
+    // side of the same fd.
+    send_endianness(be_dev[1], true);
+    pump_input(xpc, be_dev[0]);
+
+    send_msg(le_dev[1], 3, 1, 2, "to big endian", false);
+    pump_input(xpc, le_dev[0]);
+    expect_msg(xpc, be_dev[0], be_dev[1], 4, 1, 2, "to big endian", true);
+
+    send_msg(be_dev[1], 4, 2, 1, "to little endian", true);
+    pump_input(xpc, be_dev[0]);
+    expect_msg(xpc, le_dev[0], le_dev[1], 3, 2, 1, "to little endian", false);
+
+    for(int i = 0; i < 2; i++) {
+        close(le_dev[i]);
+        close(be_dev[i]);
+    }
+}
+
+static void test_negotiation_without_payload(void **state) {
+    xpc_router_t *xpc = *state;
+    int be_dev[2], out[2];
+    assert_int_equal(pipe2(be_dev, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, be_dev[0], out[1], 1, 1), 0);
+
+    // the byte order of the negotiation header itself is used.
+    send_msg(be_dev[1], 0, 0, TXPC_NEG_TYPE_ENDIANNESS, NULL, true);
+    send_msg(be_dev[1], 1, 2, 3, "payload", true);
+    pump_input(xpc, be_dev[0]);
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "payload", XPC_HOST_BIG_ENDIAN);
+
+    for(int i = 0; i < 2; i++) {
+        close(be_dev[i]);
+        close(out[i]);
+    }
+}
+
+static int wakeups = 0;
+
+static int count_wakeup(void *ctx, int fd) {
+    wakeups++;
+    return 0;
+}
+
+static void test_coalesce_threshold(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    uint8_t wire[256];
+    int msg_len = sizeof(txpc_hdr_t) + strlen("12345678");
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+    assert_int_equal(xpc_set_coalescing(xpc, out[1], 3 * msg_len, 1000000), 0);
+    xpc->io_add_fd_cb = count_wakeup;
+    wakeups = 0;
+
+    // below the threshold nothing is written, and the output is not woken.
+    for(int i = 0; i < 2; i++) {
+        send_msg(in[1], 1, 2, 3, "12345678", XPC_HOST_BIG_ENDIAN);
+        pump_input(xpc, in[0]);
+    }
+    assert_int_equal(wakeups, 0);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    assert_int_equal(read(out[0], wire, sizeof(wire)), -1);
+
+    // reaching it writes all three messages at once.
+    send_msg(in[1], 1, 2, 3, "12345678", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    assert_int_equal(wakeups, 1);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 3 * msg_len);
+    assert_int_equal(read(out[0], wire, sizeof(wire)), 3 * msg_len);
+    assert_int_equal(xpc_coalesce_poll(xpc), -1);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_coalesce_deadline(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    uint8_t wire[256];
+    int msg_len = sizeof(txpc_hdr_t) + strlen("late");
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+    assert_int_equal(xpc_set_coalescing(xpc, out[1], 1024, 2000), 0);
+    xpc->io_add_fd_cb = count_wakeup;
+    wakeups = 0;
+
+    send_msg(in[1], 1, 2, 3, "late", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    assert_in_range(xpc_coalesce_poll(xpc), 1, 2);
+    assert_int_equal(wakeups, 0);
+
+    usleep(3000);
+    // the deadline passed, so the output is handed back for writing.
+    assert_int_equal(xpc_coalesce_poll(xpc), -1);
+    assert_int_equal(wakeups, 1);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), msg_len);
+    assert_int_equal(read(out[0], wire, sizeof(wire)), msg_len);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_coalesce_opt_out(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 2, 2), 0);
+    assert_int_equal(xpc_set_route_flags(xpc, in[0], 2, XPC_ROUTE_NO_COALESCE), 0);
+    assert_int_equal(xpc_set_route_flags(xpc, in[0], 5, XPC_ROUTE_NO_COALESCE), -1);
+    assert_int_equal(xpc_set_coalescing(xpc, out[1], 1024, 1000000), 0);
+
+    send_msg(in[1], 1, 2, 3, "bulk", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+
+    // the latency-critical message goes out right away, after the one which
+    // was staged before it.
+    send_msg(in[1], 2, 2, 3, "urgent", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "bulk", XPC_HOST_BIG_ENDIAN);
+    expect_msg(xpc, out[1], out[0], 2, 2, 3, "urgent", XPC_HOST_BIG_ENDIAN);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_unrouted_discard(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    static uint8_t big[sizeof(txpc_hdr_t) + 3 * XPC_DISCARD_BUF_SIZE + 7];
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+
+    // a payload larger than the scratch buffer, full of bytes which would
+    // parse as headers for the routed channel if they were not skipped.
+    memset(big, 1, sizeof(big));
+    put_hdr(big, 7, 2, 3, sizeof(big) - sizeof(txpc_hdr_t), XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(write(in[1], big, sizeof(big)), sizeof(big));
+    send_msg(in[1], 9, 2, 3, "unrouted too", XPC_HOST_BIG_ENDIAN);
+    send_msg(in[1], 1, 2, 3, "routed", XPC_HOST_BIG_ENDIAN);
+    send_msg(in[1], 7, 2, 3, "", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "routed", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 7), 2);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 9), 1);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 1), 0);
+    assert_int_equal(xpc_get_drop_count(xpc, out[0], 7), 0);
+
+    // nothing else was queued for the output.
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+
+    // the table of an input has a fixed size, further channels share a count.
+    for(int chn = 10; chn < 10 + XPC_DROP_CHANNELS; chn++) {
+        send_msg(in[1], chn, 2, 3, "", XPC_HOST_BIG_ENDIAN);
+    }
+    pump_input(xpc, in[0]);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(xpc->in_contexts, in[0]);
+    assert_int_equal(in_ctx->n_drop_chns, XPC_DROP_CHANNELS);
+    assert_int_equal(in_ctx->drops_other, 2);
+    assert_int_equal(in_ctx->rx.drops[XPC_DROP_NO_ROUTE], 3 + XPC_DROP_CHANNELS);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 10), 1);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 9 + XPC_DROP_CHANNELS), 0);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_resync_after_dropped_byte(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    uint64_t events = 0, skipped = 0;
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+
+    // lose the first byte of a message, then send two good ones.
+    int size = strlen("xxxxxxxx");
+    put_hdr(wire, 1, 2, 3, size, XPC_HOST_BIG_ENDIAN);
+    memset(wire + sizeof(txpc_hdr_t), 'x', size);
+    assert_int_equal(write(in[1], wire + 1, sizeof(txpc_hdr_t) + size - 1),
+        sizeof(txpc_hdr_t) + size - 1);
+    send_msg(in[1], 1, 2, 3, "first after", XPC_HOST_BIG_ENDIAN);
+    send_msg(in[1], 1, 2, 3, "second after", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "first after", XPC_HOST_BIG_ENDIAN);
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "second after", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_get_resync_stats(xpc, in[0], &events, &skipped), 0);
+    assert_int_equal(events, 1);
+    assert_int_equal(skipped, sizeof(txpc_hdr_t) + size - 1);
+    assert_int_equal(xpc_get_resync_stats(xpc, out[0], &events, &skipped), -1);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_resync_through_garbage(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2];
+    static uint8_t garbage[3 * XPC_RESYNC_BUF_SIZE + 5];
+    uint64_t events = 0, skipped = 0;
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 1), 0);
+    xpc->max_msg_size = 1024;
+
+    // noise which is never a plausible header, longer than the lookahead
+    // buffer, with a few bytes that pass the candidate filter.
+    memset(garbage, 0xee, sizeof(garbage));
+    for(int i = 0; i < sizeof(garbage); i += 97) {
+        garbage[i] = 1;
+    }
+    assert_int_equal(write(in[1], garbage, sizeof(garbage)), sizeof(garbage));
+    send_msg(in[1], 1, 2, 3, "recovered", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "recovered", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_get_resync_stats(xpc, in[0], &events, &skipped), 0);
+    assert_int_equal(events, 1);
+    assert_int_equal(skipped, sizeof(garbage));
+
+    // framing is good again, messages flow without another resync.
+    send_msg(in[1], 1, 2, 3, "normal", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    expect_msg(xpc, out[1], out[0], 1, 2, 3, "normal", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_get_resync_stats(xpc, in[0], &events, &skipped), 0);
+    assert_int_equal(events, 1);
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+/**
+ * Send a message in two writes, the first one with the header and half of
+ * the payload, and let the router read it.
+ * @return the length of the first write.
+ */
+static int send_first_half(xpc_router_t *xpc, int in_rd, int in_wr,
+        int to, const char *payload, uint8_t *wire, int *len) {
+    int size = strlen(payload);
+    int half = sizeof(txpc_hdr_t) + size / 2;
+    put_hdr(wire, to, 2, 3, size, XPC_HOST_BIG_ENDIAN);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, size);
+    *len = sizeof(txpc_hdr_t) + size;
+    assert_int_equal(write(in_wr, wire, half), half);
+    pump_input(xpc, in_rd);
+    return half;
+}
+
+static void test_remove_route_inflight(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2], len = 0, half = 0;
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 2), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 4, 5), 0);
+
+    // the message being received when its route goes away is delivered.
+    half = send_first_half(xpc, in[0], in[1], 1, "half way there", wire, &len);
+    assert_int_equal(xpc_remove_route(xpc, in[0], 1), 0);
+    assert_int_equal(xpc_remove_route(xpc, in[0], 1), -1);
+    assert_null(xpc_get_route_latency(xpc, in[0], 1));
+    assert_int_equal(write(in[1], wire + half, len - half), len - half);
+    pump_input(xpc, in[0]);
+    expect_msg(xpc, out[1], out[0], 2, 2, 3, "half way there", XPC_HOST_BIG_ENDIAN);
+
+    // the next one has no route, the other route still works.
+    send_msg(in[1], 1, 2, 3, "dropped", XPC_HOST_BIG_ENDIAN);
+    send_msg(in[1], 4, 2, 3, "kept", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+    expect_msg(xpc, out[1], out[0], 5, 2, 3, "kept", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_get_drop_count(xpc, in[0], 1), 1);
+
+    // the output outlives its routes until it is drained.
+    half = send_first_half(xpc, in[0], in[1], 4, "last one", wire, &len);
+    assert_int_equal(xpc_remove_route(xpc, in[0], 4), 0);
+    xpc_router_poll(xpc);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(xpc->out_contexts, out[1]);
+    assert_non_null(out_ctx);
+    assert_true(out_ctx->retired);
+    assert_int_equal(write(in[1], wire + half, len - half), len - half);
+    pump_input(xpc, in[0]);
+    expect_msg(xpc, out[1], out[0], 5, 2, 3, "last one", XPC_HOST_BIG_ENDIAN);
+    xpc_router_poll(xpc);
+    assert_null(hashmap_fetch(xpc->out_contexts, out[1]));
+    assert_int_equal(xpc->retired_outputs, 0);
+    // the input keeps its context.
+    assert_non_null(hashmap_fetch(xpc->in_contexts, in[0]));
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out[i]);
+    }
+}
+
+static void test_redirect_inflight(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out_a[2], out_b[2], len = 0, half = 0;
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out_a, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out_b, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out_a[1], 1, 2), 0);
+
+    half = send_first_half(xpc, in[0], in[1], 1, "old route", wire, &len);
+    assert_int_equal(xpc_set_route(xpc, in[0], out_b[1], 1, 3), 0);
+    assert_int_equal(write(in[1], wire + half, len - half), len - half);
+    send_msg(in[1], 1, 2, 3, "new route", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in[0]);
+
+    expect_msg(xpc, out_a[1], out_a[0], 2, 2, 3, "old route", XPC_HOST_BIG_ENDIAN);
+    expect_msg(xpc, out_b[1], out_b[0], 3, 2, 3, "new route", XPC_HOST_BIG_ENDIAN);
+    // only the message which took the new route counts on it.
+    xpc_switch_tbl_entry_t key = {.fd = in[0], .to_chn = 1};
+    xpc_route_t *route = hashmap_fetch(xpc->switch_tbl, *(void**)&key);
+    assert_int_equal(route->stats.msgs, 1);
+    xpc_router_poll(xpc);
+    assert_null(hashmap_fetch(xpc->out_contexts, out_a[1]));
+    assert_non_null(hashmap_fetch(xpc->out_contexts, out_b[1]));
+
+    for(int i = 0; i < 2; i++) {
+        close(in[i]);
+        close(out_a[i]);
+        close(out_b[i]);
+    }
+}
+
+static void test_cut_through(void **state) {
+    xpc_router_t *xpc = *state;
+    int in_a[2], in_b[2], out[2], len = 0, half = 0;
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    uint8_t got[2 * sizeof(wire)];
+    const char *big = "written while it is still arriving";
+    assert_int_equal(pipe2(in_a, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(in_b, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in_a[0], out[1], 1, 2), 0);
+    assert_int_equal(xpc_set_route(xpc, in_b[0], out[1], 1, 3), 0);
+    assert_int_equal(xpc_set_route_flags(xpc, in_a[0], 1, XPC_ROUTE_CUT_THROUGH), 0);
+    xpc->io_add_fd_cb = count_wakeup;
+    wakeups = 0;
+
+    // the first half is written before the rest arrives.
+    half = send_first_half(xpc, in_a[0], in_a[1], 1, big, wire, &len);
+    assert_int_equal(wakeups, 1);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), half);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+
+    // a complete message waits until the other one is done.
+    send_msg(in_b[1], 1, 2, 3, "after it", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in_b[0]);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    assert_int_equal(read(out[0], got, sizeof(got)), half);
+
+    // the rest of it wakes the output.
+    wakeups = 0;
+    assert_int_equal(write(in_a[1], wire + half, len - half), len - half);
+    pump_input(xpc, in_a[0]);
+    assert_true(wakeups >= 1);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), len - half);
+    assert_int_equal(read(out[0], got + half, sizeof(got)), len - half);
+    assert_int_equal(get_field(got, FIELD_OFF(to), FIELD_LEN(to), XPC_HOST_BIG_ENDIAN), 2);
+    assert_memory_equal(got + sizeof(txpc_hdr_t), big, strlen(big));
+    expect_msg(xpc, out[1], out[0], 3, 2, 3, "after it", XPC_HOST_BIG_ENDIAN);
+
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(xpc->out_contexts, out[1]);
+    assert_int_equal(out_ctx->tx.msgs, 2);
+    assert_int_equal(out_ctx->tx.bytes, len + sizeof(txpc_hdr_t) + strlen("after it"));
+    assert_int_equal(out_ctx->msg_queue->queued_bytes, 0);
+    assert_int_equal(xpc_get_route_latency(xpc, in_a[0], 1)->count, 1);
+
+    // with a complete message waiting, it is written first.
+    send_msg(in_b[1], 1, 2, 3, "before it", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in_b[0]);
+    half = send_first_half(xpc, in_a[0], in_a[1], 1, big, wire, &len);
+    expect_msg(xpc, out[1], out[0], 3, 2, 3, "before it", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(read(out[0], got, sizeof(got)), half);
+    assert_int_equal(write(in_a[1], wire + half, len - half), len - half);
+    pump_input(xpc, in_a[0]);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), len - half);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+
+    for(int i = 0; i < 2; i++) {
+        close(in_a[i]);
+        close(in_b[i]);
+        close(out[i]);
+    }
+}
+
+static void test_cut_through_abort(void **state) {
+    xpc_router_t *xpc = *state;
+    int in_a[2], in_b[2], out[2], len = 0, half = 0;
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    uint8_t got[2 * sizeof(wire)];
+    const char *big = "written while it is still arriving";
+    assert_int_equal(pipe2(in_a, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(in_b, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in_a[0], out[1], 1, 2), 0);
+    assert_int_equal(xpc_set_route(xpc, in_b[0], out[1], 1, 3), 0);
+    assert_int_equal(xpc_set_route_flags(xpc, in_a[0], 1, XPC_ROUTE_CUT_THROUGH), 0);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(xpc->out_contexts, out[1]);
+
+    // a stalled message is dropped, the rest of it is skipped once it comes.
+    half = send_first_half(xpc, in_a[0], in_a[1], 1, big, wire, &len);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), half);
+    assert_int_equal(read(out[0], got, sizeof(got)), half);
+    send_msg(in_b[1], 1, 2, 3, "not held up", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in_b[0]);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    assert_int_equal(xpc->cut_throughs, 1);
+    out_ctx->cut_through_ns -= (uint64_t)XPC_CUT_THROUGH_STALL_MS * 1000000;
+    xpc_router_poll(xpc);
+    assert_int_equal(out_ctx->cut_through_id, -1);
+    assert_int_equal(xpc->cut_throughs, 0);
+    assert_int_equal(xpc_get_drop_count(xpc, in_a[0], 1), 1);
+    expect_msg(xpc, out[1], out[0], 3, 2, 3, "not held up", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(write(in_a[1], wire + half, len - half), len - half);
+    send_msg(in_a[1], 1, 2, 3, "next", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in_a[0]);
+    expect_msg(xpc, out[1], out[0], 2, 2, 3, "next", XPC_HOST_BIG_ENDIAN);
+
+    // an input hanging up mid-frame does not hold the output either.
+    half = send_first_half(xpc, in_a[0], in_a[1], 1, big, wire, &len);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), half);
+    assert_int_equal(read(out[0], got, sizeof(got)), half);
+    send_msg(in_b[1], 1, 2, 3, "after the hangup", XPC_HOST_BIG_ENDIAN);
+    pump_input(xpc, in_b[0]);
+    close(in_a[1]);
+    pump_input(xpc, in_a[0]);
+    assert_null(hashmap_fetch(xpc->in_contexts, in_a[0]));
+    assert_int_equal(out_ctx->cut_through_id, -1);
+    assert_int_equal(xpc->cut_throughs, 0);
+    expect_msg(xpc, out[1], out[0], 3, 2, 3, "after the hangup", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    assert_int_equal(out_ctx->msg_queue->queued_bytes, 0);
+
+    for(int i = 0; i < 2; i++) {
+        close(in_b[i]);
+        close(out[i]);
+    }
+}
+
+static void test_input_hangup(void **state) {
+    xpc_router_t *xpc = *state;
+    int in[2], out[2], len = 0;
+    uint8_t wire[sizeof(txpc_hdr_t) + 64];
+    assert_int_equal(pipe2(in, O_NONBLOCK), 0);
+    assert_int_equal(pipe2(out, O_NONBLOCK), 0);
+    assert_int_equal(xpc_set_route(xpc, in[0], out[1], 1, 2), 0);
+
+    // what was sent before the hangup is delivered, a message cut short is
+    // dropped.
+    send_msg(in[1], 1, 2, 3, "complete", XPC_HOST_BIG_ENDIAN);
+    send_first_half(xpc, in[0], in[1], 1, "cut short", wire, &len);
+    close(in[1]);
+    pump_input(xpc, in[0]);
+    assert_null(hashmap_fetch(xpc->in_contexts, in[0]));
+    assert_null(xpc_get_route_latency(xpc, in[0], 1));
+    assert_int_equal(array_size(xpc->in_fds), 0);
+    assert_int_equal(array_size(xpc->route_keys), 0);
+    // the router closed it.
+    assert_int_equal(fcntl(in[0], F_GETFD), -1);
+    expect_msg(xpc, out[1], out[0], 2, 2, 3, "complete", XPC_HOST_BIG_ENDIAN);
+    assert_int_equal(xpc_write_msg(xpc, out[1]), 0);
+    xpc_router_poll(xpc);
+    assert_null(hashmap_fetch(xpc->out_contexts, out[1]));
+
+    close(out[0]);
+    close(out[1]);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_codec_roundtrip),
+        cmocka_unit_test_setup_teardown(
+            test_mixed_endian_inputs,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_big_endian_output,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_negotiation_without_payload,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_coalesce_threshold,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_coalesce_deadline,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_coalesce_opt_out,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_unrouted_discard,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_resync_after_dropped_byte,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_resync_through_garbage,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_remove_route_inflight,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_redirect_inflight,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_cut_through,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_cut_through_abort,
+            init,
+            finish
+        ),
+        cmocka_unit_test_setup_teardown(
+            test_input_hangup,
+            init,
+            finish
+        ),
+    };
+
+    int r = cmocka_run_group_tests(tests, NULL, NULL);
+    return r;
+}
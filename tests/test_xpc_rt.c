@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_rt.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define MAX_MSG 512
+
+// allocations are counted by wrapping malloc, calloc and realloc at link
+// time (see meson.build).
+static uint64_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+typedef struct {
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads sv[0].
+    int sv[2];
+    // two outputs, channel 1 goes to p, channel 2 to q.
+    int p[2];
+    int q[2];
+} rt_state_t;
+
+static int init(void **state) {
+    rt_state_t *st = calloc(1, sizeof(rt_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0
+            || pipe2(st->p, O_NONBLOCK) != 0
+            || pipe2(st->q, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->sv[0], st->p[1], 1, 1) != 0
+            || xpc_set_route(st->xpc, st->sv[0], st->q[1], 2, 2) != 0
+            || xpc_reserve_output(st->xpc, st->p[1], 4, 64) != 0
+            || xpc_set_coalescing(st->xpc, st->p[1], 256, 1000) != 0) {
+        return -1;
+    }
+    st->xpc->max_msg_size = MAX_MSG;
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    rt_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->p[0]);
+    close(st->p[1]);
+    close(st->q[0]);
+    close(st->q[1]);
+    free(st);
+    return 0;
+}
+
+static void send_msgs(rt_state_t *st, int chn, int n, int size) {
+    uint8_t wire[sizeof(txpc_hdr_t) + MAX_MSG] = {0};
+    txpc_hdr_t hdr = {.to = chn, .from = chn, .type = 0, .size = size};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    int len = sizeof(txpc_hdr_t) + size;
+    for(int i = 0; i < n; i++) {
+        assert_int_equal(write(st->sv[1], wire, len), len);
+        while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+    }
+}
+
+static void drain(int fd) {
+    uint8_t buf[4096];
+    while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+static void test_prefault(void **state) {
+    rt_state_t *st = *state;
+    xpc_rt_opts_t opts = XPC_RT_OPTS_DEFAULT;
+    opts.lock_memory = false;
+    opts.warmup_ms = 0;
+    assert_int_equal(xpc_rt_enable(st->xpc, &opts), 0);
+
+    // every pooled buffer holds the largest message, the output without a
+    // pool gets one buffer, and the stage holds a flush.
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->p[1]);
+    msg_queue_t *queue = out_ctx->msg_queue;
+    assert_int_equal(array_size(queue->cleared_buffers), 4);
+    for(int i = 0; i < 4; i++) {
+        msg_buf_t *buf = *(msg_buf_t **)array_fetch(queue->cleared_buffers, i);
+        assert_true(buf->buf->capacity >= sizeof(txpc_hdr_t) + MAX_MSG);
+    }
+    assert_true(out_ctx->stage->capacity >= 256 + sizeof(txpc_hdr_t) + MAX_MSG);
+    out_ctx = hashmap_fetch(st->xpc->out_contexts, st->q[1]);
+    assert_int_equal(array_size(out_ctx->msg_queue->cleared_buffers), 1);
+}
+
+static void test_violations(void **state) {
+    rt_state_t *st = *state;
+    xpc_rt_usage_t usage;
+    xpc_rt_opts_t opts = XPC_RT_OPTS_DEFAULT;
+    opts.lock_memory = false;
+    opts.warmup_ms = 0;
+    opts.alloc_count = &allocations;
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), -1);
+    assert_int_equal(xpc_rt_enable(st->xpc, &opts), 0);
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), -1);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), 0);
+
+    // large messages through the warm pool allocate nothing.
+    for(int i = 0; i < 20; i++) {
+        send_msgs(st, 1, 1, MAX_MSG);
+        xpc_router_poll(st->xpc);
+        while(xpc_write_msg(st->xpc, st->p[1]) > 0);
+        drain(st->p[0]);
+    }
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), 0);
+    assert_int_equal(usage.pool_misses, 0);
+    assert_int_equal(usage.allocations, 0);
+    assert_int_equal(usage.heap_bytes, 0);
+
+    // q has one buffer, a second message waiting for it needs another.
+    send_msgs(st, 2, 2, 16);
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), 0);
+    assert_int_equal(usage.pool_misses, 1);
+    assert_true(usage.allocations > 0);
+}
+
+static void test_warmup(void **state) {
+    rt_state_t *st = *state;
+    xpc_rt_usage_t usage;
+    xpc_rt_opts_t opts = XPC_RT_OPTS_DEFAULT;
+    opts.lock_memory = false;
+    opts.warmup_ms = 60000;
+    assert_int_equal(xpc_rt_enable(st->xpc, &opts), 0);
+    // the first check is at the end of warm-up.
+    int timeout_ms = xpc_router_poll(st->xpc);
+    assert_true(timeout_ms > 59000 && timeout_ms <= 60000);
+    send_msgs(st, 2, 2, 16);
+    assert_int_equal(xpc_rt_violations(st->xpc, &usage), -1);
+
+    opts.priority = 1000;
+    errno = 0;
+    assert_int_equal(xpc_rt_enable(st->xpc, &opts), -1);
+    assert_int_equal(errno, EINVAL);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_prefault, init, finish),
+        cmocka_unit_test_setup_teardown(test_violations, init, finish),
+        cmocka_unit_test_setup_teardown(test_warmup, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
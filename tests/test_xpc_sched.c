@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_sched.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define QUANTUM 256
+
+typedef struct {
+    xpc_router_t *xpc;
+    // two senders, both routed to channel 1 of the output.
+    int a[2];
+    int b[2];
+    // the output, the router writes p[1].
+    int p[2];
+} sched_state_t;
+
+static int init(void **state) {
+    sched_state_t *st = calloc(1, sizeof(sched_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->a) != 0
+            || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->b) != 0
+            || pipe2(st->p, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->a[0], st->p[1], 1, 1) != 0
+            || xpc_set_route(st->xpc, st->b[0], st->p[1], 1, 1) != 0
+            || xpc_sched_enable(st->xpc, QUANTUM) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    sched_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->a[0]);
+    close(st->a[1]);
+    close(st->b[0]);
+    close(st->b[1]);
+    close(st->p[0]);
+    close(st->p[1]);
+    free(st);
+    return 0;
+}
+
+/**
+ * Send n messages of len bytes, header included.
+ */
+static void send_msgs(int fd, int n, int len) {
+    uint8_t wire[1024] = {0};
+    txpc_hdr_t hdr = {
+        .to = 1, .from = 1, .type = 0, .size = len - sizeof(txpc_hdr_t)
+    };
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    for(int i = 0; i < n; i++) {
+        assert_int_equal(write(fd, wire, len), len);
+    }
+}
+
+static xpc_route_t *route(sched_state_t *st, int fd) {
+    xpc_switch_tbl_entry_t key = {.fd = fd, .to_chn = 1};
+    return hashmap_fetch(st->xpc->switch_tbl, *(void**)&key);
+}
+
+/**
+ * Bytes of the next n messages the output would write, by sender.
+ */
+static void dequeue(sched_state_t *st, int n, int *a_bytes, int *b_bytes) {
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->p[1]);
+    *a_bytes = 0;
+    *b_bytes = 0;
+    for(int i = 0; i < n; i++) {
+        msg_buf_t *msg_buf = xpc_sched_dequeue(st->xpc, out_ctx);
+        assert_non_null(msg_buf);
+        if(msg_buf->src_fd == st->a[0]) {
+            *a_bytes += msg_buf->size;
+        }
+        else {
+            *b_bytes += msg_buf->size;
+        }
+    }
+}
+
+static void test_read_share(void **state) {
+    sched_state_t *st = *state;
+    // a chatty sender gets one share per event, however much it sent.
+    send_msgs(st->a[1], 16, 64);
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), QUANTUM);
+    assert_int_equal(route(st, st->a[0])->stats.msgs, QUANTUM / 64);
+
+    assert_int_equal(xpc_sched_set_fd_weight(st->xpc, st->a[0], 2), 0);
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), 2 * QUANTUM);
+    assert_int_equal(route(st, st->a[0])->stats.msgs, 3 * QUANTUM / 64);
+
+    // a sender which runs dry keeps nothing for the next event.
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), 256);
+    assert_int_equal(route(st, st->a[0])->stats.msgs, 16);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, st->a[0]);
+    assert_int_equal(in_ctx->sched_deficit, 0);
+    assert_int_equal(xpc_sched_set_fd_weight(st->xpc, st->a[1], 2), -1);
+}
+
+static void test_read_overshoot(void **state) {
+    sched_state_t *st = *state;
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, st->a[0]);
+    // a message far over the share is read whole, the debt carried is one
+    // share and the next event still reads something.
+    send_msgs(st->a[1], 1, 4 * QUANTUM);
+    send_msgs(st->a[1], 8, 64);
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), 4 * QUANTUM);
+    assert_int_equal(in_ctx->sched_deficit, -3 * QUANTUM);
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), 64);
+    assert_int_equal(in_ctx->sched_deficit, -64);
+    assert_int_equal(xpc_sched_read(st->xpc, st->a[0]), QUANTUM - 64);
+}
+
+static void test_route_bytes(void **state) {
+    sched_state_t *st = *state;
+    int a_bytes, b_bytes;
+    // large messages do not buy a route more of the output.
+    send_msgs(st->a[1], 8, QUANTUM);
+    send_msgs(st->b[1], 32, 64);
+    while(xpc_accumulate_msg(st->xpc, st->a[0]) > 0);
+    while(xpc_accumulate_msg(st->xpc, st->b[0]) > 0);
+    for(int round = 0; round < 4; round++) {
+        dequeue(st, 1 + QUANTUM / 64, &a_bytes, &b_bytes);
+        assert_int_equal(a_bytes, QUANTUM);
+        assert_int_equal(b_bytes, QUANTUM);
+    }
+}
+
+static void test_route_weight(void **state) {
+    sched_state_t *st = *state;
+    int a_bytes, b_bytes;
+    assert_int_equal(xpc_sched_set_route_weight(st->xpc, st->a[0], 1, 3), 0);
+    assert_int_equal(xpc_sched_set_route_weight(st->xpc, st->a[0], 2, 3), -1);
+    send_msgs(st->a[1], 32, 64);
+    send_msgs(st->b[1], 32, 64);
+    while(xpc_accumulate_msg(st->xpc, st->a[0]) > 0);
+    while(xpc_accumulate_msg(st->xpc, st->b[0]) > 0);
+    dequeue(st, 16, &a_bytes, &b_bytes);
+    assert_int_equal(a_bytes, 3 * b_bytes);
+
+    // once one route has nothing left the other gets all of the output.
+    dequeue(st, 48, &a_bytes, &b_bytes);
+    assert_int_equal(a_bytes + b_bytes, 48 * 64);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->p[1]);
+    assert_null(xpc_sched_dequeue(st->xpc, out_ctx));
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_read_share, init, finish),
+        cmocka_unit_test_setup_teardown(test_read_overshoot, init, finish),
+        cmocka_unit_test_setup_teardown(test_route_bytes, init, finish),
+        cmocka_unit_test_setup_teardown(test_route_weight, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
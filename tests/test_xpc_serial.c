@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <xpc_serial.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+// a pty stands in for the serial port, the slave side is configured.
+typedef struct {
+    int master;
+    int slave;
+} pty_state_t;
+
+static int init(void **state) {
+    pty_state_t *st = malloc(sizeof(pty_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    st->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(st->master == -1 || grantpt(st->master) != 0 || unlockpt(st->master) != 0) {
+        return -1;
+    }
+    st->slave = xpc_serial_open(
+        ptsname(st->master), &(xpc_serial_opts_t)XPC_SERIAL_OPTS_DEFAULT, NULL
+    );
+    if(st->slave == -1) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    pty_state_t *st = *state;
+    close(st->slave);
+    close(st->master);
+    free(st);
+    return 0;
+}
+
+static bool readable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 50) == 1;
+}
+
+static void test_arbitrary_baud(void **state) {
+    pty_state_t *st = *state;
+    xpc_serial_opts_t opts = XPC_SERIAL_OPTS_DEFAULT;
+    xpc_serial_status_t status = {0};
+    struct termios2 tio;
+    // not one of the fixed Bxxx rates.
+    opts.baud = 250000;
+    assert_int_equal(xpc_serial_configure(st->slave, &opts, &status), 0);
+    assert_int_equal(status.baud, 250000);
+    assert_int_equal(ioctl(st->slave, TCGETS2, &tio), 0);
+    assert_int_equal(tio.c_cflag & CBAUD, BOTHER);
+    assert_int_equal(tio.c_ospeed, 250000);
+    assert_int_equal(tio.c_ispeed, 250000);
+    // a pty has no serial driver, which is reported rather than fatal.
+    assert_false(status.low_latency);
+
+    opts.baud = 0;
+    assert_int_equal(xpc_serial_configure(st->slave, &opts, &status), -1);
+    assert_int_equal(errno, EINVAL);
+}
+
+static void test_raw_mode(void **state) {
+    pty_state_t *st = *state;
+    // no line discipline processing: no CR/NL mapping, no signals, no echo.
+    const uint8_t bytes[] = {'\r', 0x03, '\n', 0x11, 0x13, 0xff, 0x00};
+    uint8_t rx[sizeof(bytes)] = {0};
+    assert_int_equal(write(st->master, bytes, sizeof(bytes)), sizeof(bytes));
+    assert_true(readable(st->slave));
+    assert_int_equal(read(st->slave, rx, sizeof(rx)), sizeof(bytes));
+    assert_memory_equal(rx, bytes, sizeof(bytes));
+    assert_int_equal(read(st->master, rx, sizeof(rx)), -1);
+}
+
+static void test_vmin_batches_wakeups(void **state) {
+    pty_state_t *st = *state;
+    xpc_serial_opts_t opts = XPC_SERIAL_OPTS_DEFAULT;
+    uint8_t rx[8];
+    opts.vmin = 4;
+    assert_int_equal(xpc_serial_configure(st->slave, &opts, NULL), 0);
+    assert_int_equal(write(st->master, "ab", 2), 2);
+    assert_false(readable(st->slave));
+    assert_int_equal(write(st->master, "cd", 2), 2);
+    assert_true(readable(st->slave));
+    assert_int_equal(read(st->slave, rx, sizeof(rx)), 4);
+    assert_memory_equal(rx, "abcd", 4);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_arbitrary_baud, init, finish),
+        cmocka_unit_test_setup_teardown(test_raw_mode, init, finish),
+        cmocka_unit_test_setup_teardown(test_vmin_batches_wakeups, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_clients.h>
+#include <xpc_ring.h>
+#include <xpc_shm.h>
+#include <xpc_shm_client.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char path[64];
+    xpc_router_t *xpc;
+    int lfd;
+    // stream side: the router reads in_pipe[0] and writes out_pipe[1].
+    int in_pipe[2];
+    int out_pipe[2];
+    // the last fd the router asked to watch.
+    int watched;
+} shm_state_t;
+
+static int watch_fd(void *ctx, int fd) {
+    ((shm_state_t *)ctx)->watched = fd;
+    return 0;
+}
+
+static int make_msg(uint8_t *wire, int to, int type, const void *payload, int size) {
+    txpc_hdr_t hdr = {.to = to, .from = 0, .type = type, .size = size};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, size);
+    return sizeof(txpc_hdr_t) + size;
+}
+
+static int init(void **state) {
+    shm_state_t *st = calloc(1, sizeof(shm_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "/tmp/test_xpc_shm.%d", getpid());
+    st->lfd = xpc_listen_seqpacket(st->path);
+    st->xpc = initialize_xpc_router();
+    if(st->lfd == -1 || st->xpc == NULL
+            || pipe2(st->in_pipe, O_NONBLOCK) != 0
+            || pipe2(st->out_pipe, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    // the stream input fans out to channel 3 of the listener, and channel 5
+    // from clients goes out of the stream output as channel 6.
+    if(xpc_set_route(st->xpc, st->in_pipe[0], st->lfd, 1, 3) != 0
+            || xpc_set_route(st->xpc, st->lfd, st->out_pipe[1], 5, 6) != 0
+            || xpc_add_listener(st->xpc, st->lfd) != 0) {
+        return -1;
+    }
+    st->xpc->io_event_context = st;
+    st->xpc->io_watch_fd_cb = watch_fd;
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    shm_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->lfd);
+    close(st->in_pipe[0]);
+    close(st->in_pipe[1]);
+    close(st->out_pipe[0]);
+    close(st->out_pipe[1]);
+    unlink(st->path);
+    free(st);
+    return 0;
+}
+
+static void test_ring(void **state) {
+    const uint32_t ring_bytes = 256;
+    size_t len = xpc_ring_area_size(ring_bytes);
+    xpc_ring_area_t *area = aligned_alloc(XPC_RING_CACHE_LINE, len);
+    assert_non_null(area);
+    memset(area, 0, len);
+    xpc_ring_area_init(area, ring_bytes);
+    xpc_ring_t prod, cons, unused;
+    assert_int_equal(xpc_ring_area_open(area, len, &prod, &unused), 0);
+    assert_int_equal(xpc_ring_area_open(area, len, &cons, &unused), 0);
+    assert_int_equal(xpc_ring_area_open(area, len - 1, &cons, &unused), -1);
+
+    // the consumer of a new area is asleep, the first record wakes it.
+    uint32_t rec_len;
+    assert_null(xpc_ring_peek(&cons, &rec_len));
+    assert_null(xpc_ring_reserve(&prod, xpc_ring_max_record(&prod) + 1));
+    memcpy(xpc_ring_reserve(&prod, 5), "first", 5);
+    assert_true(xpc_ring_commit(&prod));
+    xpc_ring_consumer_wake(&cons);
+    memcpy(xpc_ring_reserve(&prod, 6), "second", 6);
+    assert_false(xpc_ring_commit(&prod));
+
+    // records wrap around the end many times over, in order.
+    char rec[64];
+    int next_out = 0;
+    int next_in = 2;
+    for(int round = 0; round < 100; round++) {
+        const char *p = xpc_ring_peek(&cons, &rec_len);
+        assert_non_null(p);
+        if(next_out == 0) {
+            assert_int_equal(rec_len, 5);
+            assert_memory_equal(p, "first", 5);
+        }
+        else if(next_out == 1) {
+            assert_memory_equal(p, "second", 6);
+        }
+        else {
+            snprintf(rec, sizeof(rec), "record %d", next_out);
+            assert_int_equal(rec_len, strlen(rec));
+            assert_memory_equal(p, rec, rec_len);
+        }
+        assert_false(xpc_ring_release(&cons));
+        next_out++;
+        // keep the ring busy with records of varying length.
+        for(int i = 0; i < 2; i++) {
+            snprintf(rec, sizeof(rec), "record %d", next_in);
+            void *dst = xpc_ring_reserve(&prod, strlen(rec));
+            if(dst == NULL) {
+                break;
+            }
+            memcpy(dst, rec, strlen(rec));
+            xpc_ring_commit(&prod);
+            next_in++;
+        }
+    }
+
+    // a full ring refuses records, and a producer asleep on it is woken by
+    // the consumer making room.
+    while(xpc_ring_reserve(&prod, 40) != NULL) {
+        xpc_ring_commit(&prod);
+    }
+    assert_true(xpc_ring_producer_sleep(&prod, 40));
+    assert_non_null(xpc_ring_peek(&cons, &rec_len));
+    assert_true(xpc_ring_release(&cons));
+    xpc_ring_producer_wake(&prod);
+    while(xpc_ring_peek(&cons, &rec_len) != NULL) {
+        assert_false(xpc_ring_release(&cons));
+    }
+    assert_true(xpc_ring_consumer_sleep(&cons));
+    assert_false(xpc_ring_producer_sleep(&prod, 40));
+
+    // an impossible head is never read past.
+    cons.ctl->head = cons.pos + ring_bytes + XPC_RING_ALIGN;
+    assert_null(xpc_ring_peek(&cons, &rec_len));
+    assert_true(cons.broken);
+    free(area);
+}
+
+static void test_round_trip(void **state) {
+    shm_state_t *st = *state;
+    uint8_t wire[64];
+    uint8_t rx[64];
+    txpc_hdr_t hdr;
+    xpc_shm_client_t *client = xpc_shm_client_connect(st->path, 4096);
+    assert_non_null(client);
+    assert_int_equal(xpc_accumulate_msg(st->xpc, st->lfd), 0);
+    int cfd = st->watched;
+    // the attach message and its fds are waiting on the socket.
+    assert_true(xpc_accumulate_msg(st->xpc, cfd) > 0);
+    int bell = st->watched;
+    assert_true(bell != cfd);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, bell);
+    assert_non_null(in_ctx);
+    assert_int_equal(in_ctx->kind, XPC_IN_SHM);
+    uint32_t chn = 3;
+    assert_int_equal(xpc_shm_client_subscribe(client, &chn, 1, true), 0);
+    xpc_accumulate_msg(st->xpc, cfd);
+
+    // stream to client: the message lands in the ring, and the doorbell is
+    // only rung because the client said it would sleep.
+    assert_int_equal(
+        xpc_shm_client_recv(client, &hdr, rx, sizeof(rx)), -1
+    );
+    assert_int_equal(errno, EAGAIN);
+    uint64_t rung;
+    assert_true(xpc_shm_client_arm(client, 0));
+    int len = make_msg(wire, 1, 7, "hello", 5);
+    assert_int_equal(write(st->in_pipe[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    assert_int_equal(read(xpc_shm_client_fd(client), &rung, sizeof(rung)), sizeof(rung));
+    assert_int_equal(xpc_shm_client_wait(client, 0, 1000), 0);
+    assert_int_equal(xpc_shm_client_recv(client, &hdr, rx, sizeof(rx)), 5);
+    assert_int_equal(hdr.to, 3);
+    assert_int_equal(hdr.type, 7);
+    assert_memory_equal(rx, "hello", 5);
+    // clients which received something are awake, and are not rung.
+    assert_int_equal(write(st->in_pipe[1], wire, len), len);
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    assert_int_equal(read(xpc_shm_client_fd(client), &rung, sizeof(rung)), -1);
+    assert_int_equal(xpc_shm_client_recv(client, &hdr, rx, 2), -1);
+    assert_int_equal(errno, EMSGSIZE);
+    assert_int_equal(xpc_shm_client_recv(client, &hdr, rx, sizeof(rx)), 5);
+
+    // client to stream, through the router's doorbell.
+    hdr = (txpc_hdr_t){.to = 5, .from = 1, .type = 2, .size = 4};
+    assert_int_equal(xpc_shm_client_send(client, &hdr, "ping"), 0);
+    assert_int_equal(xpc_shm_client_send(client, &hdr, "pong"), 0);
+    hdr.to = 9;
+    assert_int_equal(xpc_shm_client_send(client, &hdr, "lost"), 0);
+    assert_int_equal(xpc_accumulate_msg(st->xpc, bell), 3 * len - 3);
+    assert_int_equal(xpc_get_drop_count(st->xpc, cfd, 9), 1);
+    while(xpc_write_msg(st->xpc, st->out_pipe[1]) > 0);
+    assert_int_equal(read(st->out_pipe[0], rx, sizeof(rx)), 2 * (len - 1));
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, rx);
+    assert_int_equal(hdr.to, 6);
+    assert_memory_equal(rx + sizeof(txpc_hdr_t), "ping", 4);
+    assert_memory_equal(rx + 2 * sizeof(txpc_hdr_t) + 4, "pong", 4);
+
+    // the router went back to sleep, so the next message rings it again.
+    hdr.to = 5;
+    assert_int_equal(xpc_shm_client_send(client, &hdr, "ring"), 0);
+    assert_int_equal(read(bell, &rung, sizeof(rung)), sizeof(rung));
+
+    // hanging up detaches the rings along with the client.
+    xpc_shm_client_close(client);
+    xpc_accumulate_msg(st->xpc, cfd);
+    assert_null(hashmap_fetch(st->xpc->in_contexts, cfd));
+    assert_null(hashmap_fetch(st->xpc->in_contexts, bell));
+}
+
+static void test_bad_attach(void **state) {
+    shm_state_t *st = *state;
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    // a pipe is not a shared area, the client stays on its socket.
+    xpc_shm_client_t *client = xpc_shm_client_connect(st->path, 4096);
+    assert_non_null(client);
+    xpc_accumulate_msg(st->xpc, st->lfd);
+    int cfd = st->watched;
+    assert_int_equal(xpc_shm_attach(st->xpc, cfd, fds[0], -1, -1), -1);
+    // the router owns what it was given either way.
+    assert_int_equal(fcntl(fds[0], F_GETFD), -1);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(st->xpc->in_contexts, cfd);
+    assert_null(in_ctx->shm);
+
+    // an area which could be shrunk under the mapping.
+    size_t len = xpc_ring_area_size(4096);
+    int memfd = memfd_create("test", MFD_ALLOW_SEALING);
+    assert_int_equal(ftruncate(memfd, len), 0);
+    assert_int_equal(xpc_shm_attach(st->xpc, cfd, dup(memfd),
+        eventfd(0, 0), eventfd(0, 0)), -1);
+    // doorbells which are not eventfds.
+    assert_int_equal(
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW), 0
+    );
+    assert_int_equal(xpc_shm_attach(st->xpc, cfd, dup(memfd),
+        eventfd(0, 0), fds[1]), -1);
+    in_ctx = hashmap_fetch(st->xpc->in_contexts, cfd);
+    assert_null(in_ctx->shm);
+    close(memfd);
+    xpc_shm_client_close(client);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_ring),
+        cmocka_unit_test_setup_teardown(test_round_trip, init, finish),
+        cmocka_unit_test_setup_teardown(test_bad_attach, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
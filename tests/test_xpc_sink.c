@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_sink.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define PAYLOAD 100
+#define MAX_SEGMENTS 16
+#define PATH_LEN 384
+
+typedef struct {
+    char dir[64];
+    char path[128];
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads sv[0] and archives to fd.
+    int sv[2];
+    int fd;
+    // sequence number of the next message sent.
+    uint32_t sent;
+} sink_state_t;
+
+static int init(void **state) {
+    sink_state_t *st = calloc(1, sizeof(sink_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    strcpy(st->dir, "/tmp/test_xpc_sink.XXXXXX");
+    if(mkdtemp(st->dir) == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "%s/k64", st->dir);
+    st->fd = xpc_sink_open(st->path);
+    if(st->fd == -1
+            || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->sv[0], st->fd, 1, 1) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int name_cmp(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/**
+ * Get the paths of the segments in the order they were started.
+ */
+static int list_segments(sink_state_t *st, char paths[][PATH_LEN]) {
+    struct dirent **names = NULL;
+    int n = scandir(st->dir, &names, NULL, name_cmp);
+    int count = 0;
+    for(int i = 0; i < n; i++) {
+        if(names[i]->d_name[0] != '.' && count < MAX_SEGMENTS) {
+            snprintf(
+                paths[count++], PATH_LEN, "%s/%s", st->dir, names[i]->d_name
+            );
+        }
+        free(names[i]);
+    }
+    free(names);
+    return count;
+}
+
+static int finish(void **state) {
+    sink_state_t *st = *state;
+    char paths[MAX_SEGMENTS][PATH_LEN];
+    if(st->xpc != NULL) {
+        xpc_router_destroy(st->xpc);
+    }
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->fd);
+    // segments outlive the router.
+    int n = list_segments(st, paths);
+    for(int i = 0; i < n; i++) {
+        unlink(paths[i]);
+    }
+    assert_int_equal(rmdir(st->dir), 0);
+    free(st);
+    return 0;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Send messages numbered in order, of a given payload size.
+ */
+static void send_sized(sink_state_t *st, int n, int payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + payload];
+    txpc_hdr_t hdr = {.to = 1, .from = 1, .type = 0, .size = payload};
+    memset(wire, 0, sizeof(wire));
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    for(int i = 0; i < n; i++) {
+        memcpy(wire + sizeof(txpc_hdr_t), &st->sent, sizeof(st->sent));
+        st->sent++;
+        assert_int_equal(write(st->sv[1], wire, sizeof(wire)), sizeof(wire));
+        while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+    }
+}
+
+static void send_msgs(sink_state_t *st, int n) {
+    send_sized(st, n, PAYLOAD);
+}
+
+static uint32_t rec_seq(const xpc_sink_rec_t *rec) {
+    uint32_t seq;
+    assert_int_equal(rec->msg_len, sizeof(txpc_hdr_t) + PAYLOAD);
+    memcpy(&seq, xpc_sink_msg_bytes(rec) + sizeof(txpc_hdr_t), sizeof(seq));
+    return seq;
+}
+
+static size_t rec_len(void) {
+    size_t len = sizeof(xpc_sink_rec_t) + sizeof(txpc_hdr_t) + PAYLOAD;
+    return (len + XPC_SINK_ALIGN - 1) & ~(size_t)(XPC_SINK_ALIGN - 1);
+}
+
+static size_t data_off(uint32_t index_max) {
+    size_t off = sizeof(xpc_sink_hdr_t) + index_max * sizeof(xpc_sink_index_t);
+    return (off + XPC_SINK_ALIGN - 1) & ~(size_t)(XPC_SINK_ALIGN - 1);
+}
+
+static void test_archive(void **state) {
+    sink_state_t *st = *state;
+    char paths[MAX_SEGMENTS][PATH_LEN];
+    xpc_sink_stats_t stats;
+    xpc_sink_opts_t opts = XPC_SINK_OPTS_DEFAULT;
+    opts.index_max = 4;
+    opts.segment_bytes = data_off(opts.index_max) + 10 * rec_len();
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), -1);
+    assert_int_equal(xpc_sink_enable(st->xpc, st->fd, st->path, &opts), 0);
+    assert_int_equal(xpc_sink_enable(st->xpc, st->fd, st->path, &opts), -1);
+    // nothing is created before the first message.
+    assert_int_equal(list_segments(st, paths), 0);
+
+    send_msgs(st, 25);
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), 0);
+    assert_int_equal(stats.segments, 3);
+    assert_int_equal(stats.msgs, 25);
+    assert_int_equal(stats.bytes, 25 * (sizeof(txpc_hdr_t) + PAYLOAD));
+    assert_int_equal(stats.lost, 0);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->fd);
+    assert_int_equal(out_ctx->msg_queue->queued_bytes, 0);
+    assert_int_equal(out_ctx->tx.msgs, 25);
+
+    // finished segments are closed and truncated, the last one on destroy.
+    xpc_router_destroy(st->xpc);
+    st->xpc = NULL;
+    assert_int_equal(list_segments(st, paths), 3);
+    uint32_t seq = 0;
+    uint64_t last_ns = 0;
+    for(int i = 0; i < 3; i++) {
+        size_t len = 0;
+        const xpc_sink_hdr_t *hdr = xpc_sink_map(paths[i], &len);
+        assert_non_null(hdr);
+        assert_true(hdr->flags & XPC_SINK_CLOSED);
+        assert_int_equal(len, hdr->end);
+        assert_int_equal(hdr->index_count, (i < 2) ? 4:2);
+        int n = 0;
+        for(const xpc_sink_rec_t *rec = xpc_sink_next(hdr, NULL); rec != NULL;
+                rec = xpc_sink_next(hdr, rec)) {
+            assert_int_equal(rec_seq(rec), seq);
+            assert_int_equal(rec->in_fd, st->sv[0]);
+            assert_int_equal(rec->in_chn, 1);
+            assert_true(rec->time_ns >= last_ns);
+            last_ns = rec->time_ns;
+            seq++;
+            n++;
+        }
+        assert_int_equal(n, (i < 2) ? 10:5);
+        xpc_sink_unmap(hdr, len);
+    }
+    assert_int_equal(seq, 25);
+}
+
+static void test_seek(void **state) {
+    sink_state_t *st = *state;
+    char paths[MAX_SEGMENTS][PATH_LEN];
+    uint64_t start_ns[3];
+    xpc_sink_opts_t opts = XPC_SINK_OPTS_DEFAULT;
+    opts.segment_bytes = 1 << 20;
+    opts.index_max = 8;
+    assert_int_equal(xpc_sink_enable(st->xpc, st->fd, st->path, &opts), 0);
+    for(int i = 0; i < 3; i++) {
+        usleep(2000);
+        start_ns[i] = realtime_ns();
+        send_msgs(st, 100);
+    }
+
+    // the segment being written can be read.
+    assert_int_equal(list_segments(st, paths), 1);
+    size_t len = 0;
+    const xpc_sink_hdr_t *hdr = xpc_sink_map(paths[0], &len);
+    assert_non_null(hdr);
+    assert_false(hdr->flags & XPC_SINK_CLOSED);
+    assert_int_equal(len, opts.segment_bytes);
+    assert_int_equal(hdr->end, hdr->data_off + 300 * rec_len());
+    assert_true(hdr->first_ns >= start_ns[0]);
+    assert_true(hdr->last_ns >= start_ns[2]);
+    for(int i = 0; i < 3; i++) {
+        const xpc_sink_rec_t *rec = xpc_sink_seek(hdr, start_ns[i]);
+        assert_non_null(rec);
+        assert_int_equal(rec_seq(rec), i * 100);
+    }
+    assert_int_equal(rec_seq(xpc_sink_seek(hdr, 0)), 0);
+    assert_null(xpc_sink_seek(hdr, hdr->last_ns + 1));
+    xpc_sink_unmap(hdr, len);
+}
+
+static void test_rotate_sync(void **state) {
+    sink_state_t *st = *state;
+    char paths[MAX_SEGMENTS][PATH_LEN];
+    xpc_sink_stats_t stats;
+    xpc_sink_opts_t opts = XPC_SINK_OPTS_DEFAULT;
+    opts.segment_bytes = 1 << 20;
+    opts.rotate_ms = 50;
+    opts.sync_ms = 10;
+    assert_int_equal(xpc_sink_enable(st->xpc, st->fd, st->path, &opts), 0);
+    send_msgs(st, 1);
+    int timeout_ms = xpc_router_poll(st->xpc);
+    assert_true(timeout_ms > 0 && timeout_ms <= 10);
+
+    // synced once sync_ms passed, the router asks to be polled until then.
+    usleep(15000);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), 0);
+    assert_int_equal(stats.syncs, 1);
+    timeout_ms = xpc_router_poll(st->xpc);
+    assert_true(timeout_ms > 0 && timeout_ms <= 50);
+
+    // finished once rotate_ms passed, the next message starts a new one.
+    usleep(50000);
+    xpc_router_poll(st->xpc);
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), 0);
+    assert_int_equal(stats.syncs, 2);
+    assert_int_equal(xpc_router_poll(st->xpc), -1);
+    usleep(2000);
+    send_msgs(st, 1);
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), 0);
+    assert_int_equal(stats.segments, 2);
+    assert_int_equal(list_segments(st, paths), 2);
+    size_t len = 0;
+    const xpc_sink_hdr_t *hdr = xpc_sink_map(paths[0], &len);
+    assert_non_null(hdr);
+    assert_true(hdr->flags & XPC_SINK_CLOSED);
+    assert_int_equal(hdr->end, hdr->data_off + rec_len());
+    xpc_sink_unmap(hdr, len);
+}
+
+static void test_lost(void **state) {
+    sink_state_t *st = *state;
+    xpc_sink_stats_t stats;
+    xpc_sink_opts_t opts = XPC_SINK_OPTS_DEFAULT;
+    opts.index_max = 4;
+    opts.segment_bytes = data_off(opts.index_max) + 2 * rec_len();
+    assert_int_equal(xpc_sink_enable(st->xpc, st->fd, st->path, &opts), 0);
+    // larger than a segment, the segment being written is kept.
+    send_msgs(st, 1);
+    send_sized(st, 1, 2 * rec_len());
+    send_msgs(st, 1);
+    assert_int_equal(xpc_sink_get_stats(st->xpc, st->fd, &stats), 0);
+    assert_int_equal(stats.lost, 1);
+    assert_int_equal(stats.msgs, 2);
+    assert_int_equal(stats.segments, 1);
+    assert_int_equal(xpc_get_drop_count(st->xpc, st->sv[0], 1), 1);
+
+    // invalid options.
+    opts.segment_bytes = data_off(opts.index_max);
+    assert_int_equal(xpc_sink_enable(st->xpc, st->sv[1], st->path, &opts), -1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_archive, init, finish),
+        cmocka_unit_test_setup_teardown(test_seek, init, finish),
+        cmocka_unit_test_setup_teardown(test_rotate_sync, init, finish),
+        cmocka_unit_test_setup_teardown(test_lost, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_spill.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define PAYLOAD 100
+
+typedef struct {
+    char dir[64];
+    char path[128];
+    xpc_router_t *xpc;
+    // the sender is sv[1], the router reads sv[0] and writes p[1].
+    int sv[2];
+    int p[2];
+    // sequence number of the next message sent, and expected.
+    uint32_t sent;
+    uint32_t received;
+} spill_state_t;
+
+static int init(void **state) {
+    spill_state_t *st = calloc(1, sizeof(spill_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    strcpy(st->dir, "/tmp/test_xpc_spill.XXXXXX");
+    if(mkdtemp(st->dir) == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "%s/out", st->dir);
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, st->sv) != 0
+            || pipe2(st->p, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || xpc_set_route(st->xpc, st->sv[0], st->p[1], 1, 1) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    spill_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->sv[0]);
+    close(st->sv[1]);
+    close(st->p[0]);
+    close(st->p[1]);
+    // the router removes its segments.
+    assert_int_equal(rmdir(st->dir), 0);
+    free(st);
+    return 0;
+}
+
+static bool segment_exists(spill_state_t *st, int seq) {
+    char name[160];
+    snprintf(name, sizeof(name), "%s.%d", st->path, seq);
+    return access(name, F_OK) == 0;
+}
+
+/**
+ * Send messages numbered in order, without writing any.
+ */
+static void send_msgs(spill_state_t *st, int n) {
+    uint8_t wire[sizeof(txpc_hdr_t) + PAYLOAD] = {0};
+    txpc_hdr_t hdr = {.to = 1, .from = 1, .type = 0, .size = PAYLOAD};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    for(int i = 0; i < n; i++) {
+        memcpy(wire + sizeof(txpc_hdr_t), &st->sent, sizeof(st->sent));
+        st->sent++;
+        assert_int_equal(write(st->sv[1], wire, sizeof(wire)), sizeof(wire));
+        while(xpc_accumulate_msg(st->xpc, st->sv[0]) > 0);
+    }
+}
+
+/**
+ * Write up to n messages, and check that they are the next ones in order.
+ */
+static void receive_msgs(spill_state_t *st, int n) {
+    uint8_t wire[sizeof(txpc_hdr_t) + PAYLOAD];
+    txpc_hdr_t hdr;
+    for(int i = 0; i < n && xpc_write_msg(st->xpc, st->p[1]) > 0; i++) {
+        assert_int_equal(read(st->p[0], wire, sizeof(wire)), sizeof(wire));
+        xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, wire);
+        assert_int_equal(hdr.size, PAYLOAD);
+        uint32_t seq;
+        memcpy(&seq, wire + sizeof(txpc_hdr_t), sizeof(seq));
+        assert_int_equal(seq, st->received);
+        st->received++;
+    }
+}
+
+static void test_spill_order(void **state) {
+    spill_state_t *st = *state;
+    xpc_spill_stats_t stats;
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), -1);
+    assert_int_equal(
+        xpc_spill_enable(st->xpc, st->p[1], st->path, 256, 0, 0), 0
+    );
+    assert_int_equal(
+        xpc_spill_enable(st->xpc, st->p[1], st->path, 256, 0, 0), -1
+    );
+    assert_true(segment_exists(st, 0));
+
+    // two messages fit the budget, the third one sends all of them to disk.
+    send_msgs(st, 2);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.spilled, 0);
+    send_msgs(st, 48);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.spilled, 50);
+    assert_int_equal(stats.msgs, 50);
+    assert_int_equal(stats.bytes, 50 * (sizeof(txpc_hdr_t) + PAYLOAD));
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(st->xpc->out_contexts, st->p[1]);
+    assert_int_equal(out_ctx->msg_queue->queued_bytes, 0);
+
+    // what arrives while some are on disk goes behind them.
+    receive_msgs(st, 20);
+    send_msgs(st, 10);
+    receive_msgs(st, 100);
+    assert_int_equal(st->received, 60);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.msgs, 0);
+    assert_int_equal(stats.drained, 60);
+    assert_int_equal(stats.dropped, 0);
+
+    // below the budget again, nothing is spilled.
+    send_msgs(st, 1);
+    receive_msgs(st, 1);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.spilled, 60);
+    assert_int_equal(st->received, 61);
+}
+
+static void test_rotation(void **state) {
+    spill_state_t *st = *state;
+    xpc_spill_stats_t stats;
+    size_t rec_len = sizeof(xpc_spill_rec_t) + sizeof(txpc_hdr_t) + PAYLOAD;
+    rec_len = (rec_len + XPC_SPILL_ALIGN - 1) & ~(size_t)(XPC_SPILL_ALIGN - 1);
+    int per_segment = 4096 / rec_len;
+    assert_int_equal(
+        xpc_spill_enable(st->xpc, st->p[1], st->path, 0, 4096, 3), 0
+    );
+
+    // three segments hold what is sent, the rest is dropped.
+    send_msgs(st, 3 * per_segment + 5);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.segments, 3);
+    assert_int_equal(stats.msgs, 3 * per_segment);
+    assert_int_equal(stats.dropped, 5);
+    assert_int_equal(xpc_get_drop_count(st->xpc, st->sv[0], 1), 5);
+    assert_true(segment_exists(st, 2));
+
+    // each segment is removed once it is read.
+    receive_msgs(st, per_segment + 1);
+    assert_false(segment_exists(st, 0));
+    assert_true(segment_exists(st, 1));
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.segments, 2);
+
+    // a new segment is started behind the ones left.
+    send_msgs(st, per_segment);
+    assert_true(segment_exists(st, 3));
+    receive_msgs(st, 2 * per_segment - 1);
+    assert_int_equal(st->received, 3 * per_segment);
+    // the dropped ones are skipped.
+    st->received += 5;
+    receive_msgs(st, per_segment + 1);
+    assert_int_equal(st->received, 4 * per_segment + 5);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.segments, 1);
+    assert_int_equal(stats.msgs, 0);
+    assert_false(segment_exists(st, 2));
+    assert_true(segment_exists(st, 3));
+}
+
+static int wakeups = 0;
+
+static int count_wakeup(void *ctx, int fd) {
+    wakeups++;
+    return 0;
+}
+
+static void test_stall(void **state) {
+    spill_state_t *st = *state;
+    xpc_spill_stats_t stats;
+    char name[160], moved[170];
+    size_t rec_len = sizeof(xpc_spill_rec_t) + sizeof(txpc_hdr_t) + PAYLOAD;
+    rec_len = (rec_len + XPC_SPILL_ALIGN - 1) & ~(size_t)(XPC_SPILL_ALIGN - 1);
+    int per_segment = 4096 / rec_len;
+    assert_int_equal(
+        xpc_spill_enable(st->xpc, st->p[1], st->path, 0, 4096, 4), 0
+    );
+    st->xpc->io_add_fd_cb = count_wakeup;
+    // the second segment is unmapped once the third one is written.
+    send_msgs(st, 3 * per_segment);
+    snprintf(name, sizeof(name), "%s.1", st->path);
+    snprintf(moved, sizeof(moved), "%s.moved", name);
+    assert_int_equal(rename(name, moved), 0);
+
+    // it cannot be read back, the output waits rather than spinning.
+    receive_msgs(st, 2 * per_segment);
+    assert_int_equal(st->received, per_segment);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.stalls, 1);
+    assert_int_equal(stats.last_errno, ENOENT);
+    assert_in_range(xpc_router_poll(st->xpc), 1, XPC_SPILL_RETRY_MS);
+
+    // and is handed back once the retry is due.
+    assert_int_equal(rename(moved, name), 0);
+    wakeups = 0;
+    usleep((XPC_SPILL_RETRY_MS + 1) * 1000);
+    assert_int_equal(xpc_router_poll(st->xpc), -1);
+    assert_int_equal(wakeups, 1);
+    receive_msgs(st, 3 * per_segment);
+    assert_int_equal(st->received, 3 * per_segment);
+    assert_int_equal(xpc_spill_get_stats(st->xpc, st->p[1], &stats), 0);
+    assert_int_equal(stats.stalls, 1);
+    assert_int_equal(st->xpc->spill_stalled, 0);
+}
+
+static void test_retire(void **state) {
+    spill_state_t *st = *state;
+    assert_int_equal(
+        xpc_spill_enable(st->xpc, st->p[1], st->path, 0, 0, 0), 0
+    );
+    send_msgs(st, 5);
+    // the output stays until what is on disk is written.
+    assert_int_equal(xpc_remove_route(st->xpc, st->sv[0], 1), 0);
+    xpc_router_poll(st->xpc);
+    assert_non_null(hashmap_fetch(st->xpc->out_contexts, st->p[1]));
+    receive_msgs(st, 5);
+    assert_int_equal(st->received, 5);
+    xpc_router_poll(st->xpc);
+    assert_null(hashmap_fetch(st->xpc->out_contexts, st->p[1]));
+    assert_false(segment_exists(st, 0));
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_spill_order, init, finish),
+        cmocka_unit_test_setup_teardown(test_rotation, init, finish),
+        cmocka_unit_test_setup_teardown(test_stall, init, finish),
+        cmocka_unit_test_setup_teardown(test_retire, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
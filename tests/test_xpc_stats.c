@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_stats.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char path[64];
+    xpc_router_t *xpc;
+    int in_pipe[2];
+    int out_pipe[2];
+} stats_state_t;
+
+static int send_msg(int fd, int to, const char *payload) {
+    uint8_t wire[sizeof(txpc_hdr_t) + 32];
+    txpc_hdr_t hdr = {.to = to, .from = 1, .type = 0, .size = strlen(payload)};
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), payload, hdr.size);
+    int len = sizeof(txpc_hdr_t) + hdr.size;
+    assert_int_equal(write(fd, wire, len), len);
+    return len;
+}
+
+static int init(void **state) {
+    stats_state_t *st = calloc(1, sizeof(stats_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    snprintf(st->path, sizeof(st->path), "/tmp/test_xpc_stats.%d", getpid());
+    st->xpc = initialize_xpc_router();
+    if(st->xpc == NULL
+            || pipe2(st->in_pipe, O_NONBLOCK) != 0
+            || pipe2(st->out_pipe, O_NONBLOCK) != 0
+            || xpc_set_route(st->xpc, st->in_pipe[0], st->out_pipe[1], 1, 2) != 0) {
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    stats_state_t *st = *state;
+    xpc_router_destroy(st->xpc);
+    close(st->in_pipe[0]);
+    close(st->in_pipe[1]);
+    close(st->out_pipe[0]);
+    close(st->out_pipe[1]);
+    free(st);
+    return 0;
+}
+
+/**
+ * Publish and read back a snapshot, the caller frees it.
+ */
+static xpc_stats_page_t *snapshot(stats_state_t *st) {
+    size_t len = 0;
+    xpc_stats_publish(st->xpc);
+    const xpc_stats_page_t *page = xpc_stats_map(st->path, &len);
+    assert_non_null(page);
+    xpc_stats_page_t *snap = malloc(len);
+    assert_non_null(snap);
+    assert_int_equal(xpc_stats_snapshot(page, snap, len), 0);
+    xpc_stats_unmap(page, len);
+    assert_int_equal(snap->seq % 2, 0);
+    return snap;
+}
+
+static const xpc_stats_fd_t *find_fd(const xpc_stats_page_t *snap, int fd) {
+    for(uint32_t i = 0; i < snap->n_fds; i++) {
+        if(xpc_stats_fds(snap)[i].fd == fd) {
+            return &xpc_stats_fds(snap)[i];
+        }
+    }
+    fail_msg("fd %d is missing", fd);
+    return NULL;
+}
+
+static void test_counters(void **state) {
+    stats_state_t *st = *state;
+    uint8_t rx[256];
+    assert_int_equal(xpc_stats_enable(st->xpc, st->path, 8, 8, 1000), 0);
+
+    int len = send_msg(st->in_pipe[1], 1, "one");
+    len += send_msg(st->in_pipe[1], 1, "two");
+    send_msg(st->in_pipe[1], 9, "unrouted");
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+
+    // both messages are queued, nothing is written yet.
+    xpc_stats_page_t *snap = snapshot(st);
+    assert_int_equal(snap->magic, XPC_STATS_MAGIC);
+    assert_int_equal(snap->n_fds, 2);
+    assert_int_equal(snap->n_routes, 1);
+    const xpc_stats_fd_t *in = find_fd(snap, st->in_pipe[0]);
+    assert_int_equal(in->kind, XPC_IN_STREAM);
+    assert_int_equal(in->rx.msgs, 2);
+    assert_int_equal(in->rx.bytes, len);
+    assert_int_equal(in->rx.drops[XPC_DROP_NO_ROUTE], 1);
+    const xpc_stats_fd_t *out = find_fd(snap, st->out_pipe[1]);
+    assert_int_equal(out->kind, -1);
+    assert_int_equal(out->queue_bytes, len);
+    assert_int_equal(out->queue_peak_bytes, len);
+    assert_int_equal(out->pool_misses, 2);
+    assert_int_equal(out->tx.msgs, 0);
+    const xpc_stats_route_t *route = &xpc_stats_routes(snap)[0];
+    assert_int_equal(route->in_fd, st->in_pipe[0]);
+    assert_int_equal(route->in_chn, 1);
+    assert_int_equal(route->out_fd, st->out_pipe[1]);
+    assert_int_equal(route->out_chn, 2);
+    assert_int_equal(route->stats.msgs, 2);
+    assert_int_equal(route->stats.bytes, len);
+    // nothing has left the router yet.
+    assert_int_equal(route->latency.count, 0);
+    free(snap);
+
+    // writing drains the queue, the next message reuses a buffer.
+    while(xpc_write_msg(st->xpc, st->out_pipe[1]) > 0);
+    assert_int_equal(read(st->out_pipe[0], rx, sizeof(rx)), len);
+    send_msg(st->in_pipe[1], 1, "three");
+    while(xpc_accumulate_msg(st->xpc, st->in_pipe[0]) > 0);
+    snap = snapshot(st);
+    out = find_fd(snap, st->out_pipe[1]);
+    assert_int_equal(out->tx.msgs, 2);
+    assert_int_equal(out->tx.bytes, len);
+    assert_int_equal(out->queue_bytes, sizeof(txpc_hdr_t) + 5);
+    assert_int_equal(out->queue_peak_bytes, len);
+    assert_int_equal(out->pool_hits, 1);
+    assert_int_equal(out->pool_misses, 2);
+    const xpc_stats_latency_t *lat = &xpc_stats_routes(snap)[0].latency;
+    assert_int_equal(lat->count, 2);
+    assert_true(lat->max_ns > 0);
+    assert_true(lat->p50_ns <= lat->p99_ns);
+    assert_true(lat->p99_ns <= lat->p999_ns);
+    assert_true(lat->p999_ns <= lat->max_ns);
+    assert_int_equal(
+        xpc_get_route_latency(st->xpc, st->in_pipe[0], 1)->count, 2
+    );
+    free(snap);
+}
+
+static void test_poll_and_cleanup(void **state) {
+    stats_state_t *st = *state;
+    size_t len = 0;
+    assert_int_equal(xpc_stats_poll(st->xpc), -1);
+    assert_int_equal(xpc_stats_enable(st->xpc, st->path, 1, 1, 50), 0);
+    int timeout = xpc_router_poll(st->xpc);
+    assert_true(timeout > 0 && timeout <= 50);
+
+    // two fds do not fit in room for one.
+    xpc_stats_page_t *snap = snapshot(st);
+    assert_int_equal(snap->n_fds, 1);
+    assert_true(snap->truncated);
+    free(snap);
+
+    // enabled again on the same path, the file stays and grows.
+    assert_int_equal(xpc_stats_enable(st->xpc, st->path, 8, 8, 50), 0);
+    snap = snapshot(st);
+    assert_int_equal(snap->max_fds, 8);
+    assert_int_equal(snap->n_fds, 2);
+    free(snap);
+
+    // the file goes away with the router.
+    xpc_router_destroy(st->xpc);
+    st->xpc = NULL;
+    assert_null(xpc_stats_map(st->path, &len));
+    assert_int_equal(access(st->path, F_OK), -1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_counters, init, finish),
+        cmocka_unit_test_setup_teardown(test_poll_and_cleanup, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
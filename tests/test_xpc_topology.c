@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tinyxpc/tinyxpc.h>
+#include <xpc_utils.h>
+#include <xpc_endian.h>
+#include <xpc_topology.h>
+#include <xpc_credit.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+typedef struct {
+    char dir[64];
+    char file[128];
+    xpc_topology_t *topo;
+} topo_state_t;
+
+static void write_topology(topo_state_t *st, const char *text) {
+    FILE *f = fopen(st->file, "w");
+    assert_non_null(f);
+    // the text refers to the test directory as %1$s.
+    fprintf(f, text, st->dir);
+    fclose(f);
+}
+
+static int init(void **state) {
+    topo_state_t *st = calloc(1, sizeof(topo_state_t));
+    if(st == NULL) {
+        return -1;
+    }
+    strcpy(st->dir, "/tmp/test_xpc_topology.XXXXXX");
+    if(mkdtemp(st->dir) == NULL) {
+        free(st);
+        return -1;
+    }
+    snprintf(st->file, sizeof(st->file), "%s/topology", st->dir);
+    *state = st;
+    return 0;
+}
+
+static int finish(void **state) {
+    topo_state_t *st = *state;
+    char path[128];
+    xpc_topology_free(st->topo);
+    unlink(st->file);
+    snprintf(path, sizeof(path), "%s/a", st->dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/b", st->dir);
+    unlink(path);
+    rmdir(st->dir);
+    free(st);
+    return 0;
+}
+
+static void test_parse(void **state) {
+    topo_state_t *st = *state;
+    write_topology(st,
+        "# comment\n"
+        "router max_msg_size=4096 strict_channels=yes busy_poll_us=50\n"
+        "router realtime=yes rt_cpu=2 rt_priority=40 rt_warmup_ms=10\n"
+        "router pipeline=yes pipeline_queue_kb=64 control=%1$s/ctl sched_quantum=1024\n"
+        "\n"
+        "fifo a path=%1$s/a mode=rd endian=big rx_cpu=1 compress=yes\n"
+        "fifo b path=%1$s/b mode=wr queue_msgs=4 queue_msg_size=128 "
+            "coalesce_bytes=512 coalesce_us=200 credit_window=4096 weight=3  # trailing\n"
+        "fifo c path=%1$s/c mode=wr spill=%1$s/spill spill_mem_kb=0 "
+            "spill_segment_kb=64 spill_segments=4\n"
+        "file d path=%1$s/d segment_mb=8 rotate_s=60 sync=data sync_ms=500 "
+            "sync_kb=64\n"
+        "route a:1 -> b:2 no_coalesce\n"
+        "route a:3 b:3 cut_through weight=2\n"
+        "route a:4 -> b:4 hook=%1$s/hook.so:drop_debug hook_arg=level=2\n"
+        "route a:5 -> b:5 sample=10 rate_bytes=4096 burst=512\n"
+    );
+    st->topo = xpc_topology_load(st->file);
+    assert_non_null(st->topo);
+    assert_int_equal(st->topo->max_msg_size, 4096);
+    assert_true(st->topo->strict_channels);
+    assert_true(st->topo->pipeline);
+    assert_int_equal(st->topo->pipeline_queue_kb, 64);
+    char ctl[128];
+    snprintf(ctl, sizeof(ctl), "%s/ctl", st->dir);
+    assert_string_equal(st->topo->control_path, ctl);
+    assert_int_equal(st->topo->sched_quantum, 1024);
+    assert_int_equal(st->topo->busy_poll_us, 50);
+    assert_int_equal(st->topo->busy_poll_budget, 50);
+    assert_true(st->topo->realtime);
+    assert_int_equal(st->topo->rt_cpu, 2);
+    assert_int_equal(st->topo->rt_priority, 40);
+    assert_int_equal(st->topo->rt_warmup_ms, 10);
+    assert_int_equal(array_size(st->topo->endpoints), 4);
+    assert_int_equal(array_size(st->topo->routes), 4);
+
+    xpc_topo_endpoint_t *a = xpc_topology_find(st->topo, "a");
+    xpc_topo_endpoint_t *b = xpc_topology_find(st->topo, "b");
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_null(xpc_topology_find(st->topo, "e"));
+    assert_int_equal(a->kind, XPC_TOPO_FIFO);
+    assert_int_equal(a->mode, XPC_TOPO_MODE_RD);
+    assert_true(a->big_endian);
+    assert_int_equal(a->fd, -1);
+    assert_int_equal(a->rx_cpu, 1);
+    assert_int_equal(a->tx_cpu, -1);
+    assert_int_equal(b->mode, XPC_TOPO_MODE_WR);
+    assert_int_equal(b->queue_msgs, 4);
+    assert_int_equal(b->queue_msg_size, 128);
+    assert_int_equal(b->coalesce_bytes, 512);
+    assert_int_equal(b->coalesce_us, 200);
+    assert_int_equal(b->credit_window, 4096);
+    assert_int_equal(a->credit_window, XPC_CREDIT_WINDOW);
+    assert_true(a->compress);
+    assert_false(b->compress);
+    assert_int_equal(a->sched_weight, 0);
+    assert_int_equal(b->sched_weight, 3);
+    assert_string_equal(b->spill_path, "");
+    assert_int_equal(b->spill_mem_kb, 1024);
+
+    xpc_topo_endpoint_t *c = xpc_topology_find(st->topo, "c");
+    char spill[128];
+    snprintf(spill, sizeof(spill), "%s/spill", st->dir);
+    assert_string_equal(c->spill_path, spill);
+    assert_int_equal(c->spill_mem_kb, 0);
+    assert_int_equal(c->spill_segment_kb, 64);
+    assert_int_equal(c->spill_segments, 4);
+    assert_int_equal(c->sink.segment_bytes, 64 << 20);
+    assert_int_equal(c->sink.sync, XPC_SINK_SYNC_ASYNC);
+
+    xpc_topo_endpoint_t *d = xpc_topology_find(st->topo, "d");
+    assert_int_equal(d->kind, XPC_TOPO_FILE);
+    assert_int_equal(d->mode, XPC_TOPO_MODE_WR);
+    assert_int_equal(d->sink.segment_bytes, 8 << 20);
+    assert_int_equal(d->sink.rotate_ms, 60000);
+    assert_int_equal(d->sink.sync, XPC_SINK_SYNC_DATA);
+    assert_int_equal(d->sink.sync_ms, 500);
+    assert_int_equal(d->sink.sync_bytes, 64 << 10);
+
+    xpc_topo_route_t *route = array_fetch(st->topo->routes, 0);
+    assert_int_equal(route->in_ep, 0);
+    assert_int_equal(route->in_chn, 1);
+    assert_int_equal(route->out_ep, 1);
+    assert_int_equal(route->out_chn, 2);
+    assert_int_equal(route->flags, XPC_ROUTE_NO_COALESCE);
+    assert_int_equal(route->weight, 0);
+    route = array_fetch(st->topo->routes, 1);
+    assert_int_equal(route->in_chn, 3);
+    assert_int_equal(route->flags, XPC_ROUTE_CUT_THROUGH);
+    assert_int_equal(route->weight, 2);
+    assert_string_equal(route->hook_path, "");
+    route = array_fetch(st->topo->routes, 2);
+    char hook[128];
+    snprintf(hook, sizeof(hook), "%s/hook.so", st->dir);
+    assert_string_equal(route->hook_path, hook);
+    assert_string_equal(route->hook_symbol, "drop_debug");
+    assert_string_equal(route->hook_arg, "level=2");
+    assert_int_equal(route->limit.rate, 0);
+    route = array_fetch(st->topo->routes, 3);
+    assert_int_equal(route->limit.sample, 10);
+    assert_int_equal(route->limit.rate, 4096);
+    assert_true(route->limit.bytes);
+    assert_int_equal(route->limit.burst, 512);
+}
+
+static void test_parse_errors(void **state) {
+    topo_state_t *st = *state;
+    const char *bad[] = {
+        "bogus a\n",
+        "fifo a\n",
+        "fifo a path=%1$s/a\nfifo a path=%1$s/b\n",
+        "fifo a path=%1$s/a mode=sideways\n",
+        "fifo a path=%1$s/a baud=fast\n",
+        "fifo a path=%1$s/a\nroute a:1 -> c:1\n",
+        // a is read only, so it cannot be an output.
+        "fifo a path=%1$s/a\nroute a:1 -> a:2\n",
+        // channel 0 belongs to negotiation.
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:0 -> b:1\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 fast\n",
+        "router strict_channels=maybe\n",
+        // rings are a power of two in size.
+        "router pipeline_queue_kb=48\n",
+        "router sched_quantum=-1\n",
+        "router busy_poll_budget=0\n",
+        "router busy_poll_budget=101\n",
+        "router rt_priority=100\n",
+        "fifo a path=%1$s/a weight=0\n",
+        "fifo a path=%1$s/a mode=wr spill=%1$s/spill spill_segments=0\n",
+        "fifo a path=%1$s/a mode=wr spill=%1$s/spill spill_mem_kb=-1\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 weight=x\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 hook=x.so\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 hook=:sym\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 sample=x\n",
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\nroute a:1 -> b:1 burst=8\n",
+        // a channel is the source of one route.
+        "fifo a path=%1$s/a\nfifo b path=%1$s/b mode=wr\n"
+            "route a:1 -> b:1\nroute a:1 -> b:2\n",
+        // a file is only written.
+        "file a path=%1$s/a mode=rd\n",
+        "file a path=%1$s/a segment_mb=0\n",
+        "file a path=%1$s/a sync=sometimes\n",
+        // stdin and stdout are not one endpoint.
+        "stdio a mode=rdwr\n",
+    };
+    for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        write_topology(st, bad[i]);
+        assert_null(xpc_topology_load(st->file));
+    }
+    strcat(st->file, ".missing");
+    assert_null(xpc_topology_load(st->file));
+}
+
+static void test_build_router(void **state) {
+    topo_state_t *st = *state;
+    char path[128];
+    uint8_t wire[sizeof(txpc_hdr_t) + 8];
+    txpc_hdr_t hdr = {.to = 1, .from = 5, .type = 0, .size = 4};
+    write_topology(st,
+        "router sched_quantum=512\n"
+        "fifo a path=%1$s/a mode=rd compress=yes weight=2\n"
+        "fifo b path=%1$s/b mode=wr queue_msgs=3 queue_msg_size=64\n"
+        "route a:1 -> b:2 weight=4\n"
+    );
+    st->topo = xpc_topology_load(st->file);
+    assert_non_null(st->topo);
+    assert_int_equal(xpc_topology_open(st->topo), 0);
+    xpc_topo_endpoint_t *a = xpc_topology_find(st->topo, "a");
+    xpc_topo_endpoint_t *b = xpc_topology_find(st->topo, "b");
+    assert_true(a->fd > STDERR_FILENO);
+    assert_true(b->fd > STDERR_FILENO);
+
+    xpc_router_t *xpc = xpc_topology_build_router(st->topo);
+    assert_non_null(xpc);
+    xpc_out_ctx_t *out_ctx = hashmap_fetch(xpc->out_contexts, b->fd);
+    assert_non_null(out_ctx);
+    assert_int_equal(array_size(out_ctx->msg_queue->cleared_buffers), 3);
+    xpc_in_ctx_t *in_ctx = hashmap_fetch(xpc->in_contexts, a->fd);
+    assert_true(in_ctx->compress_allowed);
+    assert_int_equal(xpc->sched_quantum, 512);
+    assert_int_equal(in_ctx->sched_weight, 2);
+    assert_int_equal(out_ctx->sched_weight, 0);
+    xpc_switch_tbl_entry_t key = {.fd = a->fd, .to_chn = 1};
+    xpc_route_t *route = hashmap_fetch(xpc->switch_tbl, *(void**)&key);
+    assert_int_equal(route->sched_weight, 4);
+
+    snprintf(path, sizeof(path), "%s/a", st->dir);
+    int a_peer = open(path, O_WRONLY | O_NONBLOCK);
+    snprintf(path, sizeof(path), "%s/b", st->dir);
+    int b_peer = open(path, O_RDONLY | O_NONBLOCK);
+    assert_true(a_peer != -1 && b_peer != -1);
+
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->encode(wire, &hdr);
+    memcpy(wire + sizeof(txpc_hdr_t), "ping", 4);
+    assert_int_equal(write(a_peer, wire, sizeof(txpc_hdr_t) + 4), sizeof(txpc_hdr_t) + 4);
+    while(xpc_accumulate_msg(xpc, a->fd) > 0);
+    while(xpc_write_msg(xpc, b->fd) > 0);
+
+    memset(wire, 0, sizeof(wire));
+    assert_int_equal(read(b_peer, wire, sizeof(wire)), sizeof(txpc_hdr_t) + 4);
+    xpc_hdr_codec_select(XPC_HOST_BIG_ENDIAN)->decode(&hdr, wire);
+    assert_int_equal(hdr.to, 2);
+    assert_int_equal(hdr.from, 5);
+    assert_int_equal(hdr.size, 4);
+    assert_memory_equal(wire + sizeof(txpc_hdr_t), "ping", 4);
+
+    // the buffer went back to the pool instead of a new one being made.
+    assert_int_equal(array_size(out_ctx->msg_queue->cleared_buffers), 3);
+
+    close(a_peer);
+    close(b_peer);
+    xpc_router_destroy(xpc);
+}
+
+static int watched = 0;
+static int added = 0;
+
+static int count_watch(void *ctx, int fd) {
+    watched++;
+    return 0;
+}
+
+static int count_add(void *ctx, int fd) {
+    added++;
+    return 0;
+}
+
+static void test_connect_later(void **state) {
+    topo_state_t *st = *state;
+    char path[128];
+    write_topology(st,
+        "socket a path=%1$s/a mode=rdwr\n"
+        "route a:1 -> a:2\n"
+    );
+    st->topo = xpc_topology_load(st->file);
+    assert_non_null(st->topo);
+    // the server is not up, the router starts anyway.
+    assert_int_equal(xpc_topology_open(st->topo), 0);
+    xpc_topo_endpoint_t *a = xpc_topology_find(st->topo, "a");
+    assert_true(a->fd > STDERR_FILENO);
+    assert_true(a->connecting);
+    assert_true(xpc_topology_connecting(st->topo, a->fd));
+    xpc_router_t *xpc = xpc_topology_build_router(st->topo);
+    assert_non_null(xpc);
+    xpc->io_watch_fd_cb = count_watch;
+    xpc->io_add_fd_cb = count_add;
+    watched = 0;
+    added = 0;
+    int wait_ms = xpc_topology_connect_poll(st->topo, xpc);
+    assert_true(wait_ms > 0 && wait_ms <= XPC_TOPO_CONNECT_RETRY_MS);
+    assert_true(a->connecting);
+
+    snprintf(path, sizeof(path), "%s/a", st->dir);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_int_equal(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(lfd, 1), 0);
+    // still waiting for the next attempt.
+    assert_true(xpc_topology_connect_poll(st->topo, xpc) > 0);
+    st->topo->connect_ns = 0;
+    assert_int_equal(xpc_topology_connect_poll(st->topo, xpc), -1);
+    assert_false(a->connecting);
+    assert_false(xpc_topology_connecting(st->topo, a->fd));
+    assert_int_equal(st->topo->connecting, 0);
+    // it is read from and written to once connected.
+    assert_int_equal(watched, 1);
+    assert_int_equal(added, 1);
+
+    close(lfd);
+    xpc_router_destroy(xpc);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_parse, init, finish),
+        cmocka_unit_test_setup_teardown(test_parse_errors, init, finish),
+        cmocka_unit_test_setup_teardown(test_build_router, init, finish),
+        cmocka_unit_test_setup_teardown(test_connect_later, init, finish),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}